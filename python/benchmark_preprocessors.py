@@ -0,0 +1,217 @@
+"""Benchmark native image preprocessors.
+
+Checks that the native preprocessors (see native_engine.Preprocessor) produce the same model inputs as the Python
+preprocessors of cv2_preprocessors.py followed by quantization, and compares their throughput on decoded images.
+"""
+
+import logging
+import logging.config
+import numpy as np
+import os
+import time
+
+log = logging.getLogger(__name__)
+
+
+def _reference_quantize(image, input_quantization):
+  """Quantize like tflite_utils.quantize_image(), saturating instead of wrapping out-of-range values.
+  """
+  input_scale, input_zp, input_dtype = input_quantization
+  info = np.iinfo(input_dtype)
+  return np.clip(np.round(image/input_scale) + input_zp, info.min, info.max).astype(input_dtype)
+
+
+def load_images(dataset_split_path=None, dataset_split_map_file='val_map.txt', max_samples=None, seed=0):
+  """Decode the images of a dataset split, or generate random images of typical dataset sizes.
+
+  Returns:
+    images: List of NumPy BGR images of type uint8.
+  """
+  if dataset_split_path:
+    import cv2
+    with open(os.path.join(dataset_split_path, dataset_split_map_file), 'r') as f:
+      image_maps = [l.split() for l in f.readlines()][:max_samples]
+    return [cv2.imread(os.path.join(dataset_split_path, m[0])) for m in image_maps]
+  # Random pixels, so that rounding differences are not hidden by flat areas. Sizes cover both orientations, integer
+  # and fractional scales, and upscaling.
+  rng = np.random.default_rng(seed)
+  sizes = [(375, 500), (500, 375), (333, 500), (480, 640), (512, 1024), (256, 256), (240, 241), (150, 100)]
+  return [
+    rng.integers(0, 256, sizes[i % len(sizes)] + (3,), np.uint8)
+    for i in range(max_samples or len(sizes))
+    ]
+
+
+def check_parity(images, name, input_quantization=None, tolerance=0):
+  """Compare the native preprocessor `name` with its Python version.
+
+  Args:
+    images: List of NumPy BGR images.
+    name: Name of the preprocessor in cv2_preprocessors.preprocessors().
+    input_quantization: Tuple (scale, zero_point, dtype) to compare quantized images, or None for float images.
+    tolerance: Maximum difference allowed, in units of the output type for quantized images, and of one 8-bit input
+      level for float images.
+
+  Returns:
+    parity: Dictionary of the maximum difference and the fraction of equal values.
+  """
+  from mltools.cv2_preprocessors import preprocessors
+  from mltools.native_engine import Preprocessor
+  python_fn = preprocessors()[name]
+  native_fn = Preprocessor(name)
+  max_difference = 0.0
+  num_equal = 0
+  num_values = 0
+  for image in images:
+    expected = python_fn(image)
+    actual = native_fn(image, input_quantization)
+    if input_quantization:
+      difference = np.abs(_reference_quantize(expected, input_quantization).astype(np.int32) - actual)
+    else:
+      # Python preprocessors scale 8-bit values by a constant, the span of output values divided by 255.
+      level = (python_fn(np.full((2, 2, 3), 255, np.uint8)) - python_fn(np.zeros((2, 2, 3), np.uint8))).max() / 255
+      difference = np.abs(expected - actual) / level
+    max_difference = max(max_difference, float(difference.max()))
+    num_equal += int(np.count_nonzero(difference == 0))
+    num_values += difference.size
+  return {
+    'preprocessor': name,
+    'input_quantization': input_quantization,
+    'max_difference': max_difference,
+    'equal_fraction': num_equal / num_values,
+    'passed': max_difference <= tolerance,
+    }
+
+
+def measure_throughput(images, name, input_quantization=None, num_repeats=1):
+  """Measure images per second of the Python and native versions of preprocessor `name`, decoding excluded.
+
+  The native preprocessor writes into one preallocated input, as into an interpreter's input tensor.
+  """
+  from mltools.cv2_preprocessors import preprocessors
+  from mltools.native_engine import Preprocessor
+  from mltools.tflite_utils import quantize_image
+  python_fn = preprocessors()[name]
+  native_fn = Preprocessor(name)
+  out = native_fn(images[0], input_quantization)
+  start = time.perf_counter()
+  for _ in range(num_repeats):
+    for image in images:
+      quantize_image(python_fn(image), input_quantization)
+  python_time = time.perf_counter() - start
+  start = time.perf_counter()
+  for _ in range(num_repeats):
+    for image in images:
+      native_fn(image, input_quantization, out)
+  native_time = time.perf_counter() - start
+  num_images = num_repeats * len(images)
+  return {
+    'preprocessor': name,
+    'input_quantization': input_quantization,
+    'python_images_per_second': num_images / python_time,
+    'native_images_per_second': num_images / native_time,
+    'speedup': python_time / native_time,
+    }
+
+
+def parse_args(argv=None):
+  import argparse
+  from mltools.cv2_preprocessors import preprocessors
+
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+  )
+  parser.add_argument(
+    '-d', '--dataset_split_path',
+    help='Path to directory containing a dataset split. Default is random images.',
+    )
+
+  parser.add_argument(
+    '-m', '--dataset_split_map_file',
+    help='Name of the dataset split\'s map file.',
+    default='val_map.txt',
+    )
+
+  parser.add_argument(
+    '-p', '--model_preprocessors',
+    help='Model preprocessors.',
+    choices=preprocessors().keys(),
+    nargs='+',
+    default=list(preprocessors().keys()),
+    )
+
+  parser.add_argument(
+    '-q', '--input_quantization',
+    help='Also compare images quantized with the scale and zero point of a model input of type int8 or uint8.',
+    metavar=('SCALE', 'ZERO_POINT', 'DTYPE'),
+    nargs=3,
+    )
+
+  parser.add_argument(
+    '-s', '--max_samples',
+    help='Maximum number of images. Default is all images of the dataset split, or 8 random images.',
+    type=int,
+    )
+
+  parser.add_argument(
+    '-n', '--num_repeats',
+    help='Number of passes over the images when measuring throughput.',
+    type=int,
+    default=10,
+    )
+
+  parser.add_argument(
+    '-t', '--tolerance',
+    help='Maximum difference between native and Python outputs.',
+    type=float,
+    default=0,
+    )
+
+  parser.add_argument(
+    '--log_path',
+    help='Path to log directory. Default is same directory as this script.',
+    )
+
+  if argv:
+    args = parser.parse_args(argv)
+  else:
+    args = parser.parse_args()
+
+  from mltools.python_logging import create_log_config
+  log_config = create_log_config(
+    log_path=args.log_path,
+    )
+  logging.config.dictConfig(log_config)
+  log.info('%s %s' % (os.path.basename(__file__), args))
+  return args
+
+
+def run(args):
+  """Check parity of native preprocessors and benchmark them.
+
+  Returns:
+    status: 0 if all native outputs are within tolerance of the Python ones, 1 otherwise.
+  """
+  images = load_images(args.dataset_split_path, args.dataset_split_map_file, args.max_samples)
+  quantizations = [None]
+  if args.input_quantization:
+    input_scale, input_zp, input_dtype = args.input_quantization
+    if input_dtype not in ('int8', 'uint8'):
+      raise ValueError('Invalid quantized input type %s.' % input_dtype)
+    quantizations.append((float(np.float32(input_scale)), int(input_zp), np.dtype(input_dtype).type))
+  status = 0
+  for name in args.model_preprocessors:
+    for input_quantization in quantizations:
+      parity = check_parity(images, name, input_quantization, args.tolerance)
+      log.info(parity)
+      if not parity['passed']:
+        log.error('Native preprocessor %s differs from the Python one by %g.' % (name, parity['max_difference']))
+        status = 1
+      log.info(measure_throughput(images, name, input_quantization, args.num_repeats))
+  return status
+
+
+if __name__ == '__main__':
+  import sys
+  args = parse_args()
+  sys.exit(run(args))
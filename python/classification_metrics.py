@@ -0,0 +1,348 @@
+"""Image classification metrics.
+
+Batches are evaluated independently, possibly by different processes, and added to the metrics in batch order, which
+derives cumulative accuracies and the MLPerf-compatible log from them. Merging the batches of several evaluations thus
+produces the same metrics as evaluating them all in one.
+
+Evaluations stream their metrics to a metrics file as they go, so that memory does not grow with the dataset and an
+interrupted evaluation keeps the batches it completed, from which it can resume. The file starts with a header, followed
+by the pickled script path, arguments and model hash of the evaluation and, at a page-aligned offset, one fixed-width
+record per sample: its ground truth label, top-k labels and their scores. Readers memory-map the records as columns.
+"""
+
+import numpy as np
+import os
+import pickle
+import struct
+
+METRICS_MAGIC = b'MLTMETRC'
+METRICS_VERSION = 1
+METRICS_PAGE_SIZE = 4096
+
+# magic, version, top_k, batch_size, first_batch, end_batch, num_samples, info_size, records_offset
+METRICS_HEADER = struct.Struct('=8sIIIIIQQQ')
+
+
+class ClassificationMetrics:
+  """Cumulative top-1 and top-5 accuracy over batches added in order.
+
+  Args:
+    mlperf_log: File receiving one MLPerf-compatible line per sample.
+    metrics_writer: MetricsWriter receiving the records of each batch.
+
+  Attributes:
+    batch_metrics: Metrics dictionary of the last batch added.
+  """
+  def __init__(self, mlperf_log=None, metrics_writer=None):
+    self.mlperf_log = mlperf_log
+    self.metrics_writer = metrics_writer
+    self.total_true_positives = 0
+    self.total_top_5_true_positives = 0
+    self.total_images = 0
+    self.batch_metrics = None
+
+  def add_metrics_file(self, metrics_file, num_samples=None):
+    """Add the batches recorded in a metrics file.
+
+    Args:
+      metrics_file: MetricsFile whose batches follow those already added.
+      num_samples: Number of samples to add, a multiple of the batch size unless all. Default is all.
+    """
+    if num_samples is None:
+      num_samples = len(metrics_file)
+    for start in range(0, num_samples, metrics_file.batch_size):
+      batch = slice(start, min(start + metrics_file.batch_size, num_samples))
+      self.add_batch(metrics_file.gtlabels[batch], metrics_file.top_labels[batch], metrics_file.top_scores[batch])
+
+  def add_batch(self, gtlabel_batch, top_5_labels, top_5_scores=None):
+    """Add the next batch.
+
+    Args:
+      gtlabel_batch: Ground truth labels of the batch's samples.
+      top_5_labels: Array of shape (samples, k) of the top-k labels of each sample in increasing order of score. k is 1
+        for models whose output is already the predicted label.
+      top_5_scores: Array of the scores of `top_5_labels`, if known.
+
+    Returns:
+      metrics: The batch's metrics dictionary.
+    """
+    num_images = len(gtlabel_batch)
+    gtlabels = np.asarray(gtlabel_batch)
+    labels = np.asarray(top_5_labels)
+    predictions = labels[:, -1]
+    batch_true_positives = int(np.sum(predictions == gtlabels))
+    batch_top_5_true_positives = int(np.sum(np.any(labels == gtlabels[:, np.newaxis], axis=1)))
+    if self.mlperf_log:
+      tp = self.total_true_positives
+      ti = self.total_images
+      for i in range(num_images):
+        tp += int(predictions[i] == gtlabels[i])
+        ti += 1
+        self.mlperf_log.write('self.good = %d/%d = %.4f, result = %d, expected = %d\n' % (
+          tp,
+          ti,
+          tp / ti,
+          predictions[i],
+          gtlabels[i],
+        ))
+    if self.metrics_writer:
+      self.metrics_writer.append(gtlabels, labels, top_5_scores)
+    self.total_true_positives += batch_true_positives
+    self.total_top_5_true_positives += batch_top_5_true_positives
+    self.total_images += num_images
+    self.batch_metrics = {
+      'accuracy': batch_true_positives / num_images,
+      'top_5_accuracy': batch_top_5_true_positives / num_images,
+      'cumulative_accuracy': self.total_true_positives / self.total_images,
+      'cumulative_top_5_accuracy': self.total_top_5_true_positives / self.total_images,
+      }
+    return self.batch_metrics
+
+
+def top_k_labels(predictions, k=5):
+  """Labels of the `k` highest scores of each prediction, in increasing order of score.
+
+  Partitions the `k` highest scores out of each prediction and sorts only those, instead of sorting every prediction.
+  Equal scores rank by label, higher labels last, like `prediction.argsort(kind='stable')[-k:]`.
+
+  Args:
+    predictions: Sequence of NumPy arrays of shape (classes), or NumPy array of shape (samples, classes).
+
+  Returns:
+    labels: NumPy array of shape (samples, min(k, classes)).
+  """
+  scores = np.asarray(predictions)
+  k = min(k, scores.shape[1])
+  labels = np.argpartition(scores, -k, axis=1)[:, -k:]
+  top_scores = np.take_along_axis(scores, labels, axis=1)
+  labels = np.take_along_axis(labels, np.lexsort((labels, top_scores), axis=1), axis=1)
+  # Partitioning selects any of the labels scoring the k-th highest score, where sorting selects the highest ones. The
+  # few predictions with more such labels than places left, or NaN scores, are sorted entirely.
+  kth_scores = top_scores.min(axis=1, keepdims=True)
+  ties = np.flatnonzero(np.count_nonzero(scores >= kth_scores, axis=1) != k)
+  if len(ties):
+    labels[ties] = np.argsort(scores[ties], axis=1, kind='stable')[:, -k:]
+  return labels
+
+
+def shard_batch_ids(num_batches, shard_index, num_shards):
+  """Contiguous range of batches evaluated by shard `shard_index` of `num_shards`.
+  """
+  return range(shard_index * num_batches // num_shards, (shard_index + 1) * num_batches // num_shards)
+
+
+def shard_metrics_path(metrics_output_path, shard_index, num_shards):
+  """Path of the partial metrics written by a shard of an evaluation writing `metrics_output_path`.
+  """
+  return '%s.shard%dof%d' % (metrics_output_path, shard_index, num_shards)
+
+
+def metrics_record_dtype(top_k=5):
+  """NumPy dtype of the records of a metrics file.
+  """
+  return np.dtype([('gtlabel', '<i4'), ('top_labels', '<i4', (top_k,)), ('top_scores', '<f4', (top_k,))])
+
+
+class MetricsWriter:
+  """Append-only writer of a metrics file.
+
+  Each batch's records are flushed once appended, so that a crash of the evaluation only loses the batch being written,
+  and synced to disk on sync(), so that a crash of its host only loses the batches appended since.
+
+  Args:
+    path: Path to metrics file.
+    script: Path of the evaluation script.
+    args: Arguments of the evaluation.
+    batch_size: Number of samples in each batch.
+    num_samples: Number of samples of the evaluation.
+    batch_ids: Range of the batches recorded in this file. Default is all batches.
+    top_k: Number of top labels of each record.
+    model_hash: Hash of the evaluated model.
+    num_resumed_samples: Number of samples kept from an existing metrics file at `path`, which is appended to instead of
+      written anew. Its header is kept, so it must describe the same evaluation.
+  """
+  def __init__(self, path, script, args, batch_size, num_samples, batch_ids=None, top_k=5, model_hash=None, num_resumed_samples=None):
+    self.dtype = metrics_record_dtype(top_k)
+    if num_resumed_samples is not None:
+      self.file = open(path, 'r+b')
+      records_offset = METRICS_HEADER.unpack(self.file.read(METRICS_HEADER.size))[-1]
+      # Drops the records of batches after the resumed ones, including a partial record.
+      self.file.truncate(records_offset + num_resumed_samples * self.dtype.itemsize)
+      self.file.seek(0, os.SEEK_END)
+      return
+    if batch_ids is None:
+      batch_ids = range(-(-num_samples // batch_size))
+    info = pickle.dumps((script, args, model_hash))
+    records_offset = (METRICS_HEADER.size + len(info) + METRICS_PAGE_SIZE - 1) // METRICS_PAGE_SIZE * METRICS_PAGE_SIZE
+    self.file = open(path, 'wb')
+    self.file.write(METRICS_HEADER.pack(
+      METRICS_MAGIC,
+      METRICS_VERSION,
+      top_k,
+      batch_size,
+      batch_ids.start,
+      batch_ids.stop,
+      num_samples,
+      len(info),
+      records_offset,
+      ))
+    self.file.write(info)
+    self.file.write(bytes(records_offset - METRICS_HEADER.size - len(info)))
+    self.file.flush()
+
+  def append(self, gtlabels, top_labels, top_scores=None):
+    """Append the records of a batch.
+
+    Args:
+      gtlabels: Ground truth labels of the batch's samples.
+      top_labels: Array of shape (samples, top_k) of labels in increasing order of score.
+      top_scores: Array of the scores of `top_labels`. Default is NaN.
+    """
+    records = np.empty(len(gtlabels), self.dtype)
+    records['gtlabel'] = gtlabels
+    records['top_labels'] = top_labels
+    records['top_scores'] = np.nan if top_scores is None else top_scores
+    self.file.write(records.tobytes())
+    self.file.flush()
+
+  def sync(self):
+    """Sync the records appended so far to disk.
+    """
+    self.file.flush()
+    os.fsync(self.file.fileno())
+
+  def close(self):
+    self.file.close()
+
+
+class MetricsFile:
+  """Memory-mapped metrics file.
+
+  A trailing partial record, left by an interrupted writer, is ignored.
+
+  Args:
+    path: Path to metrics file.
+
+  Attributes:
+    script: Path of the evaluation script.
+    args: Arguments of the evaluation.
+    model_hash: Hash of the evaluated model, or None.
+    batch_size: Number of samples in each batch.
+    batch_ids: Range of the batches recorded in this file.
+    num_samples: Number of samples of the evaluation, not only of this file.
+    gtlabels: Read-only NumPy array of shape (samples) of ground truth labels.
+    top_labels: Read-only NumPy array of shape (samples, top_k) of labels in increasing order of score.
+    top_scores: Read-only NumPy array of shape (samples, top_k) of the scores of `top_labels`, or NaN if unknown.
+  """
+  def __init__(self, path):
+    with open(path, 'rb') as f:
+      header = f.read(METRICS_HEADER.size)
+      if len(header) < METRICS_HEADER.size or struct.unpack_from('=8sI', header) != (METRICS_MAGIC, METRICS_VERSION):
+        raise ValueError('Invalid metrics file (%s).' % path)
+      _, _, top_k, self.batch_size, first_batch, end_batch, self.num_samples, info_size, records_offset = (
+        METRICS_HEADER.unpack(header))
+      self.script, self.args, self.model_hash = pickle.loads(f.read(info_size))
+    self.path = path
+    self.batch_ids = range(first_batch, end_batch)
+    dtype = metrics_record_dtype(top_k)
+    num_records = max(0, os.path.getsize(path) - records_offset) // dtype.itemsize
+    if num_records:
+      records = np.memmap(path, dtype, 'r', offset=records_offset, shape=(num_records,))
+    else:
+      records = np.zeros(0, dtype)
+    self.gtlabels = records['gtlabel']
+    self.top_labels = records['top_labels']
+    self.top_scores = records['top_scores']
+
+  def __len__(self):
+    return len(self.gtlabels)
+
+  @property
+  def num_complete_batches(self):
+    """Number of batches whose records are all present.
+    """
+    if len(self) == self.num_expected_samples:
+      return len(self.batch_ids)
+    return len(self) // self.batch_size
+
+  @property
+  def num_expected_samples(self):
+    """Number of samples of the batches this file records once complete.
+    """
+    return min(self.batch_ids.stop * self.batch_size, self.num_samples) - self.batch_ids.start * self.batch_size
+
+  def batch_metrics(self):
+    """Per-batch metrics of the recorded samples, as in the dictionaries of ClassificationMetrics.
+
+    Returns:
+      metrics: Dictionary of NumPy arrays of shape (batches) by metric name.
+    """
+    num_samples = len(self)
+    starts = np.arange(0, num_samples, self.batch_size)
+    sizes = np.diff(np.append(starts, num_samples))
+    true_positives = np.zeros(len(starts), np.int64)
+    top_5_true_positives = np.zeros(len(starts), np.int64)
+    if num_samples:
+      gtlabels = np.asarray(self.gtlabels)
+      top_labels = np.asarray(self.top_labels)
+      true_positives = np.add.reduceat((top_labels[:, -1] == gtlabels).astype(np.int64), starts)
+      top_5_true_positives = np.add.reduceat(
+        np.any(top_labels == gtlabels[:, np.newaxis], axis=1).astype(np.int64), starts)
+    return {
+      'accuracy': true_positives / np.maximum(sizes, 1),
+      'top_5_accuracy': top_5_true_positives / np.maximum(sizes, 1),
+      'cumulative_accuracy': np.cumsum(true_positives) / np.maximum(np.cumsum(sizes), 1),
+      'cumulative_top_5_accuracy': np.cumsum(top_5_true_positives) / np.maximum(np.cumsum(sizes), 1),
+      }
+
+
+def load_batch_metrics(path):
+  """Load the per-batch metrics of a metrics file, or of a metrics pickle file written before metrics files.
+
+  Returns:
+    script: Path of the evaluation script.
+    args: Arguments of the evaluation.
+    metrics: Dictionary of NumPy arrays of shape (batches) by metric name.
+  """
+  with open(path, 'rb') as f:
+    magic = f.read(len(METRICS_MAGIC))
+  if magic == METRICS_MAGIC:
+    metrics_file = MetricsFile(path)
+    return metrics_file.script, metrics_file.args, metrics_file.batch_metrics()
+  with open(path, 'rb') as f:
+    script, args, batches = pickle.load(f)
+  # Older pickles also hold each batch's labels, which metrics files record per sample instead.
+  names = [name for name, value in (batches[0].items() if batches else []) if np.ndim(value) == 0]
+  return script, args, {name: np.array([batch[name] for batch in batches]) for name in names}
+
+
+def merge_shard_metrics(shard_files, metrics_writer=None, mlperf_log=None):
+  """Merge the metrics files written by all shards of an evaluation, in batch order.
+
+  Args:
+    shard_files: MetricsFile of each shard, in shard order.
+    metrics_writer, mlperf_log: See ClassificationMetrics.
+
+  Returns:
+    metrics: ClassificationMetrics of all batches.
+  """
+  metrics = ClassificationMetrics(mlperf_log, metrics_writer)
+  num_batches = -(-shard_files[0].num_samples // shard_files[0].batch_size)
+  next_batch_id = 0
+  for shard_index, shard_file in enumerate(shard_files):
+    if (shard_file.batch_ids.start != next_batch_id or len(shard_file) != shard_file.num_expected_samples
+        or shard_file.batch_size != shard_files[0].batch_size or shard_file.num_samples != shard_files[0].num_samples):
+      raise ValueError('Shard %d records %d samples of batches %d to %d, expected %d of batches %d to %d.' % (
+        shard_index,
+        len(shard_file),
+        shard_file.batch_ids.start,
+        shard_file.batch_ids.stop - 1,
+        shard_file.num_expected_samples,
+        next_batch_id,
+        shard_file.batch_ids.stop - 1,
+        ))
+    metrics.add_metrics_file(shard_file)
+    next_batch_id = shard_file.batch_ids.stop
+  if next_batch_id != num_batches:
+    raise ValueError('Shards cover %d of %d batches.' % (next_batch_id, num_batches))
+  return metrics
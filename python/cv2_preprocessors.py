@@ -6,6 +6,68 @@ Influenced by MLPerf.
 import cv2
 import numpy as np
 
+# JPEG start of frame markers, which are followed by the image size.
+JPEG_SOF_MARKERS = {0xc0, 0xc1, 0xc2, 0xc3, 0xc5, 0xc6, 0xc7, 0xc9, 0xca, 0xcb, 0xcd, 0xce, 0xcf}
+# cv2.imread() flags decoding JPEG images downscaled in the DCT domain, by factor.
+REDUCED_DECODE_FLAGS = {
+  8: cv2.IMREAD_REDUCED_COLOR_8,
+  4: cv2.IMREAD_REDUCED_COLOR_4,
+  2: cv2.IMREAD_REDUCED_COLOR_2,
+  }
+
+
+def jpeg_size(data):
+  """Return the (height, width) of a JPEG image from its header, or None if `data` is not a JPEG image.
+  """
+  if data[:2] != b'\xff\xd8':
+    return None
+  offset = 2
+  while offset + 9 <= len(data):
+    if data[offset] != 0xff:
+      return None
+    marker = data[offset + 1]
+    if marker == 0xff:
+      offset += 1
+      continue
+    if marker in JPEG_SOF_MARKERS:
+      return int.from_bytes(data[offset + 5:offset + 7], 'big'), int.from_bytes(data[offset + 7:offset + 9], 'big')
+    offset += 2 + int.from_bytes(data[offset + 2:offset + 4], 'big')
+  return None
+
+
+def resized_size(out_size=224, scale=87.5):
+  """Shorter side of images resized by resize_with_aspectratio() before cropping `out_size` pixels.
+  """
+  return int(100. * out_size / scale)
+
+
+def decode_image_data(data, min_size=None):
+  """Decode a BGR image from the contents of an image file like cv2.imdecode(). See decode_image().
+  """
+  flags = cv2.IMREAD_COLOR
+  size = jpeg_size(data) if min_size else None
+  if size:
+    for factor, reduced_flags in REDUCED_DECODE_FLAGS.items():
+      # libjpeg rounds reduced sizes up.
+      if -(-min(size) // factor) >= min_size:
+        flags = reduced_flags
+        break
+  return cv2.imdecode(np.frombuffer(data, np.uint8), flags)
+
+
+def decode_image(image_file, min_size=None):
+  """Decode a BGR image like cv2.imread().
+
+  Args:
+    image_file: Path to image file.
+    min_size: Let the JPEG decoder downscale images by 2, 4 or 8 in the DCT domain, skipping most of the decoding, as
+      long as their shorter side keeps at least `min_size` pixels. Default is decoding at full size. The resize that
+      follows then starts from a sharper, smaller image, so preprocessed images differ slightly from full decodes.
+  """
+  with open(image_file, 'rb') as f:
+    return decode_image_data(f.read(), min_size)
+
+
 def center_crop(img, out_height, out_width):
   height, width, _ = img.shape
   left = int((width - out_width) / 2)
@@ -31,12 +93,12 @@ def resize_with_aspectratio(img, out_height, out_width, scale=87.5, inter_pol=cv
 
 
 def pre_process_vgg(img, need_transpose=False):
-  img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB)
-
   output_height, output_width, _ = (224, 224, 3)
   cv2_interpol = cv2.INTER_AREA
   img = resize_with_aspectratio(img, output_height, output_width, inter_pol=cv2_interpol)
   img = center_crop(img, output_height, output_width)
+  # Converted after cropping, which only keeps the pixels to convert.
+  img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB)
   img = np.asarray(img, dtype='float32')
 
   # normalize image
@@ -50,11 +112,10 @@ def pre_process_vgg(img, need_transpose=False):
 
 
 def pre_process_mobilenet(img, need_transpose=False):
-  img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB)
-
   output_height, output_width, _ = (224, 224, 3)
   img = resize_with_aspectratio(img, output_height, output_width, inter_pol=cv2.INTER_LINEAR)
   img = center_crop(img, output_height, output_width)
+  img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB)
   img = np.asarray(img, dtype='float32')
 
   img /= 255.0
@@ -0,0 +1,141 @@
+"""Client of the native inference server (`src/serve`).
+
+Tensors are exchanged through shared memory set up by the server, see `src/serve.h` for the protocol.
+"""
+
+import mmap
+import numpy as np
+import socket
+import struct
+
+SERVE_MAGIC = 0x53544c4d
+SERVE_MAX_NAME_LEN = 64
+SERVE_MAX_TENSORS = 16
+
+SC_ATTACH = 1
+SC_RUN = 2
+SC_STATS = 3
+
+REQUEST = struct.Struct('=II%ds' % SERVE_MAX_NAME_LEN)
+TENSOR = struct.Struct('=QQiI6ifi')
+REPLY_HEADER = struct.Struct('=IiQQIIII')
+REPLY_SIZE = REPLY_HEADER.size + SERVE_MAX_TENSORS * TENSOR.size
+MODEL_STATS = struct.Struct('=%dsIIQQQQQQ' % SERVE_MAX_NAME_LEN)
+MODEL_STATS_FIELDS = (
+  'batch_size', 'queue_depth', 'num_requests', 'num_batches',
+  'mean_latency_ns', 'p50_latency_ns', 'p99_latency_ns', 'max_latency_ns',
+  )
+
+# enum tensor_type of `src/model.h`.
+TENSOR_DTYPES = {
+  0: np.float32,
+  1: np.float16,
+  2: np.int32,
+  3: np.uint8,
+  4: np.int64,
+  6: np.bool_,
+  7: np.int16,
+  9: np.int8,
+  }
+
+
+class EngineClient:
+  """Connection to the inference server attached to one model.
+
+  Input and output arrays are views into memory shared with the server: write inputs in place, call `invoke()`, then
+  read outputs, copying them if they must outlive the next call.
+  """
+  def __init__(self, socket_path, model):
+    self._socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    self._socket.connect(socket_path)
+    self._shm = None
+    reply, fds = self._request(SC_ATTACH, model, num_fds=1)
+    num_inputs, num_outputs = reply[4], reply[5]
+    try:
+      self._shm = mmap.mmap(fds[0], reply[3])
+    finally:
+      for fd in fds:
+        socket.close(fd)
+    self.details = [self._describe(reply[-1][idx]) for idx in range(num_inputs + num_outputs)]
+    self.inputs = [self._view(detail) for detail in self.details[:num_inputs]]
+    self.outputs = [self._view(detail) for detail in self.details[num_inputs:]]
+
+  def _describe(self, fields):
+    offset, size, tensor_type, num_dims = fields[:4]
+    return {
+      'offset': offset,
+      'size': size,
+      'dtype': TENSOR_DTYPES[tensor_type],
+      'shape': tuple(fields[4:4 + num_dims]),
+      'quantization': (fields[10], fields[11]),
+      }
+
+  def _view(self, detail):
+    count = int(np.prod(detail['shape']))
+    return np.frombuffer(self._shm, detail['dtype'], count, detail['offset']).reshape(detail['shape'])
+
+  def _receive(self, size, num_fds=0):
+    data = b''
+    fds = []
+    while len(data) < size:
+      chunk, ancdata, _, _ = self._socket.recvmsg(
+        size - len(data),
+        socket.CMSG_SPACE(num_fds * np.dtype(np.int32).itemsize) if num_fds else 0,
+        )
+      if not chunk:
+        raise ConnectionError('Inference server closed the connection.')
+      for level, kind, payload in ancdata:
+        if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+          fds.extend(np.frombuffer(payload, np.int32).tolist())
+      data += chunk
+    return data, fds
+
+  def _request(self, command, model='', num_fds=0):
+    self._socket.sendall(REQUEST.pack(SERVE_MAGIC, command, model.encode()))
+    data, fds = self._receive(REPLY_SIZE, num_fds)
+    header = REPLY_HEADER.unpack_from(data)
+    tensors = [TENSOR.unpack_from(data, REPLY_HEADER.size + idx * TENSOR.size) for idx in range(SERVE_MAX_TENSORS)]
+    if header[0] != SERVE_MAGIC:
+      raise ConnectionError('Not an inference server.')
+    if header[1] != 0:
+      raise OSError(header[1], 'Inference server failed command %d.' % command)
+    return header + (tensors,), fds
+
+  def invoke(self):
+    """Run the model over the current inputs.
+
+    Returns:
+      latency_ns: Time the server took from receiving the request to writing the outputs.
+    """
+    reply, _ = self._request(SC_RUN)
+    return reply[2]
+
+  def stats(self, model=''):
+    """Fetch the statistics of a model served by the server.
+
+    Args:
+      model: Name of the model, or all models if empty.
+
+    Returns:
+      stats: Dictionary of per-model dictionaries of batch size, queue depth, request and batch counts and latencies.
+    """
+    reply, _ = self._request(SC_STATS, model)
+    data, _ = self._receive(reply[6] * MODEL_STATS.size)
+    stats = {}
+    for idx in range(reply[6]):
+      fields = MODEL_STATS.unpack_from(data, idx * MODEL_STATS.size)
+      stats[fields[0].rstrip(b'\0').decode()] = dict(zip(MODEL_STATS_FIELDS, fields[1:]))
+    return stats
+
+  def close(self):
+    self.inputs = self.outputs = None
+    if self._shm is not None:
+      self._shm.close()
+      self._shm = None
+    self._socket.close()
+
+  def __enter__(self):
+    return self
+
+  def __exit__(self, *args):
+    self.close()
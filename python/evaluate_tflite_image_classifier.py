@@ -10,6 +10,19 @@ from mltools.cv2_preprocessors import preprocessors
 
 log = logging.getLogger(__name__)
 
+# Arguments that do not change the results of an evaluation, which may thus differ when resuming it. The model is
+# checked by hash instead of path.
+RESUME_IGNORED_ARGS = (
+  'tflite_model_path',
+  'num_workers',
+  'prefetch_batches',
+  'mlperf_compat_output_path',
+  'num_shards',
+  'resume',
+  'checkpoint_interval',
+  'log_path',
+  )
+
 def parse_args(argv=None):
   import argparse
 
@@ -18,15 +31,13 @@ def parse_args(argv=None):
   )
   parser.add_argument(
     '-i', '--tflite_model_path',
-    help='Path to image classifier TFLite model.',
-    required=True,
+    help='Path to image classifier TFLite model. Required unless merging shards.',
     )
 
   parser.add_argument(
     '-p', '--model_preprocessor',
-    help='Model preprocessor.',
+    help='Model preprocessor. Required unless merging shards.',
     choices=preprocessors().keys(),
-    required=True,
     )
 
   parser.add_argument(
@@ -35,6 +46,12 @@ def parse_args(argv=None):
     action='store_true',
     )
 
+  parser.add_argument(
+    '--reduced_decode',
+    help='Decode large JPEG images downscaled in the DCT domain, which slightly changes preprocessed images.',
+    action='store_true',
+    )
+
   parser.add_argument(
     '--no_quantize_input',
     help='Do not quantize images during preprocessing. Only applies to quantized models.',
@@ -53,6 +70,18 @@ def parse_args(argv=None):
     action='store_true',
     )
 
+  parser.add_argument(
+    '--native_engine',
+    help='Run inference on the native engine instead of TFLite.',
+    action='store_true',
+    )
+
+  parser.add_argument(
+    '--native_preprocessor',
+    help='Preprocess images with the native engine\'s preprocessor, which also quantizes them.',
+    action='store_true',
+    )
+
   parser.add_argument(
     '-l', '--model_labels_offset',
     help='An offset for the labels in the dataset. This flag is primarily used to evaluate architectures such as ResNet that do not use a background class.',
@@ -62,8 +91,12 @@ def parse_args(argv=None):
 
   parser.add_argument(
     '-d', '--dataset_valsplit_path',
-    help='Path to directory containing the dataset validation split.',
-    required=True,
+    help='Path to directory containing the dataset validation split. Required unless a packed split is given.',
+    )
+
+  parser.add_argument(
+    '--packed_dataset_path',
+    help='Path to the dataset validation split packed by packed_dataset.py, read instead of the split\'s directory.',
     )
 
   parser.add_argument(
@@ -79,9 +112,23 @@ def parse_args(argv=None):
     default=os.cpu_count(),
     )
 
+  parser.add_argument(
+    '-w', '--num_workers',
+    help='The number of processes reading and preprocessing images, overlapping with inference. Zero reads images inline.',
+    type=int,
+    default=os.cpu_count(),
+    )
+
+  parser.add_argument(
+    '--prefetch_batches',
+    help='The number of batches preprocessing workers prepare ahead of inference.',
+    type=int,
+    default=2,
+    )
+
   parser.add_argument(
     '-o', '--metrics_output_path',
-    help='Path to metrics output pickle file.',
+    help='Path to metrics output file, read by plot_metrics.py.',
     required=True,
     )
 
@@ -90,6 +137,44 @@ def parse_args(argv=None):
     help='Path to MLPerf-compatible output file that will store results.',
     )
 
+  parser.add_argument(
+    '--resume',
+    help='Resume an interrupted evaluation from the batches recorded in its metrics output, if any, after checking '
+      'that they were evaluated with the same model and arguments.',
+    action='store_true',
+    )
+
+  parser.add_argument(
+    '--checkpoint_interval',
+    help='The number of batches between syncs of the metrics output to disk, bounding the batches lost to a host '
+      'failure. Batches already evaluated are flushed regardless.',
+    type=int,
+    default=10,
+    )
+
+  parser.add_argument(
+    '--num_shards',
+    help='Split the batches into this many shards evaluated by as many processes, then merge their metrics.',
+    type=int,
+    )
+
+  parser.add_argument(
+    '--shard',
+    help='Only evaluate shard INDEX of COUNT, writing partial metrics next to the metrics output path, for example '
+      'on one of several machines sharing a filesystem.',
+    metavar=('INDEX', 'COUNT'),
+    type=int,
+    nargs=2,
+    )
+
+  parser.add_argument(
+    '--merge_shards',
+    help='Merge the partial metrics written by this many shards into the metrics and MLPerf-compatible outputs, '
+      'instead of evaluating.',
+    metavar='COUNT',
+    type=int,
+    )
+
   parser.add_argument(
     '--log_path',
     help='Path to log directory. Default is same directory as this script.',
@@ -99,6 +184,15 @@ def parse_args(argv=None):
     args = parser.parse_args(argv)
   else:
     args = parser.parse_args()
+  if not args.merge_shards:
+    if not args.tflite_model_path or not args.model_preprocessor:
+      parser.error('the arguments -i/--tflite_model_path and -p/--model_preprocessor are required')
+    if not args.dataset_valsplit_path and not args.packed_dataset_path:
+      parser.error('one of the arguments -d/--dataset_valsplit_path --packed_dataset_path is required')
+  if args.shard and not 0 <= args.shard[0] < args.shard[1]:
+    parser.error('invalid shard %d of %d' % tuple(args.shard))
+  if args.checkpoint_interval < 1:
+    parser.error('argument --checkpoint_interval: must be at least 1 batch')
 
   from mltools.python_logging import create_log_config
   log_config = create_log_config(
@@ -110,19 +204,132 @@ def parse_args(argv=None):
   return args
 
 
+def _run_shard(args):
+  """Evaluate one shard in a child process.
+  """
+  from mltools.python_logging import create_log_config
+  logging.config.dictConfig(create_log_config(log_path=args.log_path))
+  if run(args) != 0:
+    raise RuntimeError('Shard %d of %d failed.' % tuple(args.shard))
+
+
+def run_shards(args):
+  """Evaluate `args.num_shards` shards in parallel processes, splitting preprocessing workers between them, then merge
+  their metrics.
+  """
+  import copy
+  import multiprocessing
+
+  # Spawned, since shards start their own worker processes and interpreter threads.
+  context = multiprocessing.get_context('spawn')
+  processes = []
+  for shard_index in range(args.num_shards):
+    shard_args = copy.copy(args)
+    shard_args.num_shards = None
+    shard_args.shard = [shard_index, args.num_shards]
+    shard_args.num_workers = -(-args.num_workers // args.num_shards)
+    processes.append(context.Process(target=_run_shard, args=(shard_args,)))
+    processes[-1].start()
+  for process in processes:
+    process.join()
+  if any(process.exitcode != 0 for process in processes):
+    log.error('Shards exited with %s.' % [process.exitcode for process in processes])
+    return 1
+  merge_args = copy.copy(args)
+  merge_args.merge_shards = args.num_shards
+  return merge_shards(merge_args)
+
+
+def merge_shards(args):
+  """Merge the metrics files of `args.merge_shards` shards into the metrics and MLPerf-compatible outputs.
+  """
+  from mltools.classification_metrics import MetricsFile, MetricsWriter, merge_shard_metrics, shard_metrics_path
+
+  shard_files = [
+    MetricsFile(shard_metrics_path(args.metrics_output_path, shard_index, args.merge_shards))
+    for shard_index in range(args.merge_shards)
+    ]
+  metrics_writer = MetricsWriter(
+    args.metrics_output_path,
+    __file__,
+    shard_files[0].args,
+    shard_files[0].batch_size,
+    shard_files[0].num_samples,
+    top_k=shard_files[0].top_labels.shape[1],
+    model_hash=shard_files[0].model_hash,
+    )
+  mlperf_log = None
+  if args.mlperf_compat_output_path:
+    mlperf_log = open(args.mlperf_compat_output_path, 'w', buffering=1)
+  metrics = merge_shard_metrics(shard_files, metrics_writer, mlperf_log)
+  metrics_writer.close()
+  if mlperf_log:
+    mlperf_log.close()
+  log.info('Merged %d shards: %0.2f%% top-1, %0.2f%% top-5.' % (
+    args.merge_shards,
+    100*metrics.batch_metrics['cumulative_accuracy'],
+    100*metrics.batch_metrics['cumulative_top_5_accuracy'],
+    ))
+  return 0
+
+
+def _model_hash(tflite_model_path):
+  """SHA-256 digest of a model file.
+  """
+  import hashlib
+  model_hash = hashlib.sha256()
+  with open(tflite_model_path, 'rb') as f:
+    for chunk in iter(lambda: f.read(1 << 20), b''):
+      model_hash.update(chunk)
+  return model_hash.hexdigest()
+
+
+def _check_resumable(metrics_file, args, model_hash, num_samples, batch_ids, top_k):
+  """Raise an error unless `metrics_file` records batches of the same evaluation as `args`.
+  """
+  mismatches = []
+  if metrics_file.model_hash != model_hash:
+    mismatches.append('model %s instead of %s' % (metrics_file.model_hash, model_hash))
+  recorded_args = vars(metrics_file.args)
+  for name in sorted(set(recorded_args) | set(vars(args))):
+    if name not in RESUME_IGNORED_ARGS and recorded_args.get(name) != getattr(args, name, None):
+      mismatches.append('%s %r instead of %r' % (name, recorded_args.get(name), getattr(args, name, None)))
+  if metrics_file.num_samples != num_samples:
+    mismatches.append('%d samples instead of %d' % (metrics_file.num_samples, num_samples))
+  if metrics_file.batch_ids != batch_ids or metrics_file.top_labels.shape[1] != top_k:
+    mismatches.append('batches %s of top-%d labels instead of %s of top-%d' % (
+      metrics_file.batch_ids, metrics_file.top_labels.shape[1], batch_ids, top_k))
+  if mismatches:
+    raise ValueError('Cannot resume the evaluation recorded in %s, which has %s.' % (
+      metrics_file.path, ', '.join(mismatches)))
+
+
 def run(args):
   """Infer dataset's validation images with a TFLite image classifier.
   """
-  import pickle
   import numpy as np
 
-  from mltools.python_threading import create_thread, run_thread_pool, join_thread_pool
-  from mltools.tflite_utils import create_dataset_split_batch_queue, create_interpreter_pool, create_image_classification_thread_pool
+  from mltools.classification_metrics import ClassificationMetrics, MetricsFile, MetricsWriter, shard_metrics_path, top_k_labels
+  from mltools.python_threading import WorkerPool
+  from mltools.stage_timers import StageClock, StageTimers
+  from mltools.tflite_utils import close_interpreter_pool, create_dataset_split_batch_queue, create_interpreter_pool, evaluate_image_batch
 
+  if args.merge_shards:
+    return merge_shards(args)
+  if args.num_shards:
+    return run_shards(args)
+  if args.native_preprocessor:
+    from mltools.native_engine import Preprocessor
+    model_preprocessor_fn = Preprocessor(args.model_preprocessor)
+  else:
+    model_preprocessor_fn = preprocessors()[args.model_preprocessor]
+  model_hash = _model_hash(args.tflite_model_path)
+  stage_timers = StageTimers()
   interpreters = create_interpreter_pool(
     tflite_path=args.tflite_model_path,
     size=args.batch_size,
     delegate_to_tpu=args.delegate_to_tpu,
+    use_native_engine=args.native_engine,
     )
   dataset_batch_queue, read_batch_fn = create_dataset_split_batch_queue(
     dataset_split_path=args.dataset_valsplit_path,
@@ -130,84 +337,93 @@ def run(args):
     batch_size=args.batch_size,
     max_samples=args.max_samples,
     model_input_details=interpreters[0].get_input_details(),
-    model_preprocessor_fn=preprocessors()[args.model_preprocessor],
+    model_preprocessor_fn=model_preprocessor_fn,
     model_labels_offset=args.model_labels_offset,
     quantize_input=(not args.no_quantize_input),
     read_from_numpy=args.read_from_numpy,
+    num_workers=args.num_workers,
+    prefetch_batches=args.prefetch_batches,
+    packed_dataset_path=args.packed_dataset_path,
+    reduced_decode=args.reduced_decode,
+    stage_timers=stage_timers,
+    shard=args.shard,
     )
-  total_true_positives = 0
-  total_top_5_true_positives = 0
-  total_images = 0
-  metrics = [{}]*dataset_batch_queue['num_batches']
-  if args.mlperf_compat_output_path:
-    mlperf_log = open(args.mlperf_compat_output_path, 'w', buffering=1)
-  log.info('Processing %d batches of size %d...' % (dataset_batch_queue['num_batches'], args.batch_size))
-  for batch_id in range(dataset_batch_queue['num_batches']):
+  interpreter_pool = WorkerPool(interpreters)
+  num_batches = dataset_batch_queue['num_batches']
+  batch_ids = dataset_batch_queue['batch_ids']
+  mlperf_log = None
+  if args.shard:
+    # Shards only record their batches, whose cumulative metrics and MLPerf log are derived when merging.
+    metrics_path = shard_metrics_path(args.metrics_output_path, *args.shard)
+  else:
+    metrics_path = args.metrics_output_path
+    if args.mlperf_compat_output_path:
+      mlperf_log = open(args.mlperf_compat_output_path, 'w', buffering=1)
+  # Models with fewer than 5 classes record all of their labels.
+  top_k = 1 if args.no_postprocess_predictions else min(5, int(interpreters[0].get_output_details()[0]['shape'][-1]))
+  metrics = ClassificationMetrics(mlperf_log)
+  num_resumed_batches = 0
+  num_resumed_samples = None
+  if args.resume and os.path.isfile(metrics_path):
+    # Cumulative metrics and the MLPerf log are rederived from the resumed batches' records.
+    metrics_file = MetricsFile(metrics_path)
+    _check_resumable(metrics_file, args, model_hash, dataset_batch_queue['num_samples'], batch_ids, top_k)
+    num_resumed_batches = metrics_file.num_complete_batches
+    num_resumed_samples = min(num_resumed_batches * args.batch_size, len(metrics_file))
+    metrics.add_metrics_file(metrics_file, num_resumed_samples)
+    del metrics_file
+    log.info('Resuming after %d of %d batches.' % (num_resumed_batches, len(batch_ids)))
+  metrics_writer = MetricsWriter(
+    metrics_path,
+    __file__,
+    args,
+    args.batch_size,
+    dataset_batch_queue['num_samples'],
+    batch_ids,
+    top_k=top_k,
+    model_hash=model_hash,
+    num_resumed_samples=num_resumed_samples,
+    )
+  metrics.metrics_writer = metrics_writer
+  log.info('Processing %d batches of size %d...' % (len(batch_ids) - num_resumed_batches, args.batch_size))
+  for batch_id in batch_ids[num_resumed_batches:]:
+    timings = {}
+    clock = StageClock(timings)
     image_batch, gtlabel_batch = zip(*[image_map for image_map in read_batch_fn(batch_id)])
-    num_images = len(image_batch)
-    threads = create_image_classification_thread_pool(
-      interpreters=interpreters,
-      image_batch=image_batch,
-      create_thread_fn=create_thread,
-      )
-    run_thread_pool(threads)
-    predictions = np.array(join_thread_pool(threads))
+    clock.lap('batch_wait')
+    predictions = evaluate_image_batch(interpreter_pool, image_batch, stage_timers)
+    clock.lap('batch_inference')
     log.debug({'predictions': predictions})
+    clock.restart()
     if args.no_postprocess_predictions:
-      top_5_labels = predictions
-      batch_true_positives = np.sum(
-        [int(predictions[i] == gtlabel_batch[i]) for i in range(num_images)],
-        )
-      batch_top_5_true_positives = batch_true_positives
+      top_5_labels = np.asarray(predictions).reshape(len(gtlabel_batch), 1)
+      top_5_scores = None
     else:
-      top_5_labels = [prediction.argsort()[-5:] for prediction in predictions]
+      top_5_labels = top_k_labels(predictions, top_k)
+      top_5_scores = np.take_along_axis(predictions, top_5_labels, axis=1)
+      clock.lap('top_k')
       log.debug({'batch_top_5_labels': top_5_labels})
-      batch_true_positives = np.sum(
-        [int(top_5_labels[i][-1] == gtlabel_batch[i]) for i in range(num_images)],
-        )
-      batch_top_5_true_positives = np.sum(
-        [int(gtlabel_batch[i] in top_5_labels[i]) for i in range(num_images)],
-        )
-    batch_accuracy = batch_true_positives / num_images
-    batch_top_5_accuracy = batch_top_5_true_positives / num_images
-    if args.mlperf_compat_output_path:
-      tp = total_true_positives
-      ti = total_images
-      for i in range(num_images):
-        if args.no_postprocess_predictions:
-          prediction = top_5_labels[i]
-        else:
-          prediction = top_5_labels[i][-1]
-        tp += int(prediction == gtlabel_batch[i])
-        ti += 1
-        mlperf_log.write('self.good = %d/%d = %.4f, result = %d, expected = %d\n' % (
-          tp,
-          ti,
-          tp / ti,
-          prediction,
-          gtlabel_batch[i],
-        ))
-    total_true_positives += batch_true_positives
-    total_top_5_true_positives += batch_top_5_true_positives
-    total_images += num_images
-    cumulative_accuracy = total_true_positives / total_images
-    cumulative_top_5_accuracy = total_top_5_true_positives / total_images
-    metrics[batch_id] = {
-      'gtlabels': gtlabel_batch,
-      'top_5_labels': top_5_labels,
-      'accuracy': batch_accuracy,
-      'top_5_accuracy': batch_top_5_accuracy,
-      'cumulative_accuracy': cumulative_accuracy,
-      'cumulative_top_5_accuracy': cumulative_top_5_accuracy,
-      }
-    log.debug(metrics[batch_id])
+    stage_timers.add_timings(timings)
+    batch_metrics = metrics.add_batch(gtlabel_batch, top_5_labels, top_5_scores)
+    log.debug(batch_metrics)
+    if (batch_id + 1 - batch_ids.start) % args.checkpoint_interval == 0:
+      metrics_writer.sync()
+      log.debug({'stage_latencies': stage_timers.summary()})
     log.info('Batch %d of %d: %0.2f%%' % (
       batch_id,
-      dataset_batch_queue['num_batches'] - 1,
-      100*metrics[batch_id]['cumulative_accuracy'],
+      num_batches - 1,
+      100*batch_metrics['cumulative_accuracy'],
       ))
-  with open(args.metrics_output_path, 'wb') as f:
-    pickle.dump((__file__, args, metrics), f)
+  interpreter_pool.close()
+  close_interpreter_pool(interpreters)
+  if 'pool' in dataset_batch_queue:
+    dataset_batch_queue['pool'].close()
+    dataset_batch_queue['pool'].join()
+  metrics_writer.close()
+  if mlperf_log:
+    mlperf_log.close()
+  log.info({'stage_latencies': stage_timers.summary()})
+  log.debug({'stage_latency_buckets': stage_timers.buckets()})
   return 0
 
 
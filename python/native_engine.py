@@ -0,0 +1,291 @@
+"""Python bindings to the native engine (`src/engine`).
+
+`Interpreter` mirrors the subset of `tflite.Interpreter` used by the evaluation scripts. Tensors are NumPy views on the
+engine's arena, so inputs can be written and outputs read without copying, and `invoke()` releases the GIL while the
+engine runs. `Preprocessor` is a native equivalent of the preprocessors of `cv2_preprocessors.py`, which can write
+straight into those views. The engine exits the process on errors such as an unreadable model, instead of raising
+exceptions.
+"""
+
+import ctypes
+import ctypes.util
+import numpy as np
+import os
+
+ENGINE_MAX_DIMS = 6
+
+# enum tensor_type of `src/model.h`.
+TENSOR_DTYPES = {
+  0: np.float32,
+  1: np.float16,
+  2: np.int32,
+  3: np.uint8,
+  4: np.int64,
+  6: np.bool_,
+  7: np.int16,
+  9: np.int8,
+  }
+TENSOR_TYPES = {np.dtype(dtype): tensor_type for tensor_type, dtype in TENSOR_DTYPES.items()}
+
+
+class _ThreadpoolOptions(ctypes.Structure):
+  _fields_ = [
+    ('num_threads', ctypes.c_uint32),
+    ('cpus', ctypes.POINTER(ctypes.c_int32)),
+    ('num_cpus', ctypes.c_uint32),
+    ]
+
+
+class _EngineOptions(ctypes.Structure):
+  _fields_ = [
+    ('prepack_cache_path', ctypes.c_char_p),
+    ('registry', ctypes.c_void_p),
+    ('pool', ctypes.c_void_p),
+    ('threads', _ThreadpoolOptions),
+    ('is_sequential', ctypes.c_bool),
+    ('is_profiling', ctypes.c_bool),
+    ('max_profile_events', ctypes.c_size_t),
+    ]
+
+
+class _EngineTensor(ctypes.Structure):
+  """Leading fields of `struct engine_tensor`, only ever accessed through pointers returned by the engine.
+  """
+  _fields_ = [
+    ('type', ctypes.c_int),
+    ('num_dims', ctypes.c_uint8),
+    ('shape', ctypes.c_int32 * ENGINE_MAX_DIMS),
+    ('size', ctypes.c_size_t),
+    ('data', ctypes.c_void_p),
+    ('is_constant', ctypes.c_bool),
+    ('scale', ctypes.c_float),
+    ('zero_point', ctypes.c_int32),
+    ('channel_scales', ctypes.c_void_p),
+    ('num_channel_scales', ctypes.c_uint32),
+    ('name', ctypes.c_char_p),
+    ]
+
+
+class _PreprocessOptions(ctypes.Structure):
+  _fields_ = [
+    ('height', ctypes.c_uint32),
+    ('width', ctypes.c_uint32),
+    ('crop_percent', ctypes.c_float),
+    ('interpolation', ctypes.c_int),
+    ('divisor', ctypes.c_float),
+    ('mean', ctypes.c_float * 3),
+    ('multiplier', ctypes.c_float),
+    ]
+
+
+def _load_library():
+  """Load `libengine.so` from $MLTOOLS_ENGINE_LIB, the library search path or the source tree, in this order.
+  """
+  path = os.environ.get('MLTOOLS_ENGINE_LIB') or ctypes.util.find_library('engine')
+  if not path:
+    this_dir = os.path.dirname(os.path.realpath(__file__))
+    path = os.path.join(this_dir, os.pardir, 'src', 'engine', 'libengine.so')
+  lib = ctypes.CDLL(path)
+  lib.engine_open.argtypes = [ctypes.c_char_p, ctypes.POINTER(_EngineOptions)]
+  lib.engine_open.restype = ctypes.c_void_p
+  lib.engine_invoke.argtypes = [ctypes.c_void_p]
+  lib.engine_invoke.restype = None
+  lib.engine_close.argtypes = [ctypes.c_void_p]
+  lib.engine_close.restype = None
+  lib.engine_num_inputs.argtypes = [ctypes.c_void_p]
+  lib.engine_num_inputs.restype = ctypes.c_uint32
+  lib.engine_num_outputs.argtypes = [ctypes.c_void_p]
+  lib.engine_num_outputs.restype = ctypes.c_uint32
+  lib.engine_input_tensor.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+  lib.engine_input_tensor.restype = ctypes.POINTER(_EngineTensor)
+  lib.engine_output_tensor.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+  lib.engine_output_tensor.restype = ctypes.POINTER(_EngineTensor)
+  lib.registry_create.argtypes = []
+  lib.registry_create.restype = ctypes.c_void_p
+  lib.registry_destroy.argtypes = [ctypes.c_void_p]
+  lib.registry_destroy.restype = None
+  lib.preprocess_image.argtypes = [
+    ctypes.c_void_p, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_size_t, ctypes.POINTER(_PreprocessOptions),
+    ctypes.c_int, ctypes.c_float, ctypes.c_int32, ctypes.c_void_p,
+    ]
+  lib.preprocess_image.restype = None
+  return lib
+
+_lib = None
+
+def _library():
+  global _lib
+  if _lib is None:
+    _lib = _load_library()
+  return _lib
+
+
+class Registry:
+  """Store of constant buffers shared by the interpreters opened with it (see `src/engine/registry.h`).
+
+  Must outlive those interpreters, see tflite_utils.close_interpreter_pool().
+  """
+  def __init__(self):
+    self._registry = _library().registry_create()
+
+  def close(self):
+    if self._registry:
+      _library().registry_destroy(self._registry)
+      self._registry = None
+
+
+class Interpreter:
+  """Native engine running one model.
+
+  Args:
+    model_path: Path to TFLite model.
+    model_content: Preloaded TFLite model, used if `model_path` is not specified.
+    num_threads: Number of threads running each inference. Default is all online CPUs.
+    registry: Registry sharing constant buffers with other interpreters.
+
+  Attributes:
+    registry: The registry passed, to be closed once all interpreters opened with it are.
+  """
+  def __init__(self, model_path=None, model_content=None, num_threads=None, registry=None):
+    self._engine = None
+    options = _EngineOptions()
+    options.threads.num_threads = num_threads or 0
+    if registry:
+      options.registry = registry._registry
+    self.registry = registry
+    if model_path:
+      if not os.path.isfile(model_path):
+        raise ValueError('Invalid TFLite model path (%s).' % model_path)
+      self._engine = _library().engine_open(model_path.encode(), ctypes.byref(options))
+    elif model_content:
+      # The engine maps models from files, so preloaded models are passed through an anonymous one.
+      fd = os.memfd_create('model', os.MFD_CLOEXEC)
+      try:
+        os.write(fd, model_content)
+        self._engine = _library().engine_open(('/proc/self/fd/%d' % fd).encode(), ctypes.byref(options))
+      finally:
+        os.close(fd)
+    else:
+      raise ValueError('Invalid TFLite model. Check either model_path or model_content.')
+    num_inputs = _library().engine_num_inputs(self._engine)
+    num_outputs = _library().engine_num_outputs(self._engine)
+    self._tensors = \
+      [_library().engine_input_tensor(self._engine, idx).contents for idx in range(num_inputs)] + \
+      [_library().engine_output_tensor(self._engine, idx).contents for idx in range(num_outputs)]
+    self._views = [self._view(t) for t in self._tensors]
+    self._input_details = [self._details(idx) for idx in range(num_inputs)]
+    self._output_details = [self._details(num_inputs + idx) for idx in range(num_outputs)]
+
+  def _view(self, t):
+    shape = tuple(t.shape[:t.num_dims])
+    buffer = (ctypes.c_uint8 * t.size).from_address(t.data)
+    return np.frombuffer(buffer, TENSOR_DTYPES[t.type]).reshape(shape)
+
+  def _details(self, index):
+    """Tensor details in the format of `tflite.Interpreter`, indexing inputs then outputs.
+    """
+    t = self._tensors[index]
+    return {
+      'name': t.name.decode() if t.name else '',
+      'index': index,
+      'shape': np.array(self._views[index].shape, np.int32),
+      'dtype': self._views[index].dtype.type,
+      'quantization': (t.scale, t.zero_point),
+      }
+
+  def allocate_tensors(self):
+    """Tensors are allocated by the engine when opening the model.
+    """
+    pass
+
+  def get_input_details(self):
+    return self._input_details
+
+  def get_output_details(self):
+    return self._output_details
+
+  def tensor(self, index):
+    """Return a function returning a view of tensor `index`, like `tflite.Interpreter.tensor()`.
+    """
+    return lambda: self._views[index]
+
+  def set_tensor(self, index, value):
+    """Copy `value` into input tensor `index`, the only copy between the caller's array and the engine.
+    """
+    view = self._views[index]
+    value = np.asarray(value)
+    if value.dtype != view.dtype or value.size != view.size:
+      raise ValueError('Cannot set tensor %d of %s %s from %s %s.' % (
+        index, view.dtype, view.shape, value.dtype, value.shape))
+    np.copyto(view, value.reshape(view.shape))
+
+  def get_tensor(self, index):
+    """Return a view of tensor `index`, valid until the next call to `invoke()`.
+    """
+    return self._views[index]
+
+  def invoke(self):
+    _library().engine_invoke(self._engine)
+
+  def close(self):
+    if self._engine:
+      self._views = self._tensors = None
+      _library().engine_close(self._engine)
+      self._engine = None
+
+  def __del__(self):
+    self.close()
+
+
+class Preprocessor:
+  """Native equivalent of a preprocessor of `cv2_preprocessors.py` (see `src/engine/preprocess.h`), fused with
+  quantizing images for a model input.
+
+  Instances can be passed to worker processes, and `__name__` is the name of the Python preprocessor they replace.
+
+  Args:
+    name: Name of the preprocessor in `cv2_preprocessors.preprocessors()`.
+  """
+  is_native = True
+
+  def __init__(self, name):
+    from mltools.cv2_preprocessors import preprocessors
+    self.name = name
+    self.__name__ = preprocessors()[name].__name__
+
+  def __call__(self, img, input_quantization=None, out=None):
+    """Preprocess an image.
+
+    Args:
+      img: NumPy BGR image of type uint8, as read by `cv2.imread()`.
+      input_quantization: Tuple (scale, zero_point, dtype) of the model input, or None to store float values.
+      out: Contiguous NumPy array of the output's size and type, such as a view of an interpreter's input tensor.
+        Default is a new array.
+
+    Returns:
+      out: NumPy array of shape (height, width, 3) unless passed, holding the preprocessed image.
+    """
+    options = _PreprocessOptions.in_dll(_library(), 'preprocess_%s' % self.name)
+    dtype = np.dtype(input_quantization[2] if input_quantization else np.float32)
+    scale, zero_point = input_quantization[:2] if input_quantization else (0.0, 0)
+    if img.dtype != np.uint8 or img.ndim != 3 or img.shape[2] != 3 or img.strides[1:] != (3, 1):
+      img = np.ascontiguousarray(img, np.uint8)
+      if img.ndim != 3 or img.shape[2] != 3:
+        raise ValueError('Cannot preprocess image of shape %s.' % (img.shape,))
+    if out is None:
+      out = np.empty((options.height, options.width, 3), dtype)
+    elif out.dtype != dtype or out.size != options.height * options.width * 3 or not out.flags.c_contiguous or \
+        not out.flags.writeable:
+      raise ValueError('Cannot preprocess into %s %s.' % (out.dtype, out.shape))
+    _library().preprocess_image(
+      img.ctypes.data,
+      img.shape[0],
+      img.shape[1],
+      img.strides[0],
+      ctypes.byref(options),
+      TENSOR_TYPES[dtype],
+      scale,
+      zero_point,
+      out.ctypes.data,
+      )
+    return out
@@ -0,0 +1,361 @@
+"""Packed preprocessed dataset splits.
+
+A packed split stores all preprocessed samples of a dataset split in one file that is memory-mapped for reading, so
+that evaluations read it sequentially instead of opening one NumPy file per sample. The file starts with a header,
+followed by the int32 ground truth labels and, at a page-aligned offset, the samples back-to-back in NHWC order.
+Samples may be stored already quantized for the input of a quantized model, which quarters the bytes read and skips
+quantizing them on every evaluation. Quantized copies of a float split are cached next to it, one per input
+quantization.
+"""
+
+import logging
+import logging.config
+import numpy as np
+import os
+import struct
+import tempfile
+
+log = logging.getLogger(__name__)
+
+PACKED_MAGIC = b'MLTPACKD'
+PACKED_VERSION = 1
+PACKED_PAGE_SIZE = 4096
+PACKED_MAX_DIMS = 6
+PACKED_MAX_NAME_LEN = 64
+
+# magic, version, num_dims, dtype, preprocessor, num_samples, labels_offset, samples_offset, shape, quantization scale
+# (0 if not quantized), quantization zero point
+HEADER = struct.Struct('=8sII16s%dsQQQ%dIdq' % (PACKED_MAX_NAME_LEN, PACKED_MAX_DIMS))
+
+
+class PackedDataset:
+  """Memory-mapped packed dataset split.
+
+  Args:
+    path: Path to packed dataset split file.
+
+  Attributes:
+    images: Read-only NumPy array of shape (num_samples, height, width, channels) mapped from the file.
+    labels: Read-only NumPy array of shape (num_samples) of ground truth labels.
+    preprocessor: Name of the function that preprocessed the samples.
+    quantization: Tuple (scale, zero_point) the samples were quantized with, or None if they were not.
+  """
+  def __init__(self, path):
+    with open(path, 'rb') as f:
+      header = HEADER.unpack(f.read(HEADER.size))
+    magic, version, num_dims, dtype, preprocessor, num_samples, labels_offset, samples_offset = header[:8]
+    if magic != PACKED_MAGIC or version != PACKED_VERSION:
+      raise ValueError('Invalid packed dataset split (%s).' % path)
+    self.path = path
+    self.preprocessor = preprocessor.rstrip(b'\0').decode()
+    self.quantization = (header[-2], header[-1]) if header[-2] else None
+    self.labels = np.memmap(path, np.int32, 'r', offset=labels_offset, shape=(num_samples,))
+    self.images = np.memmap(
+      path,
+      np.dtype(dtype.rstrip(b'\0').decode()),
+      'r',
+      offset=samples_offset,
+      shape=(num_samples,) + header[8:8 + num_dims],
+      )
+    self.dtype = self.images.dtype.type
+
+  def __len__(self):
+    return len(self.labels)
+
+  def batch(self, batch_id, batch_size):
+    """Return the images and labels of a batch as views on the file.
+    """
+    batch_index = batch_id * batch_size
+    return self.images[batch_index:batch_index + batch_size], self.labels[batch_index:batch_index + batch_size]
+
+  def quantized_with(self, input_quantization):
+    """Return whether the samples were quantized with `input_quantization`, a tuple (scale, zero_point, dtype). Scales
+    are compared in float32, the precision of TFLite quantization parameters.
+    """
+    return (
+      self.quantization is not None
+      and np.float32(self.quantization[0]) == np.float32(input_quantization[0])
+      and self.quantization[1] == input_quantization[1]
+      and self.dtype == input_quantization[2]
+      )
+
+
+def _read_task(task):
+  from mltools.tflite_utils import read_image
+  return read_image(*task)
+
+
+def _umask():
+  umask = os.umask(0)
+  os.umask(umask)
+  return umask
+
+
+def _write_packed_dataset(output_path, labels, sample_shape, dtype, preprocessor, quantization, fill_fn):
+  """Write a packed dataset split file.
+
+  Args:
+    output_path: Path to packed dataset split file.
+    labels: NumPy array of int32 ground truth labels.
+    sample_shape: Shape of each sample.
+    dtype: NumPy dtype of the samples.
+    preprocessor: Name of the function that preprocessed the samples.
+    quantization: Tuple (scale, zero_point) the samples were quantized with, or None.
+    fill_fn: Function storing the samples into the array it is passed.
+  """
+  if len(sample_shape) > PACKED_MAX_DIMS - 1:
+    raise ValueError('Samples of shape %s have too many dimensions.' % (sample_shape,))
+  dtype = np.dtype(dtype)
+  labels_offset = HEADER.size
+  samples_offset = (labels_offset + labels.nbytes + PACKED_PAGE_SIZE - 1) // PACKED_PAGE_SIZE * PACKED_PAGE_SIZE
+  header = HEADER.pack(
+    PACKED_MAGIC,
+    PACKED_VERSION,
+    len(sample_shape),
+    dtype.str.encode(),
+    preprocessor.encode(),
+    len(labels),
+    labels_offset,
+    samples_offset,
+    *(tuple(sample_shape) + (0,) * (PACKED_MAX_DIMS - len(sample_shape))),
+    *(quantization or (0.0, 0)),
+    )
+  # Written under a unique temporary name, so that an interrupted run leaves no truncated split behind and concurrent
+  # writers do not write into each other's file.
+  fd, tmp_path = tempfile.mkstemp(prefix=os.path.basename(output_path) + '.', dir=os.path.dirname(output_path) or '.')
+  try:
+    with os.fdopen(fd, 'wb') as f:
+      os.fchmod(f.fileno(), 0o666 & ~_umask())
+      f.write(header)
+      f.write(labels.astype(np.int32).tobytes())
+      f.truncate(samples_offset + len(labels) * int(np.prod(sample_shape)) * dtype.itemsize)
+    images = np.memmap(tmp_path, dtype, 'r+', offset=samples_offset, shape=(len(labels),) + tuple(sample_shape))
+    fill_fn(images)
+    images.flush()
+    del images
+    os.replace(tmp_path, output_path)
+  except BaseException:
+    os.unlink(tmp_path)
+    raise
+  log.info('Packed %d samples of shape %s into %s.' % (len(labels), tuple(sample_shape), output_path))
+  return PackedDataset(output_path)
+
+
+def pack_dataset_split(dataset_split_path, dataset_split_map_file, output_path, model_preprocessor_fn, read_from_numpy=False, max_samples=None, num_workers=0, input_quantization=None, reduced_decode=False):
+  """Preprocess a dataset split into a packed dataset split file.
+
+  Args:
+    dataset_split_path: Path to dataset split's directory.
+    dataset_split_map_file: Name of dataset split's map file.
+    output_path: Path to packed dataset split file.
+    model_preprocessor_fn: Function that preprocesses each image to fit the model. Not used if `read_from_numpy` is True.
+    read_from_numpy: Load preprocessed NumPy files instead of raw image files.
+    max_samples: Maximum samples to include. Default is entire split.
+    num_workers: Number of processes reading and preprocessing images. Default is preprocessing in this process.
+    input_quantization: Tuple (scale, zero_point, dtype) to store samples quantized for a model input. Default is
+      storing float samples.
+    reduced_decode: Decode JPEG images downscaled in the DCT domain when they are large enough, see
+      cv2_preprocessors.decode_image().
+
+  Returns:
+    packed_dataset: PackedDataset read back from `output_path`.
+  """
+  with open(os.path.join(dataset_split_path, dataset_split_map_file), 'r') as f:
+    image_maps = [l.split() for l in f.readlines()]
+  if max_samples:
+    image_maps = image_maps[:max_samples]
+  tasks = [
+    (os.path.join(dataset_split_path, m[0]), model_preprocessor_fn, input_quantization, read_from_numpy, reduced_decode)
+    for m in image_maps
+    ]
+  labels = np.array([int(m[1]) for m in image_maps], np.int32)
+  first_image = _read_task(tasks[0])
+
+  def _fill(images):
+    if num_workers > 0:
+      import multiprocessing
+      with multiprocessing.Pool(num_workers) as pool:
+        for i, image in enumerate(pool.imap(_read_task, tasks, chunksize=16)):
+          images[i] = image
+    else:
+      for i, task in enumerate(tasks):
+        images[i] = _read_task(task)
+
+  return _write_packed_dataset(
+    output_path,
+    labels,
+    first_image.shape,
+    first_image.dtype,
+    'numpy' if read_from_numpy else model_preprocessor_fn.__name__,
+    input_quantization[:2] if input_quantization else None,
+    _fill,
+    )
+
+
+def quantized_dataset_path(packed_dataset_path, input_quantization):
+  """Path of the cached copy of a float packed dataset split quantized with `input_quantization`.
+  """
+  input_scale, input_zp, input_dtype = input_quantization
+  return '%s.%s_%.9g_%d' % (packed_dataset_path, np.dtype(input_dtype).name, np.float32(input_scale), input_zp)
+
+
+def _cached_quantized_dataset(output_path, packed_dataset, input_quantization):
+  if os.path.isfile(output_path) and os.path.getmtime(output_path) >= os.path.getmtime(packed_dataset.path):
+    quantized_dataset = PackedDataset(output_path)
+    if quantized_dataset.quantized_with(input_quantization):
+      return quantized_dataset
+  return None
+
+
+def quantize_packed_dataset(packed_dataset, input_quantization, chunk_size=256):
+  """Return a packed dataset split quantized for a model input, creating it from a float split unless cached.
+
+  Args:
+    packed_dataset: Float PackedDataset.
+    input_quantization: Tuple (scale, zero_point, dtype) of the model input.
+    chunk_size: Number of samples quantized at once.
+
+  Returns:
+    quantized_dataset: PackedDataset cached at quantized_dataset_path().
+  """
+  import fcntl
+  from mltools.tflite_utils import quantize_image
+  output_path = quantized_dataset_path(packed_dataset.path, input_quantization)
+  quantized_dataset = _cached_quantized_dataset(output_path, packed_dataset, input_quantization)
+  if quantized_dataset is not None:
+    return quantized_dataset
+
+  def _fill(images):
+    for i in range(0, len(packed_dataset), chunk_size):
+      images[i:i + chunk_size] = quantize_image(packed_dataset.images[i:i + chunk_size], input_quantization)
+
+  # Concurrent evaluations, such as the shards of one, quantize the split once: the others wait for the lock, then read
+  # the cached copy.
+  with open('%s.lock' % output_path, 'w') as lock_file:
+    fcntl.flock(lock_file, fcntl.LOCK_EX)
+    quantized_dataset = _cached_quantized_dataset(output_path, packed_dataset, input_quantization)
+    if quantized_dataset is not None:
+      return quantized_dataset
+    return _write_packed_dataset(
+      output_path,
+      np.asarray(packed_dataset.labels),
+      packed_dataset.images.shape[1:],
+      input_quantization[2],
+      packed_dataset.preprocessor,
+      input_quantization[:2],
+      _fill,
+      )
+
+
+def parse_args(argv=None):
+  import argparse
+  from mltools.cv2_preprocessors import preprocessors
+
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+  )
+  parser.add_argument(
+    '-d', '--dataset_split_path',
+    help='Path to directory containing a dataset split.',
+    required=True,
+    )
+
+  parser.add_argument(
+    '-m', '--dataset_split_map_file',
+    help='Name of the dataset split\'s map file.',
+    default='val_map.txt',
+    )
+
+  parser.add_argument(
+    '-p', '--model_preprocessor',
+    help='Model preprocessor.',
+    choices=preprocessors().keys(),
+    required=True,
+    )
+
+  parser.add_argument(
+    '--read_from_numpy',
+    help='Load preprocessed NumPy array files instead of raw image files.',
+    action='store_true',
+    )
+
+  parser.add_argument(
+    '--reduced_decode',
+    help='Decode large JPEG images downscaled in the DCT domain, which slightly changes preprocessed images.',
+    action='store_true',
+    )
+
+  parser.add_argument(
+    '-s', '--max_samples',
+    help='Maximum number of samples to pack. Default is all samples.',
+    type=int,
+    )
+
+  parser.add_argument(
+    '-w', '--num_workers',
+    help='The number of processes reading and preprocessing images.',
+    type=int,
+    default=os.cpu_count(),
+    )
+
+  parser.add_argument(
+    '-q', '--input_quantization',
+    help='Store samples quantized with the scale and zero point of a model input of type int8 or uint8.',
+    metavar=('SCALE', 'ZERO_POINT', 'DTYPE'),
+    nargs=3,
+    )
+
+  parser.add_argument(
+    '-o', '--output_path',
+    help='Path to packed dataset split file.',
+    required=True,
+    )
+
+  parser.add_argument(
+    '--log_path',
+    help='Path to log directory. Default is same directory as this script.',
+    )
+
+  if argv:
+    args = parser.parse_args(argv)
+  else:
+    args = parser.parse_args()
+
+  from mltools.python_logging import create_log_config
+  log_config = create_log_config(
+    log_path=args.log_path,
+    )
+  logging.config.dictConfig(log_config)
+  log.info('%s %s' % (os.path.basename(__file__), args))
+  return args
+
+
+def run(args):
+  """Pack a dataset split.
+  """
+  from mltools.cv2_preprocessors import preprocessors
+
+  input_quantization = None
+  if args.input_quantization:
+    input_scale, input_zp, input_dtype = args.input_quantization
+    if input_dtype not in ('int8', 'uint8'):
+      raise ValueError('Invalid quantized input type %s.' % input_dtype)
+    # Rounded like the float32 scale of a TFLite model input.
+    input_quantization = (float(np.float32(input_scale)), int(input_zp), np.dtype(input_dtype).type)
+  pack_dataset_split(
+    dataset_split_path=args.dataset_split_path,
+    dataset_split_map_file=args.dataset_split_map_file,
+    output_path=args.output_path,
+    model_preprocessor_fn=preprocessors()[args.model_preprocessor],
+    read_from_numpy=args.read_from_numpy,
+    max_samples=args.max_samples,
+    num_workers=args.num_workers,
+    input_quantization=input_quantization,
+    reduced_decode=args.reduced_decode,
+    )
+  return 0
+
+
+if __name__ == '__main__':
+  args = parse_args()
+  run(args)
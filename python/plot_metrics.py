@@ -47,7 +47,7 @@ def parse_args(argv=None):
 
   parser.add_argument(
     '-i', '--metrics_pickle_paths',
-    help='One or more paths to pickle files containing the data series.',
+    help='One or more paths to metrics files containing the data series, or to metrics pickle files of older evaluations.',
     metavar='PATH',
     nargs='+',
     )
@@ -82,15 +82,11 @@ def run(args):
   import matplotlib
   matplotlib.use('Agg')
   import matplotlib.pyplot as plt
-  import pickle
+  from mltools.classification_metrics import load_batch_metrics
   recorded_metrics_list = []
-  i = 0
   for path in args.metrics_pickle_paths:
-    recorded_script, recorded_args, recorded_metrics = pickle.load(
-      open(path, 'rb')
-      )
+    recorded_script, recorded_args, recorded_metrics = load_batch_metrics(path)
     recorded_metrics_list.append(recorded_metrics)
-    i += 1
   log.debug(recorded_metrics_list)
   generate_multiseries_plot(
     plt=plt,
@@ -112,7 +108,7 @@ def generate_multiseries_plot(plt, histogram, title, variable_name, function_nam
   series_axes1 = plt.subplot(gs[0, 0])
   i = 0
   for metrics in metrics_list:
-    function = [batch[function_name] for batch in metrics]
+    function = metrics[function_name]
     if histogram:
       series_axes1.hist(
         function,
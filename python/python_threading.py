@@ -1,36 +1,66 @@
 """Python multithreading.
 """
 
+import queue
+from concurrent.futures import Future
 from threading import Thread
 
-class ThreadWithReturnValueFromJoin(Thread):
-  """XXX: Hack class to retrieve the target's return value at join.
-  """
-  def __init__(self, group=None, target=None, name=None,
-               args=(), kwargs={}):
-    Thread.__init__(self, group, target, name, args, kwargs)
-    self._return = None
+class WorkerPool:
+  """Persistent threads, each bound to one state object such as an interpreter, consuming a bounded task queue.
+
+  Tasks are functions called with the worker's state followed by their arguments. Only tasks that release the GIL, such
+  as interpreter invocations, run in parallel.
 
-  def run(self):
-    if self._target is not None:
-      self._return = self._target(*self._args, **self._kwargs)
+  Args:
+    states: One state object per worker thread.
+    max_pending: Maximum number of queued tasks, beyond which submitting blocks. Default is twice the number of workers.
+  """
+  def __init__(self, states, max_pending=None):
+    self._tasks = queue.Queue(maxsize=max_pending or 2 * len(states))
+    self._threads = [Thread(target=self._run, args=(state,), daemon=True) for state in states]
+    for thread in self._threads:
+      thread.start()
 
-  def join(self, *args):
-    Thread.join(self)
-    return self._return
+  def _run(self, state):
+    while True:
+      task = self._tasks.get()
+      if task is None:
+        return
+      future, fn, args = task
+      if not future.set_running_or_notify_cancel():
+        continue
+      try:
+        future.set_result(fn(state, *args))
+      except BaseException as e:
+        future.set_exception(e)
 
+  def submit(self, fn, *args):
+    """Queue `fn(state, *args)`.
 
-def create_thread(target_fn, target_args):
-  return ThreadWithReturnValueFromJoin(
-    target=target_fn,
-    args=target_args,
-    )
+    Returns:
+      future: concurrent.futures.Future of the task's return value.
+    """
+    future = Future()
+    self._tasks.put((future, fn, args))
+    return future
 
+  def map(self, fn, iterable):
+    """Call `fn(state, item)` for every item and return the results in order.
+    """
+    futures = [self.submit(fn, item) for item in iterable]
+    return [future.result() for future in futures]
 
-def run_thread_pool(threads):
-  for thread in threads:
-    thread.start()
+  def close(self):
+    """Finish the queued tasks and join the workers.
+    """
+    for _ in self._threads:
+      self._tasks.put(None)
+    for thread in self._threads:
+      thread.join()
+    self._threads = []
 
+  def __enter__(self):
+    return self
 
-def join_thread_pool(threads):
-  return [thread.join() for thread in threads]
+  def __exit__(self, *args):
+    self.close()
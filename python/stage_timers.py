@@ -0,0 +1,148 @@
+"""Latency histograms of evaluation pipeline stages.
+
+Stage durations are counted in logarithmic buckets, 20 per decade from 1 us to 1000 s, so that histograms take constant
+memory however long the evaluation, are merged by adding counts, and estimate percentiles within 6% of the actual
+latency.
+"""
+
+import math
+import time
+
+# Stages in pipeline order. Read, decode, preprocess and quantize time each sample in the preprocessing workers, or in
+# the evaluating process when there are none. Native preprocessors quantize while preprocessing. Batch wait is the time
+# the evaluating process spends getting the next batch of samples, which stays near zero unless inference outpaces the
+# preprocessing workers, and batch inference the time its interpreters take to evaluate the batch in parallel. Set
+# tensor, invoke and get tensor time each sample on its interpreter, and top-k each batch.
+STAGES = (
+  'read',
+  'decode',
+  'preprocess',
+  'quantize',
+  'batch_wait',
+  'batch_inference',
+  'set_tensor',
+  'invoke',
+  'get_tensor',
+  'top_k',
+  )
+
+BUCKETS_PER_DECADE = 20
+MIN_LATENCY = 1e-6
+# Bucket 0 counts latencies up to MIN_LATENCY and the last bucket those beyond 1000 s.
+NUM_BUCKETS = 9 * BUCKETS_PER_DECADE + 2
+
+
+class LatencyHistogram:
+  """Logarithmic histogram of latencies in seconds.
+  """
+  def __init__(self):
+    self.counts = [0] * NUM_BUCKETS
+    self.count = 0
+    self.total = 0.0
+    self.min = math.inf
+    self.max = 0.0
+
+  def add(self, seconds):
+    if seconds <= MIN_LATENCY:
+      bucket = 0
+    else:
+      bucket = min(NUM_BUCKETS - 1, int(math.log10(seconds / MIN_LATENCY) * BUCKETS_PER_DECADE) + 1)
+    self.counts[bucket] += 1
+    self.count += 1
+    self.total += seconds
+    self.min = min(self.min, seconds)
+    self.max = max(self.max, seconds)
+
+  def percentile(self, q):
+    """Estimate the `q`th percentile, as the geometric center of the bucket holding it.
+    """
+    if not self.count:
+      return math.nan
+    rank = q / 100 * self.count
+    cumulative = 0
+    for bucket, count in enumerate(self.counts):
+      cumulative += count
+      if count and cumulative >= rank:
+        break
+    estimate = MIN_LATENCY * 10 ** ((bucket - 0.5) / BUCKETS_PER_DECADE)
+    return min(max(estimate, self.min), self.max)
+
+  def buckets(self):
+    """Upper bounds in seconds and counts of the buckets holding latencies.
+    """
+    return [
+      (MIN_LATENCY * 10 ** (bucket / BUCKETS_PER_DECADE), count)
+      for bucket, count in enumerate(self.counts) if count
+      ]
+
+
+class StageClock:
+  """Splits the time elapsed since its creation into consecutive stages.
+
+  Args:
+    timings: Dictionary accumulating the seconds spent in each stage by name, or None to time nothing.
+  """
+  def __init__(self, timings):
+    self.timings = timings
+    self.last = time.perf_counter()
+
+  def lap(self, stage):
+    """End stage `stage`, which started when the previous one ended.
+    """
+    if self.timings is None:
+      return
+    now = time.perf_counter()
+    self.timings[stage] = self.timings.get(stage, 0.0) + now - self.last
+    self.last = now
+
+  def restart(self):
+    """Start the next stage now, leaving the time since the previous one untimed.
+    """
+    self.last = time.perf_counter()
+
+
+class StageTimers:
+  """Latency histograms by stage name.
+  """
+  def __init__(self):
+    self.histograms = {}
+
+  def add(self, stage, seconds):
+    if stage not in self.histograms:
+      self.histograms[stage] = LatencyHistogram()
+    self.histograms[stage].add(seconds)
+
+  def add_timings(self, timings):
+    """Add the stage latencies of a StageClock's timings dictionary.
+    """
+    for stage, seconds in timings.items():
+      self.add(stage, seconds)
+
+  def _stages(self):
+    return [stage for stage in STAGES if stage in self.histograms] + sorted(set(self.histograms) - set(STAGES))
+
+  def summary(self):
+    """Latency statistics of each stage timed, in pipeline order.
+
+    Returns:
+      summary: Dictionary by stage name of dictionaries of the count, total seconds, and mean, p50, p95, p99 and
+        maximum milliseconds.
+    """
+    summary = {}
+    for stage in self._stages():
+      histogram = self.histograms[stage]
+      summary[stage] = {
+        'count': histogram.count,
+        'total_s': round(histogram.total, 6),
+        'mean_ms': round(1e3 * histogram.total / histogram.count, 4),
+        'p50_ms': round(1e3 * histogram.percentile(50), 4),
+        'p95_ms': round(1e3 * histogram.percentile(95), 4),
+        'p99_ms': round(1e3 * histogram.percentile(99), 4),
+        'max_ms': round(1e3 * histogram.max, 4),
+        }
+    return summary
+
+  def buckets(self):
+    """Nonempty buckets of each stage's histogram, see LatencyHistogram.buckets().
+    """
+    return {stage: self.histograms[stage].buckets() for stage in self._stages()}
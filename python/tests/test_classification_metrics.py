@@ -0,0 +1,67 @@
+"""Tests of classification_metrics.py.
+
+Run from the parent directory of the mltools package with `python -m unittest discover -s mltools/tests`.
+"""
+
+import numpy as np
+import unittest
+from mltools.classification_metrics import top_k_labels
+
+
+def sorted_top_k_labels(scores, k):
+  return np.argsort(scores, axis=1, kind='stable')[:, -k:]
+
+
+class TopKLabelsTest(unittest.TestCase):
+  def check(self, scores, k=5):
+    np.testing.assert_array_equal(top_k_labels(scores, k), sorted_top_k_labels(scores, k))
+
+  def test_distinct_scores(self):
+    rng = np.random.default_rng(0)
+    self.check(rng.random((64, 1001), np.float32))
+    self.check(rng.permutation(1001).reshape(1, 1001))
+
+  def test_ties(self):
+    rng = np.random.default_rng(1)
+    # Few distinct scores, so that most predictions tie within and at the boundary of their top 5.
+    for num_scores in (1, 2, 3, 6, 20):
+      self.check(rng.integers(0, num_scores, (256, 40)).astype(np.float32))
+      self.check(rng.integers(0, num_scores, (256, 40), np.uint8))
+    scores = np.zeros((3, 10), np.float32)
+    scores[0, [2, 7]] = 1
+    scores[1, ::2] = 1
+    scores[2, [0, 9]] = 1
+    self.check(scores)
+    self.check(scores, 1)
+
+  def test_negative_infinity(self):
+    rng = np.random.default_rng(2)
+    scores = rng.random((128, 30))
+    scores[rng.random(scores.shape) < 0.8] = -np.inf
+    scores[0] = -np.inf
+    scores[1, :] = -np.inf
+    scores[1, 3] = 0
+    self.check(scores)
+    self.check(scores.astype(np.float32))
+
+  def test_nan(self):
+    rng = np.random.default_rng(3)
+    scores = rng.random((64, 30))
+    scores[rng.random(scores.shape) < 0.1] = np.nan
+    self.check(scores)
+
+  def test_fewer_classes_than_k(self):
+    rng = np.random.default_rng(4)
+    for num_classes in (1, 2, 3, 5):
+      scores = rng.integers(0, 2, (32, num_classes)).astype(np.float32)
+      labels = top_k_labels(scores, 5)
+      self.assertEqual(labels.shape, (32, num_classes))
+      np.testing.assert_array_equal(labels, sorted_top_k_labels(scores, 5))
+
+  def test_sequence_of_predictions(self):
+    predictions = [np.array([0.1, 0.5, 0.5, 0.2, 0.0, 0.5]), np.array([1.0, 0.0, 0.0, 0.0, 0.0, 0.0])]
+    np.testing.assert_array_equal(top_k_labels(predictions, 3), [[1, 2, 5], [4, 5, 0]])
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -6,36 +6,51 @@ import math
 import numpy as np
 import os
 import tensorflow.lite as tflite
+from mltools.stage_timers import StageClock
 
 log = logging.getLogger(__name__)
 
-def evaluate_image(interpreter, image):
+def evaluate_image(interpreter, image, timings=None):
   """Call the TFLite interpreter to evaluate an image.
 
   Args:
     interpreter: Allocated TFLite interpreter.
     image: NumPy image of shape (height, width, channels).
+    timings: Dictionary receiving the seconds spent in each stage (see stage_timers.STAGES).
 
   Returns:
     predictions: NumPy array of shape (classes).
   """
+  clock = StageClock(timings)
   input_details = interpreter.get_input_details()
   output_details = interpreter.get_output_details()
   input_shape = input_details[0]['shape']
   image = image.reshape(input_shape)
   interpreter.set_tensor(input_details[0]['index'], image)
+  clock.lap('set_tensor')
   interpreter.invoke()
+  clock.lap('invoke')
   predictions = interpreter.get_tensor(output_details[0]['index'])
-  return np.squeeze(predictions)
+  # Copied, since native engine tensors are views overwritten by the next invocation.
+  predictions = np.array(np.squeeze(predictions))
+  clock.lap('get_tensor')
+  return predictions
 
 
-def create_interpreter_pool(size, tflite_path=None, tflite_model=None, delegate_to_tpu=False):
+def _timed_evaluate_image(interpreter, image):
+  timings = {}
+  return evaluate_image(interpreter, image, timings), timings
+
+
+def create_interpreter_pool(size, tflite_path=None, tflite_model=None, delegate_to_tpu=False, use_native_engine=False):
   """Create a pool of TFLite interpreters.
     Args:
       size: Target size of pool.
       tflite_path: File path to TFLite model. Takes precedence over tflite_model if specified.
       tflite_model: Preloaded TFLite model.
       delegate_to_tpu: Delegate inference to TPU.
+      use_native_engine: Run the model on the native engine (see native_engine.py). Interpreters share their weights
+        and split the online CPUs between them.
 
     Returns:
       interpreters: List of TFLite interpreters.
@@ -47,7 +62,17 @@ def create_interpreter_pool(size, tflite_path=None, tflite_model=None, delegate_
     tflite_model = open(tflite_path, 'rb').read()
   if not tflite_model:
     raise ValueError('Invalid TFLite model. Check either tflite_path (%s) or tflite_model.' % tflite_path)
-  if delegate_to_tpu:
+  if use_native_engine:
+    from mltools.native_engine import Interpreter, Registry
+    registry = Registry()
+    interpreters = [
+      Interpreter(
+        model_content=tflite_model,
+        num_threads=max(1, os.cpu_count() // size),
+        registry=registry,
+        ) for i in range(size)
+      ]
+  elif delegate_to_tpu:
     from tensorflow.lite.python.interpreter import load_delegate
     interpreters = [
       tflite.Interpreter(
@@ -72,7 +97,139 @@ def create_interpreter_pool(size, tflite_path=None, tflite_model=None, delegate_
   return interpreters
 
 
-def create_dataset_split_batch_queue(dataset_split_path, dataset_split_map_file, batch_size, model_input_details, model_preprocessor_fn, model_labels_offset, read_from_numpy=False, max_samples=None, quantize_input=True):
+def close_interpreter_pool(interpreters):
+  """Close the native interpreters of a pool created by create_interpreter_pool(), then the registry they share. TFLite
+  interpreters are left to the garbage collector.
+  """
+  registries = []
+  for interpreter in interpreters:
+    registry = getattr(interpreter, 'registry', None)
+    if registry is None:
+      continue
+    interpreter.close()
+    if registry not in registries:
+      registries.append(registry)
+  for registry in registries:
+    registry.close()
+
+
+def quantize_image(image, input_quantization):
+  """Quantize a float image.
+
+  Args:
+    image: NumPy image.
+    input_quantization: Tuple (scale, zero_point, dtype) of the model input, or None to leave the image as is.
+  """
+  if input_quantization is None:
+    return image
+  input_scale, input_zp, input_dtype = input_quantization
+  return (np.round(image/input_scale) + input_zp).astype(input_dtype)
+
+
+def read_image(image_file, model_preprocessor_fn, input_quantization, read_from_numpy, reduced_decode=False, out=None, timings=None):
+  """Read and preprocess one image. Runs in preprocessing worker processes, hence module-level arguments only.
+
+  Args:
+    image_file: Path to image file, or to NumPy file without its .npy extension if `read_from_numpy` is True.
+    model_preprocessor_fn: Function that preprocesses the image to fit the model, or a native_engine.Preprocessor,
+      which also quantizes it. Not used if `read_from_numpy` is True.
+    input_quantization: See quantize_image().
+    read_from_numpy: Load a preprocessed NumPy file.
+    reduced_decode: Decode JPEG images downscaled in the DCT domain when they are large enough, see
+      cv2_preprocessors.decode_image().
+    out: NumPy array to store the image into. Default is returning a new array.
+    timings: Dictionary receiving the seconds spent in each stage (see stage_timers.STAGES).
+  """
+  clock = StageClock(timings)
+  if read_from_numpy:
+    image = np.load('%s.npy' % image_file)
+    clock.lap('read')
+  else:
+    from mltools.cv2_preprocessors import decode_image_data, resized_size
+    with open(image_file, 'rb') as f:
+      data = f.read()
+    clock.lap('read')
+    cv2_image = decode_image_data(data, resized_size() if reduced_decode else None)
+    clock.lap('decode')
+    if getattr(model_preprocessor_fn, 'is_native', False):
+      out = model_preprocessor_fn(cv2_image, input_quantization, out)
+      clock.lap('preprocess')
+      return out
+    image = np.array(model_preprocessor_fn(cv2_image))
+    clock.lap('preprocess')
+  image = quantize_image(image, input_quantization)
+  if out is not None:
+    out[...] = image
+    image = out
+  if input_quantization is not None:
+    clock.lap('quantize')
+  return image
+
+
+_worker_batches = None
+
+def _init_batch_worker(buffer, shape, dtype):
+  """Map the batch slots shared with the parent process.
+  """
+  global _worker_batches
+  _worker_batches = np.frombuffer(buffer, dtype).reshape(shape)
+
+
+def _read_image_into(slot, sample, *read_image_args):
+  """Read and preprocess one image straight into sample `sample` of batch slot `slot`.
+
+  Returns:
+    timings: Seconds spent in each stage.
+  """
+  timings = {}
+  read_image(*read_image_args, out=_worker_batches[slot, sample], timings=timings)
+  return timings
+
+
+def _create_packed_dataset_batch_queue(packed_dataset_path, batch_size, model_input_details, model_preprocessor_fn, model_labels_offset, max_samples, input_quantization):
+  """Create a batch queue over a packed dataset split. See create_dataset_split_batch_queue().
+  """
+  from mltools.packed_dataset import PackedDataset, quantize_packed_dataset
+  packed_dataset = PackedDataset(packed_dataset_path)
+  if packed_dataset.quantization:
+    if not input_quantization or not packed_dataset.quantized_with(input_quantization):
+      raise ValueError('Packed dataset split %s was quantized with %s, not %s.' % (
+        packed_dataset_path, packed_dataset.quantization + (packed_dataset.dtype,), input_quantization))
+    input_quantization = None
+  elif input_quantization:
+    # Quantized once into a cached copy of the split, then read as is.
+    packed_dataset = quantize_packed_dataset(packed_dataset, input_quantization)
+    input_quantization = None
+  if packed_dataset.preprocessor not in ('numpy', model_preprocessor_fn.__name__):
+    raise ValueError('Packed dataset split %s was preprocessed by %s, not %s.' % (
+      packed_dataset_path, packed_dataset.preprocessor, model_preprocessor_fn.__name__))
+  if packed_dataset.images.shape[1:] != tuple(model_input_details[0]['shape'][1:]):
+    raise ValueError('Packed dataset split %s has samples of shape %s, not %s.' % (
+      packed_dataset_path, packed_dataset.images.shape[1:], tuple(model_input_details[0]['shape'][1:])))
+  dataset = {'packed_dataset': packed_dataset}
+  dataset['gtlabels'] = packed_dataset.labels
+  if max_samples:
+    dataset['num_samples'] = min(max_samples, len(packed_dataset))
+  else:
+    dataset['num_samples'] = len(packed_dataset)
+  dataset['num_batches'] = int(math.ceil(dataset['num_samples'] / float(batch_size)))
+
+  def _packed_read_batch_fn(batch_id):
+    images, labels = packed_dataset.batch(batch_id, batch_size)
+    num_images = min(len(labels), dataset['num_samples'] - batch_id * batch_size)
+    images = images[:num_images]
+    for j in range(num_images):
+      yield [images[j], int(labels[j]) + model_labels_offset]
+
+  return dataset, _packed_read_batch_fn
+
+
+def _batch_ids(num_batches, shard):
+  from mltools.classification_metrics import shard_batch_ids
+  return shard_batch_ids(num_batches, *shard) if shard else range(num_batches)
+
+
+def create_dataset_split_batch_queue(dataset_split_path, dataset_split_map_file, batch_size, model_input_details, model_preprocessor_fn, model_labels_offset, read_from_numpy=False, max_samples=None, quantize_input=True, num_workers=0, prefetch_batches=1, packed_dataset_path=None, reduced_decode=False, stage_timers=None, shard=None):
   """Create a batch queue that preprocesses a dataset for a given model.
 
   Args:
@@ -85,9 +242,22 @@ def create_dataset_split_batch_queue(dataset_split_path, dataset_split_map_file,
     read_from_numpy: Return a callback that loads preprocessed images from NumPy files. Default is preprocess images on-the-fly.
     max_samples: Maximum samples to include. Default is entire split.
     quantize_input: Quantize images during preprocessing. Only applies to quantized models.
+    num_workers: Number of processes reading and preprocessing images. Default is reading images in the calling process when asked for.
+    prefetch_batches: Number of batches the workers prepare ahead of the one the caller consumes. Batches are read into
+      shared, preallocated arrays reused round-robin, so the images of a batch are only valid until the next batch is
+      requested, and batches must be requested in order.
+    packed_dataset_path: Path to a packed dataset split (see packed_dataset.py) serving batches as views on the file,
+      in which case `dataset_split_path` and `dataset_split_map_file` are not used and no workers are started. Float
+      splits are quantized for quantized models once, into a cached copy next to them.
+    reduced_decode: Decode JPEG images downscaled in the DCT domain when they are large enough, which skips most of
+      their decoding but slightly changes preprocessed images.
+    stage_timers: stage_timers.StageTimers receiving the latencies of reading and preprocessing each image. Samples of
+      packed dataset splits are read as the interpreters copy them, hence timed as setting tensors.
+    shard: Tuple (index, count) of the shard of batches to evaluate, see classification_metrics.shard_batch_ids().
+      Workers prefetch no batch past the shard. Default is all batches.
 
   Returns:
-    dataset: Dictionary of dataset split details.
+    dataset: Dictionary of dataset split details, with the range of batches to evaluate as 'batch_ids'.
     read_batch_fn: Batch generator function.
       Signature: (batch_id)
         Args:
@@ -95,6 +265,16 @@ def create_dataset_split_batch_queue(dataset_split_path, dataset_split_map_file,
         Returns:
           List of images at batch index.
   """
+  input_dtype = model_input_details[0]['dtype']
+  input_quantization = None
+  if quantize_input and (input_dtype == np.int8 or input_dtype == np.uint8):
+    input_quantization = model_input_details[0]['quantization'][:2] + (input_dtype,)
+
+  if packed_dataset_path:
+    dataset, read_batch_fn = _create_packed_dataset_batch_queue(packed_dataset_path, batch_size, model_input_details, model_preprocessor_fn, model_labels_offset, max_samples, input_quantization)
+    dataset['batch_ids'] = _batch_ids(dataset['num_batches'], shard)
+    return dataset, read_batch_fn
+
   dataset = {}
   dataset_valmap = os.path.join(dataset_split_path, dataset_split_map_file) # FILENAME GT_LABEL_ID
   with open(dataset_valmap, 'r') as f:
@@ -106,66 +286,80 @@ def create_dataset_split_batch_queue(dataset_split_path, dataset_split_map_file,
   else:
     dataset['num_samples'] = len(image_maps)
   dataset['num_batches'] = int(math.ceil(dataset['num_samples'] / float(batch_size)))
+  dataset['batch_ids'] = _batch_ids(dataset['num_batches'], shard)
 
-  def _maybe_quantize(image):
-    input_dtype = model_input_details[0]['dtype']
-    if quantize_input and (input_dtype == np.int8 or input_dtype == np.uint8):
-      input_quant = model_input_details[0]['quantization']
-      input_scale = input_quant[0]
-      input_zp = input_quant[1]
-      quant_image = (np.round(image/input_scale) + input_zp).astype(input_dtype)
-    else:
-      quant_image = image
-    return quant_image
-
-  def _numpy_read_batch_fn(batch_id):
+  def _batch_tasks(batch_id):
     batch_index = batch_id * batch_size
-    batch_files = dataset['files'][batch_index:batch_index + batch_size]
-    i = 0
-    for image_file in batch_files:
-      image = np.load('%s.npy' % image_file)
-      image = _maybe_quantize(image)
-      yield [image, dataset['gtlabels'][batch_index + i] + model_labels_offset]
-      i += 1
-
-  def _cv2_read_batch_fn(batch_id):
-    import cv2
+    batch_end = min(batch_index + batch_size, dataset['num_samples'])
+    return [
+      (dataset['files'][i], model_preprocessor_fn, input_quantization, read_from_numpy, reduced_decode)
+      for i in range(batch_index, batch_end)
+      ]
+
+  def _batch_labels(batch_id):
     batch_index = batch_id * batch_size
-    batch_files = dataset['files'][batch_index:batch_index + batch_size]
-    i = 0
-    for image_file in batch_files:
-      cv2_image = cv2.imread(image_file)
-      preprocessed_image = model_preprocessor_fn(cv2_image)
-      image = np.array(preprocessed_image)
-      image = _maybe_quantize(image)
-      yield [image, dataset['gtlabels'][batch_index + i] + model_labels_offset]
-      i += 1
+    batch_end = min(batch_index + batch_size, dataset['num_samples'])
+    return [dataset['gtlabels'][i] + model_labels_offset for i in range(batch_index, batch_end)]
 
-  if read_from_numpy:
-    read_batch_fn = _numpy_read_batch_fn
+  def _serial_read_batch_fn(batch_id):
+    for task, label in zip(_batch_tasks(batch_id), _batch_labels(batch_id)):
+      timings = {} if stage_timers else None
+      image = read_image(*task, timings=timings)
+      if stage_timers:
+        stage_timers.add_timings(timings)
+      yield [image, label]
+
+  pending = {}
+
+  def _parallel_read_batch_fn(batch_id):
+    num_slots = prefetch_batches + 1
+    # Wait for skipped batches, since their slots are about to be reused.
+    for i in [i for i in pending if i < batch_id]:
+      pending.pop(i).wait()
+    for i in range(batch_id, min(batch_id + num_slots, dataset['batch_ids'].stop)):
+      if i not in pending:
+        pending[i] = dataset['pool'].starmap_async(
+          _read_image_into,
+          [(i % num_slots, j) + task for j, task in enumerate(_batch_tasks(i))],
+          )
+    for timings in pending.pop(batch_id).get():
+      if stage_timers:
+        stage_timers.add_timings(timings)
+    images = dataset['batches'][batch_id % num_slots]
+    for j, label in enumerate(_batch_labels(batch_id)):
+      yield [images[j], label]
+
+  if num_workers > 0:
+    import multiprocessing
+    sample_dtype = np.dtype(input_quantization[2] if input_quantization else np.float32)
+    batches_shape = (prefetch_batches + 1, batch_size) + tuple(model_input_details[0]['shape'][1:])
+    batches_buffer = multiprocessing.RawArray('B', int(np.prod(batches_shape)) * sample_dtype.itemsize)
+    dataset['batches'] = np.frombuffer(batches_buffer, sample_dtype).reshape(batches_shape)
+    dataset['pool'] = multiprocessing.Pool(
+      num_workers,
+      initializer=_init_batch_worker,
+      initargs=(batches_buffer, batches_shape, sample_dtype),
+      )
+    read_batch_fn = _parallel_read_batch_fn
   else:
-    read_batch_fn = _cv2_read_batch_fn
+    read_batch_fn = _serial_read_batch_fn
   return dataset, read_batch_fn
 
 
-def create_image_classification_thread_pool(interpreters, image_batch, create_thread_fn):
-  """Create a pool to evaluate a batch of images.
-    Args:
-      interpreters: List of allocated TFLite interpreters (see create_interpreter_pool).
-      image_batch: NumPy array of NumPy images of shape (batch_size, height, width, channels).
-      create_thread_fn: Function that creates a thread.
-        Signature: (target_fn, target_args)
-          Args:
-            target_fn: Target function.
-            target_args: Tuple of arguments for the target function.
-          Returns:
-            Thread object.
+def evaluate_image_batch(interpreter_pool, image_batch, stage_timers=None):
+  """Evaluate a batch of images in parallel.
+
+  Args:
+    interpreter_pool: python_threading.WorkerPool whose workers are bound to allocated interpreters (see create_interpreter_pool).
+    image_batch: NumPy images of shape (height, width, channels).
+    stage_timers: stage_timers.StageTimers receiving the latencies of evaluating each image.
+
+  Returns:
+    predictions: NumPy array of shape (batch_size, classes).
   """
-  size = len(image_batch)
-  return [
-    create_thread_fn(
-      target_fn=evaluate_image,
-      target_args=(interpreters[i], image_batch[i]),
-      )
-    for i in range(size)
-    ]
+  if not stage_timers:
+    return np.array(interpreter_pool.map(evaluate_image, image_batch))
+  results = interpreter_pool.map(_timed_evaluate_image, image_batch)
+  for _, timings in results:
+    stage_timers.add_timings(timings)
+  return np.array([predictions for predictions, _ in results])
@@ -0,0 +1,205 @@
+// Benchmark model.
+// Measure how long the engine takes to open a model and to run it, optionally across every thread count.
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exceptions.h"
+#include "engine/engine.h"
+#include "engine/profile.h"
+
+#define MAX_CPUS 1024
+
+static struct
+{
+  const char *in_model_path;          // input model file
+  uint32_t num_iterations;            // number of timed inferences
+  bool is_scaling;                    // run with 1 up to `options.threads.num_threads` threads
+  const char *trace_path;             // Chrome trace of the profiled operators
+  int32_t cpus[MAX_CPUS];             // CPU affinity of worker threads
+  struct engine_options options;      // engine settings
+  struct engine *engine;              // engine running the input model
+} app;
+
+static void print_usage()
+{
+  printf("benchmark [-c PACK_CACHE_FILE] [-t THREADS] [-a CPU[,CPU...]] [-q] [-p TRACE_FILE] [-s] IN_FILE N\n");
+  printf("  Runs the model stored at IN_FILE N times over zeroed inputs and prints timings in milliseconds.\n");
+  printf("  -c  Cache pre-packed weights into PACK_CACHE_FILE.\n");
+  printf("  -t  Run on THREADS threads (default: all online CPUs).\n");
+  printf("  -a  Pin worker threads to the listed CPUs, round-robin.\n");
+  printf("  -q  Run one operator at a time instead of running independent operators concurrently.\n");
+  printf("  -p  Profile operators, print their statistics and write their Chrome trace into TRACE_FILE.\n");
+  printf("  -s  Repeat the benchmark for every thread count from 1 to THREADS.\n");
+}
+
+// Release all resources held by this application. Registered on exit by `init_app()`.
+static void release_app()
+{
+  if(app.engine != NULL)
+  {
+    engine_close(app.engine);
+    app.engine = NULL;
+  }
+#ifdef DEBUG_BENCHMARK_C
+  printf("Released application's resources.\n");
+#endif //ifdef DEBUG_BENCHMARK_C
+}
+
+static void parse_cpus(
+    char *list
+    )
+{
+  char *save_ptr = NULL;
+  for(
+      char *cpu = strtok_r(list, ",", &save_ptr);
+      cpu != NULL;
+      cpu = strtok_r(NULL, ",", &save_ptr)
+     )
+  {
+    if(app.options.threads.num_cpus == MAX_CPUS)
+    {
+      errno = E2BIG;
+      ERROR("CPU list");
+    }
+    app.cpus[app.options.threads.num_cpus++] = strtol(cpu, NULL, 10);
+  }
+  app.options.threads.cpus = app.cpus;
+}
+
+// Initialize application with argv-style arguments.
+static void init_app(
+    int argc,
+    char *argv[]
+    )
+{
+  int opt;
+  memset(&app, 0, sizeof(app));
+  while((opt = getopt(argc, argv, "c:t:a:qp:s")) != -1)
+  {
+    if(opt == 'c')
+      app.options.prepack_cache_path = optarg;
+    else if(opt == 't')
+      app.options.threads.num_threads = strtoul(optarg, NULL, 10);
+    else if(opt == 'a')
+      parse_cpus(optarg);
+    else if(opt == 'q')
+      app.options.is_sequential = true;
+    else if(opt == 'p')
+    {
+      app.options.is_profiling = true;
+      app.trace_path = optarg;
+    }
+    else if(opt == 's')
+      app.is_scaling = true;
+    else
+    {
+      print_usage();
+      errno = EINVAL;
+      ERROR("Unknown option");
+    }
+  }
+  if(argc - optind != 2)
+  {
+    print_usage();
+    errno = EINVAL;
+    ERROR("Requires exactly 2 arguments");
+  }
+  app.in_model_path = argv[optind];
+  errno = 0;
+  app.num_iterations = strtoul(argv[optind + 1], NULL, 10);
+  if(errno != 0)
+    ERRORF("%s", argv[optind + 1]);
+  if(app.options.threads.num_threads == 0)
+    app.options.threads.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  atexit(release_app);
+}
+
+static double elapsed_ms(
+    const struct timespec *start,
+    const struct timespec *end
+    )
+{
+  return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) * 1e-6;
+}
+
+// Open the model with `num_threads` threads, run it and print the results prefixed by `prefix`.
+static void run_benchmark(
+    uint32_t num_threads,
+    const char *prefix
+    )
+{
+  struct engine_options options = app.options;
+  struct timespec start, end;
+  double total_ms = 0.0, min_ms = 0.0;
+  options.threads.num_threads = num_threads;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  app.engine = engine_open(app.in_model_path, &options);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%sthreads=%u\n", prefix, num_threads);
+  printf("%sopen_ms=%.3f\n", prefix, elapsed_ms(&start, &end));
+  printf("%sarena_bytes=%zu\n", prefix, app.engine->arena_size);
+  printf("%spacked_bytes=%zu\n", prefix, app.engine->pack_arena_size);
+  printf("%spacked_cached=%d\n", prefix, app.engine->pack_cache_map != NULL);
+  for(
+      uint32_t iteration = 0;
+      iteration < app.num_iterations;
+      iteration++
+     )
+  {
+    double ms;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    engine_invoke(app.engine);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = elapsed_ms(&start, &end);
+    total_ms += ms;
+    if(iteration == 0 || ms < min_ms)
+      min_ms = ms;
+  }
+  if(app.num_iterations > 0)
+  {
+    printf("%sinvoke_mean_ms=%.3f\n", prefix, total_ms / app.num_iterations);
+    printf("%sinvoke_min_ms=%.3f\n", prefix, min_ms);
+  }
+  if(app.options.is_profiling)
+  {
+    FILE *trace_file;
+    profiler_print_table(app.engine, stdout);
+    if((trace_file = fopen(app.trace_path, "w")) == NULL)
+      ERRORF("%s", app.trace_path);
+    profiler_write_trace(app.engine, trace_file);
+    if(fclose(trace_file) != 0)
+      ERRORF("%s", app.trace_path);
+  }
+  engine_close(app.engine);
+  app.engine = NULL;
+}
+
+int main(
+    int argc,
+    char *argv[]
+    )
+{
+  init_app(argc, argv);
+  if(!app.is_scaling)
+    run_benchmark(app.options.threads.num_threads, "");
+  else
+  {
+    for(
+        uint32_t num_threads = 1;
+        num_threads <= app.options.threads.num_threads;
+        num_threads++
+       )
+    {
+      char prefix[32];
+      snprintf(prefix, sizeof(prefix), "t%u.", num_threads);
+      run_benchmark(num_threads, prefix);
+    }
+  }
+  return EXIT_SUCCESS;
+}
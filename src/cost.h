@@ -0,0 +1,88 @@
+// Operator and tensor cost estimates.
+// Costs are derived from tensor shapes only, so they apply equally to models being executed and to models being
+// analyzed.
+#ifndef MLTOOLS_COST_H
+#define MLTOOLS_COST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "model.h"
+
+// Size in bytes of one element of type `type` (0 if variable-sized).
+static inline size_t tensor_type_size(
+    enum tensor_type type
+    )
+{
+  switch(type)
+  {
+    case TT_FLOAT32:
+    case TT_INT32:
+      return 4;
+    case TT_FLOAT16:
+    case TT_INT16:
+      return 2;
+    case TT_INT64:
+    case TT_COMPLEX64:
+      return 8;
+    case TT_UINT8:
+    case TT_INT8:
+    case TT_BOOL:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Estimate the multiply-accumulates (or equivalent arithmetic operations for operators without products) of one
+// invocation of an operator. `weights_shape` is the shape of the operator's second input (NULL if none) and
+// `window_size` the number of elements of a pooling window.
+static inline uint64_t operator_macs(
+    enum builtin_operator builtin_code,
+    uint64_t num_input_elements,
+    uint64_t num_output_elements,
+    const int32_t *weights_shape,
+    uint8_t weights_num_dims,
+    uint64_t window_size
+    )
+{
+  switch(builtin_code)
+  {
+    case BO_CONV_2D:
+      if(weights_shape == NULL || weights_num_dims != 4)
+        return 0;
+      return num_output_elements * weights_shape[1] * weights_shape[2] * weights_shape[3];
+    case BO_DEPTHWISE_CONV_2D:
+      if(weights_shape == NULL || weights_num_dims != 4)
+        return 0;
+      return num_output_elements * weights_shape[1] * weights_shape[2];
+    case BO_FULLY_CONNECTED:
+      if(weights_shape == NULL || weights_num_dims != 2)
+        return 0;
+      return num_output_elements * weights_shape[1];
+    case BO_AVERAGE_POOL_2D:
+    case BO_MAX_POOL_2D:
+      return num_output_elements * window_size;
+    case BO_MEAN:
+    case BO_SUM:
+    case BO_REDUCE_MAX:
+      return num_input_elements;
+    case BO_ADD:
+    case BO_SUB:
+    case BO_MUL:
+    case BO_DIV:
+    case BO_MAXIMUM:
+    case BO_MINIMUM:
+    case BO_SQUARED_DIFFERENCE:
+    case BO_LOGISTIC:
+    case BO_TANH:
+    case BO_SOFTMAX:
+    case BO_RESIZE_BILINEAR:
+    case BO_RESIZE_NEAREST_NEIGHBOR:
+      return num_output_elements;
+    default:
+      return 0;
+  }
+}
+
+#endif //ifndef MLTOOLS_COST_H
@@ -0,0 +1,335 @@
+// Activation kernels.
+// Float kernels evaluate exp() with a branch-free polynomial so that their loops vectorize. Quantized inputs only take
+// 256 values, so quantized kernels look their results up in tables built by `prepare()`.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "kernels.h"
+#include "quant.h"
+
+#define EXP_MIN -87.0f // smallest argument whose exponential is a normal float
+#define EXP_MAX 88.0f  // largest argument whose exponential is a float
+
+// Quantized activation: output values indexed by the bytes of input values.
+struct activation_state
+{
+  uint8_t table[256];
+};
+
+// Quantized softmax: exponentials indexed by the distance between an input value and the maximum of its row.
+struct softmax_state
+{
+  float exp_table[256];
+};
+
+// Approximate e^x with a relative error below 2e-7 (arguments are clamped to [EXP_MIN, EXP_MAX]).
+static inline float fast_expf(
+    float x
+    )
+{
+  union
+  {
+    int32_t i;
+    float f;
+  } power;
+  float n, r, p;
+  x = x < EXP_MIN ? EXP_MIN : (x > EXP_MAX ? EXP_MAX : x);
+  // e^x = 2^n * e^r with n = round(x / ln(2)) and |r| <= ln(2) / 2. Adding and subtracting 1.5 * 2^23 rounds to the
+  // nearest integer.
+  n = (x * 1.44269504f + 12582912.0f) - 12582912.0f;
+  r = x - n * 0.693145752f - n * 1.42860677e-6f;
+  p = 1.0f + r * (1.0f + r * (0.5f + r * (0.166666672f + r * (0.0416666679f + r * (0.00833333377f + r * 0.00138888892f)))));
+  power.i = ((int32_t)n + 127) << 23;
+  return p * power.f;
+}
+
+static inline int32_t dequantize_byte(
+    enum tensor_type type,
+    uint8_t byte
+    )
+{
+  return type == TT_INT8 ? (int8_t)byte : byte;
+}
+
+static void prepare_activation(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *output = op_output(e, op, 0);
+  struct activation_state *state;
+  if(input == NULL || input->type != output->type || input->size != output->size)
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s'", op->name, output->name);
+  }
+  if(input->type != TT_FLOAT32 && !is_quantized_type(input->type))
+  {
+    errno = ENOTSUP;
+    ERRORF("%s of type %d producing '%s'", op->name, input->type, output->name);
+  }
+  op->inplace_input = 0;
+  if(input->type == TT_FLOAT32)
+    return;
+  if((state = calloc(1, sizeof(struct activation_state))) == NULL)
+    ERROR();
+  op->state = state;
+  for(
+      uint32_t byte = 0;
+      byte < 256;
+      byte++
+     )
+  {
+    double real = (double)input->scale * (dequantize_byte(input->type, byte) - input->zero_point),
+           result = op->builtin_code == BO_TANH ? tanh(real) : 1.0 / (1.0 + exp(-real));
+    int32_t value = output->zero_point + (int32_t)lround(result / output->scale);
+    state->table[byte] = (uint8_t)clamp_int32(value, quantized_min(output->type), quantized_max(output->type));
+  }
+}
+
+static void activation_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct engine_tensor *input = op_input(ctx->e, ctx->op, 0),
+                             *output = op_output(ctx->e, ctx->op, 0);
+  (void)worker_idx;
+  if(input->type == TT_FLOAT32)
+  {
+    const float *in = (const float *)input->data;
+    float *out = (float *)output->data;
+    if(ctx->op->builtin_code == BO_TANH)
+    {
+      for(
+          size_t idx = begin;
+          idx < end;
+          idx++
+         )
+      {
+        out[idx] = 1.0f - 2.0f / (fast_expf(2.0f * in[idx]) + 1.0f);
+      }
+    }
+    else
+    {
+      for(
+          size_t idx = begin;
+          idx < end;
+          idx++
+         )
+      {
+        out[idx] = 1.0f / (1.0f + fast_expf(-in[idx]));
+      }
+    }
+  }
+  else
+  {
+    const struct activation_state *state = ctx->op->state;
+    for(
+        size_t idx = begin;
+        idx < end;
+        idx++
+       )
+    {
+      output->data[idx] = state->table[input->data[idx]];
+    }
+  }
+}
+
+static void invoke_activation(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  struct op_context ctx = {.e = e, .op = op};
+  threadpool_parallel_for(e->pool, tensor_num_elements(op_input(e, op, 0)), parallel_grain(16), activation_range, &ctx);
+}
+
+const struct kernel activation_kernel = {
+  .prepare = prepare_activation,
+  .invoke = invoke_activation
+};
+
+static void prepare_softmax(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *output = op_output(e, op, 0);
+  struct softmax_state *state;
+  if(input == NULL || input->num_dims == 0 || input->type != output->type || input->size != output->size)
+  {
+    errno = EINVAL;
+    ERRORF("SOFTMAX producing '%s'", output->name);
+  }
+  if(input->type != TT_FLOAT32 && !is_quantized_type(input->type))
+  {
+    errno = ENOTSUP;
+    ERRORF("SOFTMAX of type %d producing '%s'", input->type, output->name);
+  }
+  // Rows are read in full before they are written.
+  op->inplace_input = 0;
+  if(input->type == TT_FLOAT32)
+    return;
+  if((state = calloc(1, sizeof(struct softmax_state))) == NULL)
+    ERROR();
+  op->state = state;
+  for(
+      uint32_t distance = 0;
+      distance < 256;
+      distance++
+     )
+  {
+    state->exp_table[distance] = (float)exp(-(double)op->builtin_options.softmax_options.beta * input->scale * distance);
+  }
+}
+
+static void softmax_float_row(
+    const float *in,
+    float *out,
+    size_t count,
+    float beta
+    )
+{
+  float max = in[0], sum = 0.0f, reciprocal;
+  for(
+      size_t idx = 1;
+      idx < count;
+      idx++
+     )
+  {
+    max = in[idx] > max ? in[idx] : max;
+  }
+  for(
+      size_t idx = 0;
+      idx < count;
+      idx++
+     )
+  {
+    out[idx] = fast_expf(beta * (in[idx] - max));
+    sum += out[idx];
+  }
+  reciprocal = 1.0f / sum;
+  for(
+      size_t idx = 0;
+      idx < count;
+      idx++
+     )
+  {
+    out[idx] *= reciprocal;
+  }
+}
+
+static void softmax_quantized_row(
+    const struct softmax_state *state,
+    const struct engine_tensor *input,
+    const struct engine_tensor *output,
+    const uint8_t *in,
+    uint8_t *out,
+    size_t count
+    )
+{
+  int32_t max = dequantize_byte(input->type, in[0]),
+          min_value = quantized_min(output->type),
+          max_value = quantized_max(output->type);
+  float sum = 0.0f, multiplier;
+  for(
+      size_t idx = 1;
+      idx < count;
+      idx++
+     )
+  {
+    int32_t value = dequantize_byte(input->type, in[idx]);
+    max = value > max ? value : max;
+  }
+  for(
+      size_t idx = 0;
+      idx < count;
+      idx++
+     )
+  {
+    sum += state->exp_table[max - dequantize_byte(input->type, in[idx])];
+  }
+  multiplier = 1.0f / (sum * output->scale);
+  for(
+      size_t idx = 0;
+      idx < count;
+      idx++
+     )
+  {
+    int32_t value = output->zero_point +
+      (int32_t)lroundf(state->exp_table[max - dequantize_byte(input->type, in[idx])] * multiplier);
+    out[idx] = (uint8_t)clamp_int32(value, min_value, max_value);
+  }
+}
+
+// Parallel loop body normalizing rows [begin, end) (along the last dimension).
+static void softmax_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct engine_tensor *input = op_input(ctx->e, ctx->op, 0),
+                             *output = op_output(ctx->e, ctx->op, 0);
+  size_t count = input->shape[input->num_dims - 1],
+         element_size = tensor_type_size(input->type);
+  (void)worker_idx;
+  for(
+      size_t row = begin;
+      row < end;
+      row++
+     )
+  {
+    if(input->type == TT_FLOAT32)
+      softmax_float_row(
+          (const float *)input->data + row * count,
+          (float *)output->data + row * count,
+          count,
+          ctx->op->builtin_options.softmax_options.beta
+          );
+    else
+      softmax_quantized_row(
+          ctx->op->state,
+          input,
+          output,
+          input->data + row * count * element_size,
+          output->data + row * count * element_size,
+          count
+          );
+  }
+}
+
+static void invoke_softmax(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0);
+  size_t count = input->shape[input->num_dims - 1];
+  struct op_context ctx = {.e = e, .op = op};
+  if(count == 0)
+    return;
+  threadpool_parallel_for(
+      e->pool,
+      tensor_num_elements(input) / count,
+      parallel_grain(16 * count),
+      softmax_range,
+      &ctx
+      );
+}
+
+const struct kernel softmax_kernel = {
+  .prepare = prepare_softmax,
+  .invoke = invoke_softmax
+};
@@ -0,0 +1,340 @@
+// Batched inference.
+// Requests form a FIFO list guarded by the batcher's mutex. The dispatcher sleeps until a request is pending, then
+// until the batch is full, the oldest request's deadline passed or the batcher is stopping. It takes the batch off the
+// list and runs it without holding the lock, so that callers keep submitting meanwhile. Slots of a partial batch keep
+// stale inputs: samples of a replicated model never mix, so their results are simply not copied back.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "batcher.h"
+
+struct batcher
+{
+  struct engine *engine;
+  struct batcher_options options;
+  uint32_t batch_size;
+  pthread_t dispatcher;
+  pthread_mutex_t mutex;
+  pthread_cond_t pending_cond;  // signaled when a request is queued or the batcher is stopping
+  pthread_cond_t done_cond;     // broadcast when requests complete
+  struct batcher_request *head; // oldest pending request
+  struct batcher_request *tail;
+  bool is_stopping;
+  struct batcher_stats stats;
+};
+
+static void add_us(
+    struct timespec *t,
+    uint32_t us
+    )
+{
+  t->tv_sec += us / 1000000;
+  t->tv_nsec += (long)(us % 1000000) * 1000;
+  if(t->tv_nsec >= 1000000000)
+  {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  }
+}
+
+static bool is_before(
+    const struct timespec *a,
+    const struct timespec *b
+    )
+{
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Bytes of one sample of `t`.
+static size_t sample_size(
+    const struct batcher *b,
+    const struct engine_tensor *t
+    )
+{
+  return t->size / b->batch_size;
+}
+
+// Run the `count` requests listed from `batch` as one batch.
+static void run_batch(
+    struct batcher *b,
+    struct batcher_request *batch,
+    uint32_t count
+    )
+{
+  struct engine *e = b->engine;
+  struct batcher_request *request = batch;
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < count;
+      sample_idx++, request = request->next
+     )
+  {
+    for(
+        uint32_t input_idx = 0;
+        input_idx < e->num_inputs;
+        input_idx++
+       )
+    {
+      struct engine_tensor *input = engine_input(e, input_idx);
+      size_t size = sample_size(b, input);
+      memcpy(input->data + sample_idx * size, request->inputs[input_idx], size);
+    }
+  }
+  engine_invoke(e);
+  request = batch;
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < count;
+      sample_idx++, request = request->next
+     )
+  {
+    for(
+        uint32_t output_idx = 0;
+        output_idx < e->num_outputs;
+        output_idx++
+       )
+    {
+      struct engine_tensor *output = engine_output(e, output_idx);
+      size_t size = sample_size(b, output);
+      memcpy(request->outputs[output_idx], output->data + sample_idx * size, size);
+    }
+  }
+}
+
+// Complete the `count` requests listed from `batch`: call their callbacks, or mark them done and wake their waiters.
+static void complete_batch(
+    struct batcher *b,
+    struct batcher_request *batch,
+    uint32_t count
+    )
+{
+  // Waiters may release their request as soon as the lock is dropped, so the requests with callbacks are relinked
+  // into their own list beforehand.
+  struct batcher_request *request = batch, *callbacks = NULL, **callbacks_tail = &callbacks;
+  bool has_waiters = false;
+  pthread_mutex_lock(&(b->mutex));
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < count;
+      sample_idx++
+     )
+  {
+    struct batcher_request *next = request->next;
+    if(request->done == NULL)
+    {
+      request->is_done = true;
+      has_waiters = true;
+    }
+    else
+    {
+      *callbacks_tail = request;
+      callbacks_tail = &(request->next);
+    }
+    request = next;
+  }
+  *callbacks_tail = NULL;
+  if(has_waiters)
+    pthread_cond_broadcast(&(b->done_cond));
+  pthread_mutex_unlock(&(b->mutex));
+  // Callbacks may release their request, so the list is not walked after them.
+  request = callbacks;
+  while(request != NULL)
+  {
+    struct batcher_request *next = request->next;
+    request->done(request);
+    request = next;
+  }
+}
+
+static void *run_dispatcher(
+    void *arg
+    )
+{
+  struct batcher *b = arg;
+  pthread_mutex_lock(&(b->mutex));
+  while(true)
+  {
+    struct batcher_request *batch;
+    struct timespec start, end;
+    uint32_t count = 0;
+    while(b->head == NULL && !b->is_stopping)
+      pthread_cond_wait(&(b->pending_cond), &(b->mutex));
+    if(b->head == NULL)
+      break;
+    while(b->stats.num_pending < b->batch_size && !b->is_stopping)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if(!is_before(&now, &(b->head->deadline)))
+        break;
+      pthread_cond_timedwait(&(b->pending_cond), &(b->mutex), &(b->head->deadline));
+    }
+    // Take the oldest requests off the list.
+    batch = b->head;
+    for(
+        struct batcher_request *request = batch;
+        request != NULL && count < b->batch_size;
+        request = request->next
+       )
+    {
+      b->head = request->next;
+      count++;
+    }
+    if(b->head == NULL)
+      b->tail = NULL;
+    b->stats.num_pending -= count;
+    pthread_mutex_unlock(&(b->mutex));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_batch(b, batch, count);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&(b->mutex));
+    b->stats.num_batches++;
+    b->stats.num_samples += count;
+    b->stats.busy_ns += (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+    pthread_mutex_unlock(&(b->mutex));
+    complete_batch(b, batch, count);
+    pthread_mutex_lock(&(b->mutex));
+  }
+  pthread_mutex_unlock(&(b->mutex));
+  return NULL;
+}
+
+// Check that every input and output of `e` is batched along its first dimension and return the batch size.
+static uint32_t find_batch_size(
+    struct engine *e
+    )
+{
+  uint32_t batch_size;
+  if(e->num_inputs == 0 || engine_input(e, 0)->num_dims == 0 || (batch_size = engine_input(e, 0)->shape[0]) == 0)
+  {
+    errno = EINVAL;
+    ERROR("Model without batched input");
+  }
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < e->num_inputs + e->num_outputs;
+      tensor_idx++
+     )
+  {
+    const struct engine_tensor *t =
+      tensor_idx < e->num_inputs ? engine_input(e, tensor_idx) : engine_output(e, tensor_idx - e->num_inputs);
+    if(t->num_dims == 0 || t->shape[0] != (int32_t)batch_size)
+    {
+      errno = EINVAL;
+      ERRORF("Tensor '%s' is not batched by %u", t->name, batch_size);
+    }
+  }
+  return batch_size;
+}
+
+struct batcher *batcher_create(
+    struct engine *e,
+    const struct batcher_options *options
+    )
+{
+  struct batcher *b;
+  pthread_condattr_t cond_attr;
+  int rc;
+  if((b = calloc(1, sizeof(struct batcher))) == NULL)
+    ERROR();
+  b->engine = e;
+  if(options != NULL)
+    b->options = *options;
+  b->batch_size = find_batch_size(e);
+  pthread_mutex_init(&(b->mutex), NULL);
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&(b->pending_cond), &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_cond_init(&(b->done_cond), NULL);
+  if((rc = pthread_create(&(b->dispatcher), NULL, run_dispatcher, b)) != 0)
+  {
+    errno = rc;
+    ERROR("Starting dispatcher");
+  }
+#ifdef DEBUG_BATCHER_C
+  printf("Started dispatcher of batches of %u.\n", b->batch_size);
+#endif //ifdef DEBUG_BATCHER_C
+  return b;
+}
+
+void batcher_destroy(
+    struct batcher *b
+    )
+{
+  if(b == NULL)
+    return;
+  pthread_mutex_lock(&(b->mutex));
+  b->is_stopping = true;
+  pthread_cond_signal(&(b->pending_cond));
+  pthread_mutex_unlock(&(b->mutex));
+  pthread_join(b->dispatcher, NULL);
+  pthread_mutex_destroy(&(b->mutex));
+  pthread_cond_destroy(&(b->pending_cond));
+  pthread_cond_destroy(&(b->done_cond));
+  free(b);
+}
+
+uint32_t batcher_batch_size(
+    const struct batcher *b
+    )
+{
+  return b->batch_size;
+}
+
+void batcher_submit(
+    struct batcher *b,
+    struct batcher_request *request
+    )
+{
+  request->next = NULL;
+  request->is_done = false;
+  clock_gettime(CLOCK_MONOTONIC, &(request->deadline));
+  add_us(&(request->deadline), b->options.max_wait_us);
+  pthread_mutex_lock(&(b->mutex));
+  if(b->tail != NULL)
+    b->tail->next = request;
+  else
+    b->head = request;
+  b->tail = request;
+  // The dispatcher only needs waking for a first request or a full batch.
+  if(++b->stats.num_pending == 1 || b->stats.num_pending == b->batch_size)
+    pthread_cond_signal(&(b->pending_cond));
+  pthread_mutex_unlock(&(b->mutex));
+}
+
+void batcher_wait(
+    struct batcher *b,
+    struct batcher_request *request
+    )
+{
+  pthread_mutex_lock(&(b->mutex));
+  while(!request->is_done)
+    pthread_cond_wait(&(b->done_cond), &(b->mutex));
+  pthread_mutex_unlock(&(b->mutex));
+}
+
+void batcher_run(
+    struct batcher *b,
+    const void *const *inputs,
+    void *const *outputs
+    )
+{
+  struct batcher_request request = {.inputs = inputs, .outputs = outputs};
+  batcher_submit(b, &request);
+  batcher_wait(b, &request);
+}
+
+void batcher_get_stats(
+    struct batcher *b,
+    struct batcher_stats *stats
+    )
+{
+  pthread_mutex_lock(&(b->mutex));
+  *stats = b->stats;
+  pthread_mutex_unlock(&(b->mutex));
+}
@@ -0,0 +1,84 @@
+// Batched inference.
+// A batcher drives an engine whose inputs and outputs all share a leading batch dimension, such as the models written
+// by `replicate`. Callers submit single samples from any thread; a dispatcher thread coalesces pending samples into
+// batches, runs the engine once per batch and copies each sample's results back. A batch runs as soon as it is full or
+// once its oldest sample waited `max_wait_us`, trading that bounded latency for throughput.
+#ifndef MLTOOLS_ENGINE_BATCHER_H
+#define MLTOOLS_ENGINE_BATCHER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "engine.h"
+
+struct batcher;
+
+struct batcher_options
+{
+  uint32_t max_wait_us;         // longest a sample waits for its batch to fill (0 runs pending samples at once)
+};
+
+// A sample in flight, owned by the caller, who keeps it and its buffers alive until it completes.
+struct batcher_request
+{
+  const void *const *inputs;    // one sample of each model input, in model order
+  void *const *outputs;         // buffers receiving one sample of each model output, in model order
+  void (*done)(struct batcher_request *request); // called by the dispatcher on completion (NULL to use `batcher_wait()`)
+  void *context;                // left to the caller
+  // Set by the batcher.
+  struct batcher_request *next;
+  struct timespec deadline;     // latest time the sample's batch may start
+  bool is_done;
+};
+
+struct batcher_stats
+{
+  uint64_t num_batches;         // batches run so far
+  uint64_t num_samples;         // samples completed so far
+  uint32_t num_pending;         // samples waiting for a batch
+  uint64_t busy_ns;             // time spent running batches
+};
+
+// Start a dispatcher driving `e`, which must not be invoked by anyone else until the batcher is destroyed. `options`
+// may be NULL.
+struct batcher *batcher_create(
+    struct engine *e,
+    const struct batcher_options *options
+    );
+
+// Complete every submitted sample, then stop the dispatcher. The engine is left open.
+void batcher_destroy(
+    struct batcher *b
+    );
+
+// Number of samples run together.
+uint32_t batcher_batch_size(
+    const struct batcher *b
+    );
+
+// Queue `request` and return at once. `request->done` is called once its outputs are written.
+void batcher_submit(
+    struct batcher *b,
+    struct batcher_request *request
+    );
+
+// Block until `request` (submitted without a `done` callback) completed.
+void batcher_wait(
+    struct batcher *b,
+    struct batcher_request *request
+    );
+
+// Submit one sample and wait for its outputs.
+void batcher_run(
+    struct batcher *b,
+    const void *const *inputs,
+    void *const *outputs
+    );
+
+void batcher_get_stats(
+    struct batcher *b,
+    struct batcher_stats *stats
+    );
+
+#endif //ifndef MLTOOLS_ENGINE_BATCHER_H
@@ -0,0 +1,1065 @@
+// Convolution and fully connected kernels.
+// CONV_2D and FULLY_CONNECTED run as GEMMs over pre-packed weight panels: PACK_MR rows of input (the receptive fields
+// of PACK_MR output pixels for CONV_2D) are multiplied at a time against panels of PACK_NR output channels.
+// DEPTHWISE_CONV_2D accumulates each filter tap across all channels of an output pixel at once. Quantized kernels
+// widen their operands to 16 bits, accumulate in 32 bits and requantize per output channel.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "kernels.h"
+#include "pack.h"
+#include "quant.h"
+
+struct conv_state
+{
+  int32_t pad_h;
+  int32_t pad_w;
+  uint32_t m;                   // number of GEMM rows (output pixels or input rows)
+  uint32_t k;                   // GEMM depth
+  uint32_t num_m_tiles;         // PACK_MR-row tiles of the GEMM
+  uint32_t num_n_blocks;        // blocks of panels computed in parallel for each tile
+  uint32_t panels_per_block;
+  bool is_pointwise;            // input rows are GEMM rows (no gathering needed)
+  float float_min;              // fused activation range
+  float float_max;
+  int32_t quant_min;
+  int32_t quant_max;
+};
+
+static void check_types(
+    const struct engine_tensor *input,
+    const struct engine_tensor *filter,
+    const struct engine_tensor *bias,
+    const struct engine_tensor *output
+    )
+{
+  if(
+      input->type == TT_FLOAT32 &&
+      filter->type == TT_FLOAT32 &&
+      output->type == TT_FLOAT32 &&
+      (bias == NULL || bias->type == TT_FLOAT32)
+    )
+    return;
+  if(
+      is_quantized_type(input->type) &&
+      filter->type == input->type &&
+      output->type == input->type &&
+      (bias == NULL || bias->type == TT_INT32) &&
+      input->scale > 0.0f &&
+      output->scale > 0.0f
+    )
+    return;
+  errno = ENOTSUP;
+  ERRORF("Operator reading '%s' with types %d/%d", input->name, input->type, filter->type);
+}
+
+static void check_weights(
+    const struct engine_tensor *filter,
+    const struct engine_tensor *bias,
+    uint32_t n
+    )
+{
+  if(!filter->is_constant || (bias != NULL && !bias->is_constant))
+  {
+    errno = ENOTSUP;
+    ERRORF("Weights '%s' are not constant", filter->name);
+  }
+  if(
+      (bias != NULL && tensor_num_elements(bias) != n) ||
+      (filter->channel_scales != NULL && filter->num_channel_scales != n)
+    )
+  {
+    errno = EINVAL;
+    ERRORF("Weights '%s' do not match %u output channels", filter->name, n);
+  }
+}
+
+static void prepare_activation(
+    struct conv_state *state,
+    enum activation_function_type activation,
+    const struct engine_tensor *output
+    )
+{
+  if(activation != AFT_NONE && activation != AFT_RELU && activation != AFT_RELU6 && activation != AFT_RELU_N1_TO_1)
+  {
+    errno = ENOTSUP;
+    ERRORF("Fused activation %d producing '%s'", activation, output->name);
+  }
+  float_activation_range(activation, &(state->float_min), &(state->float_max));
+  if(is_quantized_type(output->type))
+    quantized_activation_range(
+        activation,
+        output->type,
+        output->scale,
+        output->zero_point,
+        &(state->quant_min),
+        &(state->quant_max)
+        );
+}
+
+// Pack weights `filter` (`filter[n][k]` for PL_PANELS, `filter[k][n]` for PL_DEPTHWISE) and bias into `p`. Quantized
+// weights are stored relative to their zero point. If `fold_input_zero_point`, the contribution of the input's zero
+// point is folded into the bias, which requires padded inputs to be filled with that zero point.
+static void pack_conv_weights(
+    struct packed_weights *p,
+    enum pack_layout layout,
+    uint32_t n,
+    uint32_t k,
+    const struct engine_tensor *input,
+    const struct engine_tensor *filter,
+    const struct engine_tensor *bias,
+    const struct engine_tensor *output,
+    bool fold_input_zero_point
+    )
+{
+  if(filter->type == TT_FLOAT32)
+  {
+    float *packed_bias;
+    packed_weights_init(p, layout, TT_FLOAT32, n, k);
+    pack_float_weights(p, (const float *)filter->data);
+    packed_bias = packed_float_bias(p);
+    if(bias != NULL)
+      memcpy(packed_bias, bias->data, n * sizeof(float));
+  }
+  else
+  {
+    int32_t *packed_bias, *multipliers, *shifts;
+    packed_weights_init(p, layout, TT_INT16, n, k);
+    pack_quantized_weights(p, filter->data, filter->type, filter->zero_point);
+    packed_bias = packed_int32_bias(p);
+    multipliers = packed_multipliers(p);
+    shifts = packed_shifts(p);
+    packed_weights_sums(p, packed_bias);
+    for(
+        uint32_t n_idx = 0;
+        n_idx < n;
+        n_idx++
+       )
+    {
+      int32_t bias_value = 0;
+      float filter_scale = filter->channel_scales != NULL ? filter->channel_scales[n_idx] : filter->scale;
+      int shift;
+      if(bias != NULL)
+        memcpy(&bias_value, bias->data + n_idx * sizeof(int32_t), sizeof(int32_t));
+      if(fold_input_zero_point)
+        packed_bias[n_idx] = bias_value - input->zero_point * packed_bias[n_idx];
+      else
+        packed_bias[n_idx] = bias_value;
+      quantize_multiplier((double)input->scale * filter_scale / output->scale, &(multipliers[n_idx]), &shift);
+      shifts[n_idx] = shift;
+    }
+  }
+}
+
+// Multiply PACK_MR rows of `a` (`lda` values apart) with panels [panel_begin, panel_end) of `p` and store the first
+// `mr` rows into `c`.
+static void gemm_float(
+    const float *a,
+    size_t lda,
+    uint32_t mr,
+    const struct packed_weights *p,
+    uint32_t panel_begin,
+    uint32_t panel_end,
+    float *c,
+    size_t ldc,
+    float act_min,
+    float act_max
+    )
+{
+  const float *bias = packed_float_bias(p),
+              *panel = packed_float_weights(p) + (size_t)panel_begin * p->k * PACK_NR;
+  for(
+      uint32_t n0 = panel_begin * PACK_NR;
+      n0 < p->n && n0 < panel_end * PACK_NR;
+      n0 += PACK_NR, panel += (size_t)p->k * PACK_NR
+     )
+  {
+    float acc[PACK_MR][PACK_NR];
+    uint32_t nr = p->n - n0 < PACK_NR ? p->n - n0 : PACK_NR;
+    for(
+        uint32_t row = 0;
+        row < PACK_MR;
+        row++
+       )
+    {
+      for(
+          uint32_t col = 0;
+          col < PACK_NR;
+          col++
+         )
+      {
+        acc[row][col] = bias[n0 + col];
+      }
+    }
+    for(
+        uint32_t k_idx = 0;
+        k_idx < p->k;
+        k_idx++
+       )
+    {
+      const float *w = panel + (size_t)k_idx * PACK_NR;
+      for(
+          uint32_t row = 0;
+          row < PACK_MR;
+          row++
+         )
+      {
+        float a_value = a[row * lda + k_idx];
+        for(
+            uint32_t col = 0;
+            col < PACK_NR;
+            col++
+           )
+        {
+          acc[row][col] += a_value * w[col];
+        }
+      }
+    }
+    for(
+        uint32_t row = 0;
+        row < mr;
+        row++
+       )
+    {
+      float *c_row = c + row * ldc + n0;
+      for(
+          uint32_t col = 0;
+          col < nr;
+          col++
+         )
+      {
+        float value = acc[row][col];
+        c_row[col] = value < act_min ? act_min : (value > act_max ? act_max : value);
+      }
+    }
+  }
+}
+
+// Quantized counterpart of `gemm_float()`, requantizing each output channel to `zero_point`-relative 8-bit values.
+static void gemm_quantized(
+    const int16_t *a,
+    size_t lda,
+    uint32_t mr,
+    const struct packed_weights *p,
+    uint32_t panel_begin,
+    uint32_t panel_end,
+    uint8_t *c,
+    size_t ldc,
+    int32_t zero_point,
+    int32_t act_min,
+    int32_t act_max
+    )
+{
+  const int32_t *bias = packed_int32_bias(p),
+                *multipliers = packed_multipliers(p),
+                *shifts = packed_shifts(p);
+  const int16_t *panel = packed_int16_weights(p) + (size_t)panel_begin * p->k * PACK_NR;
+  for(
+      uint32_t n0 = panel_begin * PACK_NR;
+      n0 < p->n && n0 < panel_end * PACK_NR;
+      n0 += PACK_NR, panel += (size_t)p->k * PACK_NR
+     )
+  {
+    int32_t acc[PACK_MR][PACK_NR];
+    uint32_t nr = p->n - n0 < PACK_NR ? p->n - n0 : PACK_NR;
+    for(
+        uint32_t row = 0;
+        row < PACK_MR;
+        row++
+       )
+    {
+      for(
+          uint32_t col = 0;
+          col < PACK_NR;
+          col++
+         )
+      {
+        acc[row][col] = bias[n0 + col];
+      }
+    }
+    for(
+        uint32_t k_idx = 0;
+        k_idx < p->k;
+        k_idx++
+       )
+    {
+      const int16_t *w = panel + (size_t)k_idx * PACK_NR;
+      for(
+          uint32_t row = 0;
+          row < PACK_MR;
+          row++
+         )
+      {
+        int32_t a_value = a[row * lda + k_idx];
+        for(
+            uint32_t col = 0;
+            col < PACK_NR;
+            col++
+           )
+        {
+          acc[row][col] += a_value * w[col];
+        }
+      }
+    }
+    for(
+        uint32_t row = 0;
+        row < mr;
+        row++
+       )
+    {
+      uint8_t *c_row = c + row * ldc + n0;
+      for(
+          uint32_t col = 0;
+          col < nr;
+          col++
+         )
+      {
+        int32_t value = zero_point +
+          multiply_by_quantized_multiplier(acc[row][col], multipliers[n0 + col], shifts[n0 + col]);
+        c_row[col] = (uint8_t)clamp_int32(value, act_min, act_max);
+      }
+    }
+  }
+}
+
+// Gather the receptive fields of output pixels [m0, m0 + mr) into PACK_MR rows of `k` float values.
+static void gather_float_rows(
+    const struct engine_tensor *input,
+    const struct engine_tensor *filter,
+    const struct engine_tensor *output,
+    const struct conv2d_options *options,
+    const struct conv_state *state,
+    uint32_t m0,
+    uint32_t mr,
+    float *rows
+    )
+{
+  int32_t in_h = input->shape[1], in_w = input->shape[2], channels = input->shape[3],
+          filter_h = filter->shape[1], filter_w = filter->shape[2],
+          out_h = output->shape[1], out_w = output->shape[2];
+  const float *in_data = (const float *)input->data;
+  memset(rows + (size_t)mr * state->k, 0, (size_t)(PACK_MR - mr) * state->k * sizeof(float));
+  for(
+      uint32_t row = 0;
+      row < mr;
+      row++
+     )
+  {
+    uint32_t m = m0 + row;
+    int32_t batch_idx = m / (out_h * out_w),
+            out_y = m / out_w % out_h,
+            out_x = m % out_w;
+    float *dst = rows + (size_t)row * state->k;
+    for(
+        int32_t filter_y = 0;
+        filter_y < filter_h;
+        filter_y++
+       )
+    {
+      int32_t in_y = out_y * options->stride_h - state->pad_h + filter_y * options->dilation_h_factor;
+      for(
+          int32_t filter_x = 0;
+          filter_x < filter_w;
+          filter_x++, dst += channels
+         )
+      {
+        int32_t in_x = out_x * options->stride_w - state->pad_w + filter_x * options->dilation_w_factor;
+        if(in_y < 0 || in_y >= in_h || in_x < 0 || in_x >= in_w)
+          memset(dst, 0, channels * sizeof(float));
+        else
+          memcpy(dst, in_data + (((size_t)batch_idx * in_h + in_y) * in_w + in_x) * channels, channels * sizeof(float));
+      }
+    }
+  }
+}
+
+static inline void widen_quantized(
+    const uint8_t *src,
+    enum tensor_type type,
+    size_t count,
+    int16_t *dst
+    )
+{
+  if(type == TT_INT8)
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      dst[idx] = (int8_t)src[idx];
+    }
+  }
+  else
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      dst[idx] = src[idx];
+    }
+  }
+}
+
+// Quantized counterpart of `gather_float_rows()`. Padding is filled with the input's zero point.
+static void gather_quantized_rows(
+    const struct engine_tensor *input,
+    const struct engine_tensor *filter,
+    const struct engine_tensor *output,
+    const struct conv2d_options *options,
+    const struct conv_state *state,
+    uint32_t m0,
+    uint32_t mr,
+    int16_t *rows
+    )
+{
+  int32_t in_h = input->shape[1], in_w = input->shape[2], channels = input->shape[3],
+          filter_h = filter->shape[1], filter_w = filter->shape[2],
+          out_h = output->shape[1], out_w = output->shape[2];
+  memset(rows + (size_t)mr * state->k, 0, (size_t)(PACK_MR - mr) * state->k * sizeof(int16_t));
+  for(
+      uint32_t row = 0;
+      row < mr;
+      row++
+     )
+  {
+    uint32_t m = m0 + row;
+    int32_t batch_idx = m / (out_h * out_w),
+            out_y = m / out_w % out_h,
+            out_x = m % out_w;
+    int16_t *dst = rows + (size_t)row * state->k;
+    for(
+        int32_t filter_y = 0;
+        filter_y < filter_h;
+        filter_y++
+       )
+    {
+      int32_t in_y = out_y * options->stride_h - state->pad_h + filter_y * options->dilation_h_factor;
+      for(
+          int32_t filter_x = 0;
+          filter_x < filter_w;
+          filter_x++, dst += channels
+         )
+      {
+        int32_t in_x = out_x * options->stride_w - state->pad_w + filter_x * options->dilation_w_factor;
+        if(in_y < 0 || in_y >= in_h || in_x < 0 || in_x >= in_w)
+        {
+          for(
+              int32_t channel = 0;
+              channel < channels;
+              channel++
+             )
+          {
+            dst[channel] = input->zero_point;
+          }
+        }
+        else
+          widen_quantized(
+              input->data + (((size_t)batch_idx * in_h + in_y) * in_w + in_x) * channels,
+              input->type,
+              channels,
+              dst
+              );
+      }
+    }
+  }
+}
+
+// Run rows [m0, m0 + mr) of a CONV_2D or FULLY_CONNECTED GEMM against panels [panel_begin, panel_end).
+static void gemm_rows(
+    struct engine *e,
+    const struct engine_operator *op,
+    uint32_t m0,
+    uint32_t mr,
+    uint32_t panel_begin,
+    uint32_t panel_end,
+    void *scratch
+    )
+{
+  const struct conv_state *state = op->state;
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *filter = op_input(e, op, 1),
+                             *output = op_output(e, op, 0);
+  const struct packed_weights *p = op->packed;
+  if(input->type == TT_FLOAT32)
+  {
+    const float *a = (const float *)input->data + (size_t)m0 * state->k;
+    if(!state->is_pointwise)
+    {
+      gather_float_rows(input, filter, output, &(op->builtin_options.conv2d_options), state, m0, mr, scratch);
+      a = scratch;
+    }
+    else if(mr < PACK_MR)
+    {
+      memcpy(scratch, a, (size_t)mr * state->k * sizeof(float));
+      memset((float *)scratch + (size_t)mr * state->k, 0, (size_t)(PACK_MR - mr) * state->k * sizeof(float));
+      a = scratch;
+    }
+    gemm_float(
+        a,
+        state->k,
+        mr,
+        p,
+        panel_begin,
+        panel_end,
+        (float *)output->data + (size_t)m0 * p->n,
+        p->n,
+        state->float_min,
+        state->float_max
+        );
+  }
+  else
+  {
+    if(!state->is_pointwise)
+      gather_quantized_rows(input, filter, output, &(op->builtin_options.conv2d_options), state, m0, mr, scratch);
+    else
+    {
+      widen_quantized(input->data + (size_t)m0 * state->k, input->type, (size_t)mr * state->k, scratch);
+      memset((int16_t *)scratch + (size_t)mr * state->k, 0, (size_t)(PACK_MR - mr) * state->k * sizeof(int16_t));
+    }
+    gemm_quantized(
+        scratch,
+        state->k,
+        mr,
+        p,
+        panel_begin,
+        panel_end,
+        output->data + (size_t)m0 * p->n,
+        p->n,
+        output->zero_point,
+        state->quant_min,
+        state->quant_max
+        );
+  }
+}
+
+// Parallel loop body over (tile, panel block) pairs.
+static void gemm_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct conv_state *state = ctx->op->state;
+  for(
+      size_t item = begin;
+      item < end;
+      item++
+     )
+  {
+    uint32_t m0 = item / state->num_n_blocks * PACK_MR,
+             panel_begin = item % state->num_n_blocks * state->panels_per_block;
+    gemm_rows(
+        ctx->e,
+        ctx->op,
+        m0,
+        state->m - m0 < PACK_MR ? state->m - m0 : PACK_MR,
+        panel_begin,
+        panel_begin + state->panels_per_block,
+        op_scratch(ctx->e, worker_idx)
+        );
+  }
+}
+
+static void invoke_gemm(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct conv_state *state = op->state;
+  struct op_context ctx = {.e = e, .op = op};
+  threadpool_parallel_for(
+      e->pool,
+      (size_t)state->num_m_tiles * state->num_n_blocks,
+      parallel_grain((size_t)PACK_MR * state->k * state->panels_per_block * PACK_NR),
+      gemm_range,
+      &ctx
+      );
+}
+
+// Split the GEMM of `n` output channels into tiles and panel blocks. Panels are only split across threads when there
+// are too few tiles to keep every thread busy, since each block gathers its input rows again.
+static void plan_gemm(
+    const struct engine *e,
+    struct conv_state *state,
+    uint32_t n
+    )
+{
+  uint32_t num_panels = packed_weights_padded_n(n) / PACK_NR,
+           num_items = 4 * threadpool_num_threads(e->pool);
+  state->num_m_tiles = (state->m + PACK_MR - 1) / PACK_MR;
+  state->num_n_blocks = 1;
+  if(state->num_m_tiles < num_items)
+    state->num_n_blocks = (num_items + state->num_m_tiles - 1) / state->num_m_tiles;
+  if(state->num_n_blocks > num_panels)
+    state->num_n_blocks = num_panels;
+  state->panels_per_block = (num_panels + state->num_n_blocks - 1) / state->num_n_blocks;
+  state->num_n_blocks = (num_panels + state->panels_per_block - 1) / state->panels_per_block;
+}
+
+static void pack_gemm(
+    struct engine *e,
+    struct engine_operator *op,
+    void *packed
+    )
+{
+  const struct conv_state *state = op->state;
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *filter = op_input(e, op, 1),
+                             *bias = op_input(e, op, 2),
+                             *output = op_output(e, op, 0);
+  pack_conv_weights(packed, PL_PANELS, filter->shape[0], state->k, input, filter, bias, output, true);
+}
+
+static void prepare_conv_2d(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct conv2d_options *options = &(op->builtin_options.conv2d_options);
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *filter = op_input(e, op, 1),
+                             *bias = op_input(e, op, 2),
+                             *output = op_output(e, op, 0);
+  struct conv_state *state;
+  if(
+      input == NULL || filter == NULL ||
+      input->num_dims != 4 || filter->num_dims != 4 || output->num_dims != 4 ||
+      filter->shape[3] != input->shape[3] || output->shape[3] != filter->shape[0] ||
+      output->shape[0] != input->shape[0]
+    )
+  {
+    errno = EINVAL;
+    ERRORF("CONV_2D producing '%s'", output->name);
+  }
+  check_types(input, filter, bias, output);
+  check_weights(filter, bias, filter->shape[0]);
+  if((state = calloc(1, sizeof(struct conv_state))) == NULL)
+    ERROR();
+  state->pad_h = compute_padding(
+      options->padding,
+      input->shape[1],
+      filter->shape[1],
+      options->stride_h,
+      options->dilation_h_factor,
+      output->shape[1]
+      );
+  state->pad_w = compute_padding(
+      options->padding,
+      input->shape[2],
+      filter->shape[2],
+      options->stride_w,
+      options->dilation_w_factor,
+      output->shape[2]
+      );
+  state->m = output->shape[0] * output->shape[1] * output->shape[2];
+  state->k = filter->shape[1] * filter->shape[2] * filter->shape[3];
+  state->is_pointwise =
+    filter->shape[1] == 1 && filter->shape[2] == 1 &&
+    options->stride_h == 1 && options->stride_w == 1 &&
+    input->shape[1] == output->shape[1] && input->shape[2] == output->shape[2];
+  prepare_activation(state, options->fused_activation_function, output);
+  plan_gemm(e, state, filter->shape[0]);
+  op->state = state;
+  op->scratch_size = (size_t)PACK_MR * state->k * sizeof(float);
+  op->packed_size = packed_weights_size(
+      PL_PANELS,
+      filter->type == TT_FLOAT32 ? TT_FLOAT32 : TT_INT16,
+      filter->shape[0],
+      state->k
+      );
+}
+
+static void prepare_fully_connected(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct fully_connected_options *options = &(op->builtin_options.fully_connected_options);
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *filter = op_input(e, op, 1),
+                             *bias = op_input(e, op, 2),
+                             *output = op_output(e, op, 0);
+  struct conv_state *state;
+  if(
+      input == NULL || filter == NULL || filter->num_dims != 2 ||
+      tensor_num_elements(input) % filter->shape[1] != 0 ||
+      tensor_num_elements(output) != tensor_num_elements(input) / filter->shape[1] * filter->shape[0]
+    )
+  {
+    errno = EINVAL;
+    ERRORF("FULLY_CONNECTED producing '%s'", output->name);
+  }
+  check_types(input, filter, bias, output);
+  check_weights(filter, bias, filter->shape[0]);
+  if((state = calloc(1, sizeof(struct conv_state))) == NULL)
+    ERROR();
+  state->k = filter->shape[1];
+  state->m = tensor_num_elements(input) / state->k;
+  state->is_pointwise = true;
+  prepare_activation(state, options->fused_activation_function, output);
+  plan_gemm(e, state, filter->shape[0]);
+  op->state = state;
+  op->scratch_size = (size_t)PACK_MR * state->k * sizeof(float);
+  op->packed_size = packed_weights_size(
+      PL_PANELS,
+      filter->type == TT_FLOAT32 ? TT_FLOAT32 : TT_INT16,
+      filter->shape[0],
+      state->k
+      );
+}
+
+// Accumulate one output pixel of a float depthwise convolution into `acc`.
+static void depthwise_float_pixel(
+    const struct engine_tensor *input,
+    const struct engine_tensor *filter,
+    const struct depthwise_conv2d_options *options,
+    const struct conv_state *state,
+    const struct packed_weights *p,
+    int32_t batch_idx,
+    int32_t out_y,
+    int32_t out_x,
+    float *acc
+    )
+{
+  int32_t in_h = input->shape[1], in_w = input->shape[2], channels = input->shape[3],
+          filter_h = filter->shape[1], filter_w = filter->shape[2],
+          multiplier = options->depth_multiplier;
+  uint32_t padded_n = packed_weights_padded_n(p->n);
+  const float *weights = packed_float_weights(p);
+  memcpy(acc, packed_float_bias(p), p->n * sizeof(float));
+  for(
+      int32_t filter_y = 0;
+      filter_y < filter_h;
+      filter_y++
+     )
+  {
+    int32_t in_y = out_y * options->stride_h - state->pad_h + filter_y * options->dilation_h_factor;
+    if(in_y < 0 || in_y >= in_h)
+      continue;
+    for(
+        int32_t filter_x = 0;
+        filter_x < filter_w;
+        filter_x++
+       )
+    {
+      int32_t in_x = out_x * options->stride_w - state->pad_w + filter_x * options->dilation_w_factor;
+      const float *in = (const float *)input->data + (((size_t)batch_idx * in_h + in_y) * in_w + in_x) * channels,
+                  *w = weights + (size_t)(filter_y * filter_w + filter_x) * padded_n;
+      if(in_x < 0 || in_x >= in_w)
+        continue;
+      if(multiplier == 1)
+      {
+        for(
+            int32_t channel = 0;
+            channel < channels;
+            channel++
+           )
+        {
+          acc[channel] += in[channel] * w[channel];
+        }
+      }
+      else
+      {
+        for(
+            int32_t channel = 0;
+            channel < channels;
+            channel++
+           )
+        {
+          for(
+              int32_t m = 0;
+              m < multiplier;
+              m++
+             )
+          {
+            acc[channel * multiplier + m] += in[channel] * w[channel * multiplier + m];
+          }
+        }
+      }
+    }
+  }
+}
+
+// Accumulate one output pixel of a quantized depthwise convolution into `acc`.
+static void depthwise_quantized_pixel(
+    const struct engine_tensor *input,
+    const struct engine_tensor *filter,
+    const struct depthwise_conv2d_options *options,
+    const struct conv_state *state,
+    const struct packed_weights *p,
+    int32_t batch_idx,
+    int32_t out_y,
+    int32_t out_x,
+    int32_t *acc
+    )
+{
+  int32_t in_h = input->shape[1], in_w = input->shape[2], channels = input->shape[3],
+          filter_h = filter->shape[1], filter_w = filter->shape[2],
+          multiplier = options->depth_multiplier,
+          zero_point = input->zero_point;
+  uint32_t padded_n = packed_weights_padded_n(p->n);
+  const int16_t *weights = packed_int16_weights(p);
+  memcpy(acc, packed_int32_bias(p), p->n * sizeof(int32_t));
+  for(
+      int32_t filter_y = 0;
+      filter_y < filter_h;
+      filter_y++
+     )
+  {
+    int32_t in_y = out_y * options->stride_h - state->pad_h + filter_y * options->dilation_h_factor;
+    if(in_y < 0 || in_y >= in_h)
+      continue;
+    for(
+        int32_t filter_x = 0;
+        filter_x < filter_w;
+        filter_x++
+       )
+    {
+      int32_t in_x = out_x * options->stride_w - state->pad_w + filter_x * options->dilation_w_factor;
+      const uint8_t *in = input->data + (((size_t)batch_idx * in_h + in_y) * in_w + in_x) * channels;
+      const int16_t *w = weights + (size_t)(filter_y * filter_w + filter_x) * padded_n;
+      if(in_x < 0 || in_x >= in_w)
+        continue;
+      if(multiplier == 1 && input->type == TT_UINT8)
+      {
+        for(
+            int32_t channel = 0;
+            channel < channels;
+            channel++
+           )
+        {
+          acc[channel] += ((int32_t)in[channel] - zero_point) * w[channel];
+        }
+      }
+      else if(multiplier == 1)
+      {
+        for(
+            int32_t channel = 0;
+            channel < channels;
+            channel++
+           )
+        {
+          acc[channel] += ((int32_t)(int8_t)in[channel] - zero_point) * w[channel];
+        }
+      }
+      else
+      {
+        for(
+            int32_t channel = 0;
+            channel < channels;
+            channel++
+           )
+        {
+          int32_t in_value = (input->type == TT_INT8 ? (int32_t)(int8_t)in[channel] : (int32_t)in[channel]) - zero_point;
+          for(
+              int32_t m = 0;
+              m < multiplier;
+              m++
+             )
+          {
+            acc[channel * multiplier + m] += in_value * w[channel * multiplier + m];
+          }
+        }
+      }
+    }
+  }
+}
+
+// Compute output rows [row_begin, row_end) (over batch * height) of a depthwise convolution.
+static void depthwise_rows(
+    struct engine *e,
+    const struct engine_operator *op,
+    uint32_t row_begin,
+    uint32_t row_end,
+    void *scratch
+    )
+{
+  const struct depthwise_conv2d_options *options = &(op->builtin_options.depthwise_conv2d_options);
+  const struct conv_state *state = op->state;
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *filter = op_input(e, op, 1),
+                             *output = op_output(e, op, 0);
+  const struct packed_weights *p = op->packed;
+  int32_t out_h = output->shape[1], out_w = output->shape[2];
+  for(
+      uint32_t row = row_begin;
+      row < row_end;
+      row++
+     )
+  {
+    int32_t batch_idx = row / out_h,
+            out_y = row % out_h;
+    for(
+        int32_t out_x = 0;
+        out_x < out_w;
+        out_x++
+       )
+    {
+      size_t out_offset = (((size_t)batch_idx * out_h + out_y) * out_w + out_x) * p->n;
+      if(input->type == TT_FLOAT32)
+      {
+        float *acc = scratch,
+              *out = (float *)output->data + out_offset;
+        depthwise_float_pixel(input, filter, options, state, p, batch_idx, out_y, out_x, acc);
+        for(
+            uint32_t channel = 0;
+            channel < p->n;
+            channel++
+           )
+        {
+          float value = acc[channel];
+          out[channel] = value < state->float_min ? state->float_min : (value > state->float_max ? state->float_max : value);
+        }
+      }
+      else
+      {
+        int32_t *acc = scratch;
+        const int32_t *multipliers = packed_multipliers(p),
+                      *shifts = packed_shifts(p);
+        uint8_t *out = output->data + out_offset;
+        depthwise_quantized_pixel(input, filter, options, state, p, batch_idx, out_y, out_x, acc);
+        for(
+            uint32_t channel = 0;
+            channel < p->n;
+            channel++
+           )
+        {
+          int32_t value = output->zero_point +
+            multiply_by_quantized_multiplier(acc[channel], multipliers[channel], shifts[channel]);
+          out[channel] = (uint8_t)clamp_int32(value, state->quant_min, state->quant_max);
+        }
+      }
+    }
+  }
+}
+
+static void depthwise_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  depthwise_rows(ctx->e, ctx->op, begin, end, op_scratch(ctx->e, worker_idx));
+}
+
+static void invoke_depthwise_conv_2d(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *filter = op_input(e, op, 1),
+                             *output = op_output(e, op, 0);
+  struct op_context ctx = {.e = e, .op = op};
+  threadpool_parallel_for(
+      e->pool,
+      output->shape[0] * output->shape[1],
+      parallel_grain((size_t)output->shape[2] * output->shape[3] * filter->shape[1] * filter->shape[2]),
+      depthwise_range,
+      &ctx
+      );
+}
+
+static void pack_depthwise_conv_2d(
+    struct engine *e,
+    struct engine_operator *op,
+    void *packed
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *filter = op_input(e, op, 1),
+                             *bias = op_input(e, op, 2),
+                             *output = op_output(e, op, 0);
+  pack_conv_weights(
+      packed,
+      PL_DEPTHWISE,
+      filter->shape[3],
+      filter->shape[1] * filter->shape[2],
+      input,
+      filter,
+      bias,
+      output,
+      false
+      );
+}
+
+static void prepare_depthwise_conv_2d(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct depthwise_conv2d_options *options = &(op->builtin_options.depthwise_conv2d_options);
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *filter = op_input(e, op, 1),
+                             *bias = op_input(e, op, 2),
+                             *output = op_output(e, op, 0);
+  struct conv_state *state;
+  if(
+      input == NULL || filter == NULL ||
+      input->num_dims != 4 || filter->num_dims != 4 || output->num_dims != 4 ||
+      options->depth_multiplier < 1 ||
+      filter->shape[3] != input->shape[3] * options->depth_multiplier || output->shape[3] != filter->shape[3] ||
+      output->shape[0] != input->shape[0]
+    )
+  {
+    errno = EINVAL;
+    ERRORF("DEPTHWISE_CONV_2D producing '%s'", output->name);
+  }
+  check_types(input, filter, bias, output);
+  check_weights(filter, bias, filter->shape[3]);
+  if((state = calloc(1, sizeof(struct conv_state))) == NULL)
+    ERROR();
+  state->pad_h = compute_padding(
+      options->padding,
+      input->shape[1],
+      filter->shape[1],
+      options->stride_h,
+      options->dilation_h_factor,
+      output->shape[1]
+      );
+  state->pad_w = compute_padding(
+      options->padding,
+      input->shape[2],
+      filter->shape[2],
+      options->stride_w,
+      options->dilation_w_factor,
+      output->shape[2]
+      );
+  state->k = filter->shape[1] * filter->shape[2];
+  prepare_activation(state, options->fused_activation_function, output);
+  op->state = state;
+  op->scratch_size = packed_weights_padded_n(filter->shape[3]) * sizeof(float);
+  op->packed_size = packed_weights_size(
+      PL_DEPTHWISE,
+      filter->type == TT_FLOAT32 ? TT_FLOAT32 : TT_INT16,
+      filter->shape[3],
+      state->k
+      );
+}
+
+const struct kernel conv_2d_kernel = {
+  .prepare = prepare_conv_2d,
+  .pack = pack_gemm,
+  .invoke = invoke_gemm
+};
+
+const struct kernel depthwise_conv_2d_kernel = {
+  .prepare = prepare_depthwise_conv_2d,
+  .pack = pack_depthwise_conv_2d,
+  .invoke = invoke_depthwise_conv_2d
+};
+
+const struct kernel fully_connected_kernel = {
+  .prepare = prepare_fully_connected,
+  .pack = pack_gemm,
+  .invoke = invoke_gemm
+};
@@ -0,0 +1,188 @@
+// Data movement kernels.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "kernels.h"
+#include "quant.h"
+
+static void prepare_reshape(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *output = op_output(e, op, 0);
+  if(input == NULL || input->type != output->type || input->size != output->size)
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s'", op->name, output->name);
+  }
+  op->view_input = 0;
+}
+
+static void invoke_reshape(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *output = op_output(e, op, 0);
+  if(output->data != input->data)
+    memcpy(output->data, input->data, output->size);
+}
+
+// Number of elements spanned by dimensions [first_dim, num_dims) of `t`.
+static size_t inner_size(
+    const struct engine_tensor *t,
+    uint8_t first_dim
+    )
+{
+  size_t size = 1;
+  for(
+      uint8_t dim_idx = first_dim;
+      dim_idx < t->num_dims;
+      dim_idx++
+     )
+  {
+    size *= t->shape[dim_idx];
+  }
+  return size;
+}
+
+static uint8_t concatenation_axis(
+    const struct engine_operator *op,
+    const struct engine_tensor *output
+    )
+{
+  int32_t axis = op->builtin_options.concatenation_options.axis;
+  return axis < 0 ? axis + output->num_dims : axis;
+}
+
+static void prepare_concatenation(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *output = op_output(e, op, 0);
+  int32_t axis = op->builtin_options.concatenation_options.axis,
+          axis_size = 0;
+  if(op->builtin_options.concatenation_options.fused_activation_function != AFT_NONE)
+  {
+    errno = ENOTSUP;
+    ERRORF("CONCATENATION with fused activation producing '%s'", output->name);
+  }
+  if(axis < -output->num_dims || axis >= output->num_dims)
+  {
+    errno = EINVAL;
+    ERRORF("CONCATENATION axis %d producing '%s'", axis, output->name);
+  }
+  axis = concatenation_axis(op, output);
+  for(
+      uint16_t input_idx = 0;
+      input_idx < op->num_inputs;
+      input_idx++
+     )
+  {
+    const struct engine_tensor *input = op_input(e, op, input_idx);
+    if(input == NULL || input->type != output->type || input->num_dims != output->num_dims)
+    {
+      errno = EINVAL;
+      ERRORF("CONCATENATION producing '%s'", output->name);
+    }
+    axis_size += input->shape[axis];
+  }
+  if(axis_size != output->shape[axis])
+  {
+    errno = EINVAL;
+    ERRORF("CONCATENATION producing '%s'", output->name);
+  }
+  // Along the outermost dimension of size > 1, every input occupies a contiguous slice of the output.
+  op->is_slicing_output = inner_size(output, 0) == inner_size(output, axis);
+  for(
+      uint16_t input_idx = 0;
+      input_idx < op->num_inputs;
+      input_idx++
+     )
+  {
+    const struct engine_tensor *input = op_input(e, op, input_idx);
+    if(is_quantized_type(output->type) && (input->scale != output->scale || input->zero_point != output->zero_point))
+      op->is_slicing_output = false;
+  }
+}
+
+// Copy `count` quantized values, rescaling them from the quantization of `input` into that of `output`.
+static void requantize_copy(
+    const struct engine_tensor *input,
+    const struct engine_tensor *output,
+    const uint8_t *src,
+    uint8_t *dst,
+    size_t count
+    )
+{
+  float scale = input->scale / output->scale;
+  int32_t min = quantized_min(output->type),
+          max = quantized_max(output->type);
+  for(
+      size_t idx = 0;
+      idx < count;
+      idx++
+     )
+  {
+    int32_t value = output->type == TT_INT8 ? (int8_t)src[idx] : src[idx];
+    value = output->zero_point + (int32_t)lroundf((value - input->zero_point) * scale);
+    dst[idx] = (uint8_t)clamp_int32(value, min, max);
+  }
+}
+
+static void invoke_concatenation(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *output = op_output(e, op, 0);
+  uint8_t axis = concatenation_axis(op, output);
+  size_t outer = tensor_num_elements(output) / inner_size(output, axis),
+         element_size = tensor_type_size(output->type);
+  uint8_t *dst = output->data;
+  for(
+      size_t outer_idx = 0;
+      outer_idx < outer;
+      outer_idx++
+     )
+  {
+    for(
+        uint16_t input_idx = 0;
+        input_idx < op->num_inputs;
+        input_idx++
+       )
+    {
+      const struct engine_tensor *input = op_input(e, op, input_idx);
+      size_t count = inner_size(input, axis);
+      const uint8_t *src = input->data + outer_idx * count * element_size;
+      // Inputs placed into the output by the planner are already in place.
+      if(src != dst)
+      {
+        if(
+            is_quantized_type(output->type) &&
+            (input->scale != output->scale || input->zero_point != output->zero_point)
+          )
+          requantize_copy(input, output, src, dst, count);
+        else
+          memcpy(dst, src, count * element_size);
+      }
+      dst += count * element_size;
+    }
+  }
+}
+
+const struct kernel reshape_kernel = {
+  .prepare = prepare_reshape,
+  .invoke = invoke_reshape
+};
+
+const struct kernel concatenation_kernel = {
+  .prepare = prepare_concatenation,
+  .invoke = invoke_concatenation
+};
@@ -0,0 +1,453 @@
+// Elementwise binary kernels.
+// Broadcasting is resolved once by `prepare()`: dimensions of size 1 are dropped and adjacent dimensions along which
+// both inputs are either broadcast or not are merged, leaving the minimal loop nest whose innermost loop runs over
+// contiguous memory (or a broadcast value) and vectorizes. Quantized operators follow the fixed-point arithmetic of
+// TF Lite, with the output requantization and the fused activation folded into the same pass.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "kernels.h"
+#include "quant.h"
+
+#define ELEMENTWISE_BLOCK_SIZE 16384 // elements of the innermost loop run by one parallel chunk
+#define ADD_LEFT_SHIFT 20           // headroom of quantized additions, subtractions and comparisons
+#define SQUARED_DIFFERENCE_LEFT_SHIFT 7
+
+struct elementwise_state
+{
+  uint8_t num_dims;                     // dimensions of the collapsed loop nest, innermost last
+  size_t shape[ENGINE_MAX_DIMS];
+  size_t strides[2][ENGINE_MAX_DIMS];   // element strides of each input (0 along broadcast dimensions)
+  size_t num_rows;                      // iterations of all but the innermost loop
+  size_t num_blocks;                    // chunks of the innermost loop
+  float act_min;                        // float activation range
+  float act_max;
+  int32_t quant_act_min;                // quantized activation range
+  int32_t quant_act_max;
+  int32_t input_tables[2][256];         // offset (and for additive operators, rescaled) value of each raw input byte
+  int32_t output_multiplier;            // rescale the result into the output's scale
+  int output_shift;
+  int32_t output_zero_point;
+  float real_multiplier;                // rescale quotients into the output's scale
+};
+
+static enum activation_function_type fused_activation(
+    const struct engine_operator *op
+    )
+{
+  switch(op->builtin_code)
+  {
+    case BO_ADD:
+      return op->builtin_options.add_options.fused_activation_function;
+    case BO_SUB:
+      return op->builtin_options.sub_options.fused_activation_function;
+    case BO_MUL:
+      return op->builtin_options.mul_options.fused_activation_function;
+    case BO_DIV:
+      return op->builtin_options.div_options.fused_activation_function;
+    default:
+      return AFT_NONE;
+  }
+}
+
+// Collapse the broadcast of `inputs` into `output` into the loop nest of `state`.
+static void collapse_broadcast(
+    const struct engine_operator *op,
+    const struct engine_tensor *inputs[2],
+    const struct engine_tensor *output,
+    struct elementwise_state *state
+    )
+{
+  bool is_present[2][ENGINE_MAX_DIMS];
+  state->num_dims = 0;
+  for(
+      uint8_t dim_idx = 0;
+      dim_idx < output->num_dims;
+      dim_idx++
+     )
+  {
+    int32_t size = output->shape[dim_idx];
+    bool is_input_present[2];
+    for(
+        uint8_t input_idx = 0;
+        input_idx < 2;
+        input_idx++
+       )
+    {
+      // Inputs with fewer dimensions are aligned to the innermost dimensions of the output.
+      int32_t offset = output->num_dims - inputs[input_idx]->num_dims,
+              input_size = dim_idx >= offset ? inputs[input_idx]->shape[dim_idx - offset] : 1;
+      if(input_size != size && input_size != 1)
+      {
+        errno = EINVAL;
+        ERRORF("%s cannot broadcast '%s' into '%s'", op->name, inputs[input_idx]->name, output->name);
+      }
+      is_input_present[input_idx] = input_size == size;
+    }
+    if(!is_input_present[0] && !is_input_present[1])
+    {
+      errno = EINVAL;
+      ERRORF("%s producing '%s' of mismatching shape", op->name, output->name);
+    }
+    if(size == 1)
+      continue;
+    if(
+        state->num_dims > 0 &&
+        is_present[0][state->num_dims - 1] == is_input_present[0] &&
+        is_present[1][state->num_dims - 1] == is_input_present[1]
+      )
+      state->shape[state->num_dims - 1] *= size;
+    else
+    {
+      state->shape[state->num_dims] = size;
+      is_present[0][state->num_dims] = is_input_present[0];
+      is_present[1][state->num_dims] = is_input_present[1];
+      state->num_dims++;
+    }
+  }
+  if(state->num_dims == 0)
+  {
+    state->shape[0] = 1;
+    is_present[0][0] = true;
+    is_present[1][0] = true;
+    state->num_dims = 1;
+  }
+  for(
+      uint8_t input_idx = 0;
+      input_idx < 2;
+      input_idx++
+     )
+  {
+    size_t stride = 1;
+    for(
+        int8_t dim_idx = state->num_dims - 1;
+        dim_idx >= 0;
+        dim_idx--
+       )
+    {
+      state->strides[input_idx][dim_idx] = is_present[input_idx][dim_idx] ? stride : 0;
+      if(is_present[input_idx][dim_idx])
+        stride *= state->shape[dim_idx];
+    }
+  }
+  state->num_rows = 1;
+  for(
+      uint8_t dim_idx = 0;
+      dim_idx + 1 < state->num_dims;
+      dim_idx++
+     )
+  {
+    state->num_rows *= state->shape[dim_idx];
+  }
+  state->num_blocks = (state->shape[state->num_dims - 1] + ELEMENTWISE_BLOCK_SIZE - 1) / ELEMENTWISE_BLOCK_SIZE;
+}
+
+// Fill the table mapping the raw bytes of quantized `input` to their offset value, scaled by 2^`left_shift` and
+// rescaled by `real_multiplier` unless `left_shift` is 0.
+static void fill_input_table(
+    const struct engine_tensor *input,
+    int left_shift,
+    double real_multiplier,
+    int32_t *table
+    )
+{
+  int32_t multiplier;
+  int shift;
+  quantize_multiplier(real_multiplier, &multiplier, &shift);
+  for(
+      uint32_t raw = 0;
+      raw < 256;
+      raw++
+     )
+  {
+    int32_t value = (input->type == TT_INT8 ? (int8_t)raw : (int32_t)raw) - input->zero_point;
+    table[raw] = left_shift == 0 ? value : multiply_by_quantized_multiplier(value * (1 << left_shift), multiplier, shift);
+  }
+}
+
+static void prepare_quantized(
+    const struct engine_operator *op,
+    const struct engine_tensor *inputs[2],
+    const struct engine_tensor *output,
+    struct elementwise_state *state
+    )
+{
+  double max_input_scale = inputs[0]->scale > inputs[1]->scale ? inputs[0]->scale : inputs[1]->scale,
+         twice_max_input_scale = 2.0 * max_input_scale,
+         output_real_multiplier;
+  int left_shift = 0;
+  quantized_activation_range(
+      fused_activation(op),
+      output->type,
+      output->scale,
+      output->zero_point,
+      &(state->quant_act_min),
+      &(state->quant_act_max)
+      );
+  state->output_zero_point = output->zero_point;
+  // Additive operators rescale both inputs into a common scale with extra precision (see TF Lite's reference
+  // kernels); products only remove the input offsets.
+  if(op->builtin_code == BO_MUL)
+    output_real_multiplier = (double)inputs[0]->scale * inputs[1]->scale / output->scale;
+  else if(op->builtin_code == BO_DIV)
+  {
+    output_real_multiplier = 0.0;
+    state->real_multiplier = (double)inputs[0]->scale / ((double)inputs[1]->scale * output->scale);
+  }
+  else if(op->builtin_code == BO_SQUARED_DIFFERENCE)
+  {
+    left_shift = SQUARED_DIFFERENCE_LEFT_SHIFT;
+    output_real_multiplier =
+      twice_max_input_scale * twice_max_input_scale / ((double)(1ll << (2 * left_shift)) * output->scale);
+  }
+  else
+  {
+    left_shift = ADD_LEFT_SHIFT;
+    output_real_multiplier = twice_max_input_scale / ((double)(1 << left_shift) * output->scale);
+  }
+  quantize_multiplier(output_real_multiplier, &(state->output_multiplier), &(state->output_shift));
+  for(
+      uint8_t input_idx = 0;
+      input_idx < 2;
+      input_idx++
+     )
+  {
+    fill_input_table(
+        inputs[input_idx],
+        left_shift,
+        inputs[input_idx]->scale / twice_max_input_scale,
+        state->input_tables[input_idx]
+        );
+  }
+}
+
+static void prepare_elementwise(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *inputs[2] = {op_input(e, op, 0), op_input(e, op, 1)},
+                             *output = op_output(e, op, 0);
+  struct elementwise_state *state;
+  if(inputs[0] == NULL || inputs[1] == NULL || inputs[0]->type != output->type || inputs[1]->type != output->type)
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s'", op->name, output->name);
+  }
+  if(output->type != TT_FLOAT32 && !is_quantized_type(output->type))
+  {
+    errno = ENOTSUP;
+    ERRORF("%s of type %d producing '%s'", op->name, output->type, output->name);
+  }
+  if((state = calloc(1, sizeof(struct elementwise_state))) == NULL)
+    ERROR();
+  op->state = state;
+  collapse_broadcast(op, inputs, output, state);
+  if(output->type == TT_FLOAT32)
+    float_activation_range(fused_activation(op), &(state->act_min), &(state->act_max));
+  else
+    prepare_quantized(op, inputs, output, state);
+  // Every output element only depends on the input elements at the same position, so an input that is not broadcast
+  // can be overwritten.
+  if(inputs[0]->size == output->size)
+    op->inplace_input = 0;
+  else if(inputs[1]->size == output->size)
+    op->inplace_input = 1;
+}
+
+// Innermost loop over float elements. `a_step` and `b_step` are 0 for a broadcast input and 1 otherwise; the loop is
+// instantiated for each combination so that it vectorizes. `out` may alias `a` or `b`.
+static inline void float_loop(
+    enum builtin_operator builtin_code,
+    const float *a,
+    size_t a_step,
+    const float *b,
+    size_t b_step,
+    float *out,
+    size_t count,
+    float act_min,
+    float act_max
+    )
+{
+  switch(builtin_code)
+  {
+#define FLOAT_LOOP(expression)\
+    for(\
+        size_t idx = 0;\
+        idx < count;\
+        idx++\
+       )\
+    {\
+      float x = a[idx * a_step], y = b[idx * b_step], z = (expression);\
+      out[idx] = z < act_min ? act_min : (z > act_max ? act_max : z);\
+    }\
+    break
+    case BO_ADD:
+      FLOAT_LOOP(x + y);
+    case BO_SUB:
+      FLOAT_LOOP(x - y);
+    case BO_MUL:
+      FLOAT_LOOP(x * y);
+    case BO_DIV:
+      FLOAT_LOOP(x / y);
+    case BO_MAXIMUM:
+      FLOAT_LOOP(x > y ? x : y);
+    case BO_MINIMUM:
+      FLOAT_LOOP(x < y ? x : y);
+    case BO_SQUARED_DIFFERENCE:
+      FLOAT_LOOP((x - y) * (x - y));
+    default:
+      break;
+#undef FLOAT_LOOP
+  }
+}
+
+// Quotient of two offset quantized values, in units of the output's scale.
+static inline int32_t quantized_quotient(
+    int32_t x,
+    int32_t y,
+    float real_multiplier
+    )
+{
+  float quotient = real_multiplier * x / y;
+  if(!isfinite(quotient))
+    return quotient > 0.0f ? INT16_MAX : INT16_MIN; // saturates once clamped to 8 bits
+  return (int32_t)lroundf(quotient);
+}
+
+// Innermost loop over quantized elements, whose raw bytes are looked up in the input tables of `state`. `out` may
+// alias `a` or `b`.
+static void quantized_loop(
+    enum builtin_operator builtin_code,
+    const struct elementwise_state *state,
+    const uint8_t *a,
+    size_t a_step,
+    const uint8_t *b,
+    size_t b_step,
+    uint8_t *out,
+    size_t count
+    )
+{
+  const int32_t *a_table = state->input_tables[0],
+                *b_table = state->input_tables[1];
+  int32_t multiplier = state->output_multiplier,
+          zero_point = state->output_zero_point,
+          act_min = state->quant_act_min,
+          act_max = state->quant_act_max;
+  int shift = state->output_shift;
+  switch(builtin_code)
+  {
+#define QUANTIZED_LOOP(expression)\
+    for(\
+        size_t idx = 0;\
+        idx < count;\
+        idx++\
+       )\
+    {\
+      int32_t x = a_table[a[idx * a_step]], y = b_table[b[idx * b_step]];\
+      out[idx] = (uint8_t)clamp_int32((expression) + zero_point, act_min, act_max);\
+    }\
+    break
+    case BO_ADD:
+      QUANTIZED_LOOP(multiply_by_quantized_multiplier(x + y, multiplier, shift));
+    case BO_SUB:
+      QUANTIZED_LOOP(multiply_by_quantized_multiplier(x - y, multiplier, shift));
+    case BO_MUL:
+      QUANTIZED_LOOP(multiply_by_quantized_multiplier(x * y, multiplier, shift));
+    case BO_DIV:
+      QUANTIZED_LOOP(quantized_quotient(x, y, state->real_multiplier));
+    case BO_MAXIMUM:
+      QUANTIZED_LOOP(multiply_by_quantized_multiplier(x > y ? x : y, multiplier, shift));
+    case BO_MINIMUM:
+      QUANTIZED_LOOP(multiply_by_quantized_multiplier(x < y ? x : y, multiplier, shift));
+    case BO_SQUARED_DIFFERENCE:
+      QUANTIZED_LOOP(multiply_by_quantized_multiplier((x - y) * (x - y), multiplier, shift));
+    default:
+      break;
+#undef QUANTIZED_LOOP
+  }
+}
+
+// Parallel loop body running blocks [begin, end) of the flattened loop nest.
+static void elementwise_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct engine_operator *op = ctx->op;
+  const struct elementwise_state *state = op->state;
+  const struct engine_tensor *inputs[2] = {op_input(ctx->e, op, 0), op_input(ctx->e, op, 1)},
+                             *output = op_output(ctx->e, op, 0);
+  size_t element_size = tensor_type_size(output->type),
+         inner_dim = state->num_dims - 1,
+         inner_size = state->shape[inner_dim],
+         a_step = state->strides[0][inner_dim],
+         b_step = state->strides[1][inner_dim];
+  (void)worker_idx;
+  for(
+      size_t block_idx = begin;
+      block_idx < end;
+      block_idx++
+     )
+  {
+    size_t row = block_idx / state->num_blocks,
+           first = (block_idx % state->num_blocks) * ELEMENTWISE_BLOCK_SIZE,
+           count = inner_size - first < ELEMENTWISE_BLOCK_SIZE ? inner_size - first : ELEMENTWISE_BLOCK_SIZE,
+           a_offset = first * a_step,
+           b_offset = first * b_step,
+           remainder = row;
+    const uint8_t *a, *b;
+    uint8_t *out;
+    // Locate the row in the outer loops.
+    for(
+        size_t dim_idx = inner_dim;
+        dim_idx > 0;
+        dim_idx--
+       )
+    {
+      size_t idx = remainder % state->shape[dim_idx - 1];
+      a_offset += idx * state->strides[0][dim_idx - 1];
+      b_offset += idx * state->strides[1][dim_idx - 1];
+      remainder /= state->shape[dim_idx - 1];
+    }
+    a = inputs[0]->data + a_offset * element_size;
+    b = inputs[1]->data + b_offset * element_size;
+    out = output->data + (row * inner_size + first) * element_size;
+    if(output->type != TT_FLOAT32)
+      quantized_loop(op->builtin_code, state, a, a_step, b, b_step, out, count);
+    else if(a_step == 1 && b_step == 1)
+      float_loop(op->builtin_code, (const float *)a, 1, (const float *)b, 1, (float *)out, count, state->act_min, state->act_max);
+    else if(a_step == 1)
+      float_loop(op->builtin_code, (const float *)a, 1, (const float *)b, 0, (float *)out, count, state->act_min, state->act_max);
+    else
+      float_loop(op->builtin_code, (const float *)a, 0, (const float *)b, 1, (float *)out, count, state->act_min, state->act_max);
+  }
+}
+
+static void invoke_elementwise(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct elementwise_state *state = op->state;
+  struct op_context ctx = {.e = e, .op = op};
+  size_t inner_size = state->shape[state->num_dims - 1];
+  threadpool_parallel_for(
+      e->pool,
+      state->num_rows * state->num_blocks,
+      parallel_grain(inner_size < ELEMENTWISE_BLOCK_SIZE ? inner_size : ELEMENTWISE_BLOCK_SIZE),
+      elementwise_range,
+      &ctx
+      );
+}
+
+const struct kernel elementwise_kernel = {
+  .prepare = prepare_elementwise,
+  .invoke = invoke_elementwise
+};
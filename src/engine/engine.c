@@ -0,0 +1,1003 @@
+// Native engine.
+// Loads a model's main subgraph, prepares its operators, plans the memory of its intermediate tensors and runs it.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../exceptions.h"
+#include "../schemas/tflite/tflite_v3_reader.h"
+#include "engine.h"
+#include "kernels.h"
+#include "pack.h"
+#include "profile.h"
+#include "registry.h"
+
+const struct kernel *find_kernel(
+    enum builtin_operator builtin_code
+    )
+{
+  switch(builtin_code)
+  {
+    case BO_CONV_2D:
+      return &conv_2d_kernel;
+    case BO_DEPTHWISE_CONV_2D:
+      return &depthwise_conv_2d_kernel;
+    case BO_FULLY_CONNECTED:
+      return &fully_connected_kernel;
+    case BO_RESHAPE:
+    case BO_SQUEEZE:
+    case BO_EXPAND_DIMS:
+      return &reshape_kernel;
+    case BO_CONCATENATION:
+      return &concatenation_kernel;
+    case BO_LOGISTIC:
+    case BO_TANH:
+      return &activation_kernel;
+    case BO_SOFTMAX:
+      return &softmax_kernel;
+    case BO_RESIZE_BILINEAR:
+    case BO_RESIZE_NEAREST_NEIGHBOR:
+      return &resize_kernel;
+    case BO_ADD:
+    case BO_SUB:
+    case BO_MUL:
+    case BO_DIV:
+    case BO_MAXIMUM:
+    case BO_MINIMUM:
+    case BO_SQUARED_DIFFERENCE:
+      return &elementwise_kernel;
+    case BO_AVERAGE_POOL_2D:
+    case BO_MAX_POOL_2D:
+      return &pool_2d_kernel;
+    case BO_MEAN:
+    case BO_SUM:
+    case BO_REDUCE_MAX:
+      return &reduce_kernel;
+    default:
+      return NULL;
+  }
+}
+
+static void map_model(
+    struct engine *e,
+    const char *path
+    )
+{
+  struct stat model_stat;
+  int fd;
+  if((fd = open(path, O_RDONLY)) < 0)
+    ERRORF("%s", path);
+  if(fstat(fd, &model_stat) != 0)
+    ERRORF("%s", path);
+  e->model_size = model_stat.st_size;
+  e->model_buf = mmap(NULL, e->model_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(e->model_buf == MAP_FAILED)
+  {
+    e->model_buf = NULL;
+    ERRORF("%s", path);
+  }
+  if(close(fd) != 0)
+    ERRORF("%s", path);
+}
+
+static int32_t *copy_indices(
+    flatbuffers_int32_vec_t in_indices,
+    uint32_t *num_indices
+    )
+{
+  int32_t *indices;
+  *num_indices = flatbuffers_int32_vec_len(in_indices);
+  if((indices = calloc(*num_indices + 1, sizeof(int32_t))) == NULL)
+    ERROR();
+  for(
+      uint32_t idx = 0;
+      idx < *num_indices;
+      idx++
+     )
+  {
+    indices[idx] = flatbuffers_int32_vec_at(in_indices, idx);
+  }
+  return indices;
+}
+
+// Drop the pages of the model mapping lying entirely within the `size` bytes at `data`, now held by the registry.
+static void release_model_pages(
+    const void *data,
+    size_t size
+    )
+{
+  uintptr_t page_size = sysconf(_SC_PAGESIZE),
+            start = ((uintptr_t)data + page_size - 1) / page_size * page_size,
+            end = ((uintptr_t)data + size) / page_size * page_size;
+  if(end > start && madvise((void *)start, end - start, MADV_DONTNEED) != 0)
+    WARNING("Releasing model pages");
+}
+
+static void load_tensors(
+    struct engine *e,
+    tflite_Tensor_vec_t in_tensors,
+    tflite_Buffer_vec_t in_buffers
+    )
+{
+  e->num_tensors = tflite_Tensor_vec_len(in_tensors);
+  if((e->tensors = calloc(e->num_tensors, sizeof(struct engine_tensor))) == NULL)
+    ERROR();
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < e->num_tensors;
+      tensor_idx++
+     )
+  {
+    tflite_Tensor_table_t in_tensor = tflite_Tensor_vec_at(in_tensors, tensor_idx);
+    flatbuffers_int32_vec_t in_shape = tflite_Tensor_shape(in_tensor);
+    tflite_QuantizationParameters_table_t in_quant = tflite_Tensor_quantization(in_tensor);
+    uint32_t buffer_idx = tflite_Tensor_buffer(in_tensor);
+    struct engine_tensor *t = &(e->tensors[tensor_idx]);
+    t->type = tflite_Tensor_type(in_tensor);
+    t->name = tflite_Tensor_name(in_tensor);
+    t->first_op = -1;
+    t->last_op = -1;
+    t->alias_of = -1;
+    t->num_dims = flatbuffers_int32_vec_len(in_shape);
+    if(t->num_dims > ENGINE_MAX_DIMS)
+    {
+      errno = ENOTSUP;
+      ERRORF("Tensor '%s' has %d dimensions", t->name, t->num_dims);
+    }
+    for(
+        uint8_t dim_idx = 0;
+        dim_idx < t->num_dims;
+        dim_idx++
+       )
+    {
+      t->shape[dim_idx] = flatbuffers_int32_vec_at(in_shape, dim_idx);
+    }
+    t->size = tensor_num_elements(t) * tensor_type_size(t->type);
+    if(in_quant != NULL)
+    {
+      flatbuffers_float_vec_t scales = tflite_QuantizationParameters_scale(in_quant);
+      flatbuffers_int64_vec_t zero_points = tflite_QuantizationParameters_zero_point(in_quant);
+      if(flatbuffers_float_vec_len(scales) > 0)
+        t->scale = flatbuffers_float_vec_at(scales, 0);
+      if(flatbuffers_int64_vec_len(zero_points) > 0)
+        t->zero_point = (int32_t)flatbuffers_int64_vec_at(zero_points, 0);
+      if(flatbuffers_float_vec_len(scales) > 1)
+      {
+        t->channel_scales = scales;
+        t->num_channel_scales = flatbuffers_float_vec_len(scales);
+      }
+    }
+    if(buffer_idx != 0 && buffer_idx < tflite_Buffer_vec_len(in_buffers))
+    {
+      flatbuffers_uint8_vec_t data = tflite_Buffer_data(tflite_Buffer_vec_at(in_buffers, buffer_idx));
+      if(flatbuffers_uint8_vec_len(data) > 0)
+      {
+        if(flatbuffers_uint8_vec_len(data) != t->size)
+        {
+          errno = EINVAL;
+          ERRORF("Tensor '%s' has %zu bytes of data, expected %zu", t->name, flatbuffers_uint8_vec_len(data), t->size);
+        }
+        t->data = (uint8_t *)data;
+        t->is_constant = true;
+        if(e->options.registry != NULL)
+        {
+          t->data = (uint8_t *)registry_share(e->options.registry, data, t->size);
+          release_model_pages(data, t->size);
+        }
+      }
+    }
+  }
+}
+
+static void load_builtin_options(
+    struct engine_operator *op,
+    tflite_Operator_table_t in_operator
+    )
+{
+  flatbuffers_generic_t in_options = tflite_Operator_builtin_options(in_operator);
+  union builtin_options *options = &(op->builtin_options);
+  if(op->builtin_code == BO_CONV_2D)
+  {
+    options->conv2d_options.stride_w = 1;
+    options->conv2d_options.stride_h = 1;
+    options->conv2d_options.dilation_w_factor = 1;
+    options->conv2d_options.dilation_h_factor = 1;
+    if(in_options != NULL)
+    {
+      options->conv2d_options.padding = tflite_Conv2DOptions_padding(in_options);
+      options->conv2d_options.stride_w = tflite_Conv2DOptions_stride_w(in_options);
+      options->conv2d_options.stride_h = tflite_Conv2DOptions_stride_h(in_options);
+      options->conv2d_options.fused_activation_function = tflite_Conv2DOptions_fused_activation_function(in_options);
+      options->conv2d_options.dilation_w_factor = tflite_Conv2DOptions_dilation_w_factor(in_options);
+      options->conv2d_options.dilation_h_factor = tflite_Conv2DOptions_dilation_h_factor(in_options);
+    }
+  }
+  else if(op->builtin_code == BO_DEPTHWISE_CONV_2D)
+  {
+    options->depthwise_conv2d_options.stride_w = 1;
+    options->depthwise_conv2d_options.stride_h = 1;
+    options->depthwise_conv2d_options.depth_multiplier = 1;
+    options->depthwise_conv2d_options.dilation_w_factor = 1;
+    options->depthwise_conv2d_options.dilation_h_factor = 1;
+    if(in_options != NULL)
+    {
+      options->depthwise_conv2d_options.padding = tflite_DepthwiseConv2DOptions_padding(in_options);
+      options->depthwise_conv2d_options.stride_w = tflite_DepthwiseConv2DOptions_stride_w(in_options);
+      options->depthwise_conv2d_options.stride_h = tflite_DepthwiseConv2DOptions_stride_h(in_options);
+      options->depthwise_conv2d_options.depth_multiplier = tflite_DepthwiseConv2DOptions_depth_multiplier(in_options);
+      options->depthwise_conv2d_options.fused_activation_function =
+        tflite_DepthwiseConv2DOptions_fused_activation_function(in_options);
+      options->depthwise_conv2d_options.dilation_w_factor = tflite_DepthwiseConv2DOptions_dilation_w_factor(in_options);
+      options->depthwise_conv2d_options.dilation_h_factor = tflite_DepthwiseConv2DOptions_dilation_h_factor(in_options);
+    }
+  }
+  else if(op->builtin_code == BO_FULLY_CONNECTED)
+  {
+    if(in_options != NULL)
+    {
+      options->fully_connected_options.fused_activation_function =
+        tflite_FullyConnectedOptions_fused_activation_function(in_options);
+      options->fully_connected_options.keep_num_dims = tflite_FullyConnectedOptions_keep_num_dims(in_options);
+      if(tflite_FullyConnectedOptions_weights_format(in_options) != tflite_FullyConnectedOptionsWeightsFormat_DEFAULT)
+      {
+        errno = ENOTSUP;
+        ERROR("Shuffled fully connected weights");
+      }
+    }
+  }
+  else if(op->builtin_code == BO_CONCATENATION)
+  {
+    if(in_options != NULL)
+    {
+      options->concatenation_options.axis = tflite_ConcatenationOptions_axis(in_options);
+      options->concatenation_options.fused_activation_function =
+        tflite_ConcatenationOptions_fused_activation_function(in_options);
+    }
+  }
+  else if(op->builtin_code == BO_AVERAGE_POOL_2D || op->builtin_code == BO_MAX_POOL_2D)
+  {
+    options->pool2d_options.stride_w = 1;
+    options->pool2d_options.stride_h = 1;
+    options->pool2d_options.filter_width = 1;
+    options->pool2d_options.filter_height = 1;
+    if(in_options != NULL)
+    {
+      options->pool2d_options.padding = tflite_Pool2DOptions_padding(in_options);
+      options->pool2d_options.stride_w = tflite_Pool2DOptions_stride_w(in_options);
+      options->pool2d_options.stride_h = tflite_Pool2DOptions_stride_h(in_options);
+      options->pool2d_options.filter_width = tflite_Pool2DOptions_filter_width(in_options);
+      options->pool2d_options.filter_height = tflite_Pool2DOptions_filter_height(in_options);
+      options->pool2d_options.fused_activation_function = tflite_Pool2DOptions_fused_activation_function(in_options);
+    }
+  }
+  else if(op->builtin_code == BO_RESIZE_BILINEAR)
+  {
+    if(in_options != NULL)
+      options->resize_bilinear_options.align_corners = tflite_ResizeBilinearOptions_align_corners(in_options);
+  }
+  else if(op->builtin_code == BO_RESIZE_NEAREST_NEIGHBOR)
+  {
+    if(in_options != NULL)
+      options->resize_nearest_neighbor_options.align_corners =
+        tflite_ResizeNearestNeighborOptions_align_corners(in_options);
+  }
+  else if(op->builtin_code == BO_SOFTMAX)
+  {
+    options->softmax_options.beta = 1.0f;
+    if(in_options != NULL)
+      options->softmax_options.beta = tflite_SoftmaxOptions_beta(in_options);
+  }
+  else if(op->builtin_code == BO_MEAN || op->builtin_code == BO_SUM || op->builtin_code == BO_REDUCE_MAX)
+  {
+    if(in_options != NULL)
+      options->reducer_options.keep_dims = tflite_ReducerOptions_keep_dims(in_options);
+  }
+  else if(op->builtin_code == BO_ADD)
+  {
+    if(in_options != NULL)
+      options->add_options.fused_activation_function = tflite_AddOptions_fused_activation_function(in_options);
+  }
+  else if(op->builtin_code == BO_SUB)
+  {
+    if(in_options != NULL)
+      options->sub_options.fused_activation_function = tflite_SubOptions_fused_activation_function(in_options);
+  }
+  else if(op->builtin_code == BO_MUL)
+  {
+    if(in_options != NULL)
+      options->mul_options.fused_activation_function = tflite_MulOptions_fused_activation_function(in_options);
+  }
+  else if(op->builtin_code == BO_DIV)
+  {
+    if(in_options != NULL)
+      options->div_options.fused_activation_function = tflite_DivOptions_fused_activation_function(in_options);
+  }
+}
+
+static void load_operators(
+    struct engine *e,
+    tflite_Operator_vec_t in_operators,
+    tflite_OperatorCode_vec_t in_opcodes
+    )
+{
+  e->num_operators = tflite_Operator_vec_len(in_operators);
+  if((e->operators = calloc(e->num_operators, sizeof(struct engine_operator))) == NULL)
+    ERROR();
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    tflite_Operator_table_t in_operator = tflite_Operator_vec_at(in_operators, op_idx);
+    uint32_t opcode_idx = tflite_Operator_opcode_index(in_operator);
+    tflite_BuiltinOperator_enum_t builtin_code;
+    struct engine_operator *op = &(e->operators[op_idx]);
+    uint32_t num_indices;
+    builtin_code = tflite_OperatorCode_builtin_code(tflite_OperatorCode_vec_at(in_opcodes, opcode_idx));
+    op->builtin_code = builtin_code;
+    op->name = tflite_BuiltinOperator_name(builtin_code);
+    op->inputs = copy_indices(tflite_Operator_inputs(in_operator), &num_indices);
+    op->num_inputs = num_indices;
+    op->outputs = copy_indices(tflite_Operator_outputs(in_operator), &num_indices);
+    op->num_outputs = num_indices;
+    op->inplace_input = -1;
+    op->view_input = -1;
+    if((op->kernel = find_kernel(op->builtin_code)) == NULL)
+    {
+      errno = ENOTSUP;
+      ERRORF("Operator %u (%s)", op_idx, tflite_BuiltinOperator_name(builtin_code));
+    }
+    load_builtin_options(op, in_operator);
+  }
+}
+
+static void load_model(
+    struct engine *e
+    )
+{
+  tflite_Model_table_t in_model = tflite_Model_as_root(e->model_buf);
+  tflite_SubGraph_vec_t in_subgraphs;
+  tflite_SubGraph_table_t in_subgraph;
+  if(in_model == NULL || (in_subgraphs = tflite_Model_subgraphs(in_model)) == NULL ||
+      tflite_SubGraph_vec_len(in_subgraphs) == 0)
+  {
+    errno = EINVAL;
+    ERROR("Not a TF Lite model");
+  }
+  in_subgraph = tflite_SubGraph_vec_at(in_subgraphs, 0);
+  load_tensors(e, tflite_SubGraph_tensors(in_subgraph), tflite_Model_buffers(in_model));
+  load_operators(e, tflite_SubGraph_operators(in_subgraph), tflite_Model_operator_codes(in_model));
+  e->inputs = copy_indices(tflite_SubGraph_inputs(in_subgraph), &(e->num_inputs));
+  e->outputs = copy_indices(tflite_SubGraph_outputs(in_subgraph), &(e->num_outputs));
+}
+
+static void prepare_operators(
+    struct engine *e
+    )
+{
+  e->scratch_size = 0;
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    struct engine_operator *op = &(e->operators[op_idx]);
+    op->kernel->prepare(e, op);
+    if(op->scratch_size > e->scratch_size)
+      e->scratch_size = align_size(op->scratch_size);
+  }
+  if(
+      e->scratch_size > 0 &&
+      (e->scratch = aligned_alloc(ENGINE_ALIGNMENT, e->scratch_size * threadpool_num_threads(e->pool))) == NULL
+    )
+    ERROR();
+}
+
+// Compute the range of operators during which each non-constant tensor must stay in memory.
+static void compute_lifetimes(
+    struct engine *e
+    )
+{
+  for(
+      uint32_t input_idx = 0;
+      input_idx < e->num_inputs;
+      input_idx++
+     )
+  {
+    e->tensors[e->inputs[input_idx]].first_op = -1;
+    e->tensors[e->inputs[input_idx]].last_op = 0;
+  }
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    const struct engine_operator *op = &(e->operators[op_idx]);
+    for(
+        uint16_t input_idx = 0;
+        input_idx < op->num_inputs;
+        input_idx++
+       )
+    {
+      if(op->inputs[input_idx] >= 0)
+        e->tensors[op->inputs[input_idx]].last_op = op_idx;
+    }
+    for(
+        uint16_t output_idx = 0;
+        output_idx < op->num_outputs;
+        output_idx++
+       )
+    {
+      struct engine_tensor *t = &(e->tensors[op->outputs[output_idx]]);
+      t->first_op = op_idx;
+      if(t->last_op < (int32_t)op_idx)
+        t->last_op = op_idx;
+    }
+  }
+  for(
+      uint32_t output_idx = 0;
+      output_idx < e->num_outputs;
+      output_idx++
+     )
+  {
+    e->tensors[e->outputs[output_idx]].last_op = e->num_operators;
+  }
+}
+
+static bool is_planned(
+    const struct engine_tensor *t
+    )
+{
+  return !t->is_constant && t->last_op >= 0 && t->size > 0;
+}
+
+// Tensor whose arena memory `t` shares, following chains of aliases.
+static struct engine_tensor *alias_root(
+    struct engine *e,
+    struct engine_tensor *t
+    )
+{
+  while(t->alias_of >= 0)
+    t = &(e->tensors[t->alias_of]);
+  return t;
+}
+
+// Offset of `t` into the memory of its alias root.
+static size_t alias_root_offset(
+    const struct engine *e,
+    const struct engine_tensor *t
+    )
+{
+  size_t offset = 0;
+  for(
+      ;
+      t->alias_of >= 0;
+      t = &(e->tensors[t->alias_of])
+     )
+  {
+    offset += t->alias_offset;
+  }
+  return offset;
+}
+
+// Let `t` share the memory of `root` from `offset` on, and extend the lifetime of `root` to cover that of `t`.
+static void alias_tensor(
+    struct engine *e,
+    struct engine_tensor *t,
+    struct engine_tensor *root,
+    size_t offset
+    )
+{
+  t->alias_of = root - e->tensors;
+  t->alias_offset = offset;
+  if(t->last_op > root->last_op)
+    root->last_op = t->last_op;
+}
+
+// Place the inputs of a concatenation into consecutive slices of its output, so that their producers write them in
+// place. An input qualifies if the concatenation is its last reader and the memory it shares with other tensors holds
+// nothing else.
+static void slice_output(
+    struct engine *e,
+    uint32_t op_idx
+    )
+{
+  const struct engine_operator *op = &(e->operators[op_idx]);
+  struct engine_tensor *output = op_output(e, op, 0);
+  size_t offset = 0;
+  if(!is_planned(output))
+    return;
+  for(
+      uint16_t input_idx = 0;
+      input_idx < op->num_inputs;
+      input_idx++
+     )
+  {
+    struct engine_tensor *input = op_input(e, op, input_idx),
+                         *root = alias_root(e, input);
+    if(
+        is_planned(root) && root != alias_root(e, output) && root->first_op >= 0 &&
+        root->last_op == (int32_t)op_idx && root->size == input->size
+      )
+      alias_tensor(e, root, output, offset);
+    offset += input->size;
+  }
+}
+
+// Let operators write their output over the input they offer to run in place, provided no later operator reads that
+// input and the caller does not own it. Let operators leaving their input unchanged share its memory with their output,
+// and let concatenations take the memory of their inputs over. Tensors sharing memory form a tree whose root is the
+// only one placed into the arena, over the union of their lifetimes.
+static void alias_tensors(
+    struct engine *e
+    )
+{
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    struct engine_operator *op = &(e->operators[op_idx]);
+    struct engine_tensor *input, *root, *output = op_output(e, op, 0);
+    if(op->is_slicing_output)
+      slice_output(e, op_idx);
+    if(op->inplace_input >= 0 && (input = op_input(e, op, op->inplace_input)) != NULL)
+    {
+      root = alias_root(e, input);
+      if(
+          is_planned(root) && is_planned(output) && output->alias_of < 0 &&
+          root->first_op >= 0 && root->last_op == (int32_t)op_idx && output->size <= input->size
+        )
+        alias_tensor(e, output, root, alias_root_offset(e, input));
+      else
+        op->inplace_input = -1;
+    }
+    if(op->view_input >= 0 && (input = op_input(e, op, op->view_input)) != NULL)
+    {
+      root = alias_root(e, input);
+      if(is_planned(root) && is_planned(output) && output->alias_of < 0 && output->size <= input->size)
+        alias_tensor(e, output, root, alias_root_offset(e, input));
+      else
+        op->view_input = -1;
+    }
+  }
+}
+
+struct planned_tensor
+{
+  size_t size;
+  uint32_t tensor_idx;
+  int32_t first_op;             // lifetime of the tensor and of all tensors sharing its memory
+  int32_t last_op;
+};
+
+static int compare_planned_tensors(
+    const void *a,
+    const void *b
+    )
+{
+  const struct planned_tensor *planned_a = a,
+                              *planned_b = b;
+  if(planned_a->size != planned_b->size)
+    return planned_a->size > planned_b->size ? -1 : 1;
+  return planned_a->tensor_idx < planned_b->tensor_idx ? -1 : 1;
+}
+
+// Assign arena offsets greedily, largest tensors first. A tensor may reuse the memory of any tensor whose lifetime
+// does not overlap its own.
+static void plan_arena(
+    struct engine *e
+    )
+{
+  struct planned_tensor *order;
+  uint32_t *order_idxs, num_planned = 0;
+  compute_lifetimes(e);
+  alias_tensors(e);
+  if(
+      (order = malloc(e->num_tensors * sizeof(struct planned_tensor))) == NULL ||
+      (order_idxs = malloc(e->num_tensors * sizeof(uint32_t))) == NULL
+    )
+    ERROR();
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < e->num_tensors;
+      tensor_idx++
+     )
+  {
+    const struct engine_tensor *t = &(e->tensors[tensor_idx]);
+    if(is_planned(t) && t->alias_of < 0)
+    {
+      order[num_planned].size = t->size;
+      order[num_planned].tensor_idx = tensor_idx;
+      order[num_planned].first_op = t->first_op;
+      order[num_planned].last_op = t->last_op;
+      order_idxs[tensor_idx] = num_planned++;
+    }
+  }
+  // Tensors sharing the memory of a root may be produced before it.
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < e->num_tensors;
+      tensor_idx++
+     )
+  {
+    struct engine_tensor *t = &(e->tensors[tensor_idx]);
+    struct planned_tensor *planned;
+    if(!is_planned(t) || t->alias_of < 0)
+      continue;
+    planned = &(order[order_idxs[alias_root(e, t) - e->tensors]]);
+    if(t->first_op < planned->first_op)
+      planned->first_op = t->first_op;
+  }
+  free(order_idxs);
+  qsort(order, num_planned, sizeof(struct planned_tensor), compare_planned_tensors);
+  e->arena_size = 0;
+  for(
+      uint32_t order_idx = 0;
+      order_idx < num_planned;
+      order_idx++
+     )
+  {
+    const struct planned_tensor *planned = &(order[order_idx]);
+    struct engine_tensor *t = &(e->tensors[planned->tensor_idx]);
+    size_t offset = 0, size = align_size(t->size);
+    bool moved = true;
+    // Slide past every conflicting tensor until a gap fits. Placed tensors are few, so quadratic time is fine.
+    while(moved)
+    {
+      moved = false;
+      for(
+          uint32_t placed_idx = 0;
+          placed_idx < order_idx;
+          placed_idx++
+         )
+      {
+        const struct engine_tensor *placed = &(e->tensors[order[placed_idx].tensor_idx]);
+        if(
+            order[placed_idx].first_op <= planned->last_op &&
+            planned->first_op <= order[placed_idx].last_op &&
+            placed->arena_offset < offset + size &&
+            offset < placed->arena_offset + align_size(placed->size)
+          )
+        {
+          offset = placed->arena_offset + align_size(placed->size);
+          moved = true;
+        }
+      }
+    }
+    t->arena_offset = offset;
+    if(offset + size > e->arena_size)
+      e->arena_size = offset + size;
+  }
+  free(order);
+  if(e->arena_size > 0)
+  {
+    if((e->arena = aligned_alloc(ENGINE_ALIGNMENT, e->arena_size)) == NULL)
+      ERROR();
+    memset(e->arena, 0, e->arena_size);
+  }
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < e->num_tensors;
+      tensor_idx++
+     )
+  {
+    struct engine_tensor *t = &(e->tensors[tensor_idx]);
+    if(!is_planned(t))
+      continue;
+    t->arena_offset = alias_root(e, t)->arena_offset + alias_root_offset(e, t);
+    t->data = e->arena + t->arena_offset;
+  }
+#ifdef DEBUG_ENGINE_C
+  printf("Planned %zu bytes of arena for %u tensors.\n", e->arena_size, num_planned);
+#endif //ifdef DEBUG_ENGINE_C
+}
+
+// Append `op_idx` to the predecessors being collected, once.
+static void add_predecessor(
+    int32_t op_idx,
+    bool *is_predecessor,
+    uint32_t **predecessors,
+    uint32_t *num_predecessors,
+    uint32_t *capacity
+    )
+{
+  if(op_idx < 0 || is_predecessor[op_idx])
+    return;
+  is_predecessor[op_idx] = true;
+  if(*num_predecessors == *capacity)
+  {
+    *capacity = 2 * *capacity + 16;
+    if((*predecessors = realloc(*predecessors, *capacity * sizeof(uint32_t))) == NULL)
+      ERROR();
+  }
+  (*predecessors)[(*num_predecessors)++] = op_idx;
+}
+
+// Add every operator producing or reading tensor `tensor_idx` as a predecessor.
+static void add_tensor_users(
+    const struct engine *e,
+    int32_t tensor_idx,
+    bool *is_predecessor,
+    uint32_t **predecessors,
+    uint32_t *num_predecessors,
+    uint32_t *capacity
+    )
+{
+  const struct engine_tensor *t = &(e->tensors[tensor_idx]);
+  int32_t first_op = t->first_op < 0 ? 0 : t->first_op,
+          last_op = t->last_op < (int32_t)e->num_operators ? t->last_op : (int32_t)e->num_operators - 1;
+  add_predecessor(t->first_op, is_predecessor, predecessors, num_predecessors, capacity);
+  for(
+      int32_t op_idx = first_op;
+      op_idx <= last_op;
+      op_idx++
+     )
+  {
+    const struct engine_operator *op = &(e->operators[op_idx]);
+    for(
+        uint16_t input_idx = 0;
+        input_idx < op->num_inputs;
+        input_idx++
+       )
+    {
+      if(op->inputs[input_idx] == tensor_idx)
+        add_predecessor(op_idx, is_predecessor, predecessors, num_predecessors, capacity);
+    }
+  }
+}
+
+// Build the dependency graph of the operators so that independent operators can run concurrently. Besides reading
+// the outputs of its producers, an operator writing a tensor must wait for the producer and all readers of every
+// earlier tensor sharing its arena memory. The graph is only kept if some operators may actually run concurrently.
+static void build_graph(
+    struct engine *e
+    )
+{
+  uint32_t *predecessor_offsets, *predecessors = NULL, *levels, *level_widths,
+           num_predecessors = 0, capacity = 0, max_width = 0;
+  bool *is_predecessor;
+  if(e->pool == NULL || e->options.is_sequential || e->num_operators < 2)
+    return;
+  if(
+      (predecessor_offsets = calloc(e->num_operators + 1, sizeof(uint32_t))) == NULL ||
+      (is_predecessor = calloc(e->num_operators, sizeof(bool))) == NULL ||
+      (levels = calloc(e->num_operators, sizeof(uint32_t))) == NULL ||
+      (level_widths = calloc(e->num_operators, sizeof(uint32_t))) == NULL
+    )
+    ERROR();
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    const struct engine_operator *op = &(e->operators[op_idx]);
+    struct engine_tensor *output = op_output(e, op, 0);
+    predecessor_offsets[op_idx] = num_predecessors;
+    is_predecessor[op_idx] = true; // never its own predecessor
+    // An operator writing over its input must also wait for the other readers of every earlier tensor sharing the
+    // memory it writes, including the input itself.
+    for(
+        uint32_t tensor_idx = 0;
+        op->inplace_input >= 0 && tensor_idx < e->num_tensors;
+        tensor_idx++
+       )
+    {
+      struct engine_tensor *u = &(e->tensors[tensor_idx]);
+      if(
+          u != output && is_planned(u) && u->first_op < (int32_t)op_idx &&
+          alias_root(e, u) == alias_root(e, output) &&
+          u->arena_offset < output->arena_offset + output->size &&
+          output->arena_offset < u->arena_offset + u->size
+        )
+        add_tensor_users(e, tensor_idx, is_predecessor, &predecessors, &num_predecessors, &capacity);
+    }
+    for(
+        uint16_t input_idx = 0;
+        input_idx < op->num_inputs;
+        input_idx++
+       )
+    {
+      if(op->inputs[input_idx] >= 0)
+        add_predecessor(
+            e->tensors[op->inputs[input_idx]].first_op,
+            is_predecessor,
+            &predecessors,
+            &num_predecessors,
+            &capacity
+            );
+    }
+    for(
+        uint16_t output_idx = 0;
+        output_idx < op->num_outputs;
+        output_idx++
+       )
+    {
+      const struct engine_tensor *t = &(e->tensors[op->outputs[output_idx]]);
+      if(!is_planned(t))
+        continue;
+      for(
+          uint32_t tensor_idx = 0;
+          tensor_idx < e->num_tensors;
+          tensor_idx++
+         )
+      {
+        const struct engine_tensor *u = &(e->tensors[tensor_idx]);
+        if(
+            u != t && is_planned(u) && u->last_op < t->first_op &&
+            u->arena_offset < t->arena_offset + align_size(t->size) &&
+            t->arena_offset < u->arena_offset + align_size(u->size)
+          )
+          add_tensor_users(e, tensor_idx, is_predecessor, &predecessors, &num_predecessors, &capacity);
+      }
+    }
+    // Reset the flags and rank the operator one level below its deepest predecessor.
+    is_predecessor[op_idx] = false;
+    for(
+        uint32_t pred_pos = predecessor_offsets[op_idx];
+        pred_pos < num_predecessors;
+        pred_pos++
+       )
+    {
+      is_predecessor[predecessors[pred_pos]] = false;
+      if(levels[predecessors[pred_pos]] + 1 > levels[op_idx])
+        levels[op_idx] = levels[predecessors[pred_pos]] + 1;
+    }
+    if(++level_widths[levels[op_idx]] > max_width)
+      max_width = level_widths[levels[op_idx]];
+  }
+  predecessor_offsets[e->num_operators] = num_predecessors;
+  if(max_width > 1)
+    e->graph = threadpool_graph_create(e->num_operators, predecessor_offsets, predecessors);
+#ifdef DEBUG_ENGINE_C
+  printf("Built graph of %u operators with %u edges, up to %u concurrent.\n", e->num_operators, num_predecessors, max_width);
+#endif //ifdef DEBUG_ENGINE_C
+  free(predecessor_offsets);
+  free(predecessors);
+  free(is_predecessor);
+  free(levels);
+  free(level_widths);
+}
+
+// Parallel loop body running operators [begin, end).
+static void invoke_operators(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct engine *e = context;
+  for(
+      size_t op_idx = begin;
+      op_idx < end;
+      op_idx++
+     )
+  {
+    struct engine_operator *op = &(e->operators[op_idx]);
+    if(e->profiler == NULL)
+      op->kernel->invoke(e, op);
+    else
+      profile_invoke(e, op_idx, worker_idx);
+  }
+}
+
+struct engine *engine_open(
+    const char *path,
+    const struct engine_options *options
+    )
+{
+  struct engine *e;
+  if((e = calloc(1, sizeof(struct engine))) == NULL)
+    ERROR();
+  if(options != NULL)
+    e->options = *options;
+  map_model(e, path);
+  load_model(e);
+  if((e->pool = e->options.pool) == NULL)
+  {
+    e->pool = threadpool_create(&(e->options.threads));
+    e->owns_pool = true;
+  }
+  prepare_operators(e);
+  pack_weights(e);
+  plan_arena(e);
+  build_graph(e);
+  if(e->options.is_profiling)
+    e->profiler = profiler_create(e, e->options.max_profile_events);
+  return e;
+}
+
+void engine_invoke(
+    struct engine *e
+    )
+{
+  if(e->graph != NULL)
+    threadpool_run_graph(e->pool, e->graph, invoke_operators, e);
+  else
+    invoke_operators(e, 0, e->num_operators, threadpool_num_threads(e->pool) - 1);
+}
+
+uint32_t engine_num_inputs(
+    const struct engine *e
+    )
+{
+  return e->num_inputs;
+}
+
+uint32_t engine_num_outputs(
+    const struct engine *e
+    )
+{
+  return e->num_outputs;
+}
+
+struct engine_tensor *engine_input_tensor(
+    struct engine *e,
+    uint32_t input_idx
+    )
+{
+  return engine_input(e, input_idx);
+}
+
+struct engine_tensor *engine_output_tensor(
+    struct engine *e,
+    uint32_t output_idx
+    )
+{
+  return engine_output(e, output_idx);
+}
+
+void engine_close(
+    struct engine *e
+    )
+{
+  if(e == NULL)
+    return;
+  unpack_weights(e);
+  for(
+      uint32_t op_idx = 0;
+      e->operators != NULL && op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    struct engine_operator *op = &(e->operators[op_idx]);
+    free(op->inputs);
+    free(op->outputs);
+    free(op->state);
+  }
+  for(
+      uint32_t tensor_idx = 0;
+      e->options.registry != NULL && e->tensors != NULL && tensor_idx < e->num_tensors;
+      tensor_idx++
+     )
+  {
+    if(e->tensors[tensor_idx].is_constant)
+      registry_release(e->options.registry, e->tensors[tensor_idx].data);
+  }
+  free(e->operators);
+  free(e->tensors);
+  free(e->inputs);
+  free(e->outputs);
+  free(e->arena);
+  free(e->scratch);
+  threadpool_graph_destroy(e->graph);
+  profiler_destroy(e->profiler);
+  if(e->owns_pool)
+    threadpool_destroy(e->pool);
+  if(e->model_buf != NULL)
+    munmap(e->model_buf, e->model_size);
+  free(e);
+#ifdef DEBUG_ENGINE_C
+  printf("Released engine's resources.\n");
+#endif //ifdef DEBUG_ENGINE_C
+}
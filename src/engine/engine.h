@@ -0,0 +1,171 @@
+// Native engine.
+// Executes the main subgraph of a TF Lite model on the host CPU. Refer to `../schemas/tflite/tflite_v3.fbs` for more
+// details on the model format.
+#ifndef MLTOOLS_ENGINE_H
+#define MLTOOLS_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../cost.h"
+#include "../model.h"
+#include "threadpool.h"
+
+#define ENGINE_MAX_DIMS 6
+#define ENGINE_ALIGNMENT 64 // byte alignment of arena tensors, scratch and pre-packed weights
+
+struct kernel;
+struct profiler;
+struct registry;
+
+struct engine_tensor
+{
+  enum tensor_type type;
+  uint8_t num_dims;
+  int32_t shape[ENGINE_MAX_DIMS];
+  size_t size;                  // size of `data` in bytes
+  uint8_t *data;                // constant buffer (inside the model or the registry) or a slice of the arena
+  bool is_constant;             // tensor's data is stored in the model's buffers
+  float scale;                  // quantization scale (0 if not quantized)
+  int32_t zero_point;           // quantization zero point
+  const float *channel_scales;  // per-channel quantization scales (NULL if quantized per-tensor)
+  uint32_t num_channel_scales;
+  const char *name;
+  int32_t first_op;             // index of the operator producing this tensor (-1 if fed by the caller)
+  int32_t last_op;              // index of the last operator reading this tensor
+  size_t arena_offset;          // offset of `data` into the arena
+  int32_t alias_of;             // index of the tensor whose arena memory this tensor takes over or shares (-1 if none)
+  size_t alias_offset;          // offset of `data` into the memory of tensor `alias_of`
+};
+
+struct engine_operator
+{
+  enum builtin_operator builtin_code;
+  const char *name;             // name of the builtin operator
+  int32_t *inputs;              // tensor indices (-1 for omitted optional inputs)
+  uint16_t num_inputs;
+  int32_t *outputs;             // tensor indices
+  uint16_t num_outputs;
+  union builtin_options builtin_options;
+  const struct kernel *kernel;
+  void *state;                  // kernel-specific state allocated by the kernel's `prepare()`
+  size_t scratch_size;          // scratch bytes needed by `invoke()`, set by `prepare()`
+  size_t packed_size;           // bytes of pre-packed weights needed by `invoke()`, set by `prepare()`
+  int16_t inplace_input;        // input whose memory output 0 may take over if no later operator reads it, set by
+                                // `prepare()` and reset by the planner if declined (-1 if none)
+  int16_t view_input;           // input whose memory output 0 may share because the operator leaves both unchanged,
+                                // set by `prepare()` and reset by the planner if declined (-1 if none)
+  bool is_slicing_output;       // inputs may be produced directly into consecutive slices of output 0, set by
+                                // `prepare()`
+  void *packed;                 // pre-packed weights (in the engine's pack arena, possibly mapped, or the registry)
+};
+
+struct engine_options
+{
+  const char *prepack_cache_path; // sidecar file caching pre-packed weights (NULL disables caching)
+  struct registry *registry;      // store of constant buffers and pre-packed weights shared with other engines (NULL keeps
+                                  // them private, see `registry.h`)
+  struct threadpool *pool;        // pool shared with other engines (NULL starts a pool configured by `threads`)
+  struct threadpool_options threads;
+  bool is_sequential;             // run one operator at a time (each may still use the pool)
+  bool is_profiling;              // record every operator invocation (see `profile.h`)
+  size_t max_profile_events;      // invocations kept for tracing (0 selects a default)
+};
+
+struct engine
+{
+  struct engine_options options;
+  uint8_t *model_buf;           // memory-mapped model file
+  size_t model_size;
+  struct engine_tensor *tensors;
+  uint32_t num_tensors;
+  struct engine_operator *operators;
+  uint32_t num_operators;
+  int32_t *inputs;              // indices of the tensors fed by the caller
+  uint32_t num_inputs;
+  int32_t *outputs;             // indices of the tensors returned to the caller
+  uint32_t num_outputs;
+  uint8_t *arena;               // storage of all non-constant tensors
+  size_t arena_size;
+  struct threadpool *pool;      // pool running the kernels (NULL runs them on the calling thread)
+  bool owns_pool;
+  struct threadpool_graph *graph; // operator dependencies (NULL runs operators in model order)
+  struct profiler *profiler;    // NULL unless profiling
+  uint8_t *scratch;             // working memory shared by all kernels, one slice per thread of `pool`
+  size_t scratch_size;          // size of each slice
+  uint8_t *pack_arena;          // pre-packed weights of all operators
+  size_t pack_arena_size;
+  void *pack_cache_map;         // memory-mapped pre-packed weights cache (backs `pack_arena` if not NULL, mapped
+                                // through the registry if there is one)
+  size_t pack_cache_map_size;
+};
+
+// Load the model stored at `path` and prepare it for inference. `options` may be NULL.
+struct engine *engine_open(
+    const char *path,
+    const struct engine_options *options
+    );
+
+// Run the model once over the data currently stored in the input tensors.
+void engine_invoke(
+    struct engine *e
+    );
+
+// Release all resources held by `e`.
+void engine_close(
+    struct engine *e
+    );
+
+static inline struct engine_tensor *engine_input(
+    struct engine *e,
+    uint32_t input_idx
+    )
+{
+  return &(e->tensors[e->inputs[input_idx]]);
+}
+
+static inline struct engine_tensor *engine_output(
+    struct engine *e,
+    uint32_t output_idx
+    )
+{
+  return &(e->tensors[e->outputs[output_idx]]);
+}
+
+// Non-inline counterparts of the accessors above, for foreign function interfaces (see `python/native_engine.py`).
+uint32_t engine_num_inputs(
+    const struct engine *e
+    );
+
+uint32_t engine_num_outputs(
+    const struct engine *e
+    );
+
+struct engine_tensor *engine_input_tensor(
+    struct engine *e,
+    uint32_t input_idx
+    );
+
+struct engine_tensor *engine_output_tensor(
+    struct engine *e,
+    uint32_t output_idx
+    );
+
+static inline size_t tensor_num_elements(
+    const struct engine_tensor *t
+    )
+{
+  size_t num_elements = 1;
+  for(
+      uint8_t dim_idx = 0;
+      dim_idx < t->num_dims;
+      dim_idx++
+     )
+  {
+    num_elements *= t->shape[dim_idx];
+  }
+  return num_elements;
+}
+
+#endif //ifndef MLTOOLS_ENGINE_H
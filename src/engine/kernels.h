@@ -0,0 +1,118 @@
+// Operator kernels.
+// A kernel implements one builtin operator. `prepare()` runs once when the model is opened: it validates the operator,
+// allocates `op->state`, requests scratch memory and pre-packed weights and may offer an input whose memory the output
+// can take over (`op->inplace_input`) or share (`op->view_input`), or accept inputs already laid out in its output
+// (`op->is_slicing_output`), in which case copies whose source and destination coincide must be skipped. `pack()`
+// fills the pre-packed weights (skipped when they are read back from the cache). `invoke()` runs the operator once;
+// heavy kernels split their work with `threadpool_parallel_for()` over the engine's pool and take their scratch memory
+// from the slice of the thread running each chunk.
+#ifndef MLTOOLS_ENGINE_KERNELS_H
+#define MLTOOLS_ENGINE_KERNELS_H
+
+#include "engine.h"
+#include "threadpool.h"
+
+#define KERNEL_PARALLEL_COST 32768 // minimum work of a parallel chunk, in multiply-accumulates or equivalent
+
+// Context of the parallel loops of a kernel.
+struct op_context
+{
+  struct engine *e;
+  struct engine_operator *op;
+};
+
+struct kernel
+{
+  void (*prepare)(struct engine *e, struct engine_operator *op);
+  void (*pack)(struct engine *e, struct engine_operator *op, void *packed); // optional
+  void (*invoke)(struct engine *e, struct engine_operator *op);
+};
+
+extern const struct kernel conv_2d_kernel;
+extern const struct kernel depthwise_conv_2d_kernel;
+extern const struct kernel fully_connected_kernel;
+extern const struct kernel reshape_kernel;
+extern const struct kernel concatenation_kernel;
+extern const struct kernel activation_kernel;  // LOGISTIC and TANH
+extern const struct kernel softmax_kernel;
+extern const struct kernel elementwise_kernel; // ADD, SUB, MUL, DIV, MAXIMUM, MINIMUM and SQUARED_DIFFERENCE
+extern const struct kernel pool_2d_kernel;     // AVERAGE_POOL_2D and MAX_POOL_2D
+extern const struct kernel reduce_kernel;      // MEAN, SUM and REDUCE_MAX
+extern const struct kernel resize_kernel;      // RESIZE_BILINEAR and RESIZE_NEAREST_NEIGHBOR
+
+// Look up the kernel of a builtin operator. Returns NULL if the operator is not supported.
+const struct kernel *find_kernel(
+    enum builtin_operator builtin_code
+    );
+
+static inline struct engine_tensor *op_input(
+    struct engine *e,
+    const struct engine_operator *op,
+    uint16_t input_idx
+    )
+{
+  if(input_idx >= op->num_inputs || op->inputs[input_idx] < 0)
+    return NULL;
+  return &(e->tensors[op->inputs[input_idx]]);
+}
+
+static inline struct engine_tensor *op_output(
+    struct engine *e,
+    const struct engine_operator *op,
+    uint16_t output_idx
+    )
+{
+  return &(e->tensors[op->outputs[output_idx]]);
+}
+
+// Scratch memory of thread `worker_idx`.
+static inline void *op_scratch(
+    struct engine *e,
+    uint32_t worker_idx
+    )
+{
+  return e->scratch + (size_t)worker_idx * e->scratch_size;
+}
+
+// Grain of a parallel loop whose indices cost `cost` each.
+static inline size_t parallel_grain(
+    size_t cost
+    )
+{
+  if(cost >= KERNEL_PARALLEL_COST)
+    return 1;
+  return KERNEL_PARALLEL_COST / (cost > 0 ? cost : 1);
+}
+
+// Padding before the first element along a spatial dimension of a windowed operator.
+static inline int32_t compute_padding(
+    enum padding padding,
+    int32_t in_size,
+    int32_t filter_size,
+    int32_t stride,
+    int32_t dilation,
+    int32_t out_size
+    )
+{
+  int32_t effective_filter_size = (filter_size - 1) * dilation + 1,
+          pad = ((out_size - 1) * stride + effective_filter_size - in_size) / 2;
+  if(padding == P_VALID || pad < 0)
+    return 0;
+  return pad;
+}
+
+static inline bool is_quantized_type(
+    enum tensor_type type
+    )
+{
+  return type == TT_UINT8 || type == TT_INT8;
+}
+
+static inline size_t align_size(
+    size_t size
+    )
+{
+  return (size + ENGINE_ALIGNMENT - 1) & ~(size_t)(ENGINE_ALIGNMENT - 1);
+}
+
+#endif //ifndef MLTOOLS_ENGINE_KERNELS_H
@@ -0,0 +1,476 @@
+// Pre-packed weights and their sidecar cache.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../exceptions.h"
+#include "kernels.h"
+#include "pack.h"
+#include "registry.h"
+
+#define PACK_CACHE_PAGE_SIZE 4096
+
+size_t packed_weights_size(
+    enum pack_layout layout,
+    enum tensor_type type,
+    uint32_t n,
+    uint32_t k
+    )
+{
+  // Both layouts pad output channels alike, so their sizes match.
+  (void)layout;
+  size_t padded_n = packed_weights_padded_n(n),
+         size = align_size(sizeof(struct packed_weights));
+  size += align_size(padded_n * sizeof(int32_t)); // bias
+  if(type == TT_INT16)
+    size += 2 * align_size(padded_n * sizeof(int32_t)); // multipliers, shifts
+  size += align_size(padded_n * k * tensor_type_size(type));
+  return size;
+}
+
+void packed_weights_init(
+    struct packed_weights *p,
+    enum pack_layout layout,
+    enum tensor_type type,
+    uint32_t n,
+    uint32_t k
+    )
+{
+  size_t padded_n = packed_weights_padded_n(n),
+         offset = align_size(sizeof(struct packed_weights));
+  memset(p, 0, packed_weights_size(layout, type, n, k));
+  p->layout = layout;
+  p->type = type;
+  p->n = n;
+  p->k = k;
+  p->bias_offset = offset;
+  offset += align_size(padded_n * sizeof(int32_t));
+  if(type == TT_INT16)
+  {
+    p->multiplier_offset = offset;
+    offset += align_size(padded_n * sizeof(int32_t));
+    p->shift_offset = offset;
+    offset += align_size(padded_n * sizeof(int32_t));
+  }
+  p->weights_offset = offset;
+}
+
+// Index of weight (`n_idx`, `k_idx`) in the packed weights.
+static inline size_t packed_index(
+    const struct packed_weights *p,
+    uint32_t n_idx,
+    uint32_t k_idx
+    )
+{
+  if(p->layout == PL_PANELS)
+    return ((size_t)(n_idx / PACK_NR) * p->k + k_idx) * PACK_NR + n_idx % PACK_NR;
+  return (size_t)k_idx * packed_weights_padded_n(p->n) + n_idx;
+}
+
+// Index of weight (`n_idx`, `k_idx`) in the source weights.
+static inline size_t source_index(
+    const struct packed_weights *p,
+    uint32_t n_idx,
+    uint32_t k_idx
+    )
+{
+  if(p->layout == PL_PANELS)
+    return (size_t)n_idx * p->k + k_idx;
+  return (size_t)k_idx * p->n + n_idx;
+}
+
+void pack_float_weights(
+    struct packed_weights *p,
+    const float *weights
+    )
+{
+  float *packed = packed_float_weights(p);
+  for(
+      uint32_t n_idx = 0;
+      n_idx < p->n;
+      n_idx++
+     )
+  {
+    for(
+        uint32_t k_idx = 0;
+        k_idx < p->k;
+        k_idx++
+       )
+    {
+      packed[packed_index(p, n_idx, k_idx)] = weights[source_index(p, n_idx, k_idx)];
+    }
+  }
+}
+
+void pack_quantized_weights(
+    struct packed_weights *p,
+    const uint8_t *weights,
+    enum tensor_type weights_type,
+    int32_t zero_point
+    )
+{
+  int16_t *packed = packed_int16_weights(p);
+  for(
+      uint32_t n_idx = 0;
+      n_idx < p->n;
+      n_idx++
+     )
+  {
+    for(
+        uint32_t k_idx = 0;
+        k_idx < p->k;
+        k_idx++
+       )
+    {
+      size_t src_idx = source_index(p, n_idx, k_idx);
+      int32_t w = weights_type == TT_INT8 ? (int32_t)((const int8_t *)weights)[src_idx] : (int32_t)weights[src_idx];
+      packed[packed_index(p, n_idx, k_idx)] = (int16_t)(w - zero_point);
+    }
+  }
+}
+
+void packed_weights_sums(
+    const struct packed_weights *p,
+    int32_t *sums
+    )
+{
+  const int16_t *packed = packed_int16_weights(p);
+  for(
+      uint32_t n_idx = 0;
+      n_idx < p->n;
+      n_idx++
+     )
+  {
+    int32_t sum = 0;
+    for(
+        uint32_t k_idx = 0;
+        k_idx < p->k;
+        k_idx++
+       )
+    {
+      sum += packed[packed_index(p, n_idx, k_idx)];
+    }
+    sums[n_idx] = sum;
+  }
+}
+
+// 64-bit multiplicative hash over 4 interleaved lanes of 8-byte words, fast enough to fingerprint large models at
+// every start.
+uint64_t pack_hash(
+    const void *buf,
+    size_t size
+    )
+{
+  const uint64_t prime = 0x100000001b3ull;
+  const uint8_t *bytes = buf;
+  uint64_t lanes[4] = {
+    0xcbf29ce484222325ull ^ size,
+    0x84222325cbf29ce4ull,
+    0x9e3779b97f4a7c15ull,
+    0xc2b2ae3d27d4eb4full
+  };
+  uint64_t h;
+  size_t idx = 0;
+  for(; idx + 32 <= size; idx += 32)
+  {
+    for(
+        uint8_t lane_idx = 0;
+        lane_idx < 4;
+        lane_idx++
+       )
+    {
+      uint64_t word;
+      memcpy(&word, bytes + idx + 8 * lane_idx, sizeof(word));
+      lanes[lane_idx] = (lanes[lane_idx] ^ word) * prime;
+      lanes[lane_idx] ^= lanes[lane_idx] >> 29;
+    }
+  }
+  h = lanes[0] ^ (lanes[1] * prime) ^ (lanes[2] * prime * prime) ^ (lanes[3] * prime * prime * prime);
+  for(; idx < size; idx++)
+    h = (h ^ bytes[idx]) * prime;
+  h ^= h >> 33;
+  return h;
+}
+
+uint32_t pack_cpu_features()
+{
+  uint32_t features = 0;
+#ifdef __SSE2__
+  features |= PCF_SSE2;
+#endif
+#ifdef __AVX__
+  features |= PCF_AVX;
+#endif
+#ifdef __FMA__
+  features |= PCF_FMA;
+#endif
+#ifdef __AVX2__
+  features |= PCF_AVX2;
+#endif
+#ifdef __AVX512F__
+  features |= PCF_AVX512F;
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  features |= PCF_NEON;
+#endif
+  return features;
+}
+
+// Point every operator's packed weights into the pack arena, in operator order.
+static void assign_packed_weights(
+    struct engine *e
+    )
+{
+  size_t offset = 0;
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    struct engine_operator *op = &(e->operators[op_idx]);
+    if(op->packed_size == 0)
+      continue;
+    op->packed = e->pack_arena + offset;
+    offset += align_size(op->packed_size);
+  }
+}
+
+static void init_cache_header(
+    const struct engine *e,
+    struct pack_cache_header *header
+    )
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, PACK_CACHE_MAGIC, sizeof(PACK_CACHE_MAGIC));
+  header->version = PACK_CACHE_VERSION;
+  header->cpu_features = pack_cpu_features();
+  header->model_hash = pack_hash(e->model_buf, e->model_size);
+  header->model_size = e->model_size;
+  header->num_operators = e->num_operators;
+  header->tile = PACK_MR << 16 | PACK_NR;
+  header->arena_offset = sizeof(*header) + e->num_operators * sizeof(uint64_t);
+  header->arena_offset = (header->arena_offset + PACK_CACHE_PAGE_SIZE - 1) / PACK_CACHE_PAGE_SIZE * PACK_CACHE_PAGE_SIZE;
+  header->arena_size = e->pack_arena_size;
+}
+
+// Unmap a cache mapped by `load_cache()`.
+static void unmap_cache(
+    struct engine *e,
+    void *map,
+    size_t map_size
+    )
+{
+  if(e->options.registry != NULL)
+    registry_unmap_file(e->options.registry, map);
+  else
+    munmap(map, map_size);
+}
+
+// Map the cache stored at `path` into the pack arena, through the registry if there is one so that engines mapping the
+// same cache share its pages. Returns false if there is no valid cache for this model.
+static bool load_cache(
+    struct engine *e,
+    const char *path
+    )
+{
+  struct pack_cache_header expected;
+  const struct pack_cache_header *header;
+  const uint64_t *packed_sizes;
+  struct stat cache_stat;
+  size_t map_size;
+  uint8_t *map;
+  int fd;
+  if((fd = open(path, O_RDONLY)) < 0)
+    return false;
+  if(fstat(fd, &cache_stat) != 0 || (size_t)cache_stat.st_size < sizeof(struct pack_cache_header))
+  {
+    close(fd);
+    return false;
+  }
+  if(e->options.registry != NULL)
+  {
+    map = (uint8_t *)registry_map_file(e->options.registry, fd, &map_size);
+  }
+  else
+  {
+    map_size = cache_stat.st_size;
+    if((map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      map = NULL;
+  }
+  close(fd);
+  if(map == NULL)
+    return false;
+  init_cache_header(e, &expected);
+  header = (const struct pack_cache_header *)map;
+  packed_sizes = (const uint64_t *)(map + sizeof(*header));
+  if(
+      map_size < sizeof(struct pack_cache_header) ||
+      memcmp(header, &expected, sizeof(expected)) != 0 ||
+      map_size < expected.arena_offset + expected.arena_size
+    )
+  {
+    unmap_cache(e, map, map_size);
+    return false;
+  }
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    if(packed_sizes[op_idx] != e->operators[op_idx].packed_size)
+    {
+      unmap_cache(e, map, map_size);
+      return false;
+    }
+  }
+  e->pack_cache_map = map;
+  e->pack_cache_map_size = map_size;
+  e->pack_arena = map + expected.arena_offset;
+  return true;
+}
+
+// Write the pack arena into the cache at `path`. The cache is replaced atomically so that concurrently starting
+// processes never map a partially written file. Failures are reported but not fatal.
+static void save_cache(
+    const struct engine *e,
+    const char *path
+    )
+{
+  struct pack_cache_header header;
+  char *tmp_path;
+  FILE *cache_file;
+  int fd;
+  bool written;
+  init_cache_header(e, &header);
+  if((tmp_path = malloc(strlen(path) + sizeof(".XXXXXX"))) == NULL)
+    ERROR();
+  sprintf(tmp_path, "%s.XXXXXX", path);
+  if((fd = mkstemp(tmp_path)) < 0 || (cache_file = fdopen(fd, "wb")) == NULL)
+  {
+    WARNINGF("%s", tmp_path);
+    if(fd >= 0)
+      close(fd);
+    free(tmp_path);
+    return;
+  }
+  written = fwrite(&header, sizeof(header), 1, cache_file) == 1;
+  for(
+      uint32_t op_idx = 0;
+      written && op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    uint64_t packed_size = e->operators[op_idx].packed_size;
+    written = fwrite(&packed_size, sizeof(packed_size), 1, cache_file) == 1;
+  }
+  written = written &&
+    fseek(cache_file, header.arena_offset, SEEK_SET) == 0 &&
+    fwrite(e->pack_arena, 1, e->pack_arena_size, cache_file) == e->pack_arena_size;
+  written = (fclose(cache_file) == 0) && written;
+  if(!written || rename(tmp_path, path) != 0)
+  {
+    WARNINGF("%s", path);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+}
+
+// Move every operator's packed weights to the registry and release the pack arena. Only used for weights packed by
+// this engine, since mapped caches are already shared.
+static void share_packed_weights(
+    struct engine *e
+    )
+{
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    struct engine_operator *op = &(e->operators[op_idx]);
+    if(op->packed_size != 0)
+      op->packed = (void *)registry_share(e->options.registry, op->packed, op->packed_size);
+  }
+  free(e->pack_arena);
+  e->pack_arena = NULL;
+#ifdef DEBUG_PACK_C
+  printf("Shared %zu bytes of pre-packed weights.\n", e->pack_arena_size);
+#endif //ifdef DEBUG_PACK_C
+}
+
+void pack_weights(
+    struct engine *e
+    )
+{
+  const char *cache_path = e->options.prepack_cache_path;
+  e->pack_arena_size = 0;
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    e->pack_arena_size += align_size(e->operators[op_idx].packed_size);
+  }
+  if(e->pack_arena_size == 0)
+    return;
+  if(cache_path != NULL && load_cache(e, cache_path))
+  {
+    assign_packed_weights(e);
+#ifdef DEBUG_PACK_C
+    printf("Mapped %zu bytes of pre-packed weights from '%s'.\n", e->pack_arena_size, cache_path);
+#endif //ifdef DEBUG_PACK_C
+    return;
+  }
+  if((e->pack_arena = aligned_alloc(ENGINE_ALIGNMENT, e->pack_arena_size)) == NULL)
+    ERROR();
+  assign_packed_weights(e);
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    struct engine_operator *op = &(e->operators[op_idx]);
+    if(op->packed_size != 0)
+      op->kernel->pack(e, op, op->packed);
+  }
+  if(cache_path != NULL)
+    save_cache(e, cache_path);
+#ifdef DEBUG_PACK_C
+  printf("Packed %zu bytes of weights.\n", e->pack_arena_size);
+#endif //ifdef DEBUG_PACK_C
+  if(e->options.registry != NULL)
+    share_packed_weights(e);
+}
+
+void unpack_weights(
+    struct engine *e
+    )
+{
+  if(e->pack_cache_map != NULL)
+  {
+    unmap_cache(e, e->pack_cache_map, e->pack_cache_map_size);
+  }
+  else
+  {
+    for(
+        uint32_t op_idx = 0;
+        e->options.registry != NULL && e->operators != NULL && op_idx < e->num_operators;
+        op_idx++
+       )
+    {
+      if(e->operators[op_idx].packed != NULL)
+        registry_release(e->options.registry, e->operators[op_idx].packed);
+    }
+    free(e->pack_arena);
+  }
+  e->pack_cache_map = NULL;
+  e->pack_arena = NULL;
+}
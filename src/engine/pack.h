@@ -0,0 +1,170 @@
+// Pre-packed weights.
+// Weight-bearing kernels repack their weights once into the layout consumed by their inner loops, together with the
+// per-channel bias and requantization parameters derived from them. The packed weights of all operators are laid out
+// back-to-back in the engine's pack arena. When `engine_options.prepack_cache_path` is set, the arena is written to
+// that sidecar file after packing and memory-mapped back on the next start, so that opening a large model only costs
+// the page faults of the weights it touches. Engines opened with a registry hand the weights they packed over to it, so
+// that engines packing identical weights keep a single copy, and map caches through it, so that engines reading the
+// same cache share one mapping.
+#ifndef MLTOOLS_ENGINE_PACK_H
+#define MLTOOLS_ENGINE_PACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+#define PACK_MR 4 // rows of input per GEMM micro-tile
+#define PACK_NR 8 // output channels per panel
+
+#define PACK_CACHE_MAGIC "MLTPACK"
+#define PACK_CACHE_VERSION 1
+
+enum pack_layout
+{
+  PL_PANELS = 0,   // weights[n][k] stored as panels[n / PACK_NR][k][PACK_NR]
+  PL_DEPTHWISE = 1 // weights[k][n] stored as is, rows padded to a multiple of PACK_NR
+};
+
+// Header of one operator's packed weights, followed by the arrays it references. Offsets are relative to the header.
+// All fields have a fixed width since the header is stored as is in the cache.
+struct packed_weights
+{
+  uint32_t layout;            // enum pack_layout
+  uint32_t type;              // TT_FLOAT32 (float weights and bias) or TT_INT16 (zero point-adjusted weights)
+  uint32_t n;                 // number of output channels
+  uint32_t k;                 // reduction depth per output channel
+  uint64_t bias_offset;       // float[n] or int32_t[n]
+  uint64_t multiplier_offset; // int32_t[n] requantization multipliers (TT_INT16 only)
+  uint64_t shift_offset;      // int32_t[n] requantization shifts (TT_INT16 only)
+  uint64_t weights_offset;    // float or int16_t weights, zero-padded to a multiple of PACK_NR channels
+};
+
+// Sidecar file header, followed by `num_operators` uint64_t packed sizes and, at `arena_offset`, the pack arena.
+struct pack_cache_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t cpu_features;      // instruction set extensions the kernels were compiled for
+  uint64_t model_hash;
+  uint64_t model_size;
+  uint32_t num_operators;
+  uint32_t tile;              // PACK_MR << 16 | PACK_NR
+  uint64_t arena_offset;
+  uint64_t arena_size;
+};
+
+enum pack_cpu_feature
+{
+  PCF_SSE2 = 1 << 0,
+  PCF_AVX = 1 << 1,
+  PCF_FMA = 1 << 2,
+  PCF_AVX2 = 1 << 3,
+  PCF_AVX512F = 1 << 4,
+  PCF_NEON = 1 << 5
+};
+
+static inline uint32_t packed_weights_padded_n(
+    uint32_t n
+    )
+{
+  return (n + PACK_NR - 1) / PACK_NR * PACK_NR;
+}
+
+static inline float *packed_float_weights(
+    const struct packed_weights *p
+    )
+{
+  return (float *)((uint8_t *)p + p->weights_offset);
+}
+
+static inline int16_t *packed_int16_weights(
+    const struct packed_weights *p
+    )
+{
+  return (int16_t *)((uint8_t *)p + p->weights_offset);
+}
+
+static inline float *packed_float_bias(
+    const struct packed_weights *p
+    )
+{
+  return (float *)((uint8_t *)p + p->bias_offset);
+}
+
+static inline int32_t *packed_int32_bias(
+    const struct packed_weights *p
+    )
+{
+  return (int32_t *)((uint8_t *)p + p->bias_offset);
+}
+
+static inline int32_t *packed_multipliers(
+    const struct packed_weights *p
+    )
+{
+  return (int32_t *)((uint8_t *)p + p->multiplier_offset);
+}
+
+static inline int32_t *packed_shifts(
+    const struct packed_weights *p
+    )
+{
+  return (int32_t *)((uint8_t *)p + p->shift_offset);
+}
+
+// Size of the packed weights of `n` output channels of depth `k`, including the header.
+size_t packed_weights_size(
+    enum pack_layout layout,
+    enum tensor_type type,
+    uint32_t n,
+    uint32_t k
+    );
+
+// Lay out the header of packed weights whose storage was sized by `packed_weights_size()`.
+void packed_weights_init(
+    struct packed_weights *p,
+    enum pack_layout layout,
+    enum tensor_type type,
+    uint32_t n,
+    uint32_t k
+    );
+
+// Pack float weights (`weights[n][k]` for PL_PANELS, `weights[k][n]` for PL_DEPTHWISE).
+void pack_float_weights(
+    struct packed_weights *p,
+    const float *weights
+    );
+
+// Pack 8-bit weights of type `weights_type` as int16 values relative to `zero_point`.
+void pack_quantized_weights(
+    struct packed_weights *p,
+    const uint8_t *weights,
+    enum tensor_type weights_type,
+    int32_t zero_point
+    );
+
+// Sum the int16 weights of each output channel into `sums[n]`.
+void packed_weights_sums(
+    const struct packed_weights *p,
+    int32_t *sums
+    );
+
+uint64_t pack_hash(
+    const void *buf,
+    size_t size
+    );
+
+uint32_t pack_cpu_features();
+
+// Allocate the pack arena of `e` and fill every operator's packed weights, reading them from the cache if possible.
+void pack_weights(
+    struct engine *e
+    );
+
+// Release the packed weights of `e`, or its references to them in the registry.
+void unpack_weights(
+    struct engine *e
+    );
+
+#endif //ifndef MLTOOLS_ENGINE_PACK_H
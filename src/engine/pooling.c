@@ -0,0 +1,682 @@
+// Pooling and reduction kernels.
+// Tensors are NHWC, so windows and reductions accumulate whole rows of channels at a time, which vectorizes across
+// channels. Pooling windows over the entire image (global pooling) and reductions over contiguous axes both run as a
+// reduction of an [outer, reduce, inner] view of the input, split across outer indices and blocks of inner indices.
+// Quantized kernels accumulate in 32 bits and rescale each result once.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "kernels.h"
+#include "quant.h"
+
+#define REDUCE_BLOCK_SIZE 1024 // inner indices accumulated by one parallel chunk
+
+enum reduction
+{
+  R_SUM,
+  R_MEAN,
+  R_MAX
+};
+
+struct pool_state
+{
+  enum reduction reduction;
+  bool is_global;               // reduce the [outer, reduce, inner] view of the input
+  int32_t pad_h;                // windowed pooling
+  int32_t pad_w;
+  size_t outer;                 // global pooling and reductions
+  size_t reduce;
+  size_t inner;
+  size_t num_blocks;            // blocks of inner indices
+  bool is_reduced[ENGINE_MAX_DIMS]; // axes reduced by reductions that do not map to the [outer, reduce, inner] view
+  float float_min;              // fused activation range
+  float float_max;
+  int32_t quant_min;
+  int32_t quant_max;
+  bool is_rescaled;             // quantized output scale or zero point differ from the input's
+  double rescale;               // input scale over output scale
+};
+
+// Accumulate `count` channels of `row` into `acc` (floats).
+static inline void accumulate_float(
+    enum reduction reduction,
+    const float *row,
+    float *acc,
+    size_t count
+    )
+{
+  if(reduction == R_MAX)
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      acc[idx] = row[idx] > acc[idx] ? row[idx] : acc[idx];
+    }
+  }
+  else
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      acc[idx] += row[idx];
+    }
+  }
+}
+
+// Accumulate `count` channels of `row` into `acc` (quantized values of `type`).
+static inline void accumulate_quantized(
+    enum reduction reduction,
+    enum tensor_type type,
+    const uint8_t *row,
+    int32_t *acc,
+    size_t count
+    )
+{
+  const int8_t *signed_row = (const int8_t *)row;
+  if(reduction == R_MAX && type == TT_INT8)
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      acc[idx] = signed_row[idx] > acc[idx] ? signed_row[idx] : acc[idx];
+    }
+  }
+  else if(reduction == R_MAX)
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      acc[idx] = row[idx] > acc[idx] ? row[idx] : acc[idx];
+    }
+  }
+  else if(type == TT_INT8)
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      acc[idx] += signed_row[idx];
+    }
+  }
+  else
+  {
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      acc[idx] += row[idx];
+    }
+  }
+}
+
+static void reset_accumulators(
+    const struct pool_state *state,
+    enum tensor_type type,
+    void *acc,
+    size_t count
+    )
+{
+  for(
+      size_t idx = 0;
+      idx < count;
+      idx++
+     )
+  {
+    if(type == TT_FLOAT32)
+      ((float *)acc)[idx] = state->reduction == R_MAX ? -INFINITY : 0.0f;
+    else
+      ((int32_t *)acc)[idx] = state->reduction == R_MAX ? INT32_MIN : 0;
+  }
+}
+
+// Write `count` results accumulated over `num_elements` elements each into `out`.
+static void store_results(
+    const struct pool_state *state,
+    const struct engine_tensor *input,
+    const struct engine_tensor *output,
+    const void *acc,
+    size_t num_elements,
+    uint8_t *out,
+    size_t count
+    )
+{
+  if(output->type == TT_FLOAT32)
+  {
+    const float *float_acc = acc;
+    float *float_out = (float *)out,
+          divisor = state->reduction == R_MEAN ? (float)num_elements : 1.0f;
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      float value = float_acc[idx] / divisor;
+      float_out[idx] = value < state->float_min ? state->float_min : (value > state->float_max ? state->float_max : value);
+    }
+  }
+  else
+  {
+    const int32_t *quant_acc = acc;
+    // Maxima hold one element, sums and means `num_elements` elements, each offset by the input's zero point.
+    int64_t offset = (int64_t)input->zero_point * (state->reduction == R_MAX ? 1 : num_elements);
+    double multiplier = state->rescale / (state->reduction == R_MEAN ? num_elements : 1);
+    for(
+        size_t idx = 0;
+        idx < count;
+        idx++
+       )
+    {
+      int32_t value = quant_acc[idx];
+      if(state->is_rescaled || state->reduction != R_MAX)
+        value = output->zero_point + (int32_t)lround((quant_acc[idx] - offset) * multiplier);
+      value = clamp_int32(value, state->quant_min, state->quant_max);
+      if(output->type == TT_INT8)
+        ((int8_t *)out)[idx] = (int8_t)value;
+      else
+        out[idx] = (uint8_t)value;
+    }
+  }
+}
+
+static void prepare_output(
+    struct pool_state *state,
+    enum activation_function_type activation,
+    const struct engine_tensor *input,
+    const struct engine_tensor *output
+    )
+{
+  if(output->type == TT_FLOAT32)
+    float_activation_range(activation, &(state->float_min), &(state->float_max));
+  else
+  {
+    quantized_activation_range(
+        activation,
+        output->type,
+        output->scale,
+        output->zero_point,
+        &(state->quant_min),
+        &(state->quant_max)
+        );
+    state->rescale = (double)input->scale / output->scale;
+    state->is_rescaled = input->scale != output->scale || input->zero_point != output->zero_point;
+  }
+}
+
+static void check_types(
+    const struct engine_operator *op,
+    const struct engine_tensor *input,
+    const struct engine_tensor *output
+    )
+{
+  if(input->type != output->type)
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s'", op->name, output->name);
+  }
+  if(
+      input->type != TT_FLOAT32 &&
+      (!is_quantized_type(input->type) || input->scale <= 0.0f || output->scale <= 0.0f)
+    )
+  {
+    errno = ENOTSUP;
+    ERRORF("%s of type %d producing '%s'", op->name, input->type, output->name);
+  }
+}
+
+// Split the reduction of `state` into parallel chunks of blocks of inner indices.
+static void plan_blocks(
+    struct engine_operator *op,
+    struct pool_state *state,
+    enum tensor_type type
+    )
+{
+  size_t block_size = state->inner < REDUCE_BLOCK_SIZE ? state->inner : REDUCE_BLOCK_SIZE;
+  state->num_blocks = (state->inner + REDUCE_BLOCK_SIZE - 1) / REDUCE_BLOCK_SIZE;
+  op->scratch_size = block_size * (type == TT_FLOAT32 ? sizeof(float) : sizeof(int32_t));
+}
+
+// Parallel loop body reducing blocks [begin, end) of the [outer, reduce, inner] view.
+static void reduce_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct pool_state *state = ctx->op->state;
+  const struct engine_tensor *input = op_input(ctx->e, ctx->op, 0),
+                             *output = op_output(ctx->e, ctx->op, 0);
+  size_t element_size = tensor_type_size(input->type);
+  void *acc = op_scratch(ctx->e, worker_idx);
+  for(
+      size_t block_idx = begin;
+      block_idx < end;
+      block_idx++
+     )
+  {
+    size_t outer_idx = block_idx / state->num_blocks,
+           first = (block_idx % state->num_blocks) * REDUCE_BLOCK_SIZE,
+           count = state->inner - first < REDUCE_BLOCK_SIZE ? state->inner - first : REDUCE_BLOCK_SIZE;
+    const uint8_t *in = input->data + (outer_idx * state->reduce * state->inner + first) * element_size;
+    reset_accumulators(state, input->type, acc, count);
+    for(
+        size_t reduce_idx = 0;
+        reduce_idx < state->reduce;
+        reduce_idx++
+       )
+    {
+      const uint8_t *row = in + reduce_idx * state->inner * element_size;
+      if(input->type == TT_FLOAT32)
+        accumulate_float(state->reduction, (const float *)row, acc, count);
+      else
+        accumulate_quantized(state->reduction, input->type, row, acc, count);
+    }
+    store_results(
+        state,
+        input,
+        output,
+        acc,
+        state->reduce,
+        output->data + (outer_idx * state->inner + first) * element_size,
+        count
+        );
+  }
+}
+
+// Parallel loop body reducing rows [begin, end) of the [outer, reduce] view (when `inner` is 1).
+static void reduce_rows_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct pool_state *state = ctx->op->state;
+  const struct engine_tensor *input = op_input(ctx->e, ctx->op, 0),
+                             *output = op_output(ctx->e, ctx->op, 0);
+  size_t element_size = tensor_type_size(input->type);
+  (void)worker_idx;
+  for(
+      size_t outer_idx = begin;
+      outer_idx < end;
+      outer_idx++
+     )
+  {
+    const uint8_t *in = input->data + outer_idx * state->reduce * element_size;
+    float float_acc = state->reduction == R_MAX ? -INFINITY : 0.0f;
+    int32_t quant_acc = state->reduction == R_MAX ? INT32_MIN : 0;
+    for(
+        size_t reduce_idx = 0;
+        reduce_idx < state->reduce;
+        reduce_idx++
+       )
+    {
+      if(input->type == TT_FLOAT32)
+        accumulate_float(state->reduction, (const float *)in + reduce_idx, &float_acc, 1);
+      else
+        accumulate_quantized(state->reduction, input->type, in + reduce_idx * element_size, &quant_acc, 1);
+    }
+    store_results(
+        state,
+        input,
+        output,
+        input->type == TT_FLOAT32 ? (const void *)&float_acc : (const void *)&quant_acc,
+        state->reduce,
+        output->data + outer_idx * element_size,
+        1
+        );
+  }
+}
+
+static void invoke_global(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct pool_state *state = op->state;
+  struct op_context ctx = {.e = e, .op = op};
+  if(state->inner == 1)
+    threadpool_parallel_for(e->pool, state->outer, parallel_grain(state->reduce), reduce_rows_range, &ctx);
+  else
+    threadpool_parallel_for(
+        e->pool,
+        state->outer * state->num_blocks,
+        parallel_grain(state->reduce * (state->inner < REDUCE_BLOCK_SIZE ? state->inner : REDUCE_BLOCK_SIZE)),
+        reduce_range,
+        &ctx
+        );
+}
+
+static void prepare_pool_2d(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct pool2d_options *options = &(op->builtin_options.pool2d_options);
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *output = op_output(e, op, 0);
+  struct pool_state *state;
+  if(
+      input == NULL || input->num_dims != 4 || output->num_dims != 4 ||
+      output->shape[0] != input->shape[0] || output->shape[3] != input->shape[3] ||
+      options->filter_width < 1 || options->filter_height < 1 || options->stride_w < 1 || options->stride_h < 1
+    )
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s'", op->name, output->name);
+  }
+  check_types(op, input, output);
+  if((state = calloc(1, sizeof(struct pool_state))) == NULL)
+    ERROR();
+  op->state = state;
+  state->reduction = op->builtin_code == BO_MAX_POOL_2D ? R_MAX : R_MEAN;
+  state->pad_h = compute_padding(options->padding, input->shape[1], options->filter_height, options->stride_h, 1, output->shape[1]);
+  state->pad_w = compute_padding(options->padding, input->shape[2], options->filter_width, options->stride_w, 1, output->shape[2]);
+  prepare_output(state, options->fused_activation_function, input, output);
+  // A single window covering the whole image is a reduction over H x W.
+  state->is_global =
+    output->shape[1] == 1 && output->shape[2] == 1 && state->pad_h == 0 && state->pad_w == 0 &&
+    options->filter_height >= input->shape[1] && options->filter_width >= input->shape[2];
+  if(state->is_global)
+  {
+    state->outer = input->shape[0];
+    state->reduce = (size_t)input->shape[1] * input->shape[2];
+    state->inner = input->shape[3];
+    plan_blocks(op, state, input->type);
+  }
+  else
+    op->scratch_size = (size_t)input->shape[3] * (input->type == TT_FLOAT32 ? sizeof(float) : sizeof(int32_t));
+}
+
+// Parallel loop body pooling output rows [begin, end) (over batches and output heights).
+static void pool_2d_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct pool2d_options *options = &(ctx->op->builtin_options.pool2d_options);
+  const struct pool_state *state = ctx->op->state;
+  const struct engine_tensor *input = op_input(ctx->e, ctx->op, 0),
+                             *output = op_output(ctx->e, ctx->op, 0);
+  int32_t in_h = input->shape[1],
+          in_w = input->shape[2],
+          out_h = output->shape[1],
+          out_w = output->shape[2],
+          channels = input->shape[3];
+  size_t element_size = tensor_type_size(input->type);
+  void *acc = op_scratch(ctx->e, worker_idx);
+  for(
+      size_t row = begin;
+      row < end;
+      row++
+     )
+  {
+    int32_t batch = row / out_h,
+            in_y0 = (int32_t)(row % out_h) * options->stride_h - state->pad_h,
+            filter_y_begin = in_y0 < 0 ? -in_y0 : 0,
+            filter_y_end = in_h - in_y0 < options->filter_height ? in_h - in_y0 : options->filter_height;
+    for(
+        int32_t out_x = 0;
+        out_x < out_w;
+        out_x++
+       )
+    {
+      int32_t in_x0 = out_x * options->stride_w - state->pad_w,
+              filter_x_begin = in_x0 < 0 ? -in_x0 : 0,
+              filter_x_end = in_w - in_x0 < options->filter_width ? in_w - in_x0 : options->filter_width;
+      reset_accumulators(state, input->type, acc, channels);
+      for(
+          int32_t filter_y = filter_y_begin;
+          filter_y < filter_y_end;
+          filter_y++
+         )
+      {
+        for(
+            int32_t filter_x = filter_x_begin;
+            filter_x < filter_x_end;
+            filter_x++
+           )
+        {
+          const uint8_t *in = input->data +
+            ((((size_t)batch * in_h + in_y0 + filter_y) * in_w + in_x0 + filter_x) * channels) * element_size;
+          if(input->type == TT_FLOAT32)
+            accumulate_float(state->reduction, (const float *)in, acc, channels);
+          else
+            accumulate_quantized(state->reduction, input->type, in, acc, channels);
+        }
+      }
+      // Padding is excluded from averages.
+      store_results(
+          state,
+          input,
+          output,
+          acc,
+          (size_t)(filter_y_end - filter_y_begin) * (filter_x_end - filter_x_begin),
+          output->data + ((row * out_w + out_x) * channels) * element_size,
+          channels
+          );
+    }
+  }
+}
+
+static void invoke_pool_2d(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct pool2d_options *options = &(op->builtin_options.pool2d_options);
+  const struct pool_state *state = op->state;
+  const struct engine_tensor *output = op_output(e, op, 0);
+  struct op_context ctx = {.e = e, .op = op};
+  if(state->is_global)
+  {
+    invoke_global(e, op);
+    return;
+  }
+  threadpool_parallel_for(
+      e->pool,
+      (size_t)output->shape[0] * output->shape[1],
+      parallel_grain((size_t)output->shape[2] * output->shape[3] * options->filter_width * options->filter_height),
+      pool_2d_range,
+      &ctx
+      );
+}
+
+const struct kernel pool_2d_kernel = {
+  .prepare = prepare_pool_2d,
+  .invoke = invoke_pool_2d
+};
+
+static void prepare_reduce(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *axes = op_input(e, op, 1),
+                             *output = op_output(e, op, 0);
+  struct pool_state *state;
+  size_t num_output_elements = 1;
+  uint8_t first_reduced = ENGINE_MAX_DIMS, last_reduced = 0;
+  bool is_contiguous = true;
+  if(input == NULL || axes == NULL || axes->type != TT_INT32)
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s'", op->name, output->name);
+  }
+  if(!axes->is_constant)
+  {
+    errno = ENOTSUP;
+    ERRORF("%s over variable axes producing '%s'", op->name, output->name);
+  }
+  check_types(op, input, output);
+  if((state = calloc(1, sizeof(struct pool_state))) == NULL)
+    ERROR();
+  op->state = state;
+  state->reduction = op->builtin_code == BO_REDUCE_MAX ? R_MAX : (op->builtin_code == BO_MEAN ? R_MEAN : R_SUM);
+  for(
+      size_t axis_idx = 0;
+      axis_idx < tensor_num_elements(axes);
+      axis_idx++
+     )
+  {
+    int32_t axis = ((const int32_t *)axes->data)[axis_idx];
+    if(axis < -input->num_dims || axis >= input->num_dims)
+    {
+      errno = EINVAL;
+      ERRORF("%s axis %d producing '%s'", op->name, axis, output->name);
+    }
+    state->is_reduced[axis < 0 ? axis + input->num_dims : axis] = true;
+  }
+  // Dimensions of size 1 may be considered reduced or not, whichever keeps the reduced axes contiguous.
+  for(
+      uint8_t dim_idx = 0;
+      dim_idx < input->num_dims;
+      dim_idx++
+     )
+  {
+    if(state->is_reduced[dim_idx] && input->shape[dim_idx] > 1)
+    {
+      if(first_reduced == ENGINE_MAX_DIMS)
+        first_reduced = dim_idx;
+      last_reduced = dim_idx;
+    }
+    if(!state->is_reduced[dim_idx])
+      num_output_elements *= input->shape[dim_idx];
+  }
+  if(num_output_elements != tensor_num_elements(output))
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s' of mismatching shape", op->name, output->name);
+  }
+  state->outer = 1;
+  state->reduce = 1;
+  state->inner = 1;
+  for(
+      uint8_t dim_idx = 0;
+      dim_idx < input->num_dims;
+      dim_idx++
+     )
+  {
+    if(dim_idx < first_reduced)
+      state->outer *= input->shape[dim_idx];
+    else if(dim_idx <= last_reduced && first_reduced < ENGINE_MAX_DIMS)
+    {
+      state->reduce *= input->shape[dim_idx];
+      if(!state->is_reduced[dim_idx] && input->shape[dim_idx] > 1)
+        is_contiguous = false;
+    }
+    else
+      state->inner *= input->shape[dim_idx];
+  }
+  prepare_output(state, AFT_NONE, input, output);
+  state->is_global = is_contiguous;
+  if(state->is_global)
+    plan_blocks(op, state, input->type);
+  else
+    op->scratch_size = num_output_elements * (input->type == TT_FLOAT32 ? sizeof(float) : sizeof(int32_t));
+}
+
+// Loop body reducing non-contiguous axes by visiting every input element in order, run as a single chunk.
+static void reduce_strided(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct pool_state *state = ctx->op->state;
+  const struct engine_tensor *input = op_input(ctx->e, ctx->op, 0),
+                             *output = op_output(ctx->e, ctx->op, 0);
+  size_t element_size = tensor_type_size(input->type),
+         num_input_elements = tensor_num_elements(input),
+         num_output_elements = tensor_num_elements(output),
+         index[ENGINE_MAX_DIMS] = {0};
+  void *acc = op_scratch(ctx->e, worker_idx);
+  (void)begin;
+  (void)end;
+  reset_accumulators(state, input->type, acc, num_output_elements);
+  for(
+      size_t in_idx = 0;
+      in_idx < num_input_elements;
+      in_idx++
+     )
+  {
+    size_t out_idx = 0;
+    for(
+        uint8_t dim_idx = 0;
+        dim_idx < input->num_dims;
+        dim_idx++
+       )
+    {
+      if(!state->is_reduced[dim_idx])
+        out_idx = out_idx * input->shape[dim_idx] + index[dim_idx];
+    }
+    if(input->type == TT_FLOAT32)
+      accumulate_float(state->reduction, (const float *)input->data + in_idx, (float *)acc + out_idx, 1);
+    else
+      accumulate_quantized(state->reduction, input->type, input->data + in_idx * element_size, (int32_t *)acc + out_idx, 1);
+    // Advance the multi-dimensional index.
+    for(
+        int8_t dim_idx = input->num_dims - 1;
+        dim_idx >= 0 && ++index[dim_idx] == (size_t)input->shape[dim_idx];
+        dim_idx--
+       )
+    {
+      index[dim_idx] = 0;
+    }
+  }
+  store_results(
+      state,
+      input,
+      output,
+      acc,
+      num_input_elements / (num_output_elements > 0 ? num_output_elements : 1),
+      output->data,
+      num_output_elements
+      );
+}
+
+static void invoke_reduce(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct pool_state *state = op->state;
+  struct op_context ctx = {.e = e, .op = op};
+  if(state->is_global)
+    invoke_global(e, op);
+  else
+    threadpool_parallel_for(e->pool, 1, 1, reduce_strided, &ctx);
+}
+
+const struct kernel reduce_kernel = {
+  .prepare = prepare_reduce,
+  .invoke = invoke_reduce
+};
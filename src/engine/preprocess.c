@@ -0,0 +1,601 @@
+// Image preprocessing.
+// Every output row is resampled from the source rows under it into a row of 8-bit BGR values, which a per-channel
+// lookup table maps to normalized or quantized RGB values. The tables are computed with the same float operations as
+// the Python preprocessors, so the two only differ where resampling does.
+// Resampling mirrors `cv::resize()` on 8-bit images: bilinear interpolation, and area interpolation when upscaling,
+// blends two source pixels with 11-bit fixed-point weights, horizontally then vertically; area interpolation when
+// downscaling averages the source pixels under each output pixel with float weights, or integers for integer scales.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "preprocess.h"
+
+#define PREPROCESS_COEF_BITS 11 // fractional bits of bilinear weights, as INTER_RESIZE_COEF_BITS of OpenCV
+#define PREPROCESS_COEF_ONE (1 << PREPROCESS_COEF_BITS)
+#define PREPROCESS_CHANNELS 3
+
+const struct preprocess_options preprocess_vgg = {
+  .height = 224,
+  .width = 224,
+  .crop_percent = 87.5f,
+  .interpolation = PI_AREA,
+  .divisor = 1.0f,
+  .mean = {123.68f, 116.78f, 103.94f},
+  .multiplier = 1.0f,
+};
+
+const struct preprocess_options preprocess_mobilenet = {
+  .height = 224,
+  .width = 224,
+  .crop_percent = 87.5f,
+  .interpolation = PI_LINEAR,
+  .divisor = 255.0f,
+  .mean = {0.5f, 0.5f, 0.5f},
+  .multiplier = 2.0f,
+};
+
+// Two source indices blended into one output index. Column taps hold offsets of pixels in source rows instead.
+struct linear_tap
+{
+  uint32_t low;
+  uint32_t high;
+  int16_t weights[2];           // weights of `low` and `high` in units of 1 / PREPROCESS_COEF_ONE
+};
+
+// One source index averaged into an output index.
+struct area_tap
+{
+  uint32_t dst;                 // output index relative to the crop
+  uint32_t src;
+  float weight;
+};
+
+struct preprocess_state
+{
+  const uint8_t *image;
+  size_t stride;
+  uint32_t width;               // output size
+  uint32_t height;
+  uint32_t left;                // crop offset in the resized image
+  uint32_t top;
+  double scale_x;               // source pixels per resized pixel
+  double scale_y;
+  uint8_t *row;                 // resampled BGR output row
+  // Bilinear
+  struct linear_tap *cols;
+  struct linear_tap *rows;
+  int16_t *cached_rows[2];      // horizontally interpolated source rows, without their 4 low bits
+  uint32_t cached_indices[2];
+  // Area
+  uint32_t iscale_x;            // integer scales, or 0
+  uint32_t iscale_y;
+  struct area_tap *col_taps;
+  uint32_t num_col_taps;
+  struct area_tap *row_taps;
+  uint32_t num_row_taps;
+  float *buffer;                // horizontally averaged source row
+  float *sum;
+};
+
+static inline uint8_t saturate_uint8(
+    int32_t x
+    )
+{
+  return x < 0 ? 0 : (x > UINT8_MAX ? UINT8_MAX : x);
+}
+
+// Round half to even like `lrintf()` in the default rounding mode, without a library call. |x| must be below 2^22.
+static inline int32_t round_float(
+    float x
+    )
+{
+  return (int32_t)((x + 0x1.8p23f) - 0x1.8p23f);
+}
+
+struct preprocess_output
+{
+  enum tensor_type type;
+  float values[PREPROCESS_CHANNELS][UINT8_MAX + 1]; // lookup tables of RGB channels
+  uint8_t quantized[PREPROCESS_CHANNELS][UINT8_MAX + 1];
+  void *data;
+};
+
+// Map the resampled BGR row to output row `y`.
+static void store_row(
+    struct preprocess_state *s,
+    uint32_t y,
+    struct preprocess_output *o
+    )
+{
+  uint32_t num_values = s->width * PREPROCESS_CHANNELS;
+  const uint8_t *restrict bgr = s->row;
+  if(o->type == TT_FLOAT32)
+  {
+    float *restrict rgb = (float *)o->data + (size_t)y * num_values;
+    for(
+        uint32_t idx = 0;
+        idx < num_values;
+        idx += PREPROCESS_CHANNELS
+       )
+    {
+      rgb[idx] = o->values[0][bgr[idx + 2]];
+      rgb[idx + 1] = o->values[1][bgr[idx + 1]];
+      rgb[idx + 2] = o->values[2][bgr[idx]];
+    }
+  }
+  else
+  {
+    uint8_t *restrict rgb = (uint8_t *)o->data + (size_t)y * num_values;
+    for(
+        uint32_t idx = 0;
+        idx < num_values;
+        idx += PREPROCESS_CHANNELS
+       )
+    {
+      rgb[idx] = o->quantized[0][bgr[idx + 2]];
+      rgb[idx + 1] = o->quantized[1][bgr[idx + 1]];
+      rgb[idx + 2] = o->quantized[2][bgr[idx]];
+    }
+  }
+}
+
+// Source of resized index `idx` of `size` source indices, by `cv::resize()` with INTER_LINEAR, or with INTER_AREA when
+// upscaling (`is_area`).
+static void compute_linear_tap(
+    bool is_area,
+    double scale,
+    uint32_t size,
+    uint32_t idx,
+    struct linear_tap *tap
+    )
+{
+  int32_t src;
+  float fraction;
+  if(is_area)
+  {
+    src = (int32_t)floor(idx * scale);
+    fraction = (float)((idx + 1) - (src + 1) / scale);
+    fraction = fraction <= 0.0f ? 0.0f : fraction - floorf(fraction);
+  }
+  else
+  {
+    fraction = (float)((idx + 0.5) * scale - 0.5);
+    src = (int32_t)floorf(fraction);
+    fraction -= src;
+  }
+  if(src < 0)
+  {
+    src = 0;
+    fraction = 0.0f;
+  }
+  if(src >= (int32_t)size - 1)
+  {
+    src = size - 1;
+    fraction = 0.0f;
+  }
+  tap->low = src;
+  tap->high = src + 1 < (int32_t)size ? src + 1 : src;
+  tap->weights[0] = (int16_t)lrintf((1.0f - fraction) * PREPROCESS_COEF_ONE);
+  tap->weights[1] = (int16_t)lrintf(fraction * PREPROCESS_COEF_ONE);
+}
+
+// Sources of resized indices [`first`, `first` + `count`) of `size` source indices, by `cv::resize()` with INTER_AREA
+// when downscaling. Stores at most `count` * (ceil(scale) + 1) taps.
+static uint32_t compute_area_taps(
+    double scale,
+    uint32_t size,
+    uint32_t first,
+    uint32_t count,
+    struct area_tap *taps
+    )
+{
+  uint32_t num_taps = 0;
+  for(
+      uint32_t idx = 0;
+      idx < count;
+      idx++
+     )
+  {
+    double start = (first + idx) * scale,
+           end = start + scale,
+           cell_size = fmin(scale, size - start);
+    int32_t src_start = (int32_t)ceil(start),
+            src_end = (int32_t)floor(end);
+    src_end = src_end < (int32_t)size - 1 ? src_end : (int32_t)size - 1;
+    src_start = src_start < src_end ? src_start : src_end;
+    if(src_start - start > 1e-3)
+      taps[num_taps++] = (struct area_tap){idx, src_start - 1, (float)((src_start - start) / cell_size)};
+    for(
+        int32_t src = src_start;
+        src < src_end;
+        src++
+       )
+    {
+      taps[num_taps++] = (struct area_tap){idx, src, (float)(1.0 / cell_size)};
+    }
+    if(end - src_end > 1e-3)
+      taps[num_taps++] = (struct area_tap){idx, src_end, (float)(fmin(fmin(end - src_end, 1.0), cell_size) / cell_size)};
+  }
+  return num_taps;
+}
+
+// Horizontally interpolated source row `src_row`, computed unless cached. `other` is the cache slot to keep.
+static const int16_t *linear_row(
+    struct preprocess_state *s,
+    uint32_t src_row,
+    uint32_t other
+    )
+{
+  for(
+      uint32_t slot = 0;
+      slot < 2;
+      slot++
+     )
+  {
+    if(s->cached_indices[slot] == src_row)
+      return s->cached_rows[slot];
+  }
+  uint32_t slot = s->cached_indices[0] == other ? 1 : 0,
+           width = s->width;
+  const uint8_t *restrict src = s->image + src_row * s->stride;
+  const struct linear_tap *restrict taps = s->cols;
+  int16_t *restrict row = s->cached_rows[slot];
+  for(
+      uint32_t x = 0;
+      x < width;
+      x++
+     )
+  {
+    const uint8_t *low = src + taps[x].low,
+                  *high = src + taps[x].high;
+    int32_t low_weight = taps[x].weights[0],
+            high_weight = taps[x].weights[1];
+    row[x * PREPROCESS_CHANNELS] = (low[0] * low_weight + high[0] * high_weight) >> 4;
+    row[x * PREPROCESS_CHANNELS + 1] = (low[1] * low_weight + high[1] * high_weight) >> 4;
+    row[x * PREPROCESS_CHANNELS + 2] = (low[2] * low_weight + high[2] * high_weight) >> 4;
+  }
+  s->cached_indices[slot] = src_row;
+  return row;
+}
+
+// Output row `y` by bilinear interpolation. Rows are blended with OpenCV's vectorized rounding: each product keeps the
+// 16 high bits of 16-bit operands.
+static void resample_linear_row(
+    struct preprocess_state *s,
+    uint32_t y
+    )
+{
+  const struct linear_tap *tap = &(s->rows[y]);
+  const int16_t *restrict low = linear_row(s, tap->low, tap->high),
+                *restrict high = linear_row(s, tap->high, tap->low);
+  int16_t low_weight = tap->weights[0],
+          high_weight = tap->weights[1];
+  uint32_t num_values = s->width * PREPROCESS_CHANNELS;
+  uint8_t *restrict row = s->row;
+  for(
+      uint32_t idx = 0;
+      idx < num_values;
+      idx++
+     )
+  {
+    int16_t value = ((low[idx] * low_weight) >> 16) + ((high[idx] * high_weight) >> 16);
+    row[idx] = saturate_uint8((value + 2) >> 2);
+  }
+}
+
+// Output row `y` by area averaging with integer scales.
+static void resample_area_fast_row(
+    struct preprocess_state *s,
+    uint32_t y
+    )
+{
+  uint32_t iscale_x = s->iscale_x,
+           iscale_y = s->iscale_y,
+           area = iscale_x * iscale_y;
+  float inv_area = 1.0f / area;
+  size_t stride = s->stride;
+  const uint8_t *restrict src = s->image + (s->top + y) * iscale_y * stride;
+  uint8_t *restrict row = s->row;
+  for(
+      uint32_t x = 0;
+      x < s->width;
+      x++
+     )
+  {
+    const uint8_t *cell = src + (s->left + x) * iscale_x * PREPROCESS_CHANNELS;
+    for(
+        uint32_t c = 0;
+        c < PREPROCESS_CHANNELS;
+        c++
+       )
+    {
+      int32_t sum = 0;
+      for(
+          uint32_t dy = 0;
+          dy < iscale_y;
+          dy++
+         )
+      {
+        for(
+            uint32_t dx = 0;
+            dx < iscale_x;
+            dx++
+           )
+        {
+          sum += cell[dy * stride + dx * PREPROCESS_CHANNELS + c];
+        }
+      }
+      // OpenCV halves ties up when averaging 2x2 cells, and to even otherwise.
+      row[x * PREPROCESS_CHANNELS + c] = area == 4 ? (sum + 2) >> 2 : saturate_uint8(round_float(sum * inv_area));
+    }
+  }
+}
+
+// Round the averaged output row and map it to output row `y`.
+static void store_area_row(
+    struct preprocess_state *s,
+    uint32_t y,
+    struct preprocess_output *o
+    )
+{
+  uint32_t num_values = s->width * PREPROCESS_CHANNELS;
+  const float *restrict sum = s->sum;
+  uint8_t *restrict row = s->row;
+  for(
+      uint32_t idx = 0;
+      idx < num_values;
+      idx++
+     )
+  {
+    row[idx] = saturate_uint8(round_float(sum[idx]));
+  }
+  store_row(s, y, o);
+}
+
+// Output rows by area averaging with float weights, in one sweep over the source rows of all row taps.
+static void resample_area_rows(
+    struct preprocess_state *s,
+    struct preprocess_output *o
+    )
+{
+  uint32_t num_values = s->width * PREPROCESS_CHANNELS,
+           num_col_taps = s->num_col_taps;
+  const struct area_tap *restrict col_taps = s->col_taps;
+  float *restrict buffer = s->buffer,
+        *restrict sum = s->sum;
+  for(
+      uint32_t idx = 0;
+      idx < s->num_row_taps;
+      idx++
+     )
+  {
+    const struct area_tap *row_tap = &(s->row_taps[idx]);
+    const uint8_t *restrict src = s->image + row_tap->src * s->stride;
+    float weight = row_tap->weight;
+    memset(buffer, 0, num_values * sizeof(float));
+    for(
+        uint32_t col_idx = 0;
+        col_idx < num_col_taps;
+        col_idx++
+       )
+    {
+      float *values = buffer + col_taps[col_idx].dst * PREPROCESS_CHANNELS;
+      const uint8_t *pixel = src + col_taps[col_idx].src * PREPROCESS_CHANNELS;
+      float col_weight = col_taps[col_idx].weight;
+      values[0] += pixel[0] * col_weight;
+      values[1] += pixel[1] * col_weight;
+      values[2] += pixel[2] * col_weight;
+    }
+    // Row taps are sorted by output row, whose first tap starts its sum.
+    if(idx == 0 || row_tap->dst != row_tap[-1].dst)
+    {
+      if(idx > 0)
+        store_area_row(s, row_tap[-1].dst, o);
+      for(
+          uint32_t value_idx = 0;
+          value_idx < num_values;
+          value_idx++
+         )
+      {
+        sum[value_idx] = weight * buffer[value_idx];
+      }
+    }
+    else
+    {
+      for(
+          uint32_t value_idx = 0;
+          value_idx < num_values;
+          value_idx++
+         )
+      {
+        sum[value_idx] += weight * buffer[value_idx];
+      }
+    }
+  }
+  store_area_row(s, s->row_taps[s->num_row_taps - 1].dst, o);
+}
+
+static void init_output(
+    const struct preprocess_options *options,
+    enum tensor_type type,
+    float scale,
+    int32_t zero_point,
+    void *data,
+    struct preprocess_output *o
+    )
+{
+  int32_t min = type == TT_INT8 ? INT8_MIN : 0,
+          max = type == TT_INT8 ? INT8_MAX : UINT8_MAX;
+  if(type != TT_FLOAT32 && type != TT_UINT8 && type != TT_INT8)
+  {
+    errno = EINVAL;
+    ERRORF("Preprocessing into tensors of type %d", type);
+  }
+  if(type != TT_FLOAT32 && !(scale > 0.0f))
+  {
+    errno = EINVAL;
+    ERRORF("Quantizing with scale %g", scale);
+  }
+  o->type = type;
+  o->data = data;
+  for(
+      uint32_t c = 0;
+      c < PREPROCESS_CHANNELS;
+      c++
+     )
+  {
+    for(
+        uint32_t value = 0;
+        value <= UINT8_MAX;
+        value++
+       )
+    {
+      // Same operations as the Python preprocessors and quantize_image(), in float32.
+      float normalized = ((float)value / options->divisor - options->mean[c]) * options->multiplier;
+      o->values[c][value] = normalized;
+      if(type != TT_FLOAT32)
+      {
+        float quantized = nearbyintf(normalized / scale) + zero_point;
+        o->quantized[c][value] = (uint8_t)(int32_t)(quantized < min ? min : (quantized > max ? max : quantized));
+      }
+    }
+  }
+}
+
+void preprocess_image(
+    const uint8_t *image,
+    uint32_t height,
+    uint32_t width,
+    size_t stride,
+    const struct preprocess_options *options,
+    enum tensor_type type,
+    float scale,
+    int32_t zero_point,
+    void *output
+    )
+{
+  struct preprocess_state s = {
+    .image = image,
+    .stride = stride,
+    .width = options->width,
+    .height = options->height,
+    .cached_indices = {UINT32_MAX, UINT32_MAX},
+  };
+  struct preprocess_output *o;
+  uint32_t resized_height = (uint32_t)(100.0 * options->height / options->crop_percent),
+           resized_width = (uint32_t)(100.0 * options->width / options->crop_percent);
+  bool is_area;
+  if((o = malloc(sizeof(struct preprocess_output))) == NULL)
+    ERROR();
+  init_output(options, type, scale, zero_point, output, o);
+
+  // Resize the shorter side, then crop the center.
+  if(height == 0 || width == 0)
+  {
+    errno = EINVAL;
+    ERRORF("Preprocessing a %ux%u image into %ux%u", width, height, s.width, s.height);
+  }
+  if(height > width)
+    resized_height = (uint32_t)((double)((uint64_t)resized_height * height) / width);
+  else
+    resized_width = (uint32_t)((double)((uint64_t)resized_width * width) / height);
+  if(resized_height < s.height || resized_width < s.width)
+  {
+    errno = EINVAL;
+    ERRORF("Preprocessing a %ux%u image into %ux%u", width, height, s.width, s.height);
+  }
+  s.left = (resized_width - s.width) / 2;
+  s.top = (resized_height - s.height) / 2;
+  s.scale_x = 1.0 / ((double)resized_width / width);
+  s.scale_y = 1.0 / ((double)resized_height / height);
+  is_area = options->interpolation == PI_AREA;
+
+  if(is_area && s.scale_x >= 1.0 && s.scale_y >= 1.0)
+  {
+    s.iscale_x = (uint32_t)lround(s.scale_x);
+    s.iscale_y = (uint32_t)lround(s.scale_y);
+    if(fabs(s.scale_x - s.iscale_x) >= __DBL_EPSILON__ || fabs(s.scale_y - s.iscale_y) >= __DBL_EPSILON__)
+      s.iscale_x = s.iscale_y = 0;
+  }
+  if(
+      (s.row = malloc(s.width * PREPROCESS_CHANNELS)) == NULL ||
+      (s.cols = malloc((s.width + s.height) * sizeof(struct linear_tap))) == NULL
+    )
+  {
+    ERROR();
+  }
+  s.rows = s.cols + s.width;
+
+  if(s.iscale_x > 0)
+  {
+    for(
+        uint32_t y = 0;
+        y < s.height;
+        y++
+       )
+    {
+      resample_area_fast_row(&s, y);
+      store_row(&s, y, o);
+    }
+  }
+  else if(is_area && s.scale_x >= 1.0 && s.scale_y >= 1.0)
+  {
+    uint32_t max_col_taps = s.width * ((uint32_t)ceil(s.scale_x) + 1),
+             max_row_taps = s.height * ((uint32_t)ceil(s.scale_y) + 1);
+    if(
+        (s.col_taps = malloc((max_col_taps + max_row_taps) * sizeof(struct area_tap))) == NULL ||
+        (s.buffer = malloc(2 * s.width * PREPROCESS_CHANNELS * sizeof(float))) == NULL
+      )
+    {
+      ERROR();
+    }
+    s.row_taps = s.col_taps + max_col_taps;
+    s.sum = s.buffer + s.width * PREPROCESS_CHANNELS;
+    s.num_col_taps = compute_area_taps(s.scale_x, width, s.left, s.width, s.col_taps);
+    s.num_row_taps = compute_area_taps(s.scale_y, height, s.top, s.height, s.row_taps);
+    resample_area_rows(&s, o);
+    free(s.col_taps);
+    free(s.buffer);
+  }
+  else
+  {
+    for(
+        uint32_t x = 0;
+        x < s.width;
+        x++
+       )
+    {
+      compute_linear_tap(is_area, s.scale_x, width, s.left + x, &(s.cols[x]));
+      s.cols[x].low *= PREPROCESS_CHANNELS;
+      s.cols[x].high *= PREPROCESS_CHANNELS;
+    }
+    for(
+        uint32_t y = 0;
+        y < s.height;
+        y++
+       )
+    {
+      compute_linear_tap(is_area, s.scale_y, height, s.top + y, &(s.rows[y]));
+    }
+    if((s.cached_rows[0] = malloc(2 * s.width * PREPROCESS_CHANNELS * sizeof(int16_t))) == NULL)
+      ERROR();
+    s.cached_rows[1] = s.cached_rows[0] + s.width * PREPROCESS_CHANNELS;
+    for(
+        uint32_t y = 0;
+        y < s.height;
+        y++
+       )
+    {
+      resample_linear_row(&s, y);
+      store_row(&s, y, o);
+    }
+    free(s.cached_rows[0]);
+  }
+  free(s.cols);
+  free(s.row);
+  free(o);
+}
@@ -0,0 +1,51 @@
+// Image preprocessing.
+// Preprocesses decoded 8-bit BGR images into model inputs like the preprocessors of `python/cv2_preprocessors.py`, but
+// in one pass over the output: color conversion, aspect-preserving resize, center crop, normalization and quantization
+// are fused, only the source pixels under the crop are resampled and no intermediate image is stored. Resampling
+// follows OpenCV's `INTER_LINEAR` and `INTER_AREA`, including their 8-bit rounding, so that outputs match those of the
+// Python preprocessors. `python/benchmark_preprocessors.py` checks parity and compares throughput.
+#ifndef MLTOOLS_ENGINE_PREPROCESS_H
+#define MLTOOLS_ENGINE_PREPROCESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../model.h"
+
+enum preprocess_interpolation
+{
+  PI_LINEAR = 0,                // cv2.INTER_LINEAR
+  PI_AREA = 1,                  // cv2.INTER_AREA
+};
+
+struct preprocess_options
+{
+  uint32_t height;              // output size
+  uint32_t width;
+  float crop_percent;           // percentage of the resized image's shorter side kept by the center crop
+  enum preprocess_interpolation interpolation;
+  float divisor;                // RGB values are normalized to (value / divisor - mean) * multiplier
+  float mean[3];
+  float multiplier;
+};
+
+// Options of `pre_process_vgg()` and `pre_process_mobilenet()`.
+extern const struct preprocess_options preprocess_vgg;
+extern const struct preprocess_options preprocess_mobilenet;
+
+// Preprocess the BGR image of `height` rows of `stride` bytes at `image` into the RGB NHWC image at `output`, of float
+// values if `type` is TT_FLOAT32, or of values quantized with `scale` and `zero_point` if it is TT_UINT8 or TT_INT8.
+// Quantized values are rounded half to even like `numpy.round()` and saturated.
+void preprocess_image(
+    const uint8_t *image,
+    uint32_t height,
+    uint32_t width,
+    size_t stride,
+    const struct preprocess_options *options,
+    enum tensor_type type,
+    float scale,
+    int32_t zero_point,
+    void *output
+    );
+
+#endif //ifndef MLTOOLS_ENGINE_PREPROCESS_H
@@ -0,0 +1,257 @@
+// Operator profiler.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cost.h"
+#include "../exceptions.h"
+#include "kernels.h"
+#include "profile.h"
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void estimate_cost(
+    const struct engine *e,
+    const struct engine_operator *op,
+    struct operator_profile *profile
+    )
+{
+  const struct engine_tensor *input = op->num_inputs > 0 && op->inputs[0] >= 0 ? &(e->tensors[op->inputs[0]]) : NULL,
+                             *weights = op->num_inputs > 1 && op->inputs[1] >= 0 ? &(e->tensors[op->inputs[1]]) : NULL,
+                             *output = &(e->tensors[op->outputs[0]]);
+  for(
+      uint16_t input_idx = 0;
+      input_idx < op->num_inputs;
+      input_idx++
+     )
+  {
+    if(op->inputs[input_idx] >= 0)
+      profile->bytes_read += e->tensors[op->inputs[input_idx]].size;
+  }
+  for(
+      uint16_t output_idx = 0;
+      output_idx < op->num_outputs;
+      output_idx++
+     )
+  {
+    profile->bytes_written += e->tensors[op->outputs[output_idx]].size;
+  }
+  profile->macs = operator_macs(
+      op->builtin_code,
+      input != NULL ? tensor_num_elements(input) : 0,
+      tensor_num_elements(output),
+      weights != NULL ? weights->shape : NULL,
+      weights != NULL ? weights->num_dims : 0,
+      op->builtin_code == BO_AVERAGE_POOL_2D || op->builtin_code == BO_MAX_POOL_2D ?
+        (uint64_t)op->builtin_options.pool2d_options.filter_width * op->builtin_options.pool2d_options.filter_height : 0
+      );
+}
+
+struct profiler *profiler_create(
+    const struct engine *e,
+    size_t max_events
+    )
+{
+  struct profiler *p;
+  if(max_events == 0)
+    max_events = PROFILE_DEFAULT_MAX_EVENTS;
+  if(
+      (p = calloc(1, sizeof(struct profiler))) == NULL ||
+      (p->operators = calloc(e->num_operators + 1, sizeof(struct operator_profile))) == NULL ||
+      (p->events = calloc(max_events, sizeof(struct profile_event))) == NULL
+    )
+    ERROR();
+  p->num_operators = e->num_operators;
+  p->max_events = max_events;
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    estimate_cost(e, &(e->operators[op_idx]), &(p->operators[op_idx]));
+  }
+  profiler_reset(p);
+  return p;
+}
+
+void profiler_destroy(
+    struct profiler *p
+    )
+{
+  if(p == NULL)
+    return;
+  free(p->operators);
+  free(p->events);
+  free(p);
+}
+
+void profiler_reset(
+    struct profiler *p
+    )
+{
+  for(
+      uint32_t op_idx = 0;
+      op_idx < p->num_operators;
+      op_idx++
+     )
+  {
+    p->operators[op_idx].num_invocations = 0;
+    p->operators[op_idx].total_ns = 0;
+    p->operators[op_idx].max_ns = 0;
+  }
+  atomic_store(&(p->num_events), 0);
+  p->origin_ns = now_ns();
+}
+
+void profile_invoke(
+    struct engine *e,
+    uint32_t op_idx,
+    uint32_t worker_idx
+    )
+{
+  struct profiler *p = e->profiler;
+  struct engine_operator *op = &(e->operators[op_idx]);
+  // Operators run at most once at a time, so their statistics need no synchronization; only trace slots are shared.
+  struct operator_profile *profile = &(p->operators[op_idx]);
+  uint64_t start_ns = now_ns(), duration_ns;
+  size_t event_idx;
+  op->kernel->invoke(e, op);
+  duration_ns = now_ns() - start_ns;
+  profile->num_invocations++;
+  profile->total_ns += duration_ns;
+  if(duration_ns > profile->max_ns)
+    profile->max_ns = duration_ns;
+  if((event_idx = atomic_fetch_add(&(p->num_events), 1)) < p->max_events)
+  {
+    p->events[event_idx].op_idx = op_idx;
+    p->events[event_idx].worker_idx = worker_idx;
+    p->events[event_idx].start_ns = start_ns - p->origin_ns;
+    p->events[event_idx].duration_ns = duration_ns;
+  }
+}
+
+struct profiled_operator
+{
+  uint64_t total_ns;
+  uint32_t op_idx;
+};
+
+static int compare_profiled_operators(
+    const void *a,
+    const void *b
+    )
+{
+  const struct profiled_operator *profiled_a = a,
+                                 *profiled_b = b;
+  if(profiled_a->total_ns != profiled_b->total_ns)
+    return profiled_a->total_ns > profiled_b->total_ns ? -1 : 1;
+  return profiled_a->op_idx < profiled_b->op_idx ? -1 : 1;
+}
+
+void profiler_print_table(
+    const struct engine *e,
+    FILE *f
+    )
+{
+  const struct profiler *p = e->profiler;
+  struct profiled_operator *order;
+  uint64_t total_ns = 0, total_macs = 0;
+  if(p == NULL)
+    return;
+  if((order = malloc((e->num_operators + 1) * sizeof(struct profiled_operator))) == NULL)
+    ERROR();
+  for(
+      uint32_t op_idx = 0;
+      op_idx < e->num_operators;
+      op_idx++
+     )
+  {
+    order[op_idx].total_ns = p->operators[op_idx].total_ns;
+    order[op_idx].op_idx = op_idx;
+    total_ns += p->operators[op_idx].total_ns;
+    total_macs += p->operators[op_idx].macs * p->operators[op_idx].num_invocations;
+  }
+  qsort(order, e->num_operators, sizeof(struct profiled_operator), compare_profiled_operators);
+  fprintf(
+      f,
+      "%5s %-24s %8s %10s %10s %10s %6s %12s %8s %10s %10s\n",
+      "op", "name", "calls", "total_ms", "mean_us", "max_us", "%", "MACs", "GMAC/s", "read_KiB", "write_KiB"
+      );
+  for(
+      uint32_t order_idx = 0;
+      order_idx < e->num_operators;
+      order_idx++
+     )
+  {
+    const struct operator_profile *profile = &(p->operators[order[order_idx].op_idx]);
+    double mean_ns = profile->num_invocations > 0 ? (double)profile->total_ns / profile->num_invocations : 0.0;
+    fprintf(
+        f,
+        "%5u %-24s %8lu %10.3f %10.1f %10.1f %6.2f %12lu %8.2f %10.1f %10.1f\n",
+        order[order_idx].op_idx,
+        e->operators[order[order_idx].op_idx].name,
+        (unsigned long)profile->num_invocations,
+        profile->total_ns * 1e-6,
+        mean_ns * 1e-3,
+        profile->max_ns * 1e-3,
+        total_ns > 0 ? 100.0 * profile->total_ns / total_ns : 0.0,
+        (unsigned long)profile->macs,
+        mean_ns > 0.0 ? profile->macs / mean_ns : 0.0,
+        profile->bytes_read / 1024.0,
+        profile->bytes_written / 1024.0
+        );
+  }
+  fprintf(
+      f,
+      "%5s %-24s %8s %10.3f %10s %10s %6.2f %12lu\n",
+      "", "total", "", total_ns * 1e-6, "", "", 100.0, (unsigned long)total_macs
+      );
+  free(order);
+}
+
+void profiler_write_trace(
+    const struct engine *e,
+    FILE *f
+    )
+{
+  const struct profiler *p = e->profiler;
+  size_t num_events;
+  if(p == NULL)
+    return;
+  num_events = atomic_load(&(p->num_events));
+  if(num_events > p->max_events)
+    num_events = p->max_events;
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for(
+      size_t event_idx = 0;
+      event_idx < num_events;
+      event_idx++
+     )
+  {
+    const struct profile_event *event = &(p->events[event_idx]);
+    const struct operator_profile *profile = &(p->operators[event->op_idx]);
+    fprintf(
+        f,
+        "%s\n  {\"name\": \"%s\", \"cat\": \"operator\", \"ph\": \"X\", \"pid\": 0, \"tid\": %u, "
+        "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"op\": %u, \"macs\": %lu, \"bytes_read\": %lu, "
+        "\"bytes_written\": %lu}}",
+        event_idx > 0 ? "," : "",
+        e->operators[event->op_idx].name,
+        event->worker_idx,
+        event->start_ns * 1e-3,
+        event->duration_ns * 1e-3,
+        event->op_idx,
+        (unsigned long)profile->macs,
+        (unsigned long)profile->bytes_read,
+        (unsigned long)profile->bytes_written
+        );
+  }
+  fprintf(f, "\n]}\n");
+}
@@ -0,0 +1,78 @@
+// Operator profiler.
+// When `engine_options.is_profiling` is set, every operator invocation is timed and accumulated per operator together
+// with its estimated cost, and recorded as a trace event. Results are dumped as a table sorted by total time or as a
+// Chrome trace (load it in chrome://tracing or Perfetto). Disabled profiling costs one branch per operator.
+#ifndef MLTOOLS_ENGINE_PROFILE_H
+#define MLTOOLS_ENGINE_PROFILE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+
+#define PROFILE_DEFAULT_MAX_EVENTS 65536
+
+struct operator_profile
+{
+  uint64_t num_invocations;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t macs;                // estimated per invocation
+  uint64_t bytes_read;          // per invocation, including weights
+  uint64_t bytes_written;       // per invocation
+};
+
+struct profile_event
+{
+  uint32_t op_idx;
+  uint32_t worker_idx;
+  uint64_t start_ns;            // relative to the profiler's creation
+  uint64_t duration_ns;
+};
+
+struct profiler
+{
+  struct operator_profile *operators;
+  uint32_t num_operators;
+  struct profile_event *events;
+  size_t max_events;            // events beyond this count are dropped from the trace
+  atomic_size_t num_events;
+  uint64_t origin_ns;
+};
+
+// Create the profiler of `e`, estimating the cost of every operator.
+struct profiler *profiler_create(
+    const struct engine *e,
+    size_t max_events
+    );
+
+void profiler_destroy(
+    struct profiler *p
+    );
+
+// Clear all recorded invocations.
+void profiler_reset(
+    struct profiler *p
+    );
+
+// Run operator `op_idx` of `e` on thread `worker_idx` and record it.
+void profile_invoke(
+    struct engine *e,
+    uint32_t op_idx,
+    uint32_t worker_idx
+    );
+
+// Print per-operator statistics, slowest operators first.
+void profiler_print_table(
+    const struct engine *e,
+    FILE *f
+    );
+
+// Write recorded invocations in the Chrome trace event format.
+void profiler_write_trace(
+    const struct engine *e,
+    FILE *f
+    );
+
+#endif //ifndef MLTOOLS_ENGINE_PROFILE_H
@@ -0,0 +1,161 @@
+// Fixed-point arithmetic shared by quantized kernels.
+// Real multipliers are represented as a Q31 `multiplier` and a power-of-two `shift` (positive shifts left), following
+// the asymmetric quantization scheme of TF Lite: real = scale * (quantized - zero_point).
+#ifndef MLTOOLS_ENGINE_QUANT_H
+#define MLTOOLS_ENGINE_QUANT_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include "../model.h"
+
+// Decompose `real_multiplier` into a Q31 multiplier and a shift.
+static inline void quantize_multiplier(
+    double real_multiplier,
+    int32_t *multiplier,
+    int *shift
+    )
+{
+  int64_t q_fixed;
+  if(real_multiplier == 0.0)
+  {
+    *multiplier = 0;
+    *shift = 0;
+    return;
+  }
+  q_fixed = llround(frexp(real_multiplier, shift) * (1ll << 31));
+  if(q_fixed == (1ll << 31))
+  {
+    q_fixed /= 2;
+    (*shift)++;
+  }
+  if(*shift < -31)
+  {
+    *shift = 0;
+    q_fixed = 0;
+  }
+  *multiplier = (int32_t)q_fixed;
+}
+
+static inline int32_t saturating_rounding_doubling_high_mul(
+    int32_t a,
+    int32_t b
+    )
+{
+  int64_t ab = (int64_t)a * (int64_t)b;
+  int64_t nudge = ab >= 0 ? (1ll << 30) : (1 - (1ll << 30));
+  if(a == INT32_MIN && b == INT32_MIN)
+    return INT32_MAX;
+  return (int32_t)((ab + nudge) / (1ll << 31));
+}
+
+static inline int32_t rounding_divide_by_pot(
+    int32_t x,
+    int exponent
+    )
+{
+  int32_t mask = (int32_t)((1ll << exponent) - 1);
+  int32_t remainder = x & mask;
+  int32_t threshold = (mask >> 1) + (x < 0 ? 1 : 0);
+  return (x >> exponent) + (remainder > threshold ? 1 : 0);
+}
+
+// Compute round(x * multiplier * 2^shift / 2^31).
+static inline int32_t multiply_by_quantized_multiplier(
+    int32_t x,
+    int32_t multiplier,
+    int shift
+    )
+{
+  int left_shift = shift > 0 ? shift : 0;
+  int right_shift = shift > 0 ? 0 : -shift;
+  return rounding_divide_by_pot(
+      saturating_rounding_doubling_high_mul(x * (1 << left_shift), multiplier),
+      right_shift
+      );
+}
+
+static inline int32_t quantized_min(
+    enum tensor_type type
+    )
+{
+  return type == TT_INT8 ? INT8_MIN : 0;
+}
+
+static inline int32_t quantized_max(
+    enum tensor_type type
+    )
+{
+  return type == TT_INT8 ? INT8_MAX : UINT8_MAX;
+}
+
+static inline int32_t quantize_value(
+    float value,
+    float scale,
+    int32_t zero_point
+    )
+{
+  return zero_point + (int32_t)lroundf(value / scale);
+}
+
+static inline int32_t clamp_int32(
+    int32_t x,
+    int32_t min,
+    int32_t max
+    )
+{
+  return x < min ? min : (x > max ? max : x);
+}
+
+// Range of quantized values that survives the fused activation function.
+static inline void quantized_activation_range(
+    enum activation_function_type activation,
+    enum tensor_type type,
+    float scale,
+    int32_t zero_point,
+    int32_t *act_min,
+    int32_t *act_max
+    )
+{
+  int32_t min = quantized_min(type),
+          max = quantized_max(type);
+  *act_min = min;
+  *act_max = max;
+  if(activation == AFT_RELU)
+    *act_min = clamp_int32(quantize_value(0.0f, scale, zero_point), min, max);
+  else if(activation == AFT_RELU6)
+  {
+    *act_min = clamp_int32(quantize_value(0.0f, scale, zero_point), min, max);
+    *act_max = clamp_int32(quantize_value(6.0f, scale, zero_point), min, max);
+  }
+  else if(activation == AFT_RELU_N1_TO_1)
+  {
+    *act_min = clamp_int32(quantize_value(-1.0f, scale, zero_point), min, max);
+    *act_max = clamp_int32(quantize_value(1.0f, scale, zero_point), min, max);
+  }
+}
+
+// Range of float values that survives the fused activation function.
+static inline void float_activation_range(
+    enum activation_function_type activation,
+    float *act_min,
+    float *act_max
+    )
+{
+  *act_min = -INFINITY;
+  *act_max = INFINITY;
+  if(activation == AFT_RELU)
+    *act_min = 0.0f;
+  else if(activation == AFT_RELU6)
+  {
+    *act_min = 0.0f;
+    *act_max = 6.0f;
+  }
+  else if(activation == AFT_RELU_N1_TO_1)
+  {
+    *act_min = -1.0f;
+    *act_max = 1.0f;
+  }
+}
+
+#endif //ifndef MLTOOLS_ENGINE_QUANT_H
@@ -0,0 +1,338 @@
+// Model registry.
+// Buffers are kept in a chained hash table indexed by their content hash and confirmed byte for byte. Releases look
+// buffers up by address in a second table, since engines only keep the shared pointers. Mapped files are few, so they
+// are kept in a list.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../exceptions.h"
+#include "engine.h"
+#include "kernels.h"
+#include "pack.h"
+#include "registry.h"
+
+#define REGISTRY_MIN_BUCKETS 64
+
+struct registry_buffer
+{
+  uint64_t hash;
+  size_t size;
+  uint8_t *data;
+  uint32_t num_refs;
+  struct registry_buffer *next_by_hash;
+  struct registry_buffer *next_by_address;
+};
+
+struct registry_mapping
+{
+  dev_t dev;                    // identity of the file mapped
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  uint8_t *map;
+  uint32_t num_refs;
+  struct registry_mapping *next;
+};
+
+struct registry
+{
+  pthread_mutex_t mutex;
+  struct registry_mapping *mappings;
+  struct registry_buffer **by_hash;   // buckets of buffers by content hash
+  struct registry_buffer **by_address; // buckets of buffers by address of their data
+  uint32_t num_buckets;               // a power of two
+  struct registry_stats stats;
+};
+
+static uint32_t address_bucket(
+    const struct registry *r,
+    const void *data
+    )
+{
+  uint64_t address = (uintptr_t)data;
+  return (uint32_t)((address >> 6) * 0x9e3779b97f4a7c15ull >> 32) & (r->num_buckets - 1);
+}
+
+static void alloc_buckets(
+    struct registry *r,
+    uint32_t num_buckets
+    )
+{
+  if(
+      (r->by_hash = calloc(num_buckets, sizeof(struct registry_buffer *))) == NULL ||
+      (r->by_address = calloc(num_buckets, sizeof(struct registry_buffer *))) == NULL
+    )
+    ERROR();
+  r->num_buckets = num_buckets;
+}
+
+static void insert_buffer(
+    struct registry *r,
+    struct registry_buffer *buffer
+    )
+{
+  uint32_t hash_bucket = buffer->hash & (r->num_buckets - 1),
+           address_idx = address_bucket(r, buffer->data);
+  buffer->next_by_hash = r->by_hash[hash_bucket];
+  r->by_hash[hash_bucket] = buffer;
+  buffer->next_by_address = r->by_address[address_idx];
+  r->by_address[address_idx] = buffer;
+}
+
+// Double the number of buckets once there are more buffers than buckets.
+static void grow_buckets(
+    struct registry *r
+    )
+{
+  struct registry_buffer **by_hash = r->by_hash;
+  uint32_t num_buckets = r->num_buckets;
+  if(r->stats.num_buffers < num_buckets)
+    return;
+  free(r->by_address);
+  alloc_buckets(r, 2 * num_buckets);
+  for(
+      uint32_t bucket_idx = 0;
+      bucket_idx < num_buckets;
+      bucket_idx++
+     )
+  {
+    struct registry_buffer *buffer = by_hash[bucket_idx];
+    while(buffer != NULL)
+    {
+      struct registry_buffer *next = buffer->next_by_hash;
+      insert_buffer(r, buffer);
+      buffer = next;
+    }
+  }
+  free(by_hash);
+}
+
+struct registry *registry_create()
+{
+  struct registry *r;
+  if((r = calloc(1, sizeof(struct registry))) == NULL)
+    ERROR();
+  pthread_mutex_init(&(r->mutex), NULL);
+  alloc_buckets(r, REGISTRY_MIN_BUCKETS);
+  return r;
+}
+
+void registry_destroy(
+    struct registry *r
+    )
+{
+  if(r == NULL)
+    return;
+  if(r->stats.num_buffers > 0 || r->stats.num_mappings > 0)
+    WARNINGF("Destroying registry still holding %u buffers and %u mappings", r->stats.num_buffers,
+        r->stats.num_mappings);
+  while(r->mappings != NULL)
+  {
+    struct registry_mapping *next = r->mappings->next;
+    munmap(r->mappings->map, r->mappings->size);
+    free(r->mappings);
+    r->mappings = next;
+  }
+  for(
+      uint32_t bucket_idx = 0;
+      bucket_idx < r->num_buckets;
+      bucket_idx++
+     )
+  {
+    struct registry_buffer *buffer = r->by_hash[bucket_idx];
+    while(buffer != NULL)
+    {
+      struct registry_buffer *next = buffer->next_by_hash;
+      free(buffer->data);
+      free(buffer);
+      buffer = next;
+    }
+  }
+  free(r->by_hash);
+  free(r->by_address);
+  pthread_mutex_destroy(&(r->mutex));
+  free(r);
+}
+
+const uint8_t *registry_share(
+    struct registry *r,
+    const void *data,
+    size_t size
+    )
+{
+  uint64_t hash = pack_hash(data, size);
+  struct registry_buffer *buffer;
+  pthread_mutex_lock(&(r->mutex));
+  for(
+      buffer = r->by_hash[hash & (r->num_buckets - 1)];
+      buffer != NULL;
+      buffer = buffer->next_by_hash
+     )
+  {
+    if(buffer->hash == hash && buffer->size == size && memcmp(buffer->data, data, size) == 0)
+      break;
+  }
+  if(buffer == NULL)
+  {
+    if(
+        (buffer = calloc(1, sizeof(struct registry_buffer))) == NULL ||
+        (buffer->data = aligned_alloc(ENGINE_ALIGNMENT, align_size(size > 0 ? size : 1))) == NULL
+      )
+      ERROR();
+    memcpy(buffer->data, data, size);
+    buffer->hash = hash;
+    buffer->size = size;
+    r->stats.num_buffers++;
+    r->stats.stored_bytes += size;
+    grow_buckets(r);
+    insert_buffer(r, buffer);
+  }
+  buffer->num_refs++;
+  r->stats.shared_bytes += size;
+  pthread_mutex_unlock(&(r->mutex));
+  return buffer->data;
+}
+
+// Unlink `buffer` from the chain starting at `head`, following the links at byte offset `link_offset` of each buffer.
+static void unlink_buffer(
+    struct registry_buffer **head,
+    struct registry_buffer *buffer,
+    size_t link_offset
+    )
+{
+  struct registry_buffer **link = head;
+  while(*link != buffer)
+    link = (struct registry_buffer **)((uint8_t *)*link + link_offset);
+  *link = *(struct registry_buffer **)((uint8_t *)buffer + link_offset);
+}
+
+void registry_release(
+    struct registry *r,
+    const void *data
+    )
+{
+  struct registry_buffer *buffer;
+  pthread_mutex_lock(&(r->mutex));
+  for(
+      buffer = r->by_address[address_bucket(r, data)];
+      buffer != NULL && buffer->data != data;
+      buffer = buffer->next_by_address
+     );
+  if(buffer == NULL)
+  {
+    errno = EINVAL;
+    ERROR("Releasing a buffer not stored in the registry");
+  }
+  r->stats.shared_bytes -= buffer->size;
+  if(--buffer->num_refs == 0)
+  {
+    unlink_buffer(
+        &(r->by_hash[buffer->hash & (r->num_buckets - 1)]),
+        buffer,
+        offsetof(struct registry_buffer, next_by_hash)
+        );
+    unlink_buffer(
+        &(r->by_address[address_bucket(r, data)]),
+        buffer,
+        offsetof(struct registry_buffer, next_by_address)
+        );
+    r->stats.num_buffers--;
+    r->stats.stored_bytes -= buffer->size;
+    free(buffer->data);
+    free(buffer);
+  }
+  pthread_mutex_unlock(&(r->mutex));
+}
+
+const uint8_t *registry_map_file(
+    struct registry *r,
+    int fd,
+    size_t *size
+    )
+{
+  struct registry_mapping *mapping;
+  struct stat file_stat;
+  uint8_t *map;
+  if(fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    return NULL;
+  pthread_mutex_lock(&(r->mutex));
+  for(
+      mapping = r->mappings;
+      mapping != NULL;
+      mapping = mapping->next
+     )
+  {
+    if(
+        mapping->dev == file_stat.st_dev && mapping->ino == file_stat.st_ino && mapping->size == file_stat.st_size &&
+        mapping->mtime.tv_sec == file_stat.st_mtim.tv_sec && mapping->mtime.tv_nsec == file_stat.st_mtim.tv_nsec
+      )
+      break;
+  }
+  if(mapping == NULL)
+  {
+    if((map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+      pthread_mutex_unlock(&(r->mutex));
+      return NULL;
+    }
+    if((mapping = calloc(1, sizeof(struct registry_mapping))) == NULL)
+      ERROR();
+    mapping->dev = file_stat.st_dev;
+    mapping->ino = file_stat.st_ino;
+    mapping->size = file_stat.st_size;
+    mapping->mtime = file_stat.st_mtim;
+    mapping->map = map;
+    mapping->next = r->mappings;
+    r->mappings = mapping;
+    r->stats.num_mappings++;
+    r->stats.mapped_bytes += file_stat.st_size;
+  }
+  mapping->num_refs++;
+  *size = mapping->size;
+  pthread_mutex_unlock(&(r->mutex));
+  return mapping->map;
+}
+
+void registry_unmap_file(
+    struct registry *r,
+    const void *map
+    )
+{
+  struct registry_mapping **link;
+  pthread_mutex_lock(&(r->mutex));
+  for(
+      link = &(r->mappings);
+      *link != NULL && (*link)->map != map;
+      link = &((*link)->next)
+     );
+  if(*link == NULL)
+  {
+    errno = EINVAL;
+    ERROR("Unmapping a file not mapped by the registry");
+  }
+  if(--(*link)->num_refs == 0)
+  {
+    struct registry_mapping *mapping = *link;
+    *link = mapping->next;
+    r->stats.num_mappings--;
+    r->stats.mapped_bytes -= mapping->size;
+    munmap(mapping->map, mapping->size);
+    free(mapping);
+  }
+  pthread_mutex_unlock(&(r->mutex));
+}
+
+void registry_get_stats(
+    struct registry *r,
+    struct registry_stats *stats
+    )
+{
+  pthread_mutex_lock(&(r->mutex));
+  *stats = r->stats;
+  pthread_mutex_unlock(&(r->mutex));
+}
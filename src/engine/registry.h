@@ -0,0 +1,65 @@
+// Model registry.
+// Engines opened with the same registry (`engine_options.registry`) store each distinct constant buffer and each
+// distinct set of pre-packed weights once, identified by a hash of their contents. Batch variants of a model written by
+// `replicate` only differ in their datapath and shape buffers, so hosting several of them costs about as much memory
+// as one. Engines mapping the same pre-packed weights cache share one read-only mapping of it through the registry,
+// keeping the cache's pages lazily faulted in. The registry is thread-safe and must outlive the engines opened with it.
+#ifndef MLTOOLS_ENGINE_REGISTRY_H
+#define MLTOOLS_ENGINE_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct registry;
+
+struct registry_stats
+{
+  uint32_t num_buffers;         // distinct buffers stored
+  size_t stored_bytes;          // bytes of the distinct buffers
+  size_t shared_bytes;          // bytes of all buffers held by open engines, counting every reference
+  uint32_t num_mappings;        // distinct files mapped
+  size_t mapped_bytes;          // bytes of the distinct files mapped
+};
+
+struct registry *registry_create();
+
+// Release the registry. All engines opened with it must be closed.
+void registry_destroy(
+    struct registry *r
+    );
+
+// Return the registry's copy of the `size` bytes at `data`, storing one if no equal buffer is stored yet. Each call
+// must be balanced by `registry_release()`.
+const uint8_t *registry_share(
+    struct registry *r,
+    const void *data,
+    size_t size
+    );
+
+// Drop a reference returned by `registry_share()`, freeing the buffer with its last reference.
+void registry_release(
+    struct registry *r,
+    const void *data
+    );
+
+// Map the whole file open at `fd` read-only, or return the registry's mapping of the same file (same device, inode,
+// size and modification time) if there is one, storing its size at `size`. Returns NULL if the file cannot be mapped.
+// Each mapping returned must be balanced by `registry_unmap_file()`.
+const uint8_t *registry_map_file(
+    struct registry *r,
+    int fd,
+    size_t *size
+    );
+
+// Drop a reference returned by `registry_map_file()`, unmapping the file with its last reference.
+void registry_unmap_file(
+    struct registry *r,
+    const void *map
+    );
+
+void registry_get_stats(
+    struct registry *r,
+    struct registry_stats *stats
+    );
+
+#endif //ifndef MLTOOLS_ENGINE_REGISTRY_H
@@ -0,0 +1,296 @@
+// Resize kernels.
+// Source rows and columns of every output row and column, and their interpolation weights, are computed by
+// `prepare()`, so that `invoke()` only blends whole NHWC pixels, which vectorizes across channels. Quantized tensors are
+// interpolated with fixed-point weights.
+// Sampling follows the legacy TF Lite convention: output pixel `i` samples input coordinate `i * scale`. Half-pixel
+// centers are not part of the v3 schema.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../exceptions.h"
+#include "kernels.h"
+#include "quant.h"
+
+#define RESIZE_WEIGHT_BITS 10 // fractional bits of fixed-point weights, so that products of two weights fit in 20 bits
+#define RESIZE_WEIGHT_ONE (1 << RESIZE_WEIGHT_BITS)
+
+// Source of one output row or column.
+struct resize_index
+{
+  int32_t low;                  // nearest source index, or the lower one of the two interpolated
+  int32_t high;
+  float weight;                 // weight of `high`
+  int32_t fixed_weight;         // weight of `high` in units of 1 / RESIZE_WEIGHT_ONE
+};
+
+struct resize_state
+{
+  bool is_bilinear;
+  struct resize_index *rows;    // one per output row, followed by one per output column
+  struct resize_index *cols;
+  struct resize_index indices[];
+};
+
+static void compute_indices(
+    bool is_bilinear,
+    bool align_corners,
+    int32_t in_size,
+    int32_t out_size,
+    struct resize_index *indices
+    )
+{
+  double scale = align_corners && out_size > 1 ? (double)(in_size - 1) / (out_size - 1) : (double)in_size / out_size;
+  for(
+      int32_t out_idx = 0;
+      out_idx < out_size;
+      out_idx++
+     )
+  {
+    double in_coord = out_idx * scale;
+    struct resize_index *index = &(indices[out_idx]);
+    if(is_bilinear)
+    {
+      index->low = (int32_t)floor(in_coord);
+      index->high = index->low + 1 < in_size ? index->low + 1 : in_size - 1;
+      index->weight = (float)(in_coord - index->low);
+      index->fixed_weight = (int32_t)lround((in_coord - index->low) * RESIZE_WEIGHT_ONE);
+    }
+    else
+    {
+      index->low = (int32_t)(align_corners ? round(in_coord) : floor(in_coord));
+      if(index->low > in_size - 1)
+        index->low = in_size - 1;
+      index->high = index->low;
+    }
+  }
+}
+
+static void prepare_resize(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *input = op_input(e, op, 0),
+                             *size = op_input(e, op, 1),
+                             *output = op_output(e, op, 0);
+  struct resize_state *state;
+  bool is_bilinear = op->builtin_code == BO_RESIZE_BILINEAR,
+       align_corners = is_bilinear ?
+         op->builtin_options.resize_bilinear_options.align_corners :
+         op->builtin_options.resize_nearest_neighbor_options.align_corners;
+  if(
+      input == NULL || input->num_dims != 4 || output->num_dims != 4 || input->type != output->type ||
+      output->shape[0] != input->shape[0] || output->shape[3] != input->shape[3] ||
+      input->shape[1] < 1 || input->shape[2] < 1
+    )
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s'", op->name, output->name);
+  }
+  if(
+      size != NULL && size->is_constant && size->type == TT_INT32 && tensor_num_elements(size) == 2 &&
+      (((const int32_t *)size->data)[0] != output->shape[1] || ((const int32_t *)size->data)[1] != output->shape[2])
+    )
+  {
+    errno = EINVAL;
+    ERRORF("%s producing '%s' of mismatching size", op->name, output->name);
+  }
+  if(
+      input->type != TT_FLOAT32 &&
+      (!is_quantized_type(input->type) || input->scale != output->scale || input->zero_point != output->zero_point)
+    )
+  {
+    errno = ENOTSUP;
+    ERRORF("%s of type %d producing '%s'", op->name, input->type, output->name);
+  }
+  state = calloc(1, sizeof(struct resize_state) + (output->shape[1] + output->shape[2]) * sizeof(struct resize_index));
+  if(state == NULL)
+    ERROR();
+  op->state = state;
+  state->is_bilinear = is_bilinear;
+  state->rows = state->indices;
+  state->cols = state->indices + output->shape[1];
+  compute_indices(is_bilinear, align_corners, input->shape[1], output->shape[1], state->rows);
+  compute_indices(is_bilinear, align_corners, input->shape[2], output->shape[2], state->cols);
+}
+
+// Interpolate `channels` float channels of one output pixel between four source pixels.
+static inline void blend_float(
+    const float *top_left,
+    const float *top_right,
+    const float *bottom_left,
+    const float *bottom_right,
+    float x_weight,
+    float y_weight,
+    float *out,
+    int32_t channels
+    )
+{
+  float top_left_weight = (1.0f - y_weight) * (1.0f - x_weight),
+        top_right_weight = (1.0f - y_weight) * x_weight,
+        bottom_left_weight = y_weight * (1.0f - x_weight),
+        bottom_right_weight = y_weight * x_weight;
+  for(
+      int32_t channel = 0;
+      channel < channels;
+      channel++
+     )
+  {
+    out[channel] =
+      top_left[channel] * top_left_weight + top_right[channel] * top_right_weight +
+      bottom_left[channel] * bottom_left_weight + bottom_right[channel] * bottom_right_weight;
+  }
+}
+
+// Interpolate `channels` quantized channels of one output pixel between four source pixels. Weights sum up to
+// RESIZE_WEIGHT_ONE^2, so that uniform areas are reproduced exactly.
+#define BLEND_QUANTIZED(type)\
+static inline void blend_##type(\
+    const type *top_left,\
+    const type *top_right,\
+    const type *bottom_left,\
+    const type *bottom_right,\
+    int32_t x_weight,\
+    int32_t y_weight,\
+    type *out,\
+    int32_t channels\
+    )\
+{\
+  int32_t top_left_weight = (RESIZE_WEIGHT_ONE - y_weight) * (RESIZE_WEIGHT_ONE - x_weight),\
+          top_right_weight = (RESIZE_WEIGHT_ONE - y_weight) * x_weight,\
+          bottom_left_weight = y_weight * (RESIZE_WEIGHT_ONE - x_weight),\
+          bottom_right_weight = y_weight * x_weight;\
+  for(\
+      int32_t channel = 0;\
+      channel < channels;\
+      channel++\
+     )\
+  {\
+    int32_t sum =\
+      top_left[channel] * top_left_weight + top_right[channel] * top_right_weight +\
+      bottom_left[channel] * bottom_left_weight + bottom_right[channel] * bottom_right_weight;\
+    out[channel] = (type)((sum + (1 << (2 * RESIZE_WEIGHT_BITS - 1))) >> (2 * RESIZE_WEIGHT_BITS));\
+  }\
+}
+
+BLEND_QUANTIZED(uint8_t)
+BLEND_QUANTIZED(int8_t)
+
+// Parallel loop body resizing output rows [begin, end) (over batches and output heights).
+static void resize_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  struct op_context *ctx = context;
+  const struct resize_state *state = ctx->op->state;
+  const struct engine_tensor *input = op_input(ctx->e, ctx->op, 0),
+                             *output = op_output(ctx->e, ctx->op, 0);
+  int32_t in_h = input->shape[1],
+          in_w = input->shape[2],
+          out_h = output->shape[1],
+          out_w = output->shape[2],
+          channels = input->shape[3];
+  size_t element_size = tensor_type_size(input->type),
+         pixel_size = channels * element_size,
+         out_row_size = out_w * pixel_size;
+  (void)worker_idx;
+  for(
+      size_t row = begin;
+      row < end;
+      row++
+     )
+  {
+    size_t batch = row / out_h;
+    const struct resize_index *row_index = &(state->rows[row % out_h]);
+    const uint8_t *top = input->data + (batch * in_h + row_index->low) * in_w * pixel_size,
+                  *bottom = input->data + (batch * in_h + row_index->high) * in_w * pixel_size;
+    uint8_t *out = output->data + row * out_row_size;
+    if(!state->is_bilinear)
+    {
+      // Upsampling repeats source rows: copy the previous output row when it has the same source.
+      if(row > begin && row % out_h > 0 && state->rows[row % out_h - 1].low == row_index->low)
+      {
+        memcpy(out, out - out_row_size, out_row_size);
+        continue;
+      }
+      for(
+          int32_t out_x = 0;
+          out_x < out_w;
+          out_x++
+         )
+      {
+        memcpy(out + out_x * pixel_size, top + state->cols[out_x].low * pixel_size, pixel_size);
+      }
+      continue;
+    }
+    for(
+        int32_t out_x = 0;
+        out_x < out_w;
+        out_x++
+       )
+    {
+      const struct resize_index *col_index = &(state->cols[out_x]);
+      size_t left = col_index->low * pixel_size,
+             right = col_index->high * pixel_size;
+      if(input->type == TT_FLOAT32)
+        blend_float(
+            (const float *)(top + left),
+            (const float *)(top + right),
+            (const float *)(bottom + left),
+            (const float *)(bottom + right),
+            col_index->weight,
+            row_index->weight,
+            (float *)(out + out_x * pixel_size),
+            channels
+            );
+      else if(input->type == TT_INT8)
+        blend_int8_t(
+            (const int8_t *)(top + left),
+            (const int8_t *)(top + right),
+            (const int8_t *)(bottom + left),
+            (const int8_t *)(bottom + right),
+            col_index->fixed_weight,
+            row_index->fixed_weight,
+            (int8_t *)(out + out_x * pixel_size),
+            channels
+            );
+      else
+        blend_uint8_t(
+            top + left,
+            top + right,
+            bottom + left,
+            bottom + right,
+            col_index->fixed_weight,
+            row_index->fixed_weight,
+            out + out_x * pixel_size,
+            channels
+            );
+    }
+  }
+}
+
+static void invoke_resize(
+    struct engine *e,
+    struct engine_operator *op
+    )
+{
+  const struct engine_tensor *output = op_output(e, op, 0);
+  struct op_context ctx = {.e = e, .op = op};
+  threadpool_parallel_for(
+      e->pool,
+      (size_t)output->shape[0] * output->shape[1],
+      parallel_grain((size_t)output->shape[2] * output->shape[3] * 4),
+      resize_range,
+      &ctx
+      );
+}
+
+const struct kernel resize_kernel = {
+  .prepare = prepare_resize,
+  .invoke = invoke_resize
+};
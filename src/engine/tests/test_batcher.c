@@ -0,0 +1,95 @@
+// Test batched inference.
+// Submit more samples than fit in one batch, some waited for and some completed through callbacks, to a batcher
+// driving a replicated model (`replicate MODEL.tflite 4 MODEL_x4.tflite`). Every sample must produce the same outputs
+// as the single-sample model.
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../batcher.h"
+
+#define MODEL "mobilenet_v1_1.0_224_quant"
+#define NUM_SAMPLES 10
+
+static atomic_int num_callbacks;
+
+static void count_callback(
+    struct batcher_request *request
+    )
+{
+  (void)request;
+  atomic_fetch_add(&num_callbacks, 1);
+}
+
+int main()
+{
+  struct engine *single = engine_open(MODEL ".tflite", NULL),
+                *batched = engine_open(MODEL "_x4.tflite", NULL);
+  struct batcher_options options = {.max_wait_us = 2000};
+  struct batcher *b = batcher_create(batched, &options);
+  struct batcher_request requests[NUM_SAMPLES];
+  size_t input_size = engine_input(single, 0)->size,
+         output_size = engine_output(single, 0)->size;
+  uint8_t *inputs = malloc(NUM_SAMPLES * input_size),
+          *outputs = malloc(NUM_SAMPLES * output_size);
+  const void *input_ptrs[NUM_SAMPLES];
+  void *output_ptrs[NUM_SAMPLES];
+  int status = 0;
+  if(inputs == NULL || outputs == NULL || batcher_batch_size(b) != 4)
+    return EINVAL;
+  memset(requests, 0, sizeof(requests));
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < NUM_SAMPLES;
+      sample_idx++
+     )
+  {
+    for(
+        size_t idx = 0;
+        idx < input_size;
+        idx++
+       )
+    {
+      inputs[sample_idx * input_size + idx] = (idx * 7 + sample_idx * 13) % 251;
+    }
+    input_ptrs[sample_idx] = inputs + sample_idx * input_size;
+    output_ptrs[sample_idx] = outputs + sample_idx * output_size;
+    requests[sample_idx].inputs = &(input_ptrs[sample_idx]);
+    requests[sample_idx].outputs = &(output_ptrs[sample_idx]);
+    requests[sample_idx].done = sample_idx % 2 ? count_callback : NULL;
+    batcher_submit(b, &(requests[sample_idx]));
+  }
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < NUM_SAMPLES;
+      sample_idx += 2
+     )
+  {
+    batcher_wait(b, &(requests[sample_idx]));
+  }
+  batcher_destroy(b); // completes the callbacks
+  if(atomic_load(&num_callbacks) != NUM_SAMPLES / 2)
+    status = EINVAL;
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < NUM_SAMPLES;
+      sample_idx++
+     )
+  {
+    memcpy(engine_input(single, 0)->data, inputs + sample_idx * input_size, input_size);
+    engine_invoke(single);
+    if(memcmp(engine_output(single, 0)->data, outputs + sample_idx * output_size, output_size) != 0)
+    {
+      printf("Sample %u differs.\n", sample_idx);
+      status = EINVAL;
+    }
+  }
+  free(inputs);
+  free(outputs);
+  engine_close(single);
+  engine_close(batched);
+  return status;
+}
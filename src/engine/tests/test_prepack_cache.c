@@ -0,0 +1,93 @@
+// Test pre-packed weights cache.
+// Open a model twice through the same cache: the first run packs the weights and writes the cache, the second maps
+// it back. Both runs must produce identical outputs. Two engines opened through a registry must then share one mapping
+// of the cache. The model must have weights to pack, or there is nothing to test.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../engine.h"
+#include "../registry.h"
+
+#define MODEL "mobilenet_v1_1.0_224_quant"
+
+// Run `e` over a deterministic input and return a copy of its first output.
+static uint8_t *run(
+    struct engine *e
+    )
+{
+  struct engine_tensor *input = engine_input(e, 0),
+                       *output = engine_output(e, 0);
+  uint8_t *result = malloc(output->size);
+  for(
+      size_t idx = 0;
+      idx < input->size;
+      idx++
+     )
+  {
+    input->data[idx] = idx * 7 % 251;
+  }
+  engine_invoke(e);
+  if(result)
+    memcpy(result, output->data, output->size);
+  return result;
+}
+
+int main()
+{
+  struct engine_options options = {.prepack_cache_path = MODEL ".pack"};
+  struct engine *e, *shared[2];
+  struct registry_stats stats;
+  uint8_t *packed_result = NULL, *cached_result = NULL;
+  size_t output_size;
+  int status = 0;
+  unlink(options.prepack_cache_path);
+  e = engine_open(MODEL ".tflite", &options);
+  if(e->pack_arena_size == 0)
+  {
+    printf("%s has no weights to pack.\n", MODEL);
+    engine_close(e);
+    return EINVAL;
+  }
+  output_size = engine_output(e, 0)->size;
+  packed_result = run(e);
+  if(e->pack_cache_map != NULL)
+    status = EINVAL; // nothing to map yet
+  engine_close(e);
+  e = engine_open(MODEL ".tflite", &options);
+  cached_result = run(e);
+  if(e->pack_cache_map == NULL)
+    status = ENOENT; // cache was not written or not accepted
+  if(!packed_result || !cached_result || memcmp(packed_result, cached_result, output_size) != 0)
+    status = EINVAL;
+  engine_close(e);
+  options.registry = registry_create();
+  for(
+      uint32_t engine_idx = 0;
+      engine_idx < 2;
+      engine_idx++
+     )
+  {
+    shared[engine_idx] = engine_open(MODEL ".tflite", &options);
+    free(cached_result);
+    cached_result = run(shared[engine_idx]);
+    if(!packed_result || !cached_result || memcmp(packed_result, cached_result, output_size) != 0)
+      status = EINVAL;
+  }
+  registry_get_stats(options.registry, &stats);
+  if(shared[0]->pack_cache_map == NULL || shared[0]->pack_cache_map != shared[1]->pack_cache_map || stats.num_mappings != 1)
+    status = ENOENT; // cache was not shared
+  engine_close(shared[0]);
+  engine_close(shared[1]);
+  registry_get_stats(options.registry, &stats);
+  if(stats.num_mappings != 0 || stats.num_buffers != 0)
+    status = EINVAL;
+  registry_destroy(options.registry);
+  if(packed_result) free(packed_result);
+  if(cached_result) free(cached_result);
+  unlink(options.prepack_cache_path);
+  return status;
+}
@@ -0,0 +1,85 @@
+// Test shared constant buffers.
+// Open a model and its replicated batch variant (`replicate MODEL.tflite 4 MODEL_x4.tflite`) through one registry. The
+// variant must add no stored weights, both must produce the same outputs as a privately loaded model and the registry
+// must be empty once they are closed.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../engine.h"
+#include "../registry.h"
+
+#define MODEL "mobilenet_v1_1.0_224_quant"
+
+int main()
+{
+  struct registry *r = registry_create();
+  struct engine_options options = {.registry = r};
+  struct engine *private = engine_open(MODEL ".tflite", NULL),
+                *single = engine_open(MODEL ".tflite", &options);
+  struct registry_stats single_stats, stats;
+  struct engine *batched;
+  size_t input_size = engine_input(private, 0)->size,
+         output_size = engine_output(private, 0)->size;
+  int status = 0;
+  registry_get_stats(r, &single_stats);
+  batched = engine_open(MODEL "_x4.tflite", &options);
+  registry_get_stats(r, &stats);
+  if(single_stats.num_buffers == 0 || stats.stored_bytes > single_stats.stored_bytes + single_stats.stored_bytes / 100)
+  {
+    printf("Batch variant stored %zu bytes on top of %zu.\n",
+        stats.stored_bytes - single_stats.stored_bytes, single_stats.stored_bytes);
+    status = EINVAL;
+  }
+  for(
+      size_t idx = 0;
+      idx < input_size;
+      idx++
+     )
+  {
+    engine_input(private, 0)->data[idx] = (idx * 7) % 251;
+  }
+  memcpy(engine_input(single, 0)->data, engine_input(private, 0)->data, input_size);
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < 4;
+      sample_idx++
+     )
+  {
+    memcpy(engine_input(batched, 0)->data + sample_idx * input_size, engine_input(private, 0)->data, input_size);
+  }
+  engine_invoke(private);
+  engine_invoke(single);
+  engine_invoke(batched);
+  if(memcmp(engine_output(private, 0)->data, engine_output(single, 0)->data, output_size) != 0)
+  {
+    printf("Shared model differs.\n");
+    status = EINVAL;
+  }
+  for(
+      uint32_t sample_idx = 0;
+      sample_idx < 4;
+      sample_idx++
+     )
+  {
+    if(memcmp(engine_output(private, 0)->data, engine_output(batched, 0)->data + sample_idx * output_size,
+          output_size) != 0)
+    {
+      printf("Sample %u of the batch variant differs.\n", sample_idx);
+      status = EINVAL;
+    }
+  }
+  engine_close(private);
+  engine_close(single);
+  engine_close(batched);
+  registry_get_stats(r, &stats);
+  if(stats.num_buffers != 0 || stats.shared_bytes != 0 || stats.num_mappings != 0)
+  {
+    printf("Registry still holds %u buffers and %u mappings.\n", stats.num_buffers, stats.num_mappings);
+    status = EINVAL;
+  }
+  registry_destroy(r);
+  return status;
+}
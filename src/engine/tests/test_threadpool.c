@@ -0,0 +1,153 @@
+// Test thread pool.
+// Run nested parallel loops from the calling thread and check that every index is visited exactly once, then run a
+// task graph and check that no task starts before its predecessors completed.
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../threadpool.h"
+
+#define COUNT 100000
+#define INNER_COUNT 64
+#define NUM_TASKS 300
+
+static struct threadpool *pool;
+static atomic_int visits[COUNT];
+static atomic_int inner_visits;
+static atomic_int completed[NUM_TASKS];
+static uint32_t predecessor_offsets[NUM_TASKS + 1];
+static uint32_t predecessors[2 * NUM_TASKS];
+static atomic_int graph_errors;
+
+static void inner_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  (void)context;
+  (void)worker_idx;
+  atomic_fetch_add(&inner_visits, end - begin);
+}
+
+static void outer_range(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  (void)context;
+  for(
+      size_t idx = begin;
+      idx < end;
+      idx++
+     )
+  {
+    atomic_fetch_add(&(visits[idx]), 1);
+    if(idx % 1000 == 0)
+      threadpool_parallel_for(pool, INNER_COUNT, 1, inner_range, NULL);
+  }
+  if(worker_idx >= threadpool_num_threads(pool))
+    atomic_fetch_add(&(visits[0]), COUNT); // out of range worker index
+}
+
+static void run_graph_task(
+    void *context,
+    size_t begin,
+    size_t end,
+    uint32_t worker_idx
+    )
+{
+  (void)context;
+  (void)end;
+  (void)worker_idx;
+  for(
+      uint32_t pred_pos = predecessor_offsets[begin];
+      pred_pos < predecessor_offsets[begin + 1];
+      pred_pos++
+     )
+  {
+    if(atomic_load(&(completed[predecessors[pred_pos]])) == 0)
+      atomic_fetch_add(&graph_errors, 1);
+  }
+  threadpool_parallel_for(pool, INNER_COUNT, 1, inner_range, NULL);
+  atomic_store(&(completed[begin]), 1);
+}
+
+int main()
+{
+  struct threadpool_graph *graph;
+  uint32_t num_predecessors = 0;
+  struct threadpool_options options = {.num_threads = 4};
+  int status = 0;
+  pool = threadpool_create(&options);
+  for(
+      int round = 0;
+      round < 10;
+      round++
+     )
+  {
+    threadpool_parallel_for(pool, COUNT, 16, outer_range, NULL);
+  }
+  for(
+      size_t idx = 0;
+      idx < COUNT;
+      idx++
+     )
+  {
+    if(atomic_load(&(visits[idx])) != 10)
+      status = EINVAL;
+  }
+  if(atomic_load(&inner_visits) != 10 * (COUNT / 1000) * INNER_COUNT)
+    status = EINVAL;
+  atomic_store(&inner_visits, 0);
+  // Task `idx` depends on tasks `idx / 2` and `idx / 3`, giving a wide graph.
+  for(
+      uint32_t task_idx = 0;
+      task_idx < NUM_TASKS;
+      task_idx++
+     )
+  {
+    predecessor_offsets[task_idx] = num_predecessors;
+    if(task_idx > 0)
+      predecessors[num_predecessors++] = task_idx / 2;
+    if(task_idx > 2 && task_idx / 3 != task_idx / 2)
+      predecessors[num_predecessors++] = task_idx / 3;
+  }
+  predecessor_offsets[NUM_TASKS] = num_predecessors;
+  graph = threadpool_graph_create(NUM_TASKS, predecessor_offsets, predecessors);
+  for(
+      int round = 0;
+      round < 10;
+      round++
+     )
+  {
+    for(
+        uint32_t task_idx = 0;
+        task_idx < NUM_TASKS;
+        task_idx++
+       )
+    {
+      atomic_store(&(completed[task_idx]), 0);
+    }
+    threadpool_run_graph(pool, graph, run_graph_task, NULL);
+    for(
+        uint32_t task_idx = 0;
+        task_idx < NUM_TASKS;
+        task_idx++
+       )
+    {
+      if(atomic_load(&(completed[task_idx])) == 0)
+        status = EINVAL;
+    }
+  }
+  if(atomic_load(&graph_errors) != 0)
+    status = EINVAL;
+  threadpool_graph_destroy(graph);
+  threadpool_destroy(pool);
+  return status;
+}
@@ -0,0 +1,674 @@
+// Work-stealing thread pool.
+// A parallel loop is a job counting its unprocessed indices. Whoever runs a task of the job keeps the first half of
+// its range and pushes the second half back onto its own deque until the range is no larger than the job's grain, so
+// that thieves always find the largest pieces at the front of a deque. Callers outside the pool push into a deque
+// shared by all of them and only ever run tasks of their own job, which keeps worker indices unique within a job.
+// A task graph is a job whose tasks are single indices. Completing a task releases the successors whose predecessors
+// all completed onto the deque of the thread that completed it.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../exceptions.h"
+#include "threadpool.h"
+
+#define THREADPOOL_DEQUE_CAPACITY 256
+#define THREADPOOL_SPIN_ROUNDS 64 // failed steal rounds before a thread blocks
+
+struct threadpool_graph
+{
+  uint32_t num_tasks;
+  uint32_t *num_predecessors;
+  uint32_t *successor_offsets;  // successors of task `idx` are `successors[successor_offsets[idx]:successor_offsets[idx + 1]]`
+  uint32_t *successors;
+  uint32_t *order;              // a topological order of the tasks, used when running without a pool
+  atomic_uint *pending;         // predecessors left to complete, per task
+};
+
+struct job
+{
+  threadpool_range_fn fn;
+  void *context;
+  size_t grain;
+  const struct threadpool_graph *graph; // NULL for parallel loops
+  atomic_size_t remaining;      // number of indices not processed yet
+};
+
+struct task
+{
+  struct job *job;
+  size_t begin;
+  size_t end;
+};
+
+// Bounded double-ended queue of tasks. The owner works at the back, thieves at the front.
+struct deque
+{
+  pthread_mutex_t mutex;
+  struct task tasks[THREADPOOL_DEQUE_CAPACITY];
+  uint32_t head;                // index of the oldest task
+  atomic_uint count;            // read without the lock to skip empty deques
+};
+
+struct worker
+{
+  struct threadpool *pool;
+  uint32_t idx;
+  uint32_t seed;                // state of the victim selection generator
+  pthread_t thread;
+  bool is_started;
+};
+
+struct threadpool
+{
+  uint32_t num_threads;
+  uint32_t num_workers;
+  struct worker *workers;
+  struct deque *deques;         // one per worker, followed by the one shared by callers outside the pool
+  atomic_uint num_queued;       // tasks sitting in any deque
+  atomic_uint num_sleeping;     // workers blocked on `work_cond`
+  atomic_bool stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;     // signaled when tasks are queued
+  pthread_cond_t done_cond;     // broadcast when a job completes
+};
+
+static _Thread_local struct threadpool *current_pool; // pool of the calling worker thread
+static _Thread_local uint32_t current_worker_idx;
+
+static bool deque_push_back(
+    struct deque *d,
+    const struct task *task
+    )
+{
+  bool is_pushed = false;
+  pthread_mutex_lock(&(d->mutex));
+  if(d->count < THREADPOOL_DEQUE_CAPACITY)
+  {
+    d->tasks[(d->head + d->count) % THREADPOOL_DEQUE_CAPACITY] = *task;
+    d->count++;
+    is_pushed = true;
+  }
+  pthread_mutex_unlock(&(d->mutex));
+  return is_pushed;
+}
+
+static bool deque_pop_back(
+    struct deque *d,
+    struct task *task
+    )
+{
+  bool is_popped = false;
+  pthread_mutex_lock(&(d->mutex));
+  if(d->count > 0)
+  {
+    d->count--;
+    *task = d->tasks[(d->head + d->count) % THREADPOOL_DEQUE_CAPACITY];
+    is_popped = true;
+  }
+  pthread_mutex_unlock(&(d->mutex));
+  return is_popped;
+}
+
+static bool deque_steal_front(
+    struct deque *d,
+    struct task *task
+    )
+{
+  bool is_stolen = false;
+  if(atomic_load_explicit(&(d->count), memory_order_relaxed) == 0)
+    return false;
+  pthread_mutex_lock(&(d->mutex));
+  if(d->count > 0)
+  {
+    *task = d->tasks[d->head];
+    d->head = (d->head + 1) % THREADPOOL_DEQUE_CAPACITY;
+    d->count--;
+    is_stolen = true;
+  }
+  pthread_mutex_unlock(&(d->mutex));
+  return is_stolen;
+}
+
+// Remove the newest task of `job` from `d`, if any.
+static bool deque_take_job(
+    struct deque *d,
+    const struct job *job,
+    struct task *task
+    )
+{
+  bool is_taken = false;
+  pthread_mutex_lock(&(d->mutex));
+  for(
+      uint32_t pos = d->count;
+      pos > 0 && !is_taken;
+      pos--
+     )
+  {
+    uint32_t task_idx = (d->head + pos - 1) % THREADPOOL_DEQUE_CAPACITY;
+    if(d->tasks[task_idx].job != job)
+      continue;
+    *task = d->tasks[task_idx];
+    // Close the gap by shifting the newer tasks down.
+    for(
+        uint32_t next_pos = pos;
+        next_pos < d->count;
+        next_pos++
+       )
+    {
+      d->tasks[(d->head + next_pos - 1) % THREADPOOL_DEQUE_CAPACITY] =
+        d->tasks[(d->head + next_pos) % THREADPOOL_DEQUE_CAPACITY];
+    }
+    d->count--;
+    is_taken = true;
+  }
+  pthread_mutex_unlock(&(d->mutex));
+  return is_taken;
+}
+
+static bool push_task(
+    struct threadpool *pool,
+    uint32_t deque_idx,
+    const struct task *task
+    )
+{
+  if(!deque_push_back(&(pool->deques[deque_idx]), task))
+    return false;
+  atomic_fetch_add(&(pool->num_queued), 1);
+  if(atomic_load(&(pool->num_sleeping)) > 0)
+  {
+    pthread_mutex_lock(&(pool->mutex));
+    pthread_cond_signal(&(pool->work_cond));
+    pthread_mutex_unlock(&(pool->mutex));
+  }
+  return true;
+}
+
+// Pop a task of worker `worker_idx`, or steal one from another deque.
+static bool find_task(
+    struct threadpool *pool,
+    uint32_t worker_idx,
+    struct task *task
+    )
+{
+  struct worker *worker = &(pool->workers[worker_idx]);
+  uint32_t num_deques = pool->num_workers + 1, victim_idx;
+  if(deque_pop_back(&(pool->deques[worker_idx]), task))
+  {
+    atomic_fetch_sub(&(pool->num_queued), 1);
+    return true;
+  }
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 17;
+  worker->seed ^= worker->seed << 5;
+  victim_idx = worker->seed % num_deques;
+  for(
+      uint32_t attempt = 0;
+      attempt < num_deques;
+      attempt++, victim_idx = (victim_idx + 1) % num_deques
+     )
+  {
+    if(victim_idx != worker_idx && deque_steal_front(&(pool->deques[victim_idx]), task))
+    {
+      atomic_fetch_sub(&(pool->num_queued), 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Split the range of `task` down to its job's grain, pushing the upper halves onto deque `deque_idx`, then run what is
+// left of it.
+static void complete_job_indices(
+    struct threadpool *pool,
+    struct job *job,
+    size_t count
+    )
+{
+  // The job may be released by its caller as soon as `remaining` drops to 0, so it must not be touched afterwards.
+  if(atomic_fetch_sub(&(job->remaining), count) == count)
+  {
+    pthread_mutex_lock(&(pool->mutex));
+    pthread_cond_broadcast(&(pool->done_cond));
+    pthread_mutex_unlock(&(pool->mutex));
+  }
+}
+
+static void run_task(
+    struct threadpool *pool,
+    const struct task *task,
+    uint32_t worker_idx,
+    uint32_t deque_idx
+    );
+
+// Run graph task `task_idx` and release its ready successors.
+static void run_graph_task(
+    struct threadpool *pool,
+    struct job *job,
+    uint32_t task_idx,
+    uint32_t worker_idx,
+    uint32_t deque_idx
+    )
+{
+  const struct threadpool_graph *graph = job->graph;
+  job->fn(job->context, task_idx, task_idx + 1, worker_idx);
+  for(
+      uint32_t succ_pos = graph->successor_offsets[task_idx];
+      succ_pos < graph->successor_offsets[task_idx + 1];
+      succ_pos++
+     )
+  {
+    uint32_t succ_idx = graph->successors[succ_pos];
+    if(atomic_fetch_sub(&(graph->pending[succ_idx]), 1) == 1)
+    {
+      struct task ready = {.job = job, .begin = succ_idx, .end = succ_idx + 1};
+      if(!push_task(pool, deque_idx, &ready))
+        run_task(pool, &ready, worker_idx, deque_idx);
+    }
+  }
+  complete_job_indices(pool, job, 1);
+}
+
+static void run_task(
+    struct threadpool *pool,
+    const struct task *task,
+    uint32_t worker_idx,
+    uint32_t deque_idx
+    )
+{
+  struct job *job = task->job;
+  size_t begin = task->begin, end = task->end;
+  if(job->graph != NULL)
+  {
+    run_graph_task(pool, job, begin, worker_idx, deque_idx);
+    return;
+  }
+  while(end - begin > job->grain)
+  {
+    struct task upper = {.job = job, .begin = begin + (end - begin) / 2, .end = end};
+    if(!push_task(pool, deque_idx, &upper))
+      break;
+    end = upper.begin;
+  }
+  job->fn(job->context, begin, end, worker_idx);
+  complete_job_indices(pool, job, end - begin);
+}
+
+static void *run_worker(
+    void *arg
+    )
+{
+  struct worker *worker = arg;
+  struct threadpool *pool = worker->pool;
+  uint32_t spin_rounds = 0;
+  current_pool = pool;
+  current_worker_idx = worker->idx;
+  while(!atomic_load(&(pool->stop)))
+  {
+    struct task task;
+    if(find_task(pool, worker->idx, &task))
+    {
+      run_task(pool, &task, worker->idx, worker->idx);
+      spin_rounds = 0;
+    }
+    else if(spin_rounds < THREADPOOL_SPIN_ROUNDS)
+    {
+      spin_rounds++;
+      sched_yield();
+    }
+    else
+    {
+      pthread_mutex_lock(&(pool->mutex));
+      atomic_fetch_add(&(pool->num_sleeping), 1);
+      while(atomic_load(&(pool->num_queued)) == 0 && !atomic_load(&(pool->stop)))
+        pthread_cond_wait(&(pool->work_cond), &(pool->mutex));
+      atomic_fetch_sub(&(pool->num_sleeping), 1);
+      pthread_mutex_unlock(&(pool->mutex));
+      spin_rounds = 0;
+    }
+  }
+  return NULL;
+}
+
+static void pin_worker(
+    struct worker *worker,
+    int32_t cpu
+    )
+{
+  cpu_set_t cpu_set;
+  int rc;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  if((rc = pthread_setaffinity_np(worker->thread, sizeof(cpu_set), &cpu_set)) != 0)
+  {
+    errno = rc;
+    WARNINGF("Pinning worker %u to CPU %d", worker->idx, cpu);
+  }
+}
+
+struct threadpool *threadpool_create(
+    const struct threadpool_options *options
+    )
+{
+  struct threadpool *pool;
+  long num_threads = options != NULL ? options->num_threads : 0;
+  if(num_threads == 0 && (num_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    num_threads = 1;
+  if(num_threads == 1)
+    return NULL;
+  if((pool = calloc(1, sizeof(struct threadpool))) == NULL)
+    ERROR();
+  pool->num_threads = num_threads;
+  pool->num_workers = num_threads - 1;
+  if(
+      (pool->workers = calloc(pool->num_workers, sizeof(struct worker))) == NULL ||
+      (pool->deques = calloc(pool->num_workers + 1, sizeof(struct deque))) == NULL
+    )
+    ERROR();
+  atomic_init(&(pool->num_queued), 0);
+  atomic_init(&(pool->num_sleeping), 0);
+  atomic_init(&(pool->stop), false);
+  pthread_mutex_init(&(pool->mutex), NULL);
+  pthread_cond_init(&(pool->work_cond), NULL);
+  pthread_cond_init(&(pool->done_cond), NULL);
+  for(
+      uint32_t deque_idx = 0;
+      deque_idx <= pool->num_workers;
+      deque_idx++
+     )
+  {
+    pthread_mutex_init(&(pool->deques[deque_idx].mutex), NULL);
+  }
+  for(
+      uint32_t worker_idx = 0;
+      worker_idx < pool->num_workers;
+      worker_idx++
+     )
+  {
+    struct worker *worker = &(pool->workers[worker_idx]);
+    int rc;
+    worker->pool = pool;
+    worker->idx = worker_idx;
+    worker->seed = 2654435761u * (worker_idx + 1);
+    if((rc = pthread_create(&(worker->thread), NULL, run_worker, worker)) != 0)
+    {
+      errno = rc;
+      ERRORF("Starting worker %u", worker_idx);
+    }
+    worker->is_started = true;
+    if(options != NULL && options->cpus != NULL && options->num_cpus > 0)
+      pin_worker(worker, options->cpus[worker_idx % options->num_cpus]);
+  }
+#ifdef DEBUG_THREADPOOL_C
+  printf("Started %u workers.\n", pool->num_workers);
+#endif //ifdef DEBUG_THREADPOOL_C
+  return pool;
+}
+
+void threadpool_destroy(
+    struct threadpool *pool
+    )
+{
+  if(pool == NULL)
+    return;
+  atomic_store(&(pool->stop), true);
+  pthread_mutex_lock(&(pool->mutex));
+  pthread_cond_broadcast(&(pool->work_cond));
+  pthread_mutex_unlock(&(pool->mutex));
+  for(
+      uint32_t worker_idx = 0;
+      worker_idx < pool->num_workers;
+      worker_idx++
+     )
+  {
+    if(pool->workers[worker_idx].is_started)
+      pthread_join(pool->workers[worker_idx].thread, NULL);
+  }
+  for(
+      uint32_t deque_idx = 0;
+      deque_idx <= pool->num_workers;
+      deque_idx++
+     )
+  {
+    pthread_mutex_destroy(&(pool->deques[deque_idx].mutex));
+  }
+  pthread_mutex_destroy(&(pool->mutex));
+  pthread_cond_destroy(&(pool->work_cond));
+  pthread_cond_destroy(&(pool->done_cond));
+  free(pool->workers);
+  free(pool->deques);
+  free(pool);
+#ifdef DEBUG_THREADPOOL_C
+  printf("Stopped thread pool.\n");
+#endif //ifdef DEBUG_THREADPOOL_C
+}
+
+uint32_t threadpool_num_threads(
+    const struct threadpool *pool
+    )
+{
+  return pool != NULL ? pool->num_threads : 1;
+}
+
+// Run tasks until `job` completed. Workers run any task meanwhile; other callers only run tasks of `job`.
+static void wait_job(
+    struct threadpool *pool,
+    struct job *job,
+    bool is_worker,
+    uint32_t worker_idx
+    )
+{
+  uint32_t spin_rounds = 0;
+  struct task task;
+  while(atomic_load(&(job->remaining)) > 0)
+  {
+    if(
+        is_worker ?
+        find_task(pool, worker_idx, &task) :
+        deque_take_job(&(pool->deques[pool->num_workers]), job, &task)
+      )
+    {
+      if(!is_worker)
+        atomic_fetch_sub(&(pool->num_queued), 1);
+      run_task(pool, &task, worker_idx, is_worker ? worker_idx : pool->num_workers);
+      spin_rounds = 0;
+    }
+    else if(is_worker || spin_rounds < THREADPOOL_SPIN_ROUNDS)
+    {
+      spin_rounds++;
+      sched_yield();
+    }
+    else
+    {
+      pthread_mutex_lock(&(pool->mutex));
+      while(atomic_load(&(job->remaining)) > 0)
+        pthread_cond_wait(&(pool->done_cond), &(pool->mutex));
+      pthread_mutex_unlock(&(pool->mutex));
+    }
+  }
+}
+
+void threadpool_parallel_for(
+    struct threadpool *pool,
+    size_t count,
+    size_t grain,
+    threadpool_range_fn fn,
+    void *context
+    )
+{
+  bool is_worker = pool != NULL && current_pool == pool;
+  uint32_t worker_idx = is_worker ? current_worker_idx : threadpool_num_threads(pool) - 1;
+  struct job job = {.fn = fn, .context = context, .grain = grain > 0 ? grain : 1};
+  struct task task = {.job = &job, .begin = 0, .end = count};
+  if(count == 0)
+    return;
+  if(pool == NULL || count <= job.grain)
+  {
+    fn(context, 0, count, worker_idx);
+    return;
+  }
+  atomic_init(&(job.remaining), count);
+  run_task(pool, &task, worker_idx, is_worker ? worker_idx : pool->num_workers);
+  wait_job(pool, &job, is_worker, worker_idx);
+}
+
+struct threadpool_graph *threadpool_graph_create(
+    uint32_t num_tasks,
+    const uint32_t *predecessor_offsets,
+    const uint32_t *predecessors
+    )
+{
+  struct threadpool_graph *graph;
+  uint32_t num_edges = predecessor_offsets[num_tasks], num_ordered = 0;
+  if(
+      (graph = calloc(1, sizeof(struct threadpool_graph))) == NULL ||
+      (graph->num_predecessors = calloc(num_tasks, sizeof(uint32_t))) == NULL ||
+      (graph->successor_offsets = calloc(num_tasks + 1, sizeof(uint32_t))) == NULL ||
+      (graph->successors = calloc(num_edges + 1, sizeof(uint32_t))) == NULL ||
+      (graph->order = calloc(num_tasks + 1, sizeof(uint32_t))) == NULL ||
+      (graph->pending = calloc(num_tasks + 1, sizeof(atomic_uint))) == NULL
+    )
+    ERROR();
+  graph->num_tasks = num_tasks;
+  // Invert the predecessor lists into successor lists.
+  for(
+      uint32_t edge_idx = 0;
+      edge_idx < num_edges;
+      edge_idx++
+     )
+  {
+    graph->successor_offsets[predecessors[edge_idx] + 1]++;
+  }
+  for(
+      uint32_t task_idx = 0;
+      task_idx < num_tasks;
+      task_idx++
+     )
+  {
+    graph->successor_offsets[task_idx + 1] += graph->successor_offsets[task_idx];
+    graph->num_predecessors[task_idx] = predecessor_offsets[task_idx + 1] - predecessor_offsets[task_idx];
+    atomic_init(&(graph->pending[task_idx]), 0); // fill position into the successors of the task
+  }
+  for(
+      uint32_t task_idx = 0;
+      task_idx < num_tasks;
+      task_idx++
+     )
+  {
+    for(
+        uint32_t edge_idx = predecessor_offsets[task_idx];
+        edge_idx < predecessor_offsets[task_idx + 1];
+        edge_idx++
+       )
+    {
+      uint32_t pred_idx = predecessors[edge_idx];
+      graph->successors[graph->successor_offsets[pred_idx] + atomic_load(&(graph->pending[pred_idx]))] = task_idx;
+      atomic_fetch_add(&(graph->pending[pred_idx]), 1);
+    }
+  }
+  // Sort topologically (Kahn), reusing `pending` as the in-degrees left.
+  for(
+      uint32_t task_idx = 0;
+      task_idx < num_tasks;
+      task_idx++
+     )
+  {
+    atomic_store(&(graph->pending[task_idx]), graph->num_predecessors[task_idx]);
+    if(graph->num_predecessors[task_idx] == 0)
+      graph->order[num_ordered++] = task_idx;
+  }
+  for(
+      uint32_t order_idx = 0;
+      order_idx < num_ordered;
+      order_idx++
+     )
+  {
+    uint32_t task_idx = graph->order[order_idx];
+    for(
+        uint32_t succ_pos = graph->successor_offsets[task_idx];
+        succ_pos < graph->successor_offsets[task_idx + 1];
+        succ_pos++
+       )
+    {
+      if(atomic_fetch_sub(&(graph->pending[graph->successors[succ_pos]]), 1) == 1)
+        graph->order[num_ordered++] = graph->successors[succ_pos];
+    }
+  }
+  if(num_ordered != num_tasks)
+  {
+    errno = EINVAL;
+    ERROR("Task graph has a cycle");
+  }
+  return graph;
+}
+
+void threadpool_graph_destroy(
+    struct threadpool_graph *graph
+    )
+{
+  if(graph == NULL)
+    return;
+  free(graph->num_predecessors);
+  free(graph->successor_offsets);
+  free(graph->successors);
+  free(graph->order);
+  free((void *)graph->pending);
+  free(graph);
+}
+
+void threadpool_run_graph(
+    struct threadpool *pool,
+    struct threadpool_graph *graph,
+    threadpool_range_fn fn,
+    void *context
+    )
+{
+  bool is_worker = pool != NULL && current_pool == pool;
+  uint32_t worker_idx = is_worker ? current_worker_idx : threadpool_num_threads(pool) - 1,
+           deque_idx = is_worker ? worker_idx : threadpool_num_threads(pool) - 1;
+  struct job job = {.fn = fn, .context = context, .grain = 1, .graph = graph};
+  if(graph->num_tasks == 0)
+    return;
+  if(pool == NULL)
+  {
+    for(
+        uint32_t order_idx = 0;
+        order_idx < graph->num_tasks;
+        order_idx++
+       )
+    {
+      fn(context, graph->order[order_idx], graph->order[order_idx] + 1, worker_idx);
+    }
+    return;
+  }
+  atomic_init(&(job.remaining), graph->num_tasks);
+  for(
+      uint32_t task_idx = 0;
+      task_idx < graph->num_tasks;
+      task_idx++
+     )
+  {
+    atomic_store(&(graph->pending[task_idx]), graph->num_predecessors[task_idx]);
+  }
+  // Release the roots, the first of them last so that this thread runs it right away.
+  for(
+      uint32_t order_idx = graph->num_tasks;
+      order_idx > 0;
+      order_idx--
+     )
+  {
+    uint32_t task_idx = graph->order[order_idx - 1];
+    struct task root = {.job = &job, .begin = task_idx, .end = task_idx + 1};
+    if(graph->num_predecessors[task_idx] != 0)
+      continue;
+    if(!push_task(pool, deque_idx, &root))
+      run_task(pool, &root, worker_idx, deque_idx);
+  }
+  wait_job(pool, &job, is_worker, worker_idx);
+}
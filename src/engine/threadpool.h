@@ -0,0 +1,71 @@
+// Work-stealing thread pool.
+// A pool owns `num_threads - 1` persistent worker threads; the thread calling into the pool is the last participant.
+// Work is split into range tasks kept in per-worker deques: owners pop their newest task, idle workers steal the
+// oldest (largest) task of a random victim, and workers sleep once there is nothing left to steal.
+#ifndef MLTOOLS_ENGINE_THREADPOOL_H
+#define MLTOOLS_ENGINE_THREADPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct threadpool;
+struct threadpool_graph;
+
+// Body of a parallel loop, run over indices [begin, end). `worker_idx` is below `threadpool_num_threads()` and unique
+// among the threads running the same loop, so it can index per-thread scratch memory.
+typedef void (*threadpool_range_fn)(void *context, size_t begin, size_t end, uint32_t worker_idx);
+
+struct threadpool_options
+{
+  uint32_t num_threads;         // number of participants including the caller (0 selects all online CPUs)
+  const int32_t *cpus;          // CPUs to pin worker threads to, round-robin (NULL leaves them unpinned)
+  uint32_t num_cpus;
+};
+
+// Start a pool. Returns NULL if `options` asks for a single thread, in which case loops run inline.
+struct threadpool *threadpool_create(
+    const struct threadpool_options *options
+    );
+
+// Stop and join all worker threads. Must not race with running loops.
+void threadpool_destroy(
+    struct threadpool *pool
+    );
+
+// Number of participants of `pool` (1 if `pool` is NULL).
+uint32_t threadpool_num_threads(
+    const struct threadpool *pool
+    );
+
+// Run `fn` over [0, count), split into chunks of no less than `grain` indices, and return once all chunks completed.
+// May be called from inside a loop body; the caller runs chunks of the loop while waiting.
+void threadpool_parallel_for(
+    struct threadpool *pool,
+    size_t count,
+    size_t grain,
+    threadpool_range_fn fn,
+    void *context
+    );
+
+// Build a graph of tasks [0, num_tasks) in which task `idx` may only start once the tasks listed in
+// `predecessors[predecessor_offsets[idx]:predecessor_offsets[idx + 1]]` completed. The graph must be acyclic.
+struct threadpool_graph *threadpool_graph_create(
+    uint32_t num_tasks,
+    const uint32_t *predecessor_offsets,
+    const uint32_t *predecessors
+    );
+
+void threadpool_graph_destroy(
+    struct threadpool_graph *graph
+    );
+
+// Run every task `idx` of `graph` once, as `fn(context, idx, idx + 1, worker_idx)`, starting each task as soon as its
+// predecessors completed, and return once all tasks completed. A graph runs at most once at a time.
+void threadpool_run_graph(
+    struct threadpool *pool,
+    struct threadpool_graph *graph,
+    threadpool_range_fn fn,
+    void *context
+    );
+
+#endif //ifndef MLTOOLS_ENGINE_THREADPOOL_H
@@ -12,5 +12,7 @@
 
 #define ERROR(msg) {perror(AT msg); exit(errno);}
 #define ERRORF(fmt, ...) {fprintf(stderr, AT fmt ": %s\n", __VA_ARGS__, strerror(errno)); exit(errno);}
+#define WARNING(msg) perror(AT msg)
+#define WARNINGF(fmt, ...) fprintf(stderr, AT fmt ": %s\n", __VA_ARGS__, strerror(errno))
 
 #endif //ifndef MLTOOLS_EXCEPTIONS_H
@@ -2,10 +2,25 @@
 #ifndef MLTOOLS_MODEL_H
 #define MLTOOLS_MODEL_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+enum tensor_type
+{
+  TT_FLOAT32 = 0,
+  TT_FLOAT16 = 1,
+  TT_INT32 = 2,
+  TT_UINT8 = 3,
+  TT_INT64 = 4,
+  TT_STRING = 5,
+  TT_BOOL = 6,
+  TT_INT16 = 7,
+  TT_COMPLEX64 = 8,
+  TT_INT8 = 9
+};
+
 enum builtin_operator
 {
   BO_ADD = 0,
@@ -167,10 +182,83 @@ struct depthwise_conv2d_options
   int8_t dilation_h_factor; // default: 1
 };
 
+struct fully_connected_options
+{
+  enum activation_function_type fused_activation_function;
+  bool keep_num_dims;
+};
+
+struct concatenation_options
+{
+  int8_t axis;
+  enum activation_function_type fused_activation_function;
+};
+
+struct pool2d_options
+{
+  enum padding padding;
+  int8_t stride_w;
+  int8_t stride_h;
+  int32_t filter_width;
+  int32_t filter_height;
+  enum activation_function_type fused_activation_function;
+};
+
+struct resize_bilinear_options
+{
+  bool align_corners;
+};
+
+struct resize_nearest_neighbor_options
+{
+  bool align_corners;
+};
+
+struct softmax_options
+{
+  float beta;
+};
+
+struct reducer_options
+{
+  bool keep_dims;
+};
+
+struct add_options
+{
+  enum activation_function_type fused_activation_function;
+};
+
+struct sub_options
+{
+  enum activation_function_type fused_activation_function;
+};
+
+struct mul_options
+{
+  enum activation_function_type fused_activation_function;
+};
+
+struct div_options
+{
+  enum activation_function_type fused_activation_function;
+};
+
 union builtin_options
 {
   struct conv2d_options conv2d_options;
   struct depthwise_conv2d_options depthwise_conv2d_options;
+  struct fully_connected_options fully_connected_options;
+  struct concatenation_options concatenation_options;
+  struct pool2d_options pool2d_options;
+  struct resize_bilinear_options resize_bilinear_options;
+  struct resize_nearest_neighbor_options resize_nearest_neighbor_options;
+  struct softmax_options softmax_options;
+  struct reducer_options reducer_options;
+  struct add_options add_options;
+  struct sub_options sub_options;
+  struct mul_options mul_options;
+  struct div_options div_options;
 };
 
 struct metadata
@@ -0,0 +1,598 @@
+// Model statistics.
+// Estimate the compute and memory cost of a model without running it: per-operator and total MACs, parameter bytes
+// per tensor type, peak activation memory and buffer sizes of every subgraph.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <flatcc/flatcc.h>
+
+#include "cost.h"
+#include "exceptions.h"
+#include "schemas/tflite/tflite_v3_reader.h"
+
+#define MAX_DIMS 8
+#define NUM_TENSOR_TYPES (TT_INT8 + 1)
+
+struct operator_stats
+{
+  tflite_BuiltinOperator_enum_t builtin_code;
+  uint64_t macs;
+  uint64_t param_bytes;                 // constant inputs
+  uint64_t output_bytes;
+};
+
+struct subgraph_stats
+{
+  const char *name;
+  struct operator_stats *operators;
+  uint32_t num_operators;
+  uint32_t num_tensors;
+  uint64_t macs;
+  uint64_t param_bytes[NUM_TENSOR_TYPES]; // per tensor type, counting shared buffers once
+  uint64_t activation_bytes;            // total size of non-constant tensors
+  uint64_t activation_peak_bytes;       // largest total size of tensors live at once
+};
+
+static struct
+{
+  tflite_Model_table_t in_model;        // input model TF Lite flatbuffers structure
+  void *in_model_map;                   // input model mapping (referenced by `in_model`)
+  size_t in_model_size;                 // size of `in_model_map`
+  bool is_json;                         // print JSON instead of text
+  struct subgraph_stats *subgraphs;     // statistics of each subgraph
+  uint32_t num_subgraphs;
+  bool *are_buffers_counted;            // boolean array indicating which buffers were counted as parameters
+  int64_t *live_bytes_deltas;           // change of live activation bytes at each operator (liveness sweep)
+} app;
+
+static void print_usage()
+{
+  printf("model_stats [-j] IN_FILE\n");
+  printf("  Prints the compute and memory cost of the model stored at IN_FILE without running it.\n");
+  printf("  -j  Print JSON instead of text.\n");
+}
+
+// Release all resources held by this application. Registered on exit by `init_app()`.
+static void release_app()
+{
+  if(app.subgraphs != NULL)
+  {
+    for(
+        uint32_t subgraph_idx = 0;
+        subgraph_idx < app.num_subgraphs;
+        subgraph_idx++
+       )
+    {
+      free(app.subgraphs[subgraph_idx].operators);
+    }
+    free(app.subgraphs);
+    app.subgraphs = NULL;
+  }
+  if(app.are_buffers_counted != NULL)
+  {
+    free(app.are_buffers_counted);
+    app.are_buffers_counted = NULL;
+  }
+  if(app.live_bytes_deltas != NULL)
+  {
+    free(app.live_bytes_deltas);
+    app.live_bytes_deltas = NULL;
+  }
+  if(app.in_model_map != NULL)
+  {
+    munmap(app.in_model_map, app.in_model_size);
+    app.in_model_map = NULL;
+  }
+#ifdef DEBUG_MODEL_STATS_C
+  printf("Released application's resources.\n");
+#endif //ifdef DEBUG_MODEL_STATS_C
+}
+
+// Initialize application with argv-style arguments.
+static void init_app(
+    int argc,
+    char *argv[]
+    )
+{
+  int opt, in_model_fd;
+  struct stat in_model_stat;
+  memset(&app, 0, sizeof(app));
+  while((opt = getopt(argc, argv, "j")) != -1)
+  {
+    if(opt == 'j')
+      app.is_json = true;
+    else
+    {
+      print_usage();
+      errno = EINVAL;
+      ERROR("Unknown option");
+    }
+  }
+  if(argc - optind != 1)
+  {
+    print_usage();
+    errno = EINVAL;
+    ERROR("Requires exactly 1 argument");
+  }
+  atexit(release_app);
+  // Map rather than read the model: only the lengths of buffers are inspected, so weights are never paged in.
+  if((in_model_fd = open(argv[optind], O_RDONLY)) == -1)
+    ERRORF("%s", argv[optind]);
+  if(fstat(in_model_fd, &in_model_stat) != 0)
+    ERRORF("%s", argv[optind]);
+  app.in_model_size = in_model_stat.st_size;
+  if((app.in_model_map = mmap(NULL, app.in_model_size, PROT_READ, MAP_PRIVATE, in_model_fd, 0)) == MAP_FAILED)
+  {
+    app.in_model_map = NULL;
+    ERRORF("%s", argv[optind]);
+  }
+  close(in_model_fd);
+  if((app.in_model = tflite_Model_as_root(app.in_model_map)) == NULL)
+  {
+    errno = EINVAL;
+    ERRORF("%s", argv[optind]);
+  }
+  if((app.are_buffers_counted = calloc(tflite_Buffer_vec_len(tflite_Model_buffers(app.in_model)) + 1, sizeof(bool))) == NULL)
+    ERROR();
+}
+
+// Size in bytes of the data stored for tensor `t` (0 if it is not a constant).
+static uint64_t constant_bytes(
+    tflite_Tensor_table_t t
+    )
+{
+  tflite_Buffer_vec_t buffers = tflite_Model_buffers(app.in_model);
+  uint32_t buffer_idx = tflite_Tensor_buffer(t);
+  if(buffer_idx == 0 || buffer_idx >= tflite_Buffer_vec_len(buffers))
+    return 0;
+  return flatbuffers_uint8_vec_len(tflite_Buffer_data(tflite_Buffer_vec_at(buffers, buffer_idx)));
+}
+
+static uint64_t tensor_num_elements(
+    tflite_Tensor_table_t t
+    )
+{
+  flatbuffers_int32_vec_t shape = tflite_Tensor_shape(t);
+  uint64_t num_elements = 1;
+  for(
+      size_t dim_idx = 0;
+      dim_idx < flatbuffers_int32_vec_len(shape);
+      dim_idx++
+     )
+  {
+    int32_t dim = flatbuffers_int32_vec_at(shape, dim_idx);
+    num_elements *= dim > 0 ? dim : 1; // unknown dimensions (-1) count as 1
+  }
+  return num_elements;
+}
+
+static uint64_t tensor_bytes(
+    tflite_Tensor_table_t t
+    )
+{
+  return tensor_num_elements(t) * tensor_type_size(tflite_Tensor_type(t));
+}
+
+static void analyze_operator(
+    tflite_Tensor_vec_t tensors,
+    tflite_Operator_table_t op,
+    struct operator_stats *stats
+    )
+{
+  tflite_OperatorCode_vec_t operator_codes = tflite_Model_operator_codes(app.in_model);
+  flatbuffers_int32_vec_t inputs = tflite_Operator_inputs(op),
+                          outputs = tflite_Operator_outputs(op);
+  size_t num_inputs = flatbuffers_int32_vec_len(inputs),
+         num_outputs = flatbuffers_int32_vec_len(outputs);
+  int32_t weights_shape[MAX_DIMS];
+  uint8_t weights_num_dims = 0;
+  uint64_t num_input_elements = 0, num_output_elements = 0, window_size = 0;
+  stats->builtin_code = tflite_OperatorCode_builtin_code(
+      tflite_OperatorCode_vec_at(operator_codes, tflite_Operator_opcode_index(op))
+      );
+  for(
+      size_t input_idx = 0;
+      input_idx < num_inputs;
+      input_idx++
+     )
+  {
+    int32_t tensor_idx = flatbuffers_int32_vec_at(inputs, input_idx);
+    if(tensor_idx >= 0)
+      stats->param_bytes += constant_bytes(tflite_Tensor_vec_at(tensors, tensor_idx));
+  }
+  for(
+      size_t output_idx = 0;
+      output_idx < num_outputs;
+      output_idx++
+     )
+  {
+    stats->output_bytes += tensor_bytes(tflite_Tensor_vec_at(tensors, flatbuffers_int32_vec_at(outputs, output_idx)));
+  }
+  if(num_inputs > 0 && flatbuffers_int32_vec_at(inputs, 0) >= 0)
+    num_input_elements = tensor_num_elements(tflite_Tensor_vec_at(tensors, flatbuffers_int32_vec_at(inputs, 0)));
+  if(num_outputs > 0)
+    num_output_elements = tensor_num_elements(tflite_Tensor_vec_at(tensors, flatbuffers_int32_vec_at(outputs, 0)));
+  if(num_inputs > 1 && flatbuffers_int32_vec_at(inputs, 1) >= 0)
+  {
+    flatbuffers_int32_vec_t shape = tflite_Tensor_shape(tflite_Tensor_vec_at(tensors, flatbuffers_int32_vec_at(inputs, 1)));
+    weights_num_dims = flatbuffers_int32_vec_len(shape) < MAX_DIMS ? flatbuffers_int32_vec_len(shape) : MAX_DIMS;
+    for(
+        uint8_t dim_idx = 0;
+        dim_idx < weights_num_dims;
+        dim_idx++
+       )
+    {
+      weights_shape[dim_idx] = flatbuffers_int32_vec_at(shape, dim_idx);
+    }
+  }
+  if(tflite_Operator_builtin_options_type(op) == tflite_BuiltinOptions_Pool2DOptions)
+  {
+    tflite_Pool2DOptions_table_t options = (tflite_Pool2DOptions_table_t)tflite_Operator_builtin_options(op);
+    window_size = (uint64_t)tflite_Pool2DOptions_filter_width(options) * tflite_Pool2DOptions_filter_height(options);
+  }
+  stats->macs = operator_macs(
+      stats->builtin_code,
+      num_input_elements,
+      num_output_elements,
+      weights_num_dims > 0 ? weights_shape : NULL,
+      weights_num_dims,
+      window_size
+      );
+}
+
+// Find the peak of live activation memory, assuming each non-constant tensor lives from the operator producing it (or
+// the start for subgraph inputs) to the last operator reading it (or the end for subgraph outputs and variables).
+static void analyze_liveness(
+    tflite_SubGraph_table_t subgraph,
+    struct subgraph_stats *stats
+    )
+{
+  tflite_Tensor_vec_t tensors = tflite_SubGraph_tensors(subgraph);
+  tflite_Operator_vec_t operators = tflite_SubGraph_operators(subgraph);
+  flatbuffers_int32_vec_t inputs = tflite_SubGraph_inputs(subgraph),
+                          outputs = tflite_SubGraph_outputs(subgraph);
+  int64_t *first_op, *last_op, live_bytes = 0;
+  if(
+      (first_op = malloc((stats->num_tensors + 1) * sizeof(int64_t))) == NULL ||
+      (last_op = malloc((stats->num_tensors + 1) * sizeof(int64_t))) == NULL ||
+      (app.live_bytes_deltas = calloc(stats->num_operators + 2, sizeof(int64_t))) == NULL
+    )
+    ERROR();
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < stats->num_tensors;
+      tensor_idx++
+     )
+  {
+    first_op[tensor_idx] = -1;
+    last_op[tensor_idx] = -1;
+    if(tflite_Tensor_is_variable(tflite_Tensor_vec_at(tensors, tensor_idx)))
+    {
+      first_op[tensor_idx] = 0;
+      last_op[tensor_idx] = stats->num_operators;
+    }
+  }
+  for(
+      size_t input_idx = 0;
+      input_idx < flatbuffers_int32_vec_len(inputs);
+      input_idx++
+     )
+  {
+    first_op[flatbuffers_int32_vec_at(inputs, input_idx)] = 0;
+  }
+  for(
+      uint32_t op_idx = 0;
+      op_idx < stats->num_operators;
+      op_idx++
+     )
+  {
+    tflite_Operator_table_t op = tflite_Operator_vec_at(operators, op_idx);
+    flatbuffers_int32_vec_t op_inputs = tflite_Operator_inputs(op),
+                            op_outputs = tflite_Operator_outputs(op);
+    for(
+        size_t input_idx = 0;
+        input_idx < flatbuffers_int32_vec_len(op_inputs);
+        input_idx++
+       )
+    {
+      int32_t tensor_idx = flatbuffers_int32_vec_at(op_inputs, input_idx);
+      if(tensor_idx >= 0 && last_op[tensor_idx] < op_idx)
+        last_op[tensor_idx] = op_idx;
+    }
+    for(
+        size_t output_idx = 0;
+        output_idx < flatbuffers_int32_vec_len(op_outputs);
+        output_idx++
+       )
+    {
+      int32_t tensor_idx = flatbuffers_int32_vec_at(op_outputs, output_idx);
+      if(first_op[tensor_idx] == -1)
+        first_op[tensor_idx] = op_idx;
+      if(last_op[tensor_idx] < op_idx)
+        last_op[tensor_idx] = op_idx;
+    }
+  }
+  for(
+      size_t output_idx = 0;
+      output_idx < flatbuffers_int32_vec_len(outputs);
+      output_idx++
+     )
+  {
+    last_op[flatbuffers_int32_vec_at(outputs, output_idx)] = stats->num_operators;
+  }
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < stats->num_tensors;
+      tensor_idx++
+     )
+  {
+    tflite_Tensor_table_t t = tflite_Tensor_vec_at(tensors, tensor_idx);
+    uint64_t size;
+    if(first_op[tensor_idx] == -1 || constant_bytes(t) > 0)
+      continue;
+    size = tensor_bytes(t);
+    stats->activation_bytes += size;
+    app.live_bytes_deltas[first_op[tensor_idx]] += size;
+    app.live_bytes_deltas[last_op[tensor_idx] + 1] -= size;
+  }
+  for(
+      uint32_t op_idx = 0;
+      op_idx <= stats->num_operators;
+      op_idx++
+     )
+  {
+    live_bytes += app.live_bytes_deltas[op_idx];
+    if(live_bytes > (int64_t)stats->activation_peak_bytes)
+      stats->activation_peak_bytes = live_bytes;
+  }
+  free(first_op);
+  free(last_op);
+  free(app.live_bytes_deltas);
+  app.live_bytes_deltas = NULL;
+}
+
+static void analyze_subgraph(
+    tflite_SubGraph_table_t subgraph,
+    struct subgraph_stats *stats
+    )
+{
+  tflite_Tensor_vec_t tensors = tflite_SubGraph_tensors(subgraph);
+  tflite_Operator_vec_t operators = tflite_SubGraph_operators(subgraph);
+  stats->name = tflite_SubGraph_name(subgraph);
+  stats->num_tensors = tflite_Tensor_vec_len(tensors);
+  stats->num_operators = tflite_Operator_vec_len(operators);
+  if((stats->operators = calloc(stats->num_operators + 1, sizeof(struct operator_stats))) == NULL)
+    ERROR();
+  for(
+      uint32_t op_idx = 0;
+      op_idx < stats->num_operators;
+      op_idx++
+     )
+  {
+    analyze_operator(tensors, tflite_Operator_vec_at(operators, op_idx), &(stats->operators[op_idx]));
+    stats->macs += stats->operators[op_idx].macs;
+  }
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < stats->num_tensors;
+      tensor_idx++
+     )
+  {
+    tflite_Tensor_table_t t = tflite_Tensor_vec_at(tensors, tensor_idx);
+    uint32_t buffer_idx = tflite_Tensor_buffer(t);
+    tflite_TensorType_enum_t type = tflite_Tensor_type(t);
+    uint64_t size = constant_bytes(t);
+    if(size == 0 || app.are_buffers_counted[buffer_idx] || (uint8_t)type >= NUM_TENSOR_TYPES)
+      continue;
+    app.are_buffers_counted[buffer_idx] = true;
+    stats->param_bytes[type] += size;
+  }
+  analyze_liveness(subgraph, stats);
+}
+
+static void analyze_model()
+{
+  tflite_SubGraph_vec_t subgraphs = tflite_Model_subgraphs(app.in_model);
+  app.num_subgraphs = tflite_SubGraph_vec_len(subgraphs);
+  if((app.subgraphs = calloc(app.num_subgraphs + 1, sizeof(struct subgraph_stats))) == NULL)
+    ERROR();
+  for(
+      uint32_t subgraph_idx = 0;
+      subgraph_idx < app.num_subgraphs;
+      subgraph_idx++
+     )
+  {
+    analyze_subgraph(tflite_SubGraph_vec_at(subgraphs, subgraph_idx), &(app.subgraphs[subgraph_idx]));
+  }
+}
+
+// Print `s` as a JSON string.
+static void print_json_string(
+    const char *s
+    )
+{
+  putchar('"');
+  for(
+      ;
+      s != NULL && *s != '\0';
+      s++
+     )
+  {
+    if(*s == '"' || *s == '\\')
+      printf("\\%c", *s);
+    else if((unsigned char)*s < 0x20)
+      printf("\\u%04x", *s);
+    else
+      putchar(*s);
+  }
+  putchar('"');
+}
+
+static void print_text()
+{
+  tflite_Buffer_vec_t buffers = tflite_Model_buffers(app.in_model);
+  uint64_t total_macs = 0, total_param_bytes = 0, total_buffer_bytes = 0, max_buffer_bytes = 0, peak_bytes = 0;
+  for(
+      uint32_t subgraph_idx = 0;
+      subgraph_idx < app.num_subgraphs;
+      subgraph_idx++
+     )
+  {
+    const struct subgraph_stats *stats = &(app.subgraphs[subgraph_idx]);
+    printf(
+        "subgraph %u \"%s\": %u operators, %u tensors\n",
+        subgraph_idx,
+        stats->name != NULL ? stats->name : "",
+        stats->num_operators,
+        stats->num_tensors
+        );
+    printf("%5s %-24s %14s %12s %12s\n", "op", "name", "MACs", "param_bytes", "output_bytes");
+    for(
+        uint32_t op_idx = 0;
+        op_idx < stats->num_operators;
+        op_idx++
+       )
+    {
+      const struct operator_stats *op = &(stats->operators[op_idx]);
+      printf(
+          "%5u %-24s %14lu %12lu %12lu\n",
+          op_idx,
+          tflite_BuiltinOperator_name(op->builtin_code),
+          (unsigned long)op->macs,
+          (unsigned long)op->param_bytes,
+          (unsigned long)op->output_bytes
+          );
+    }
+    printf("macs=%lu\n", (unsigned long)stats->macs);
+    for(
+        uint8_t type = 0;
+        type < NUM_TENSOR_TYPES;
+        type++
+       )
+    {
+      if(stats->param_bytes[type] == 0)
+        continue;
+      printf("param_bytes.%s=%lu\n", tflite_TensorType_name(type), (unsigned long)stats->param_bytes[type]);
+      total_param_bytes += stats->param_bytes[type];
+    }
+    printf("activation_bytes=%lu\n", (unsigned long)stats->activation_bytes);
+    printf("activation_peak_bytes=%lu\n\n", (unsigned long)stats->activation_peak_bytes);
+    total_macs += stats->macs;
+    if(stats->activation_peak_bytes > peak_bytes)
+      peak_bytes = stats->activation_peak_bytes;
+  }
+  for(
+      size_t buffer_idx = 0;
+      buffer_idx < tflite_Buffer_vec_len(buffers);
+      buffer_idx++
+     )
+  {
+    uint64_t size = flatbuffers_uint8_vec_len(tflite_Buffer_data(tflite_Buffer_vec_at(buffers, buffer_idx)));
+    total_buffer_bytes += size;
+    if(size > max_buffer_bytes)
+      max_buffer_bytes = size;
+  }
+  printf("total_macs=%lu\n", (unsigned long)total_macs);
+  printf("total_param_bytes=%lu\n", (unsigned long)total_param_bytes);
+  printf("max_activation_peak_bytes=%lu\n", (unsigned long)peak_bytes);
+  printf("num_buffers=%zu\n", tflite_Buffer_vec_len(buffers));
+  printf("buffer_bytes=%lu\n", (unsigned long)total_buffer_bytes);
+  printf("max_buffer_bytes=%lu\n", (unsigned long)max_buffer_bytes);
+  printf("model_bytes=%zu\n", app.in_model_size);
+}
+
+static void print_json()
+{
+  tflite_Buffer_vec_t buffers = tflite_Model_buffers(app.in_model);
+  uint64_t total_macs = 0, total_param_bytes = 0;
+  printf("{\n  \"subgraphs\": [");
+  for(
+      uint32_t subgraph_idx = 0;
+      subgraph_idx < app.num_subgraphs;
+      subgraph_idx++
+     )
+  {
+    const struct subgraph_stats *stats = &(app.subgraphs[subgraph_idx]);
+    bool is_first_type = true;
+    printf("%s\n    {\"name\": ", subgraph_idx > 0 ? "," : "");
+    print_json_string(stats->name);
+    printf(", \"num_tensors\": %u, \"macs\": %lu, \"param_bytes\": {", stats->num_tensors, (unsigned long)stats->macs);
+    for(
+        uint8_t type = 0;
+        type < NUM_TENSOR_TYPES;
+        type++
+       )
+    {
+      if(stats->param_bytes[type] == 0)
+        continue;
+      printf(
+          "%s\"%s\": %lu",
+          is_first_type ? "" : ", ",
+          tflite_TensorType_name(type),
+          (unsigned long)stats->param_bytes[type]
+          );
+      is_first_type = false;
+      total_param_bytes += stats->param_bytes[type];
+    }
+    printf(
+        "}, \"activation_bytes\": %lu, \"activation_peak_bytes\": %lu, \"operators\": [",
+        (unsigned long)stats->activation_bytes,
+        (unsigned long)stats->activation_peak_bytes
+        );
+    for(
+        uint32_t op_idx = 0;
+        op_idx < stats->num_operators;
+        op_idx++
+       )
+    {
+      const struct operator_stats *op = &(stats->operators[op_idx]);
+      printf(
+          "%s\n      {\"name\": \"%s\", \"macs\": %lu, \"param_bytes\": %lu, \"output_bytes\": %lu}",
+          op_idx > 0 ? "," : "",
+          tflite_BuiltinOperator_name(op->builtin_code),
+          (unsigned long)op->macs,
+          (unsigned long)op->param_bytes,
+          (unsigned long)op->output_bytes
+          );
+    }
+    printf("\n    ]}");
+    total_macs += stats->macs;
+  }
+  printf("\n  ],\n  \"total_macs\": %lu,\n", (unsigned long)total_macs);
+  printf("  \"total_param_bytes\": %lu,\n", (unsigned long)total_param_bytes);
+  printf("  \"model_bytes\": %zu,\n  \"buffer_bytes\": [", app.in_model_size);
+  for(
+      size_t buffer_idx = 0;
+      buffer_idx < tflite_Buffer_vec_len(buffers);
+      buffer_idx++
+     )
+  {
+    printf(
+        "%s%zu",
+        buffer_idx > 0 ? ", " : "",
+        flatbuffers_uint8_vec_len(tflite_Buffer_data(tflite_Buffer_vec_at(buffers, buffer_idx)))
+        );
+  }
+  printf("]\n}\n");
+}
+
+int main(
+    int argc,
+    char *argv[]
+    )
+{
+  init_app(argc, argv);
+  analyze_model();
+  if(app.is_json)
+    print_json();
+  else
+    print_text();
+  return EXIT_SUCCESS;
+}
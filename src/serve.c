@@ -0,0 +1,654 @@
+// Serve models.
+// Keep models open and run them for local clients speaking the protocol of `serve.h`. All models share one thread pool
+// and one registry, so that batch variants of a model cost little more than the model itself. Each model is driven by
+// a batcher coalescing the samples of concurrent clients, and each client connection is handled by its own thread.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "exceptions.h"
+#include "serve.h"
+#include "engine/batcher.h"
+#include "engine/engine.h"
+#include "engine/registry.h"
+
+#define MAX_MODELS 64
+#define NUM_LATENCY_BUCKETS 252 // 4 buckets per power of two up to 2^63 ns
+
+struct served_model
+{
+  const char *name;
+  const char *path;
+  struct engine *engine;
+  struct batcher *batcher;
+  uint32_t batch_size;
+  pthread_mutex_t mutex;        // guards the statistics below
+  uint64_t num_requests;
+  uint64_t total_latency_ns;
+  uint64_t max_latency_ns;
+  uint64_t latency_buckets[NUM_LATENCY_BUCKETS];
+};
+
+struct client
+{
+  int fd;
+  struct served_model *model;          // attached model (NULL until attached)
+  uint8_t *shm;                 // shared memory holding one sample of each input and output
+  size_t shm_size;
+  const void *inputs[SERVE_MAX_TENSORS];
+  void *outputs[SERVE_MAX_TENSORS];
+  struct client *next;
+};
+
+static struct
+{
+  const char *socket_path;            // path the server listens on
+  struct served_model models[MAX_MODELS];    // served models
+  uint32_t num_models;
+  struct engine_options options;      // engine settings shared by all models
+  struct batcher_options batcher_options;
+  struct registry *registry;          // constant buffers shared by all models
+  int listen_fd;
+  int signal_fd;                      // readable once SIGINT or SIGTERM is received
+  pthread_mutex_t clients_mutex;
+  pthread_cond_t clients_cond;        // broadcast when a client disconnects
+  struct client *clients;             // connected clients
+} app;
+
+static void print_usage()
+{
+  printf("serve [-t THREADS] [-w MAX_WAIT_US] SOCKET_FILE NAME=IN_FILE [NAME=IN_FILE...]\n");
+  printf("  Keeps the models stored at each IN_FILE open and runs them for clients connecting to SOCKET_FILE until\n");
+  printf("  interrupted. Clients refer to models by NAME. A model whose inputs and outputs have a leading batch\n");
+  printf("  dimension N (see `replicate`) runs the samples of up to N concurrent requests at once.\n");
+  printf("  -t  Run on THREADS threads (default: all online CPUs).\n");
+  printf("  -w  Wait up to MAX_WAIT_US microseconds for a batch to fill (default: 1000).\n");
+}
+
+// Release all resources held by this application. Registered on exit by `init_app()`.
+static void release_app()
+{
+  if(app.listen_fd > 0)
+  {
+    close(app.listen_fd);
+    unlink(app.socket_path);
+  }
+  if(app.signal_fd > 0)
+    close(app.signal_fd);
+  for(
+      uint32_t model_idx = 0;
+      model_idx < app.num_models;
+      model_idx++
+     )
+  {
+    struct served_model *m = &(app.models[model_idx]);
+    batcher_destroy(m->batcher);
+    engine_close(m->engine);
+    pthread_mutex_destroy(&(m->mutex));
+  }
+  app.num_models = 0;
+  registry_destroy(app.registry);
+  app.registry = NULL;
+  if(app.options.pool != NULL)
+  {
+    threadpool_destroy(app.options.pool);
+    app.options.pool = NULL;
+  }
+#ifdef DEBUG_SERVE_C
+  printf("Released application's resources.\n");
+#endif //ifdef DEBUG_SERVE_C
+}
+
+static void parse_model(
+    char *spec
+    )
+{
+  char *separator = strchr(spec, '=');
+  struct served_model *m = &(app.models[app.num_models]);
+  if(separator == NULL || separator == spec || strlen(spec) - strlen(separator) >= SERVE_MAX_NAME_LEN)
+  {
+    print_usage();
+    errno = EINVAL;
+    ERRORF("%s", spec);
+  }
+  if(app.num_models == MAX_MODELS)
+  {
+    errno = E2BIG;
+    ERROR("Models");
+  }
+  *separator = '\0';
+  m->name = spec;
+  m->path = separator + 1;
+  app.num_models++;
+}
+
+// Initialize application with argv-style arguments.
+static void init_app(
+    int argc,
+    char *argv[]
+    )
+{
+  int opt;
+  memset(&app, 0, sizeof(app));
+  app.batcher_options.max_wait_us = 1000;
+  while((opt = getopt(argc, argv, "t:w:")) != -1)
+  {
+    if(opt == 't')
+      app.options.threads.num_threads = strtoul(optarg, NULL, 10);
+    else if(opt == 'w')
+      app.batcher_options.max_wait_us = strtoul(optarg, NULL, 10);
+    else
+    {
+      print_usage();
+      errno = EINVAL;
+      ERROR("Unknown option");
+    }
+  }
+  if(argc - optind < 2)
+  {
+    print_usage();
+    errno = EINVAL;
+    ERROR("Requires at least 2 arguments");
+  }
+  app.socket_path = argv[optind];
+  for(
+      int arg_idx = optind + 1;
+      arg_idx < argc;
+      arg_idx++
+     )
+  {
+    parse_model(argv[arg_idx]);
+  }
+  if(app.options.threads.num_threads == 0)
+    app.options.threads.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_mutex_init(&(app.clients_mutex), NULL);
+  pthread_cond_init(&(app.clients_cond), NULL);
+  atexit(release_app);
+}
+
+static void open_models()
+{
+  app.options.pool = threadpool_create(&(app.options.threads));
+  app.registry = registry_create();
+  app.options.registry = app.registry;
+  for(
+      uint32_t model_idx = 0;
+      model_idx < app.num_models;
+      model_idx++
+     )
+  {
+    struct served_model *m = &(app.models[model_idx]);
+    m->engine = engine_open(m->path, &(app.options));
+    m->batcher = batcher_create(m->engine, &(app.batcher_options));
+    m->batch_size = batcher_batch_size(m->batcher);
+    if(m->engine->num_inputs + m->engine->num_outputs > SERVE_MAX_TENSORS)
+    {
+      errno = E2BIG;
+      ERRORF("%s inputs and outputs", m->path);
+    }
+    pthread_mutex_init(&(m->mutex), NULL);
+    printf("Serving '%s' from '%s' in batches of %u.\n", m->name, m->path, m->batch_size);
+  }
+}
+
+static struct served_model *find_model(
+    const char *name
+    )
+{
+  for(
+      uint32_t model_idx = 0;
+      model_idx < app.num_models;
+      model_idx++
+     )
+  {
+    if(strncmp(app.models[model_idx].name, name, SERVE_MAX_NAME_LEN) == 0)
+      return &(app.models[model_idx]);
+  }
+  return NULL;
+}
+
+// Index of the latency histogram bucket holding `ns`.
+static uint32_t latency_bucket(
+    uint64_t ns
+    )
+{
+  uint32_t log2;
+  if(ns < 4)
+    return ns;
+  log2 = 63 - __builtin_clzll(ns);
+  return 4 * (log2 - 1) + ((ns >> (log2 - 2)) & 3);
+}
+
+// Largest latency falling into bucket `bucket_idx`.
+static uint64_t latency_bucket_max(
+    uint32_t bucket_idx
+    )
+{
+  uint32_t log2 = bucket_idx / 4 + 1;
+  if(bucket_idx < 4)
+    return bucket_idx;
+  return ((uint64_t)(5 + bucket_idx % 4) << (log2 - 2)) - 1;
+}
+
+static void record_latency(
+    struct served_model *m,
+    uint64_t ns
+    )
+{
+  pthread_mutex_lock(&(m->mutex));
+  m->num_requests++;
+  m->total_latency_ns += ns;
+  if(ns > m->max_latency_ns)
+    m->max_latency_ns = ns;
+  m->latency_buckets[latency_bucket(ns)]++;
+  pthread_mutex_unlock(&(m->mutex));
+}
+
+// Smallest latency exceeded by at most `1 - fraction` of the requests of `m`, which must be locked.
+static uint64_t latency_percentile(
+    const struct served_model *m,
+    double fraction
+    )
+{
+  uint64_t rank = (uint64_t)(fraction * m->num_requests), count = 0;
+  for(
+      uint32_t bucket_idx = 0;
+      bucket_idx < NUM_LATENCY_BUCKETS;
+      bucket_idx++
+     )
+  {
+    count += m->latency_buckets[bucket_idx];
+    if(count > rank)
+    {
+      uint64_t ns = latency_bucket_max(bucket_idx);
+      return ns < m->max_latency_ns ? ns : m->max_latency_ns;
+    }
+  }
+  return m->max_latency_ns;
+}
+
+static void get_model_stats(
+    struct served_model *m,
+    struct serve_model_stats *stats
+    )
+{
+  struct batcher_stats batcher_stats;
+  memset(stats, 0, sizeof(*stats));
+  strncpy(stats->model, m->name, SERVE_MAX_NAME_LEN);
+  stats->batch_size = m->batch_size;
+  batcher_get_stats(m->batcher, &batcher_stats);
+  stats->queue_depth = batcher_stats.num_pending;
+  stats->num_batches = batcher_stats.num_batches;
+  pthread_mutex_lock(&(m->mutex));
+  stats->num_requests = m->num_requests;
+  if(m->num_requests > 0)
+  {
+    stats->mean_latency_ns = m->total_latency_ns / m->num_requests;
+    stats->p50_latency_ns = latency_percentile(m, 0.5);
+    stats->p99_latency_ns = latency_percentile(m, 0.99);
+    stats->max_latency_ns = m->max_latency_ns;
+  }
+  pthread_mutex_unlock(&(m->mutex));
+}
+
+static bool receive_all(
+    int fd,
+    void *buf,
+    size_t size
+    )
+{
+  for(
+      size_t received = 0;
+      received < size;
+     )
+  {
+    ssize_t rc = recv(fd, (uint8_t *)buf + received, size - received, 0);
+    if(rc <= 0)
+    {
+      if(rc < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    received += rc;
+  }
+  return true;
+}
+
+// Send `size` bytes of `buf`, passing file descriptor `shm_fd` along unless it is negative.
+static bool send_all(
+    int fd,
+    const void *buf,
+    size_t size,
+    int shm_fd
+    )
+{
+  union
+  {
+    struct cmsghdr header;
+    uint8_t buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = size};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  if(shm_fd >= 0)
+  {
+    struct cmsghdr *cmsg;
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+  }
+  while(iov.iov_len > 0)
+  {
+    ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if(rc < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    // The descriptor went along with the first byte.
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    iov.iov_base = (uint8_t *)iov.iov_base + rc;
+    iov.iov_len -= rc;
+  }
+  return true;
+}
+
+static void describe_tensor(
+    const struct served_model *m,
+    const struct engine_tensor *t,
+    size_t offset,
+    struct serve_tensor *description
+    )
+{
+  description->offset = offset;
+  description->size = t->size / m->batch_size;
+  description->type = t->type;
+  description->num_dims = t->num_dims;
+  memcpy(description->shape, t->shape, t->num_dims * sizeof(int32_t));
+  description->shape[0] = 1;
+  description->scale = t->scale;
+  description->zero_point = t->zero_point;
+}
+
+static void detach(
+    struct client *c
+    )
+{
+  if(c->shm != NULL)
+    munmap(c->shm, c->shm_size);
+  c->shm = NULL;
+  c->model = NULL;
+}
+
+// Attach `c` to model `name`, describing its tensors into `reply`. Returns the memfd to send along, or -1 on failure
+// with `reply->status` set.
+static int attach(
+    struct client *c,
+    const char *name,
+    struct serve_reply *reply
+    )
+{
+  struct served_model *m = find_model(name);
+  struct engine *e;
+  size_t offset = 0;
+  int shm_fd;
+  detach(c);
+  if(m == NULL)
+  {
+    reply->status = ENOENT;
+    return -1;
+  }
+  e = m->engine;
+  reply->num_inputs = e->num_inputs;
+  reply->num_outputs = e->num_outputs;
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < e->num_inputs + e->num_outputs;
+      tensor_idx++
+     )
+  {
+    const struct engine_tensor *t =
+      tensor_idx < e->num_inputs ? engine_input(e, tensor_idx) : engine_output(e, tensor_idx - e->num_inputs);
+    describe_tensor(m, t, offset, &(reply->tensors[tensor_idx]));
+    offset += (reply->tensors[tensor_idx].size + ENGINE_ALIGNMENT - 1) / ENGINE_ALIGNMENT * ENGINE_ALIGNMENT;
+  }
+  reply->shm_size = offset;
+  // Sealing the size keeps clients from truncating memory the server is about to touch.
+  if(
+      (shm_fd = memfd_create(m->name, MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+      ftruncate(shm_fd, offset) != 0 ||
+      fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+      (c->shm = mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0)) == MAP_FAILED
+    )
+  {
+    reply->status = errno;
+    c->shm = NULL;
+    if(shm_fd >= 0)
+      close(shm_fd);
+    return -1;
+  }
+  c->shm_size = offset;
+  c->model = m;
+  for(
+      uint32_t tensor_idx = 0;
+      tensor_idx < e->num_inputs + e->num_outputs;
+      tensor_idx++
+     )
+  {
+    uint8_t *data = c->shm + reply->tensors[tensor_idx].offset;
+    if(tensor_idx < e->num_inputs)
+      c->inputs[tensor_idx] = data;
+    else
+      c->outputs[tensor_idx - e->num_inputs] = data;
+  }
+  return shm_fd;
+}
+
+// Answer one request of `c`. Returns false once the connection should be closed.
+static bool handle_request(
+    struct client *c,
+    const struct serve_request *request,
+    const struct timespec *start
+    )
+{
+  struct serve_reply reply;
+  struct serve_model_stats stats[MAX_MODELS];
+  char name[SERVE_MAX_NAME_LEN + 1];
+  int shm_fd = -1;
+  bool is_sent;
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = SERVE_MAGIC;
+  memcpy(name, request->model, SERVE_MAX_NAME_LEN);
+  name[SERVE_MAX_NAME_LEN] = '\0';
+  if(request->magic != SERVE_MAGIC)
+    return false;
+  if(request->command == SC_ATTACH)
+    shm_fd = attach(c, name, &reply);
+  else if(request->command == SC_RUN)
+  {
+    if(c->model == NULL)
+      reply.status = ENOTCONN;
+    else
+    {
+      struct timespec end;
+      batcher_run(c->model->batcher, c->inputs, c->outputs);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      reply.latency_ns = (end.tv_sec - start->tv_sec) * 1000000000ull + end.tv_nsec - start->tv_nsec;
+      record_latency(c->model, reply.latency_ns);
+    }
+  }
+  else if(request->command == SC_STATS)
+  {
+    for(
+        uint32_t model_idx = 0;
+        model_idx < app.num_models;
+        model_idx++
+       )
+    {
+      struct served_model *m = &(app.models[model_idx]);
+      if(name[0] == '\0' || strcmp(m->name, name) == 0)
+        get_model_stats(m, &(stats[reply.num_models++]));
+    }
+    if(name[0] != '\0' && reply.num_models == 0)
+      reply.status = ENOENT;
+  }
+  else
+    reply.status = EINVAL;
+  is_sent = send_all(c->fd, &reply, sizeof(reply), shm_fd) &&
+    send_all(c->fd, stats, reply.num_models * sizeof(struct serve_model_stats), -1);
+  if(shm_fd >= 0)
+    close(shm_fd);
+  return is_sent;
+}
+
+static void *run_client(
+    void *arg
+    )
+{
+  struct client *c = arg;
+  struct serve_request request;
+  while(receive_all(c->fd, &request, sizeof(request)))
+  {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(!handle_request(c, &request, &start))
+      break;
+  }
+  detach(c);
+  pthread_mutex_lock(&(app.clients_mutex));
+  for(
+      struct client **link = &(app.clients);
+      *link != NULL;
+      link = &((*link)->next)
+     )
+  {
+    if(*link == c)
+    {
+      *link = c->next;
+      break;
+    }
+  }
+  close(c->fd);
+  free(c);
+  pthread_cond_broadcast(&(app.clients_cond));
+  pthread_mutex_unlock(&(app.clients_mutex));
+  return NULL;
+}
+
+static void listen_socket()
+{
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if(strlen(app.socket_path) >= sizeof(address.sun_path))
+  {
+    errno = ENAMETOOLONG;
+    ERRORF("%s", app.socket_path);
+  }
+  strcpy(address.sun_path, app.socket_path);
+  if((app.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    ERROR("Socket");
+  unlink(app.socket_path);
+  if(bind(app.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(app.listen_fd, SOMAXCONN) != 0)
+    ERRORF("%s", app.socket_path);
+}
+
+static void accept_client()
+{
+  struct client *c;
+  pthread_t thread;
+  int fd, rc;
+  if((fd = accept4(app.listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+  {
+    WARNING("Accepting client");
+    return;
+  }
+  if((c = calloc(1, sizeof(struct client))) == NULL)
+    ERROR();
+  c->fd = fd;
+  pthread_mutex_lock(&(app.clients_mutex));
+  c->next = app.clients;
+  app.clients = c;
+  if((rc = pthread_create(&thread, NULL, run_client, c)) != 0)
+  {
+    errno = rc;
+    ERROR("Starting client thread");
+  }
+  pthread_detach(thread);
+  pthread_mutex_unlock(&(app.clients_mutex));
+}
+
+// Disconnect every client and wait for their threads to finish their current request.
+static void disconnect_clients()
+{
+  pthread_mutex_lock(&(app.clients_mutex));
+  for(
+      struct client *c = app.clients;
+      c != NULL;
+      c = c->next
+     )
+  {
+    shutdown(c->fd, SHUT_RDWR);
+  }
+  while(app.clients != NULL)
+    pthread_cond_wait(&(app.clients_cond), &(app.clients_mutex));
+  pthread_mutex_unlock(&(app.clients_mutex));
+}
+
+int main(
+    int argc,
+    char *argv[]
+    )
+{
+  sigset_t signals;
+  init_app(argc, argv);
+  // Block the termination signals in every thread started from here on, and receive them through a descriptor.
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  if((app.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC)) < 0)
+    ERROR("Signals");
+  open_models();
+  listen_socket();
+  printf("Listening on '%s'.\n", app.socket_path);
+  fflush(stdout);
+  while(true)
+  {
+    struct pollfd fds[2] = {{.fd = app.listen_fd, .events = POLLIN}, {.fd = app.signal_fd, .events = POLLIN}};
+    if(poll(fds, 2, -1) < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      ERROR("Polling");
+    }
+    if(fds[1].revents != 0)
+      break;
+    if(fds[0].revents != 0)
+      accept_client();
+  }
+  printf("Stopping.\n");
+  close(app.listen_fd);
+  app.listen_fd = -1;
+  unlink(app.socket_path);
+  disconnect_clients();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+// Inference server protocol.
+// Clients talk to `serve` over a Unix-domain stream socket by sending fixed-size `serve_request` messages, each
+// answered by one `serve_reply`. A client first attaches to a model: the reply describes one sample of each model input
+// and output and carries, as SCM_RIGHTS ancillary data, a memfd holding all of them. The client maps it, writes its
+// inputs there and sends SC_RUN; the reply arrives once the outputs were written next to them, so tensors never travel
+// through the socket. All fields have a fixed width and native byte order, since both ends share the host.
+#ifndef MLTOOLS_SERVE_H
+#define MLTOOLS_SERVE_H
+
+#include <stdint.h>
+
+#define SERVE_MAGIC 0x53544c4d // "MLTS"
+#define SERVE_MAX_NAME_LEN 64
+#define SERVE_MAX_TENSORS 16
+#define SERVE_MAX_DIMS 6
+
+enum serve_command
+{
+  SC_ATTACH = 1,    // bind the connection to `model` and receive its shared memory
+  SC_RUN = 2,       // run the attached model over the inputs in shared memory
+  SC_STATS = 3      // receive the statistics of `model` (all models if empty)
+};
+
+struct serve_request
+{
+  uint32_t magic;
+  uint32_t command;                 // enum serve_command
+  char model[SERVE_MAX_NAME_LEN];   // NUL-padded model name (SC_ATTACH and SC_STATS)
+};
+
+// One sample of a model input or output.
+struct serve_tensor
+{
+  uint64_t offset;                  // offset of the tensor into shared memory
+  uint64_t size;                    // size in bytes
+  int32_t type;                     // enum tensor_type
+  uint32_t num_dims;
+  int32_t shape[SERVE_MAX_DIMS];    // leading dimension is 1
+  float scale;                      // quantization scale (0 if not quantized)
+  int32_t zero_point;
+};
+
+struct serve_reply
+{
+  uint32_t magic;
+  int32_t status;                   // 0 or an errno value
+  uint64_t latency_ns;              // SC_RUN: time from receiving the request to writing the outputs
+  uint64_t shm_size;                // SC_ATTACH: size of the shared memory
+  uint32_t num_inputs;              // SC_ATTACH: number of inputs, described first in `tensors`
+  uint32_t num_outputs;             // SC_ATTACH: number of outputs, described after the inputs
+  uint32_t num_models;              // SC_STATS: number of `serve_model_stats` following the reply
+  uint32_t reserved;
+  struct serve_tensor tensors[SERVE_MAX_TENSORS];
+};
+
+struct serve_model_stats
+{
+  char model[SERVE_MAX_NAME_LEN];
+  uint32_t batch_size;              // samples run together by the model
+  uint32_t queue_depth;             // samples waiting for a batch
+  uint64_t num_requests;            // samples completed so far
+  uint64_t num_batches;             // batches run so far
+  uint64_t mean_latency_ns;
+  uint64_t p50_latency_ns;          // percentiles, accurate to within 25%
+  uint64_t p99_latency_ns;
+  uint64_t max_latency_ns;
+};
+
+#endif //ifndef MLTOOLS_SERVE_H